@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "arena.h"
 #include "tdb_io.h"
@@ -18,6 +19,32 @@ done:
     return ret;
 }
 
+static int add_chunk(struct arena *a)
+{
+    char *chunk;
+
+    if (!a->chunk_bits){
+        const uint64_t increment = a->arena_increment ? a->arena_increment:
+                                                        ARENA_INCREMENT;
+        while ((1LLU << a->chunk_bits) < increment)
+            ++a->chunk_bits;
+    }
+
+    /* grow the array of chunk pointers geometrically */
+    if (!(a->num_chunks & (a->num_chunks - 1))){
+        char **chunks;
+        uint64_t n = a->num_chunks ? a->num_chunks * 2: 1;
+        if (!(chunks = realloc(a->chunks, n * sizeof(char*))))
+            return -1;
+        a->chunks = chunks;
+    }
+    if (!(chunk = malloc(a->item_size << a->chunk_bits)))
+        return -1;
+    a->chunks[a->num_chunks++] = chunk;
+    a->size += 1LLU << a->chunk_bits;
+    return 0;
+}
+
 void *arena_add_item(struct arena *a)
 {
     if (a->failed)
@@ -36,13 +63,57 @@ void *arena_add_item(struct arena *a)
         return a->data + a->item_size * (a->next++ & (ARENA_DISK_BUFFER - 1));
     }else{
         if (a->next >= a->size){
-            a->size += a->arena_increment ? a->arena_increment: ARENA_INCREMENT;
-            if (!(a->data = realloc(a->data, a->item_size * (uint64_t)a->size))){
+            if (add_chunk(a)){
                 a->failed = 1;
                 return NULL;
             }
         }
-        return a->data + a->item_size * a->next++;
+        return arena_get_item(a, a->next++);
     }
 }
 
+/*
+Append num_items items to the arena. This is equivalent to calling
+arena_add_item() for each item but copies items in chunks.
+*/
+int arena_add_items(struct arena *a, const void *items, uint64_t num_items)
+{
+    const char *src = (const char*)items;
+
+    while (num_items){
+        uint64_t n;
+        char *dst;
+
+        /* allocates, flushes or adds a chunk if needed */
+        if (!(dst = arena_add_item(a)))
+            return -1;
+
+        /* free items after dst in the same buffer or chunk */
+        if (a->fd)
+            n = ARENA_DISK_BUFFER - ((a->next - 1) & (ARENA_DISK_BUFFER - 1));
+        else
+            n = (1LLU << a->chunk_bits) -
+                ((a->next - 1) & ((1LLU << a->chunk_bits) - 1));
+        if (n > num_items)
+            n = num_items;
+
+        memcpy(dst, src, n * a->item_size);
+        a->next += n - 1;
+        src += n * a->item_size;
+        num_items -= n;
+    }
+    return 0;
+}
+
+void arena_free(struct arena *a)
+{
+    uint64_t i;
+    for (i = 0; i < a->num_chunks; i++)
+        free(a->chunks[i]);
+    free(a->chunks);
+    free(a->data);
+    a->chunks = NULL;
+    a->num_chunks = 0;
+    a->data = NULL;
+    a->size = 0;
+}
@@ -11,8 +11,23 @@
 
 #define ARENA_DISK_BUFFER (1 << 23) /* must be a power of two */
 
+/*
+An arena is either file-backed (fd is set), in which case items are
+written to fd through a buffer of ARENA_DISK_BUFFER items, or in memory.
+An in-memory arena grows in chunks of at least arena_increment items,
+rounded up to a power of two. Chunks are never moved, so growing the
+arena doesn't copy existing items and pointers to items stay valid.
+Use arena_get_item() to access items by index. Setting next to 0 rewinds
+an in-memory arena, so that its chunks are reused for new items.
+*/
 struct arena{
+    /* the disk buffer of a file-backed arena */
     char *data;
+    /* chunks of an in-memory arena */
+    char **chunks;
+    uint64_t num_chunks;
+    /* log2 of the number of items in a chunk */
+    uint64_t chunk_bits;
     uint64_t size;
     uint64_t next;
     uint64_t item_size;
@@ -25,4 +40,15 @@ int arena_flush(const struct arena *a);
 
 void *arena_add_item(struct arena *a);
 
+int arena_add_items(struct arena *a, const void *items, uint64_t num_items);
+
+void arena_free(struct arena *a);
+
+/* the item at idx of an in-memory arena, idx < a->next */
+static inline void *arena_get_item(const struct arena *a, uint64_t idx)
+{
+    const uint64_t mask = (1LLU << a->chunk_bits) - 1;
+    return a->chunks[idx >> a->chunk_bits] + (idx & mask) * a->item_size;
+}
+
 #endif /* __ARENA_H__ */
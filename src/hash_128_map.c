@@ -0,0 +1,47 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "hash_128_map.h"
+#include "tdb_error.h"
+
+int h128m_init(struct hash_128_map *h128m, uint64_t max_keys)
+{
+    /* keep the load factor at most 0.5 so probes stay short */
+    uint64_t size = 16;
+    while (size < max_keys * 2)
+        size *= 2;
+
+    memset(h128m, 0, sizeof(struct hash_128_map));
+    if (!(h128m->slots = calloc(size, sizeof(struct h128m_slot))))
+        return TDB_ERR_NOMEM;
+    h128m->mask = size - 1;
+    return 0;
+}
+
+void h128m_set(struct hash_128_map *h128m, __uint128_t key, uint64_t value)
+{
+    const uint64_t lo = (uint64_t)key;
+    const uint64_t hi = (uint64_t)(key >> 64);
+    uint64_t i = h128m_hash(lo, hi);
+
+    while (1){
+        struct h128m_slot *slot = &h128m->slots[i & h128m->mask];
+        if (!slot->value){
+            slot->lo = lo;
+            slot->hi = hi;
+            ++h128m->num_keys;
+            break;
+        }else if (slot->lo == lo && slot->hi == hi)
+            break;
+        ++i;
+    }
+    h128m->slots[i & h128m->mask].value = value;
+}
+
+void h128m_free(struct hash_128_map *h128m)
+{
+    free(h128m->slots);
+    memset(h128m, 0, sizeof(struct hash_128_map));
+}
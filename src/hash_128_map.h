@@ -0,0 +1,65 @@
+
+#ifndef __HASH_128_MAP_H__
+#define __HASH_128_MAP_H__
+
+#include <stdint.h>
+
+/*
+A flat, open-addressing hash map from 128-bit keys to non-zero 64-bit
+values. The map is built once with a known number of keys and it is
+read-only after that, so lookups are a hash and a short linear probe
+in a single array, unlike a two-level walk in a judy_128_map.
+*/
+
+struct h128m_slot{
+    uint64_t lo;
+    uint64_t hi;
+    /* zero marks an empty slot */
+    uint64_t value;
+};
+
+struct hash_128_map{
+    struct h128m_slot *slots;
+    uint64_t mask;
+    uint64_t num_keys;
+};
+
+/* allocate space for at most max_keys keys */
+int h128m_init(struct hash_128_map *h128m, uint64_t max_keys);
+
+/* value must be non-zero */
+void h128m_set(struct hash_128_map *h128m, __uint128_t key, uint64_t value);
+
+void h128m_free(struct hash_128_map *h128m);
+
+static inline uint64_t h128m_hash(uint64_t lo, uint64_t hi)
+{
+    /* the finalizer of MurmurHash3 */
+    uint64_t h = lo ^ (hi * 0x9e3779b97f4a7c15LLU);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdLLU;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53LLU;
+    h ^= h >> 33;
+    return h;
+}
+
+/* return the value of key or 0 if key is not in the map */
+static inline uint64_t h128m_get(const struct hash_128_map *h128m,
+                                 __uint128_t key)
+{
+    const uint64_t lo = (uint64_t)key;
+    const uint64_t hi = (uint64_t)(key >> 64);
+    uint64_t i = h128m_hash(lo, hi);
+
+    while (1){
+        const struct h128m_slot *slot = &h128m->slots[i & h128m->mask];
+        if (!slot->value)
+            return 0;
+        if (slot->lo == lo && slot->hi == hi)
+            return slot->value;
+        ++i;
+    }
+}
+
+#endif /* __HASH_128_MAP_H__ */
@@ -24,8 +24,13 @@
 #include "tdb_io.h"
 #include "tdb_huffman.h"
 #include "tdb_package.h"
+#include "tdb_cache.h"
+#include "tdb_pread.h"
+#include "tdb_compress.h"
 
 #define DEFAULT_OPT_CURSOR_EVENT_BUFFER_SIZE 1000
+#define HUGE_PAGE_SIZE (2LLU << 20)
+#define DEFAULT_OPT_BLOCK_CACHE_SIZE (64LLU << 20)
 
 struct io_ops{
     FILE* (*fopen)(const char *fname, const char *root, const tdb *db);
@@ -36,12 +41,77 @@ struct io_ops{
                 const char *root,
                 struct tdb_file *dst,
                 const tdb *db);
+
+    /* returns a file descriptor and the location of the file in it */
+    int (*open)(const char *fname,
+                const char *root,
+                const tdb *db,
+                uint64_t *offset,
+                uint64_t *size);
 };
 
+/*
+mmap() a region of a file, honoring TDB_OPT_MMAP_HUGEPAGES and
+TDB_OPT_MMAP_POPULATE. Transparent huge pages can back a file mapping only
+if its address is congruent with the file offset modulo the huge page size,
+so we reserve a larger region of address space and place the mapping in it.
+*/
+void *tdb_mmap(uint64_t size, int fd, uint64_t offset, const tdb *db)
+{
+    int flags = MAP_SHARED;
+
+#ifdef MAP_POPULATE
+    if (db && db->opt_mmap_populate)
+        flags |= MAP_POPULATE;
+#endif
+
+#ifdef MADV_HUGEPAGE
+    if (db && db->opt_mmap_hugepages && size >= HUGE_PAGE_SIZE){
+        const uint64_t page_mask = (uint64_t)getpagesize() - 1;
+        const uint64_t reserved_size = size + HUGE_PAGE_SIZE;
+        uint64_t shift, end;
+        char *reserved, *p;
+
+        reserved = mmap(NULL,
+                        reserved_size,
+                        PROT_NONE,
+                        MAP_PRIVATE | MAP_ANONYMOUS,
+                        -1,
+                        0);
+        if (reserved != MAP_FAILED){
+            /* the first address in the reservation congruent with offset */
+            shift = (offset - (uint64_t)reserved) & (HUGE_PAGE_SIZE - 1);
+            p = mmap(&reserved[shift],
+                     size,
+                     PROT_READ,
+                     flags | MAP_FIXED,
+                     fd,
+                     (off_t)offset);
+            if (p == MAP_FAILED){
+                munmap(reserved, reserved_size);
+                return MAP_FAILED;
+            }
+
+            /* release the unused parts of the reservation */
+            if (shift)
+                munmap(reserved, shift);
+            end = (shift + size + page_mask) & ~page_mask;
+            if (end < reserved_size)
+                munmap(&reserved[end], reserved_size - end);
+
+            madvise(p, size, MADV_HUGEPAGE);
+            return p;
+        }
+    }
+#endif
+
+    return mmap(NULL, size, PROT_READ, flags, fd, (off_t)offset);
+}
+
 int file_mmap(const char *fname,
               const char *root,
               struct tdb_file *dst,
-              const tdb *db __attribute__((unused)))
+              const tdb *db)
 {
     char path[TDB_MAX_PATH_SIZE];
     int fd = 0;
@@ -66,7 +136,7 @@ int file_mmap(const char *fname,
     dst->data = dst->ptr = MAP_FAILED;
 
     if (dst->size > 0)
-        dst->ptr = mmap(NULL, dst->size, PROT_READ, MAP_SHARED, fd, 0);
+        dst->ptr = tdb_mmap(dst->size, fd, 0, db);
 
     if (dst->ptr == MAP_FAILED){
         ret = -1;
@@ -103,12 +173,70 @@ static int file_fclose(FILE *f)
     return fclose(f);
 }
 
-void tdb_lexicon_read(const tdb *db, tdb_field field, struct tdb_lexicon *lex)
+static int file_open(const char *fname,
+                     const char *root,
+                     const tdb *db __attribute__((unused)),
+                     uint64_t *offset,
+                     uint64_t *size)
+{
+    char path[TDB_MAX_PATH_SIZE];
+    struct stat stats;
+    int fd;
+
+    if (tdb_path(path, "%s/%s", root, fname))
+        return -1;
+    if ((fd = open(path, O_RDONLY)) == -1)
+        return -1;
+    if (fstat(fd, &stats)){
+        close(fd);
+        return -1;
+    }
+    *offset = 0;
+    *size = (uint64_t)stats.st_size;
+    return fd;
+}
+
+/*
+Map a lazy lexicon. The mapping is published by setting its data pointer,
+so concurrent readers either see a complete mapping or take the lock.
+*/
+static int lexicon_map(const tdb *db, tdb_field field)
 {
+    struct tdb_lazy_lexicons *lazy = db->lazy_lexicons;
+    struct tdb_file *lexicon = &db->lexicons[field - 1];
+    struct tdb_file tmp;
+    int ret = 0;
+
+    pthread_mutex_lock(&lazy->lock);
+    if (!lexicon->data){
+        ret = package_mmap_region(lazy->fd,
+                                  lazy->offsets[field - 1],
+                                  lazy->sizes[field - 1],
+                                  &tmp,
+                                  db);
+        if (!ret){
+            lexicon->ptr = tmp.ptr;
+            lexicon->size = tmp.size;
+            lexicon->mmap_size = tmp.mmap_size;
+            __atomic_store_n(&lexicon->data, tmp.data, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&lazy->lock);
+    return ret;
+}
+
+int tdb_lexicon_read(const tdb *db, tdb_field field, struct tdb_lexicon *lex)
+{
+    const struct tdb_file *lexicon = &db->lexicons[field - 1];
+
+    if (!__atomic_load_n(&lexicon->data, __ATOMIC_ACQUIRE))
+        if (lexicon_map(db, field))
+            return -1;
+
     lex->version = db->version;
-    lex->data = db->lexicons[field - 1].data;
+    lex->data = lexicon->data;
     lex->size = 0;
-    if (db->lexicons[field - 1].size > UINT32_MAX){
+    if (lexicon->size > UINT32_MAX){
         lex->width = 8;
         lex->toc.toc64 = (const uint64_t*)&lex->data[lex->width];
         memcpy(&lex->size, lex->data, 8);
@@ -117,6 +245,7 @@ void tdb_lexicon_read(const tdb *db, tdb_field field, struct tdb_lexicon *lex)
         lex->toc.toc32 = (const uint32_t*)&lex->data[lex->width];
         memcpy(&lex->size, lex->data, 4);
     }
+    return 0;
 }
 
 static inline uint64_t tdb_lex_offset(const struct tdb_lexicon *lex, tdb_val i)
@@ -139,90 +268,200 @@ const char *tdb_lexicon_get(const struct tdb_lexicon *lex,
     return &lex->data[tdb_lex_offset(lex, i)];
 }
 
-static tdb_error fields_open(tdb *db, const char *root, struct io_ops *io)
+/*
+The fields file lists field names, one per line, followed by an empty line.
+V0 tdbs don't have the empty line. Newer tdbs list the number of values in
+each lexicon after the empty line, which allows lexicons to be mapped
+lazily. Older versions of TrailDB ignore everything after the empty line.
+*/
+static tdb_error fields_read(tdb *db,
+                             const char *root,
+                             struct io_ops *io,
+                             uint64_t **cardinalities)
 {
-    char path[TDB_MAX_PATH_SIZE];
     FILE *f = NULL;
     char *line = NULL;
     size_t n = 0;
-    tdb_field i, num_ofields = 0;
+    ssize_t len;
+    uint64_t max_fields = 0, num_cardinalities = 0;
+    int in_names = 1;
     int ret = 0;
-    int ok = 0;
 
     if (!(f = io->fopen("fields", root, db)))
         return TDB_ERR_INVALID_FIELDS_FILE;
 
-    while (getline(&line, &n, f) != -1){
-        if (line[0] == '\n'){
-            /*
-            V0 tdbs don't have the extra newline,
-            they should read until EOF
-            */
-            ok = 1;
-            break;
+    db->num_fields = 1;
+    while ((len = getline(&line, &n, f)) != -1){
+        if (in_names){
+            if (line[0] == '\n'){
+                in_names = 0;
+                if (db->num_fields > 1 &&
+                    !(*cardinalities = malloc((db->num_fields - 1) * 8))){
+                    ret = TDB_ERR_NOMEM;
+                    goto done;
+                }
+                continue;
+            }
+            if (line[len - 1] == '\n')
+                line[len - 1] = 0;
+
+            /* let's be paranoid and sanity check the fieldname again */
+            if (is_fieldname_invalid(line)){
+                ret = TDB_ERR_INVALID_FIELDS_FILE;
+                goto done;
+            }
+            if (db->num_fields >= max_fields){
+                char **names;
+                max_fields = max_fields ? max_fields * 2: 64;
+                if (!(names = realloc(db->field_names,
+                                      max_fields * sizeof(char*)))){
+                    ret = TDB_ERR_NOMEM;
+                    goto done;
+                }
+                db->field_names = names;
+            }
+            if (!(db->field_names[db->num_fields] = strdup(line))){
+                ret = TDB_ERR_NOMEM;
+                goto done;
+            }
+            ++db->num_fields;
+        }else{
+            char *end;
+            if (num_cardinalities == db->num_fields - 1)
+                break;
+            (*cardinalities)[num_cardinalities++] = strtoull(line, &end, 10);
+            if (end == line || *end != '\n')
+                break;
         }
-        ++num_ofields;
     }
-    if (!(ok || feof(f))){
+    if (!feof(f) && in_names){
         /* we can get here if malloc fails inside getline() */
         ret = TDB_ERR_NOMEM;
         goto done;
     }
-    db->num_fields = num_ofields + 1U;
-
-    if (!(db->field_names = calloc(db->num_fields, sizeof(char*)))){
-        ret = TDB_ERR_NOMEM;
+    if (db->num_fields > TDB_MAX_NUM_FIELDS + 1){
+        ret = TDB_ERR_INVALID_FIELDS_FILE;
         goto done;
     }
 
-    if (num_ofields){
-        if (!(db->lexicons = calloc(num_ofields, sizeof(struct tdb_file)))){
-            ret = TDB_ERR_NOMEM;
-            goto done;
-        }
-    }else
-        db->lexicons = NULL;
+    /* tdbs without cardinalities, or with broken ones, are read eagerly */
+    if (num_cardinalities != db->num_fields - 1 ||
+        num_cardinalities == 0){
+        free(*cardinalities);
+        *cardinalities = NULL;
+    }
 
-    /* io_ops doesn't support rewind(), so we have to close and reopen */
-    io->fclose(f);
-    if (!(f = io->fopen("fields", root, db))){
-        ret = TDB_ERR_IO_OPEN;
-        goto done;
+done:
+    free(line);
+    if (f)
+        io->fclose(f);
+    return ret;
+}
+
+static tdb_error lazy_lexicons_init(tdb *db, uint64_t *cardinalities)
+{
+    struct tdb_lazy_lexicons *lazy;
+    tdb_field i;
+
+    if (!(lazy = calloc(1, sizeof(struct tdb_lazy_lexicons)))){
+        free(cardinalities);
+        return TDB_ERR_NOMEM;
+    }
+    if (pthread_mutex_init(&lazy->lock, NULL)){
+        free(cardinalities);
+        free(lazy);
+        return TDB_ERR_NOMEM;
     }
+    lazy->cardinalities = cardinalities;
+    lazy->fd = -1;
+    db->lazy_lexicons = lazy;
 
-    db->field_names[0] = "time";
+    /*
+    lexicons are located now, while the TOC is available, and mapped
+    later through a descriptor of their own: db->package_handle is closed
+    at the end of tdb_open() and the package may have been replaced or
+    removed by the time a lexicon is used
+    */
+    if (!(lazy->offsets = malloc((db->num_fields - 1) * 8)))
+        return TDB_ERR_NOMEM;
+    if (!(lazy->sizes = malloc((db->num_fields - 1) * 8)))
+        return TDB_ERR_NOMEM;
+    for (i = 1; i < db->num_fields; i++){
+        char path[TDB_MAX_PATH_SIZE];
+        if (tdb_path(path, "lexicon.%s", db->field_names[i]))
+            return TDB_ERR_PATH_TOO_LONG;
+        if (package_locate(db,
+                           path,
+                           &lazy->offsets[i - 1],
+                           &lazy->sizes[i - 1]))
+            return TDB_ERR_INVALID_LEXICON_FILE;
+    }
+    /* a whole package mapping needs no file descriptor */
+    if (!db->package.ptr &&
+        (lazy->fd = dup(fileno(db->package_handle))) == -1)
+        return TDB_ERR_IO_OPEN;
+    return 0;
+}
 
-    for (i = 1; getline(&line, &n, f) != -1 && i < db->num_fields; i++){
+static void lazy_lexicons_free(struct tdb_lazy_lexicons *lazy)
+{
+    if (lazy){
+        pthread_mutex_destroy(&lazy->lock);
+        if (lazy->fd != -1)
+            close(lazy->fd);
+        free(lazy->cardinalities);
+        free(lazy->offsets);
+        free(lazy->sizes);
+        free(lazy);
+    }
+}
 
-        line[strlen(line) - 1] = 0;
+static tdb_error fields_open(tdb *db, const char *root, struct io_ops *io)
+{
+    char path[TDB_MAX_PATH_SIZE];
+    uint64_t *cardinalities = NULL;
+    tdb_field i;
+    int ret = 0;
 
-        /* let's be paranoid and sanity check the fieldname again */
-        if (is_fieldname_invalid(line)){
-            ret = TDB_ERR_INVALID_FIELDS_FILE;
-            goto done;
-        }
+    if ((ret = fields_read(db, root, io, &cardinalities)))
+        goto done;
 
-        if (!(db->field_names[i] = strdup(line))){
-            ret = TDB_ERR_NOMEM;
-            goto done;
-        }
+    if (!db->field_names &&
+        !(db->field_names = malloc(sizeof(char*)))){
+        ret = TDB_ERR_NOMEM;
+        goto done;
+    }
+    db->field_names[0] = "time";
+
+    if (db->num_fields == 1)
+        return 0;
+
+    if (!(db->lexicons = calloc(db->num_fields - 1, sizeof(struct tdb_file)))){
+        ret = TDB_ERR_NOMEM;
+        goto done;
+    }
+
+    /*
+    with known cardinalities, lexicons of a package are mapped on first
+    use. Lexicons of a directory are mapped now: they are separate files,
+    so mapping them later would depend on the directory staying intact.
+    */
+    if (cardinalities && db->is_package){
+        ret = lazy_lexicons_init(db, cardinalities);
+        cardinalities = NULL;
+        goto done;
+    }
 
-        TDB_PATH(path, "lexicon.%s", line);
+    for (i = 1; i < db->num_fields; i++){
+        TDB_PATH(path, "lexicon.%s", db->field_names[i]);
         if (io->mmap(path, root, &db->lexicons[i - 1], db)){
             ret = TDB_ERR_INVALID_LEXICON_FILE;
             goto done;
         }
     }
 
-    if (i != db->num_fields){
-        ret = TDB_ERR_INVALID_FIELDS_FILE;
-        goto done;
-    }
-
 done:
-    free(line);
-    if (f)
-        io->fclose(f);
+    free(cardinalities);
     return ret;
 }
 
@@ -237,17 +476,25 @@ static tdb_error init_field_stats(tdb *db)
             return TDB_ERR_NOMEM;
     }
 
-    for (i = 1; i < db->num_fields; i++){
-        struct tdb_lexicon lex;
-        tdb_lexicon_read(db, i, &lex);
-        field_cardinalities[i - 1] = lex.size;
-    }
+    if (db->lazy_lexicons)
+        memcpy(field_cardinalities,
+               db->lazy_lexicons->cardinalities,
+               (db->num_fields - 1) * 8);
+    else
+        for (i = 1; i < db->num_fields; i++){
+            struct tdb_lexicon lex;
+            if (tdb_lexicon_read(db, i, &lex)){
+                ret = TDB_ERR_INVALID_LEXICON_FILE;
+                goto done;
+            }
+            field_cardinalities[i - 1] = lex.size;
+        }
 
     if (!(db->field_stats = huff_field_stats(field_cardinalities,
                                              db->num_fields,
                                              db->max_timestamp_delta)))
         ret = TDB_ERR_NOMEM;
-
+done:
     free(field_cardinalities);
     return ret;
 }
@@ -262,7 +509,7 @@ static tdb_error read_version(tdb *db, const char *root, struct io_ops *io)
     else{
         if (fscanf(f, "%"PRIu64, &db->version) != 1)
             ret = TDB_ERR_INVALID_VERSION_FILE;
-        else if (db->version > TDB_VERSION_LATEST)
+        else if (db->version > TDB_VERSION_MAX)
             ret = TDB_ERR_INCOMPATIBLE_VERSION;
         io->fclose(f);
     }
@@ -290,11 +537,119 @@ static tdb_error read_info(tdb *db, const char *root, struct io_ops *io)
     return ret;
 }
 
+/*
+Validate the prefix table, so that lookups never see trail IDs out of
+range: entries must be non-decreasing from 0 to num_trails. The table
+has at most num_trails / 4 entries, which is cheap to check.
+*/
+static tdb_error uuid_index_open(tdb *db)
+{
+    const uint64_t width = db->num_trails < UINT32_MAX ? 4: 8;
+    const char *table = &db->uuid_index.data[8];
+    uint64_t i, num_prefixes, prev = 0;
+
+    if (db->uuid_index.size < 8)
+        return TDB_ERR_INVALID_UUIDS_FILE;
+
+    memcpy(&db->uuid_index_bits, db->uuid_index.data, 8);
+    if (db->uuid_index_bits > TDB_UUID_INDEX_MAX_BITS)
+        return TDB_ERR_INVALID_UUIDS_FILE;
+
+    num_prefixes = 1LLU << db->uuid_index_bits;
+    if (db->uuid_index.size != 8 + (num_prefixes + 1) * width)
+        return TDB_ERR_INVALID_UUIDS_FILE;
+
+    for (i = 0; i <= num_prefixes; i++){
+        uint64_t entry;
+        if (width == 4)
+            entry = ((const uint32_t*)table)[i];
+        else
+            entry = ((const uint64_t*)table)[i];
+        if ((i == 0 && entry) || entry < prev || entry > db->num_trails)
+            return TDB_ERR_INVALID_UUIDS_FILE;
+        prev = entry;
+    }
+    if (prev != db->num_trails)
+        return TDB_ERR_INVALID_UUIDS_FILE;
+
+    return 0;
+}
+
+static tdb_error trail_meta_open(tdb *db)
+{
+    uint64_t header[4];
+    uint64_t i, record_bits = 0;
+
+    if (db->trail_meta.size < sizeof(header))
+        return TDB_ERR_INVALID_TRAILS_FILE;
+
+    memcpy(header, db->trail_meta.data, sizeof(header));
+    if (header[0] != db->num_trails)
+        return TDB_ERR_INVALID_TRAILS_FILE;
+
+    for (i = 0; i < 3; i++){
+        if (header[i + 1] > 64)
+            return TDB_ERR_INVALID_TRAILS_FILE;
+        db->trail_meta_bits[i] = (uint32_t)header[i + 1];
+        record_bits += header[i + 1];
+    }
+
+    if (db->trail_meta.size !=
+            sizeof(header) + (db->num_trails * record_bits + 7) / 8 + 8)
+        return TDB_ERR_INVALID_TRAILS_FILE;
+
+    return 0;
+}
+
+static struct tdb_uuid_order *uuid_order_new(void)
+{
+    struct tdb_uuid_order *uo;
+
+    if (!(uo = calloc(1, sizeof(struct tdb_uuid_order))))
+        return NULL;
+
+    if (pthread_mutex_init(&uo->lock, NULL)){
+        free(uo);
+        return NULL;
+    }
+    return uo;
+}
+
+static void uuid_order_free(struct tdb_uuid_order *uo)
+{
+    if (uo){
+        if (uo->file.ptr)
+            munmap(uo->file.ptr, uo->file.mmap_size);
+        free(uo->buf);
+        pthread_mutex_destroy(&uo->lock);
+        free(uo);
+    }
+}
+
 TDB_EXPORT tdb *tdb_init(void)
 {
     return calloc(1, sizeof(tdb));
 }
 
+/*
+Sidecar files contain auxiliary data that is derived from a TrailDB and
+can be created after the TrailDB has been finalized. They are stored
+inside the TrailDB directory or next to the package as <package>.<name>
+*/
+tdb_error tdb_sidecar_path(const tdb *db,
+                           char path[TDB_MAX_PATH_SIZE],
+                           const char *name)
+{
+    int ret = 0;
+    if (db->is_package){
+        TDB_PATH(path, "%s.%s", db->root, name);
+    }else{
+        TDB_PATH(path, "%s/%s", db->root, name);
+    }
+done:
+    return ret;
+}
+
 TDB_EXPORT tdb_error tdb_open(tdb *db, const char *orig_root)
 {
     char root[TDB_MAX_PATH_SIZE];
@@ -328,16 +683,23 @@ TDB_EXPORT tdb_error tdb_open(tdb *db, const char *orig_root)
             goto done;
         }
     }
+    if (!(db->root = strdup(root))){
+        ret = TDB_ERR_NOMEM;
+        goto done;
+    }
     if (S_ISDIR(stats.st_mode)){
         /* open tdb in a directory */
         io.fopen = file_fopen;
         io.fclose = file_fclose;
         io.mmap = file_mmap;
+        io.open = file_open;
     }else{
         /* open tdb in a tarball */
         io.fopen = package_fopen;
         io.fclose = package_fclose;
         io.mmap = package_mmap;
+        io.open = package_open;
+        db->is_package = 1;
         if ((ret = open_package(db, root)))
             goto done;
     }
@@ -361,11 +723,20 @@ TDB_EXPORT tdb_error tdb_open(tdb *db, const char *orig_root)
                 ret = TDB_ERR_INVALID_UUIDS_FILE;
                 goto done;
             }
+            if (!(db->uuid_order = uuid_order_new())){
+                ret = TDB_ERR_NOMEM;
+                goto done;
+            }
         }else{
             if (io.mmap("uuids", root, &db->uuids, db)){
                 ret = TDB_ERR_INVALID_UUIDS_FILE;
                 goto done;
             }
+            /* the UUID index is optional, older TrailDBs don't have it */
+            if (io.mmap("uuids.index", root, &db->uuid_index, db))
+                memset(&db->uuid_index, 0, sizeof(struct tdb_file));
+            else if ((ret = uuid_index_open(db)))
+                goto done;
         }
 
         if (io.mmap("trails.codebook", root, &db->codebook, db)){
@@ -382,10 +753,54 @@ TDB_EXPORT tdb_error tdb_open(tdb *db, const char *orig_root)
             goto done;
         }
 
-        if (io.mmap("trails.data", root, &db->trails, db)){
+        /* trail metadata is optional, older TrailDBs don't have it */
+        if (io.mmap("trails.meta", root, &db->trail_meta, db))
+            memset(&db->trail_meta, 0, sizeof(struct tdb_file));
+        else if ((ret = trail_meta_open(db)))
+            goto done;
+
+        if (db->opt_pread_cache_size){
+            /* read trails with pread() instead of mapping them */
+            uint64_t offset;
+            int fd = io.open("trails.data", root, db, &offset, &db->trails.size);
+            if (fd == -1){
+                ret = TDB_ERR_INVALID_TRAILS_FILE;
+                goto done;
+            }
+            if (!(db->pread = tdb_pread_new(fd,
+                                            offset,
+                                            db->trails.size,
+                                            db->opt_pread_cache_size))){
+                close(fd);
+                ret = TDB_ERR_NOMEM;
+                goto done;
+            }
+        }else if (io.mmap("trails.data", root, &db->trails, db)){
             ret = TDB_ERR_INVALID_TRAILS_FILE;
             goto done;
         }
+        db->trails_size = db->trails.size;
+
+        if (db->version == TDB_VERSION_V0_2){
+            struct tdb_file blocks;
+            if (io.mmap("trails.blocks", root, &blocks, db)){
+                ret = TDB_ERR_INVALID_TRAILS_FILE;
+                goto done;
+            }
+            if ((ret = tdb_compressed_new(&blocks,
+                                          db->opt_block_cache_size ?
+                                              db->opt_block_cache_size:
+                                              DEFAULT_OPT_BLOCK_CACHE_SIZE,
+                                          &db->compressed))){
+                if (blocks.ptr)
+                    munmap(blocks.ptr, blocks.mmap_size);
+                goto done;
+            }
+            db->trails_size = tdb_compressed_size(db->compressed);
+        }
+
+        if ((ret = tdb_deleted_open(db)))
+            goto done;
     }
 done:
     free_package(db);
@@ -396,14 +811,24 @@ static void tdb_madvise(const tdb *db, int advice)
 {
     if (db && db->num_fields > 0){
         tdb_field i;
+        /* lazy lexicons that haven't been used yet are not mapped */
         for (i = 0; i < db->num_fields - 1; i++)
-            madvise(db->lexicons[i].ptr,
-                    db->lexicons[i].mmap_size,
-                    advice);
+            if (__atomic_load_n(&db->lexicons[i].data, __ATOMIC_ACQUIRE))
+                madvise(db->lexicons[i].ptr,
+                        db->lexicons[i].mmap_size,
+                        advice);
+
+        /*
+        with TDB_OPT_MMAP_WHOLE_PACKAGE, files point to the package
+        mapping and they have no mappings of their own
+        */
+        madvise(db->package.ptr, db->package.mmap_size, advice);
 
         madvise(db->uuids.ptr, db->uuids.mmap_size, advice);
+        madvise(db->uuid_index.ptr, db->uuid_index.mmap_size, advice);
         madvise(db->codebook.ptr, db->codebook.mmap_size, advice);
         madvise(db->toc.ptr, db->toc.mmap_size, advice);
+        madvise(db->trail_meta.ptr, db->trail_meta.mmap_size, advice);
         madvise(db->trails.ptr, db->trails.mmap_size, advice);
     }
 }
@@ -411,11 +836,15 @@ static void tdb_madvise(const tdb *db, int advice)
 TDB_EXPORT void tdb_willneed(const tdb *db)
 {
     tdb_madvise(db, MADV_WILLNEED);
+    if (db && db->pread)
+        tdb_pread_advise(db->pread, 0, db->trails.size, POSIX_FADV_WILLNEED);
 }
 
 TDB_EXPORT void tdb_dontneed(const tdb *db)
 {
     tdb_madvise(db, MADV_DONTNEED);
+    if (db && db->pread)
+        tdb_pread_advise(db->pread, 0, db->trails.size, POSIX_FADV_DONTNEED);
 }
 
 TDB_EXPORT void tdb_close(tdb *db)
@@ -427,25 +856,39 @@ TDB_EXPORT void tdb_close(tdb *db)
         if (db->num_fields > 0){
             for (i = 0; i < db->num_fields - 1; i++){
                 free(db->field_names[i + 1]);
-                if (db->lexicons[i].ptr)
+                if (db->lexicons && db->lexicons[i].ptr)
                     munmap(db->lexicons[i].ptr, db->lexicons[i].mmap_size);
             }
         }
 
         if (db->uuids.ptr)
             munmap(db->uuids.ptr, db->uuids.mmap_size);
+        if (db->uuid_index.ptr)
+            munmap(db->uuid_index.ptr, db->uuid_index.mmap_size);
         if (db->codebook.ptr)
             munmap(db->codebook.ptr, db->codebook.mmap_size);
         if (db->toc.ptr)
             munmap(db->toc.ptr, db->toc.mmap_size);
+        if (db->trail_meta.ptr)
+            munmap(db->trail_meta.ptr, db->trail_meta.mmap_size);
         if (db->trails.ptr)
             munmap(db->trails.ptr, db->trails.mmap_size);
+        if (db->package.ptr)
+            munmap(db->package.ptr, db->package.mmap_size);
 
         JLFA(tmp, db->opt_trail_event_filters);
 
+        tdb_cache_free(db->trail_cache);
+        tdb_pread_free(db->pread);
+        tdb_compressed_free(db->compressed);
+
         free(db->lexicons);
+        lazy_lexicons_free(db->lazy_lexicons);
         free(db->field_names);
         free(db->field_stats);
+        uuid_order_free(db->uuid_order);
+        free(db->deleted);
+        free(db->root);
         free(db);
     }
 out_of_memory:
@@ -456,10 +899,13 @@ TDB_EXPORT uint64_t tdb_lexicon_size(const tdb *db, tdb_field field)
 {
     if (field == 0 || field >= db->num_fields)
         return 0;
+    else if (db->lazy_lexicons)
+        /* +1 refers to the implicit NULL value (empty string) */
+        return db->lazy_lexicons->cardinalities[field - 1] + 1;
     else{
         struct tdb_lexicon lex;
-        tdb_lexicon_read(db, field, &lex);
-        /* +1 refers to the implicit NULL value (empty string) */
+        if (tdb_lexicon_read(db, field, &lex))
+            return 0;
         return lex.size + 1;
     }
 }
@@ -498,7 +944,8 @@ TDB_EXPORT tdb_item tdb_get_item(const tdb *db,
     else{
         struct tdb_lexicon lex;
         tdb_val i;
-        tdb_lexicon_read(db, field, &lex);
+        if (tdb_lexicon_read(db, field, &lex))
+            return 0;
 
         for (i = 0; i < lex.size; i++){
             uint64_t length;
@@ -523,7 +970,8 @@ TDB_EXPORT const char *tdb_get_value(const tdb *db,
         return "";
     }else{
         struct tdb_lexicon lex;
-        tdb_lexicon_read(db, field, &lex);
+        if (tdb_lexicon_read(db, field, &lex))
+            return NULL;
         if ((val - 1) < lex.size)
             return tdb_lexicon_get(&lex, val - 1, value_length);
         else
@@ -549,45 +997,378 @@ TDB_EXPORT const uint8_t *tdb_get_uuid(const tdb *db,
     return NULL;
 }
 
-TDB_EXPORT tdb_error tdb_get_trail_id(const tdb *db,
-                                      const uint8_t *uuid,
-                                      uint64_t *trail_id)
+static inline __uint128_t uuid_at(const tdb *db, uint64_t idx)
+{
+    __uint128_t key;
+    memcpy(&key, &db->uuids.data[idx * 16], 16);
+    return key;
+}
+
+static inline uint64_t uuid_index_entry(const tdb *db, uint64_t prefix)
+{
+    const char *table = &db->uuid_index.data[8];
+    if (db->num_trails < UINT32_MAX)
+        return ((const uint32_t*)table)[prefix];
+    else
+        return ((const uint64_t*)table)[prefix];
+}
+
+/*
+Find the range of trail IDs [left, right) that may contain the key.
+Without the UUID index, this is the full range of trails.
+*/
+static inline void uuid_index_range(const tdb *db,
+                                    __uint128_t key,
+                                    uint64_t *left,
+                                    uint64_t *right)
+{
+    if (db->uuid_index.data){
+        uint64_t prefix = tdb_uuid_prefix(key, db->uuid_index_bits);
+        *left = uuid_index_entry(db, prefix);
+        *right = uuid_index_entry(db, prefix + 1);
+    }else{
+        *left = 0;
+        *right = db->num_trails;
+    }
+}
+
+/* return the first trail ID in [left, right) whose UUID >= key */
+static uint64_t uuid_lower_bound(const tdb *db,
+                                 __uint128_t key,
+                                 uint64_t left,
+                                 uint64_t right)
+{
+    /*
+    gallop forward from left first: this is a plain binary search
+    if the key is far away, but it requires only a few probes, close
+    to each other, when the key is near left (see tdb_get_trail_ids)
+    */
+    uint64_t bound = 1;
+    while (left + bound < right && uuid_at(db, left + bound) < key)
+        bound *= 2;
+
+    right = left + bound + 1 < right ? left + bound + 1: right;
+    left += bound / 2;
+
+    while (left < right){
+        uint64_t mid = left + (right - left) / 2;
+        if (uuid_at(db, mid) < key)
+            left = mid + 1;
+        else
+            right = mid;
+    }
+    return left;
+}
+
+struct uuid_query{
+    __uint128_t key;
+    uint64_t idx;
+};
+
+static int uuid_query_cmp(const void *a, const void *b)
 {
-    __uint128_t cmp, key;
+    const struct uuid_query *qa = (const struct uuid_query*)a;
+    const struct uuid_query *qb = (const struct uuid_query*)b;
+
+    if (qa->key > qb->key)
+        return 1;
+    else if (qa->key < qb->key)
+        return -1;
+    else if (qa->idx > qb->idx)
+        return 1;
+    else if (qa->idx < qb->idx)
+        return -1;
+    else
+        return 0;
+}
+
+/*
+uuids.order: [ num_trails (8 bytes) | trail IDs in the order of UUIDs ]
+(8 bytes each). Ties are ordered by trail ID, so that lookups return
+the first matching trail like a linear scan would.
+*/
+static int uuid_order_is_valid(const tdb *db, const struct tdb_file *file)
+{
+    const uint64_t *order = (const uint64_t*)&file->data[8];
+    uint64_t i, num_trails;
+
+    if (file->size != 8 + db->num_trails * 8)
+        return 0;
+
+    memcpy(&num_trails, file->data, 8);
+    if (num_trails != db->num_trails)
+        return 0;
+
+    for (i = 0; i < num_trails; i++){
+        if (order[i] >= num_trails)
+            return 0;
+        if (i > 0){
+            __uint128_t prev = uuid_at(db, order[i - 1]);
+            __uint128_t cur = uuid_at(db, order[i]);
+            if (prev > cur || (prev == cur && order[i - 1] >= order[i]))
+                return 0;
+        }
+    }
+    return 1;
+}
+
+static const uint64_t *uuid_order_load(const tdb *db,
+                                       struct tdb_file *file)
+{
+    char path[TDB_MAX_PATH_SIZE];
+
+    if (tdb_sidecar_path(db, path, "uuids.order"))
+        return NULL;
+
+    if (file_mmap(path, NULL, file, db)){
+        memset(file, 0, sizeof(struct tdb_file));
+        return NULL;
+    }
+
+    if (!uuid_order_is_valid(db, file)){
+        /* a stale or corrupted sidecar is ignored and rebuilt */
+        munmap(file->ptr, file->mmap_size);
+        memset(file, 0, sizeof(struct tdb_file));
+        return NULL;
+    }
+
+    return (const uint64_t*)&file->data[8];
+}
+
+/* write the sidecar atomically, readers never see a partial file */
+static tdb_error uuid_order_store(const tdb *db, const uint64_t *order)
+{
+    char path[TDB_MAX_PATH_SIZE];
+    char tmp_path[TDB_MAX_PATH_SIZE];
+    FILE *out = NULL;
+    int ret = 0;
+
+    if ((ret = tdb_sidecar_path(db, path, "uuids.order")))
+        return ret;
+    TDB_PATH(tmp_path, "%s.tmp.%d", path, (int)getpid());
+
+    TDB_OPEN(out, tmp_path, "w");
+    TDB_WRITE(out, &db->num_trails, 8);
+    TDB_WRITE(out, order, db->num_trails * 8);
+
+    /* out must not be closed again in done, even if fclose fails */
+    ret = fclose(out) ? TDB_ERR_IO_CLOSE: 0;
+    out = NULL;
+    if (!ret && rename(tmp_path, path))
+        ret = TDB_ERR_IO_WRITE;
+    if (ret)
+        unlink(tmp_path);
+done:
+    if (out){
+        fclose(out);
+        unlink(tmp_path);
+    }
+    return ret;
+}
+
+static uint64_t *uuid_order_build(const tdb *db)
+{
+    struct uuid_query *keys;
+    uint64_t *order;
+    uint64_t i;
+
+    if (!(keys = malloc(db->num_trails * sizeof(struct uuid_query))))
+        return NULL;
+
+    if (!(order = malloc(db->num_trails * 8))){
+        free(keys);
+        return NULL;
+    }
+
+    for (i = 0; i < db->num_trails; i++){
+        keys[i].key = uuid_at(db, i);
+        keys[i].idx = i;
+    }
+    qsort(keys, db->num_trails, sizeof(struct uuid_query), uuid_query_cmp);
+
+    for (i = 0; i < db->num_trails; i++)
+        order[i] = keys[i].idx;
+    free(keys);
+
+    /*
+    persisting is best-effort: archives may be on read-only storage and
+    lookups use the order in memory anyway. A failed write only means
+    that the next handle sorts the UUIDs again.
+    */
+    if (db->opt_persist_uuid_order)
+        (void)uuid_order_store(db, order);
+
+    return order;
+}
+
+/*
+Return trail IDs in the order of UUIDs for a V0 TrailDB, or NULL if the
+order couldn't be built. The order is initialized only once per handle,
+so it is safe to call this function from multiple threads.
+*/
+static const uint64_t *uuid_order_get(const tdb *db)
+{
+    struct tdb_uuid_order *uo = db->uuid_order;
+    const uint64_t *order = __atomic_load_n(&uo->order, __ATOMIC_ACQUIRE);
+
+    if (order)
+        return order;
+
+    pthread_mutex_lock(&uo->lock);
+    if (!(order = uo->order) && !uo->failed){
+        if (!(order = uuid_order_load(db, &uo->file)))
+            order = uo->buf = uuid_order_build(db);
+        if (order)
+            __atomic_store_n(&uo->order, order, __ATOMIC_RELEASE);
+        else
+            uo->failed = 1;
+    }
+    pthread_mutex_unlock(&uo->lock);
+    return order;
+}
+
+static tdb_error uuid_lookup(const tdb *db,
+                             const uint8_t *uuid,
+                             uint64_t *trail_id)
+{
+    __uint128_t key;
     memcpy(&key, uuid, 16);
 
     if (db->version == TDB_VERSION_V0){
         /* V0 doesn't guarantee that UUIDs would be ordered */
+        const uint64_t *order = uuid_order_get(db);
         uint64_t idx;
-        for (idx = 0; idx < db->num_trails; idx++){
-            memcpy(&cmp, &db->uuids.data[idx * 16], 16);
-            if (key == cmp){
-                *trail_id = idx;
+
+        if (order){
+            uint64_t left = 0;
+            uint64_t right = db->num_trails;
+            while (left < right){
+                uint64_t mid = left + (right - left) / 2;
+                if (uuid_at(db, order[mid]) < key)
+                    left = mid + 1;
+                else
+                    right = mid;
+            }
+            if (left < db->num_trails && uuid_at(db, order[left]) == key){
+                *trail_id = order[left];
                 return 0;
             }
+        }else{
+            /* we ran out of memory, fall back to a linear scan */
+            for (idx = 0; idx < db->num_trails; idx++){
+                if (key == uuid_at(db, idx)){
+                    *trail_id = idx;
+                    return 0;
+                }
+            }
         }
     }else{
-        /* note: TDB_MAX_NUM_TRAILS < 2^63, so we can safely use int64_t */
-        int64_t idx;
-        int64_t left = 0;
-        int64_t right = ((int64_t)db->num_trails) - 1LL;
-
-        while (left <= right){
-            /* compute midpoint in an overflow-safe manner (see Wikipedia) */
-            idx = left + ((right - left) / 2);
-            memcpy(&cmp, &db->uuids.data[idx * 16], 16);
-            if (cmp == key){
-                *trail_id = (uint64_t)idx;
-                return 0;
-            }else if (cmp > key)
-                right = idx - 1;
-            else
-                left = idx + 1;
+        uint64_t idx, left, right;
+
+        uuid_index_range(db, key, &left, &right);
+        idx = uuid_lower_bound(db, key, left, right);
+        if (idx < right && uuid_at(db, idx) == key){
+            *trail_id = idx;
+            return 0;
         }
     }
     return TDB_ERR_UNKNOWN_UUID;
 }
 
+TDB_EXPORT tdb_error tdb_get_trail_id(const tdb *db,
+                                      const uint8_t *uuid,
+                                      uint64_t *trail_id)
+{
+    tdb_error err = uuid_lookup(db, uuid, trail_id);
+    if (!err && tdb_trail_is_deleted(db, *trail_id))
+        return TDB_ERR_UNKNOWN_UUID;
+    return err;
+}
+
+/* how many queries ahead tdb_get_trail_ids() prefetches */
+#define UUID_PREFETCH_DISTANCE 8
+
+TDB_EXPORT tdb_error tdb_get_trail_ids(const tdb *db,
+                                       const uint8_t *uuids,
+                                       uint64_t num_uuids,
+                                       uint64_t *trail_ids)
+{
+    const uint64_t width = db->num_trails < UINT32_MAX ? 4: 8;
+    struct uuid_query *queries;
+    uint64_t i, prev = 0;
+    tdb_error ret = 0;
+
+    if (db->version == TDB_VERSION_V0){
+        for (i = 0; i < num_uuids; i++)
+            if (tdb_get_trail_id(db, &uuids[i * 16], &trail_ids[i])){
+                trail_ids[i] = TDB_UNKNOWN_TRAIL_ID;
+                ret = TDB_ERR_UNKNOWN_UUID;
+            }
+        return ret;
+    }
+
+    if (!num_uuids)
+        return 0;
+
+    if (!(queries = malloc(num_uuids * sizeof(struct uuid_query))))
+        return TDB_ERR_NOMEM;
+
+    for (i = 0; i < num_uuids; i++){
+        memcpy(&queries[i].key, &uuids[i * 16], 16);
+        queries[i].idx = i;
+    }
+
+    /*
+    resolve UUIDs in ascending order: each search can start from the
+    previous result, which keeps probes close to each other
+    */
+    qsort(queries, num_uuids, sizeof(struct uuid_query), uuid_query_cmp);
+
+    for (i = 0; i < num_uuids; i++){
+        uint64_t idx, left, right;
+
+        if (db->uuid_index.data){
+            /*
+            prefetch in two stages: first the index entry for a query
+            far ahead, then the UUIDs for a query a bit closer, whose
+            index entry was prefetched earlier
+            */
+            if (i + 2 * UUID_PREFETCH_DISTANCE < num_uuids){
+                uint64_t prefix = tdb_uuid_prefix(
+                    queries[i + 2 * UUID_PREFETCH_DISTANCE].key,
+                    db->uuid_index_bits);
+                __builtin_prefetch(&db->uuid_index.data[8 + prefix * width]);
+            }
+            if (i + UUID_PREFETCH_DISTANCE < num_uuids){
+                uuid_index_range(db,
+                                 queries[i + UUID_PREFETCH_DISTANCE].key,
+                                 &left,
+                                 &right);
+                if (left < right)
+                    __builtin_prefetch(&db->uuids.data[left * 16]);
+            }
+        }
+
+        uuid_index_range(db, queries[i].key, &left, &right);
+        if (prev > left)
+            left = prev;
+
+        idx = uuid_lower_bound(db, queries[i].key, left, right);
+        if (idx < right &&
+            uuid_at(db, idx) == queries[i].key &&
+            !tdb_trail_is_deleted(db, idx)){
+            trail_ids[queries[i].idx] = idx;
+            prev = idx;
+        }else{
+            trail_ids[queries[i].idx] = TDB_UNKNOWN_TRAIL_ID;
+            ret = TDB_ERR_UNKNOWN_UUID;
+        }
+    }
+
+    free(queries);
+    return ret;
+}
+
 TDB_EXPORT const char *tdb_error_str(tdb_error errcode)
 {
     switch (errcode){
@@ -643,6 +1424,10 @@ TDB_EXPORT const char *tdb_error_str(tdb_error errcode)
             return "TDB_ERR_INVALID_LEXICON_FILE";
         case        TDB_ERR_INVALID_PACKAGE:
             return "TDB_ERR_INVALID_PACKAGE";
+        case        TDB_ERR_INVALID_DELETIONS_FILE:
+            return "TDB_ERR_INVALID_DELETIONS_FILE";
+        case        TDB_ERR_INVALID_MANIFEST_FILE:
+            return "TDB_ERR_INVALID_MANIFEST_FILE";
         case        TDB_ERR_TOO_MANY_FIELDS:
             return "TDB_ERR_TOO_MANY_FIELDS";
         case        TDB_ERR_DUPLICATE_FIELDS:
@@ -726,6 +1511,59 @@ TDB_EXPORT tdb_error tdb_set_opt(tdb *db,
                 return 0;
             }else
                 return TDB_ERR_INVALID_OPTION_VALUE;
+        case TDB_OPT_TRAIL_CACHE_SIZE:
+            /*
+            the cache is kept until tdb_close() even if it is disabled,
+            since cursors may still hold references to its entries
+            */
+            if (db->trail_cache)
+                tdb_cache_set_max_size(db->trail_cache, value.value);
+            else if (value.value){
+                if (!(db->trail_cache = tdb_cache_new(value.value)))
+                    return TDB_ERR_NOMEM;
+            }
+            return 0;
+        case TDB_OPT_PERSIST_UUID_ORDER:
+            db->opt_persist_uuid_order = value.value ? 1: 0;
+            return 0;
+        case TDB_OPT_MMAP_HUGEPAGES:
+            /*
+            mappings are aligned for huge pages in tdb_open(), sections
+            that are mapped already can only be advised
+            */
+            db->opt_mmap_hugepages = value.value ? 1: 0;
+#ifdef MADV_HUGEPAGE
+            if (db->opt_mmap_hugepages)
+                tdb_madvise(db, MADV_HUGEPAGE);
+#endif
+            return 0;
+        case TDB_OPT_MMAP_POPULATE:
+            db->opt_mmap_populate = value.value ? 1: 0;
+            if (db->opt_mmap_populate){
+#ifdef MADV_POPULATE_READ
+                tdb_madvise(db, MADV_POPULATE_READ);
+#else
+                tdb_madvise(db, MADV_WILLNEED);
+#endif
+            }
+            return 0;
+        case TDB_OPT_MMAP_WHOLE_PACKAGE:
+            /* takes effect in tdb_open() */
+            db->opt_mmap_whole_package = value.value ? 1: 0;
+            return 0;
+        case TDB_OPT_PREAD_CACHE_SIZE:
+            /* takes effect in tdb_open() */
+            if (db->num_fields)
+                return TDB_ERR_INVALID_OPTION_VALUE;
+            db->opt_pread_cache_size = value.value;
+            return 0;
+        case TDB_OPT_BLOCK_CACHE_SIZE:
+            if (!value.value)
+                return TDB_ERR_INVALID_OPTION_VALUE;
+            db->opt_block_cache_size = value.value;
+            if (db->compressed)
+                tdb_compressed_set_cache_size(db->compressed, value.value);
+            return 0;
         default:
             return TDB_ERR_UNKNOWN_OPTION;
     }
@@ -745,6 +1583,46 @@ TDB_EXPORT tdb_error tdb_get_opt(tdb *db,
         case TDB_OPT_CURSOR_EVENT_BUFFER_SIZE:
             value->value = db->opt_cursor_event_buffer_size;
             return 0;
+        case TDB_OPT_TRAIL_CACHE_SIZE:
+            if (db->trail_cache)
+                value->value = tdb_cache_max_size(db->trail_cache);
+            else
+                value->value = 0;
+            return 0;
+        case TDB_OPT_TRAIL_CACHE_HITS:
+        case TDB_OPT_TRAIL_CACHE_MISSES:
+            {
+                uint64_t num_hits = 0;
+                uint64_t num_misses = 0;
+                if (db->trail_cache)
+                    tdb_cache_stats(db->trail_cache, &num_hits, &num_misses);
+                if (key == TDB_OPT_TRAIL_CACHE_HITS)
+                    value->value = num_hits;
+                else
+                    value->value = num_misses;
+            }
+            return 0;
+        case TDB_OPT_PERSIST_UUID_ORDER:
+            *value = db->opt_persist_uuid_order ? TDB_TRUE: TDB_FALSE;
+            return 0;
+        case TDB_OPT_MMAP_HUGEPAGES:
+            *value = db->opt_mmap_hugepages ? TDB_TRUE: TDB_FALSE;
+            return 0;
+        case TDB_OPT_MMAP_POPULATE:
+            *value = db->opt_mmap_populate ? TDB_TRUE: TDB_FALSE;
+            return 0;
+        case TDB_OPT_MMAP_WHOLE_PACKAGE:
+            *value = db->opt_mmap_whole_package ? TDB_TRUE: TDB_FALSE;
+            return 0;
+        case TDB_OPT_PREAD_CACHE_SIZE:
+            value->value = db->opt_pread_cache_size;
+            return 0;
+        case TDB_OPT_BLOCK_CACHE_SIZE:
+            if (db->opt_block_cache_size)
+                value->value = db->opt_block_cache_size;
+            else
+                value->value = DEFAULT_OPT_BLOCK_CACHE_SIZE;
+            return 0;
         default:
             return TDB_ERR_UNKNOWN_OPTION;
     }
@@ -0,0 +1,234 @@
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#undef JUDYERROR
+#define JUDYERROR(CallerFile, CallerLine, JudyFunc, JudyErrno, JudyErrID) \
+{                                                                         \
+   if ((JudyErrno) == JU_ERRNO_NOMEM)                                     \
+       goto out_of_memory;                                                \
+}
+#include <Judy.h>
+
+#include "tdb_cache.h"
+
+struct tdb_cache{
+    pthread_mutex_t lock;
+
+    /* key -> struct tdb_cache_entry* */
+    Pvoid_t entries;
+
+    /* LRU list: head is the most recently used entry */
+    struct tdb_cache_entry *head;
+    struct tdb_cache_entry *tail;
+
+    uint64_t size;
+    uint64_t max_size;
+
+    uint64_t num_hits;
+    uint64_t num_misses;
+};
+
+static void lru_unlink(struct tdb_cache *cache, struct tdb_cache_entry *e)
+{
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        cache->head = e->next;
+
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        cache->tail = e->prev;
+
+    e->prev = e->next = NULL;
+}
+
+static void lru_push_head(struct tdb_cache *cache, struct tdb_cache_entry *e)
+{
+    e->prev = NULL;
+    e->next = cache->head;
+    if (cache->head)
+        cache->head->prev = e;
+    else
+        cache->tail = e;
+    cache->head = e;
+}
+
+/* NOTE: the caller must hold cache->lock */
+static void evict(struct tdb_cache *cache, struct tdb_cache_entry *e)
+{
+    int tmp;
+
+    JLD(tmp, cache->entries, (Word_t)e->key);
+    lru_unlink(cache, e);
+    cache->size -= e->size;
+    e->is_cached = 0;
+    /* referenced entries are freed when the last reference is released */
+    if (!e->num_refs)
+        free(e);
+out_of_memory:
+    return;
+}
+
+/* NOTE: the caller must hold cache->lock */
+static void evict_until_fits(struct tdb_cache *cache, uint64_t size)
+{
+    while (cache->tail && cache->size + size > cache->max_size)
+        evict(cache, cache->tail);
+}
+
+struct tdb_cache *tdb_cache_new(uint64_t max_size)
+{
+    struct tdb_cache *cache;
+
+    if (!(cache = calloc(1, sizeof(struct tdb_cache))))
+        return NULL;
+
+    if (pthread_mutex_init(&cache->lock, NULL)){
+        free(cache);
+        return NULL;
+    }
+
+    cache->max_size = max_size;
+    return cache;
+}
+
+void tdb_cache_free(struct tdb_cache *cache)
+{
+    if (cache){
+        Word_t tmp;
+        /*
+        all references must have been released at this point,
+        i.e. all cursors using the cache must have been freed
+        */
+        while (cache->tail)
+            evict(cache, cache->tail);
+        JLFA(tmp, cache->entries);
+        pthread_mutex_destroy(&cache->lock);
+        free(cache);
+    }
+out_of_memory:
+    return;
+}
+
+void tdb_cache_set_max_size(struct tdb_cache *cache, uint64_t max_size)
+{
+    pthread_mutex_lock(&cache->lock);
+    cache->max_size = max_size;
+    evict_until_fits(cache, 0);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+uint64_t tdb_cache_max_size(struct tdb_cache *cache)
+{
+    uint64_t max_size;
+    pthread_mutex_lock(&cache->lock);
+    max_size = cache->max_size;
+    pthread_mutex_unlock(&cache->lock);
+    return max_size;
+}
+
+void tdb_cache_stats(struct tdb_cache *cache,
+                     uint64_t *num_hits,
+                     uint64_t *num_misses)
+{
+    pthread_mutex_lock(&cache->lock);
+    *num_hits = cache->num_hits;
+    *num_misses = cache->num_misses;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+struct tdb_cache_entry *tdb_cache_entry_new(uint64_t key, uint64_t size)
+{
+    struct tdb_cache_entry *e;
+
+    if (!(e = malloc(sizeof(struct tdb_cache_entry) + size)))
+        return NULL;
+
+    e->key = key;
+    e->value = 0;
+    e->size = sizeof(struct tdb_cache_entry) + size;
+    e->num_refs = 1;
+    e->is_cached = 0;
+    e->prev = e->next = NULL;
+    return e;
+}
+
+struct tdb_cache_entry *tdb_cache_entry_resize(struct tdb_cache_entry *e,
+                                               uint64_t size)
+{
+    struct tdb_cache_entry *new_e;
+
+    /* only entries that haven't been inserted in the cache can be resized */
+    if (!(new_e = realloc(e, sizeof(struct tdb_cache_entry) + size)))
+        return NULL;
+    new_e->size = sizeof(struct tdb_cache_entry) + size;
+    return new_e;
+}
+
+struct tdb_cache_entry *tdb_cache_get(struct tdb_cache *cache, uint64_t key)
+{
+    struct tdb_cache_entry *e = NULL;
+    Word_t *ptr;
+
+    pthread_mutex_lock(&cache->lock);
+    if (cache->max_size){
+        JLG(ptr, cache->entries, (Word_t)key);
+        if (ptr){
+            e = (struct tdb_cache_entry*)*ptr;
+            ++e->num_refs;
+            lru_unlink(cache, e);
+            lru_push_head(cache, e);
+            ++cache->num_hits;
+        }else
+            ++cache->num_misses;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return e;
+}
+
+void tdb_cache_put(struct tdb_cache *cache, struct tdb_cache_entry *e)
+{
+    Word_t *ptr;
+
+    pthread_mutex_lock(&cache->lock);
+
+    if (e->size > cache->max_size)
+        goto done;
+
+    JLG(ptr, cache->entries, (Word_t)e->key);
+    if (ptr)
+        /*
+        another thread inserted the same key while we were preparing
+        this entry. Keep the existing one.
+        */
+        goto done;
+
+    evict_until_fits(cache, e->size);
+
+    JLI(ptr, cache->entries, (Word_t)e->key);
+    *ptr = (Word_t)e;
+    e->is_cached = 1;
+    cache->size += e->size;
+    lru_push_head(cache, e);
+
+done:
+out_of_memory:
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void tdb_cache_release(struct tdb_cache *cache, struct tdb_cache_entry *e)
+{
+    if (e){
+        int do_free;
+
+        pthread_mutex_lock(&cache->lock);
+        do_free = --e->num_refs == 0 && !e->is_cached;
+        pthread_mutex_unlock(&cache->lock);
+
+        if (do_free)
+            free(e);
+    }
+}
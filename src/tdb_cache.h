@@ -0,0 +1,60 @@
+#ifndef __TDB_CACHE_H__
+#define __TDB_CACHE_H__
+
+#include <stdint.h>
+
+/*
+A thread-safe, memory-bounded LRU cache of immutable blobs keyed by
+a 64-bit integer.
+
+Entries are reference counted: tdb_cache_get() and tdb_cache_put()
+return an entry with a reference that must be returned with
+tdb_cache_release(). An entry that is evicted while it is referenced
+stays valid until its last reference is released, so callers may hand
+out pointers to entry->data without copying.
+*/
+
+struct tdb_cache;
+
+struct tdb_cache_entry{
+    uint64_t key;
+    /* caller-defined metadata, e.g. the number of items in data */
+    uint64_t value;
+    uint64_t size;
+
+    /* internal */
+    uint64_t num_refs;
+    int is_cached;
+    struct tdb_cache_entry *prev;
+    struct tdb_cache_entry *next;
+
+    char data[0];
+};
+
+struct tdb_cache *tdb_cache_new(uint64_t max_size);
+void tdb_cache_free(struct tdb_cache *cache);
+
+void tdb_cache_set_max_size(struct tdb_cache *cache, uint64_t max_size);
+uint64_t tdb_cache_max_size(struct tdb_cache *cache);
+
+void tdb_cache_stats(struct tdb_cache *cache,
+                     uint64_t *num_hits,
+                     uint64_t *num_misses);
+
+struct tdb_cache_entry *tdb_cache_entry_new(uint64_t key, uint64_t size);
+struct tdb_cache_entry *tdb_cache_entry_resize(struct tdb_cache_entry *e,
+                                               uint64_t size);
+
+struct tdb_cache_entry *tdb_cache_get(struct tdb_cache *cache, uint64_t key);
+
+/*
+Insert a new entry, allocated with tdb_cache_entry_new(), in the cache.
+The caller keeps a reference to the entry that must be released with
+tdb_cache_release(). Entries that don't fit in the cache are not
+inserted but they are valid until released.
+*/
+void tdb_cache_put(struct tdb_cache *cache, struct tdb_cache_entry *e);
+
+void tdb_cache_release(struct tdb_cache *cache, struct tdb_cache_entry *e);
+
+#endif /* __TDB_CACHE_H__ */
@@ -0,0 +1,371 @@
+#define _DEFAULT_SOURCE /* strdup() */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#undef JUDYERROR
+#define JUDYERROR(CallerFile, CallerLine, JudyFunc, JudyErrno, JudyErrID) \
+{                                                                         \
+   if ((JudyErrno) == JU_ERRNO_NOMEM)                                     \
+       goto out_of_memory;                                                \
+}
+#include <Judy.h>
+
+#include "tdb_internal.h"
+
+/*
+A catalog keeps a bounded number of TrailDBs open. Handles are reference
+counted: a handle that is not referenced is idle and it may be closed to
+make room for other TrailDBs. Metadata of a TrailDB, like its info and
+field names and lexicon sizes, is kept after the handle is closed, so it
+can be queried without opening the TrailDB again.
+*/
+
+struct catalog_entry{
+    char *root;
+    tdb *db;
+    uint64_t num_refs;
+    int is_opening;
+
+    /* metadata, valid if has_info is set */
+    int has_info;
+    tdb_catalog_info info;
+    char **field_names;
+    uint64_t *lexicon_sizes;
+
+    /* LRU list of idle handles: head is the most recently used entry */
+    struct catalog_entry *prev;
+    struct catalog_entry *next;
+};
+
+struct tdb_catalog{
+    pthread_mutex_t lock;
+    pthread_cond_t opened;
+
+    /* root -> struct catalog_entry* */
+    Pvoid_t entries;
+    /* tdb* -> struct catalog_entry* */
+    Pvoid_t handles;
+
+    struct catalog_entry *head;
+    struct catalog_entry *tail;
+
+    uint64_t num_open;
+    uint64_t max_open;
+};
+
+static void lru_unlink(tdb_catalog *catalog, struct catalog_entry *e)
+{
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        catalog->head = e->next;
+
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        catalog->tail = e->prev;
+
+    e->prev = e->next = NULL;
+}
+
+static void lru_push_head(tdb_catalog *catalog, struct catalog_entry *e)
+{
+    e->prev = NULL;
+    e->next = catalog->head;
+    if (catalog->head)
+        catalog->head->prev = e;
+    else
+        catalog->tail = e;
+    catalog->head = e;
+}
+
+/* NOTE: the caller must hold catalog->lock */
+static void close_idle(tdb_catalog *catalog, struct catalog_entry *e)
+{
+    int tmp;
+
+    lru_unlink(catalog, e);
+    JLD(tmp, catalog->handles, (Word_t)e->db);
+    tdb_close(e->db);
+    e->db = NULL;
+    --catalog->num_open;
+out_of_memory:
+    return;
+}
+
+/* NOTE: the caller must hold catalog->lock */
+static void close_until_fits(tdb_catalog *catalog)
+{
+    while (catalog->tail && catalog->num_open > catalog->max_open)
+        close_idle(catalog, catalog->tail);
+}
+
+static void free_field_names(char **field_names, uint64_t num_fields)
+{
+    if (field_names){
+        uint64_t i;
+        for (i = 0; i < num_fields; i++)
+            free(field_names[i]);
+        free(field_names);
+    }
+}
+
+static tdb_error store_info(struct catalog_entry *e, const tdb *db)
+{
+    tdb_field i;
+
+    if (!(e->lexicon_sizes = malloc(db->num_fields * 8)))
+        return TDB_ERR_NOMEM;
+    /* lazy lexicons know their sizes without being mapped */
+    for (i = 0; i < db->num_fields; i++)
+        e->lexicon_sizes[i] = tdb_lexicon_size(db, i);
+
+    if (!(e->field_names = calloc(db->num_fields, sizeof(char*))))
+        goto out_of_memory;
+    for (i = 0; i < db->num_fields; i++)
+        if (!(e->field_names[i] = strdup(db->field_names[i])))
+            goto out_of_memory;
+
+    e->info.num_trails = db->num_trails;
+    e->info.num_events = db->num_events;
+    e->info.num_fields = db->num_fields;
+    e->info.min_timestamp = db->min_timestamp;
+    e->info.max_timestamp = db->max_timestamp;
+    e->info.version = db->version;
+    e->info.field_names = (const char * const *)e->field_names;
+    e->info.lexicon_sizes = e->lexicon_sizes;
+    e->has_info = 1;
+    return 0;
+
+out_of_memory:
+    free_field_names(e->field_names, db->num_fields);
+    free(e->lexicon_sizes);
+    e->field_names = NULL;
+    e->lexicon_sizes = NULL;
+    return TDB_ERR_NOMEM;
+}
+
+static void entry_free(struct catalog_entry *e)
+{
+    free_field_names(e->field_names, e->info.num_fields);
+    free(e->lexicon_sizes);
+    free(e->root);
+    free(e);
+}
+
+/* NOTE: the caller must hold catalog->lock */
+static struct catalog_entry *find_entry(tdb_catalog *catalog,
+                                        const char *root)
+{
+    struct catalog_entry *e;
+    Word_t *ptr;
+
+    JSLI(ptr, catalog->entries, (const uint8_t*)root);
+    if (*ptr)
+        return (struct catalog_entry*)*ptr;
+
+    if (!(e = calloc(1, sizeof(struct catalog_entry))))
+        goto out_of_memory;
+    if (!(e->root = strdup(root))){
+        free(e);
+        goto out_of_memory;
+    }
+    *ptr = (Word_t)e;
+    return e;
+
+out_of_memory:
+    return NULL;
+}
+
+/*
+Open the TrailDB of an entry. The catalog lock is released while
+the TrailDB is being opened, other threads wait for is_opening.
+NOTE: the caller must hold catalog->lock
+*/
+static tdb_error open_entry(tdb_catalog *catalog, struct catalog_entry *e)
+{
+    Word_t *ptr;
+    tdb *db;
+    int ret = 0;
+
+    e->is_opening = 1;
+    pthread_mutex_unlock(&catalog->lock);
+
+    if (!(db = tdb_init()))
+        ret = TDB_ERR_NOMEM;
+    else if ((ret = tdb_open(db, e->root))){
+        tdb_close(db);
+        db = NULL;
+    }
+
+    pthread_mutex_lock(&catalog->lock);
+    e->is_opening = 0;
+    pthread_cond_broadcast(&catalog->opened);
+
+    if (ret)
+        return ret;
+
+    if (!e->has_info && (ret = store_info(e, db)))
+        goto done;
+
+    JLI(ptr, catalog->handles, (Word_t)db);
+    *ptr = (Word_t)e;
+    e->db = db;
+    ++catalog->num_open;
+    close_until_fits(catalog);
+done:
+    if (ret)
+        tdb_close(db);
+    return ret;
+out_of_memory:
+    ret = TDB_ERR_NOMEM;
+    goto done;
+}
+
+TDB_EXPORT tdb_catalog *tdb_catalog_new(uint64_t max_open)
+{
+    tdb_catalog *catalog;
+
+    if (!(catalog = calloc(1, sizeof(tdb_catalog))))
+        return NULL;
+
+    if (pthread_mutex_init(&catalog->lock, NULL)){
+        free(catalog);
+        return NULL;
+    }
+    if (pthread_cond_init(&catalog->opened, NULL)){
+        pthread_mutex_destroy(&catalog->lock);
+        free(catalog);
+        return NULL;
+    }
+
+    catalog->max_open = max_open;
+    return catalog;
+}
+
+TDB_EXPORT void tdb_catalog_free(tdb_catalog *catalog)
+{
+    if (catalog){
+        uint8_t root[TDB_MAX_PATH_SIZE];
+        Word_t *ptr;
+        Word_t tmp;
+
+        /* all handles must have been released at this point */
+        root[0] = 0;
+        JSLF(ptr, catalog->entries, root);
+        while (ptr){
+            struct catalog_entry *e = (struct catalog_entry*)*ptr;
+            if (e->db)
+                tdb_close(e->db);
+            entry_free(e);
+            JSLN(ptr, catalog->entries, root);
+        }
+        JSLFA(tmp, catalog->entries);
+        JLFA(tmp, catalog->handles);
+        pthread_cond_destroy(&catalog->opened);
+        pthread_mutex_destroy(&catalog->lock);
+        free(catalog);
+    }
+out_of_memory:
+    return;
+}
+
+TDB_EXPORT tdb_error tdb_catalog_get(tdb_catalog *catalog,
+                                     const char *root,
+                                     const tdb **db)
+{
+    struct catalog_entry *e;
+    int ret = 0;
+
+    if (strlen(root) >= TDB_MAX_PATH_SIZE)
+        return TDB_ERR_PATH_TOO_LONG;
+
+    pthread_mutex_lock(&catalog->lock);
+    if (!(e = find_entry(catalog, root))){
+        ret = TDB_ERR_NOMEM;
+        goto done;
+    }
+
+    ++e->num_refs;
+    while (e->is_opening)
+        pthread_cond_wait(&catalog->opened, &catalog->lock);
+
+    if (e->db){
+        /* an idle handle is not a candidate for closing anymore */
+        if (e->num_refs == 1)
+            lru_unlink(catalog, e);
+    }else if ((ret = open_entry(catalog, e))){
+        --e->num_refs;
+        goto done;
+    }
+    *db = e->db;
+done:
+    pthread_mutex_unlock(&catalog->lock);
+    return ret;
+}
+
+TDB_EXPORT void tdb_catalog_release(tdb_catalog *catalog, const tdb *db)
+{
+    Word_t *ptr;
+
+    pthread_mutex_lock(&catalog->lock);
+    JLG(ptr, catalog->handles, (Word_t)db);
+    if (ptr){
+        struct catalog_entry *e = (struct catalog_entry*)*ptr;
+        if (!--e->num_refs){
+            lru_push_head(catalog, e);
+            close_until_fits(catalog);
+        }
+    }
+    pthread_mutex_unlock(&catalog->lock);
+}
+
+static int copy_info(tdb_catalog *catalog,
+                     const char *root,
+                     tdb_catalog_info *info)
+{
+    Word_t *ptr;
+    int ret = -1;
+
+    pthread_mutex_lock(&catalog->lock);
+    JSLG(ptr, catalog->entries, (const uint8_t*)root);
+    if (ptr && ((struct catalog_entry*)*ptr)->has_info){
+        *info = ((struct catalog_entry*)*ptr)->info;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&catalog->lock);
+    return ret;
+}
+
+TDB_EXPORT tdb_error tdb_catalog_get_info(tdb_catalog *catalog,
+                                          const char *root,
+                                          tdb_catalog_info *info)
+{
+    const tdb *db;
+    int ret = 0;
+
+    if (!copy_info(catalog, root, info))
+        return 0;
+
+    /*
+    opening the TrailDB stores its metadata. The handle is released
+    right away, so it can be closed when the catalog is full.
+    */
+    if ((ret = tdb_catalog_get(catalog, root, &db)))
+        return ret;
+    copy_info(catalog, root, info);
+    tdb_catalog_release(catalog, db);
+    return 0;
+}
+
+TDB_EXPORT uint64_t tdb_catalog_num_open(tdb_catalog *catalog)
+{
+    uint64_t num_open;
+    pthread_mutex_lock(&catalog->lock);
+    num_open = catalog->num_open;
+    pthread_mutex_unlock(&catalog->lock);
+    return num_open;
+}
@@ -0,0 +1,391 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "tdb_compress.h"
+#include "tdb_cache.h"
+#include "tdb_pread.h"
+
+/* huff_decode_value() may read 64 bits at the last bit offset of a trail */
+#define BLOCK_PADDING 16
+
+#define HEADER_SIZE 16
+
+struct tdb_block_writer{
+    uint64_t codec;
+
+    /* the current block */
+    char *block;
+    uint64_t block_size;
+    uint64_t block_alloc;
+
+    char *compressed;
+    uint64_t compressed_alloc;
+
+    /* offsets of the blocks written so far */
+    uint64_t *offsets;
+    uint64_t *compressed_offsets;
+    uint64_t num_blocks;
+    uint64_t num_alloc;
+
+    uint64_t offset;
+    uint64_t compressed_offset;
+
+#ifdef HAVE_ZSTD
+    ZSTD_CCtx *cctx;
+#endif
+};
+
+struct tdb_compressed{
+    struct tdb_file file;
+    uint64_t codec;
+    uint64_t num_blocks;
+    const uint64_t *offsets;
+    const uint64_t *compressed_offsets;
+    struct tdb_cache *blocks;
+};
+
+int tdb_compression_is_supported(uint64_t codec)
+{
+    switch (codec){
+        case TDB_OPT_CONS_COMPRESSION_NONE:
+            return 1;
+#ifdef HAVE_ZSTD
+        case TDB_OPT_CONS_COMPRESSION_ZSTD:
+            return 1;
+#endif
+        default:
+            return 0;
+    }
+}
+
+static tdb_error reserve(char **buf, uint64_t *alloc, uint64_t size)
+{
+    if (size > *alloc){
+        char *new_buf;
+        uint64_t new_alloc = *alloc ? *alloc: TDB_COMPRESSED_BLOCK_SIZE;
+        while (new_alloc < size)
+            new_alloc *= 2;
+        if (!(new_buf = realloc(*buf, new_alloc)))
+            return TDB_ERR_NOMEM;
+        *buf = new_buf;
+        *alloc = new_alloc;
+    }
+    return 0;
+}
+
+tdb_error tdb_block_writer_new(uint64_t codec, struct tdb_block_writer **w)
+{
+    struct tdb_block_writer *new_w;
+
+    if (codec == TDB_OPT_CONS_COMPRESSION_NONE ||
+        !tdb_compression_is_supported(codec))
+        return TDB_ERR_INVALID_OPTION_VALUE;
+
+    if (!(new_w = calloc(1, sizeof(struct tdb_block_writer))))
+        return TDB_ERR_NOMEM;
+    new_w->codec = codec;
+#ifdef HAVE_ZSTD
+    if (!(new_w->cctx = ZSTD_createCCtx())){
+        free(new_w);
+        return TDB_ERR_NOMEM;
+    }
+#endif
+    *w = new_w;
+    return 0;
+}
+
+void tdb_block_writer_free(struct tdb_block_writer *w)
+{
+    if (w){
+#ifdef HAVE_ZSTD
+        ZSTD_freeCCtx(w->cctx);
+#endif
+        free(w->block);
+        free(w->compressed);
+        free(w->offsets);
+        free(w->compressed_offsets);
+        free(w);
+    }
+}
+
+static tdb_error add_block_offsets(struct tdb_block_writer *w)
+{
+    if (w->num_blocks == w->num_alloc){
+        uint64_t *offsets, *compressed_offsets;
+        uint64_t num_alloc = w->num_alloc ? w->num_alloc * 2: 1024;
+
+        if (!(offsets = realloc(w->offsets, num_alloc * 8)))
+            return TDB_ERR_NOMEM;
+        w->offsets = offsets;
+        if (!(compressed_offsets = realloc(w->compressed_offsets,
+                                           num_alloc * 8)))
+            return TDB_ERR_NOMEM;
+        w->compressed_offsets = compressed_offsets;
+        w->num_alloc = num_alloc;
+    }
+    w->offsets[w->num_blocks] = w->offset;
+    w->compressed_offsets[w->num_blocks] = w->compressed_offset;
+    ++w->num_blocks;
+    return 0;
+}
+
+static tdb_error compress_block(struct tdb_block_writer *w, uint64_t *size)
+{
+#ifdef HAVE_ZSTD
+    const uint64_t bound = ZSTD_compressBound(w->block_size);
+    size_t n;
+    int ret = 0;
+
+    if ((ret = reserve(&w->compressed, &w->compressed_alloc, bound)))
+        return ret;
+
+    n = ZSTD_compressCCtx(w->cctx,
+                          w->compressed,
+                          bound,
+                          w->block,
+                          w->block_size,
+                          ZSTD_CLEVEL_DEFAULT);
+    if (ZSTD_isError(n))
+        return TDB_ERR_IO_WRITE;
+    *size = n;
+    return 0;
+#else
+    return TDB_ERR_INVALID_OPTION_VALUE;
+#endif
+}
+
+tdb_error tdb_block_writer_flush(struct tdb_block_writer *w, FILE *out)
+{
+    uint64_t size = 0;
+    int ret = 0;
+
+    if (w->block_size){
+        if ((ret = add_block_offsets(w)))
+            goto done;
+        if ((ret = compress_block(w, &size)))
+            goto done;
+        TDB_WRITE(out, w->compressed, size);
+        w->offset += w->block_size;
+        w->compressed_offset += size;
+        w->block_size = 0;
+    }
+done:
+    return ret;
+}
+
+tdb_error tdb_block_writer_add(struct tdb_block_writer *w,
+                               FILE *out,
+                               const char *trail,
+                               uint64_t size)
+{
+    int ret = 0;
+
+    if (w->block_size && w->block_size + size > TDB_COMPRESSED_BLOCK_SIZE)
+        if ((ret = tdb_block_writer_flush(w, out)))
+            return ret;
+
+    if ((ret = reserve(&w->block, &w->block_alloc, w->block_size + size)))
+        return ret;
+    memcpy(&w->block[w->block_size], trail, size);
+    w->block_size += size;
+    return 0;
+}
+
+tdb_error tdb_block_writer_store(struct tdb_block_writer *w, tdb_cons *cons)
+{
+    const uint64_t num_offsets = w->num_blocks + 1;
+    FILE *out = NULL;
+    int ret = 0;
+
+    TDB_CONS_OPEN(cons,
+                  out,
+                  "trails.blocks",
+                  HEADER_SIZE + num_offsets * 16);
+    TDB_WRITE(out, &w->codec, 8);
+    TDB_WRITE(out, &w->num_blocks, 8);
+    if (w->num_blocks){
+        TDB_WRITE(out, w->offsets, w->num_blocks * 8);
+    }
+    TDB_WRITE(out, &w->offset, 8);
+    if (w->num_blocks){
+        TDB_WRITE(out, w->compressed_offsets, w->num_blocks * 8);
+    }
+    TDB_WRITE(out, &w->compressed_offset, 8);
+done:
+    TDB_CONS_CLOSE_FINAL(cons, out);
+    return ret;
+}
+
+tdb_error tdb_compressed_new(const struct tdb_file *file,
+                             uint64_t cache_size,
+                             struct tdb_compressed **c)
+{
+    const uint64_t *header = (const uint64_t*)file->data;
+    struct tdb_compressed *new_c;
+
+    if (file->size < HEADER_SIZE + 16 ||
+        (file->size - HEADER_SIZE) % 16 ||
+        header[1] != (file->size - HEADER_SIZE) / 16 - 1)
+        return TDB_ERR_INVALID_TRAILS_FILE;
+
+    /* TrailDBs compressed with a codec that was not compiled in */
+    if (header[0] == TDB_OPT_CONS_COMPRESSION_NONE ||
+        !tdb_compression_is_supported(header[0]))
+        return TDB_ERR_INCOMPATIBLE_VERSION;
+
+    if (!(new_c = calloc(1, sizeof(struct tdb_compressed))))
+        return TDB_ERR_NOMEM;
+    if (!(new_c->blocks = tdb_cache_new(cache_size))){
+        free(new_c);
+        return TDB_ERR_NOMEM;
+    }
+    new_c->file = *file;
+    new_c->codec = header[0];
+    new_c->num_blocks = header[1];
+    new_c->offsets = &header[2];
+    new_c->compressed_offsets = &header[2 + new_c->num_blocks + 1];
+    *c = new_c;
+    return 0;
+}
+
+void tdb_compressed_free(struct tdb_compressed *c)
+{
+    if (c){
+        if (c->file.ptr)
+            munmap(c->file.ptr, c->file.mmap_size);
+        tdb_cache_free(c->blocks);
+        free(c);
+    }
+}
+
+uint64_t tdb_compressed_size(const struct tdb_compressed *c)
+{
+    return c->offsets[c->num_blocks];
+}
+
+void tdb_compressed_set_cache_size(struct tdb_compressed *c, uint64_t size)
+{
+    tdb_cache_set_max_size(c->blocks, size);
+}
+
+uint64_t tdb_compressed_cache_size(const struct tdb_compressed *c)
+{
+    return tdb_cache_max_size(c->blocks);
+}
+
+/* the block that contains the uncompressed offset */
+static uint64_t find_block(const struct tdb_compressed *c, uint64_t offset)
+{
+    uint64_t lo = 0;
+    uint64_t hi = c->num_blocks;
+
+    while (hi - lo > 1){
+        const uint64_t mid = lo + (hi - lo) / 2;
+        if (c->offsets[mid] <= offset)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static tdb_error decompress_block(const tdb *db,
+                                  uint64_t block,
+                                  struct tdb_cache_entry **out)
+{
+    const struct tdb_compressed *c = db->compressed;
+    const uint64_t start = c->compressed_offsets[block];
+    const uint64_t size = c->compressed_offsets[block + 1] - start;
+    const uint64_t uncompressed_size =
+        c->offsets[block + 1] - c->offsets[block];
+    struct tdb_cache_entry *e;
+    char *buf = NULL;
+    const char *src;
+    int ret = 0;
+
+    if (start + size < start ||
+        c->compressed_offsets[block + 1] > db->trails.size)
+        return TDB_ERR_INVALID_TRAILS_FILE;
+
+    if (!(e = tdb_cache_entry_new(block, uncompressed_size + BLOCK_PADDING)))
+        return TDB_ERR_NOMEM;
+
+    if (db->pread){
+        if (!(buf = malloc(size))){
+            ret = TDB_ERR_NOMEM;
+            goto done;
+        }
+        if ((ret = tdb_pread_read(db->pread, buf, start, size)))
+            goto done;
+        src = buf;
+    }else
+        src = &db->trails.data[start];
+
+#ifdef HAVE_ZSTD
+    if (ZSTD_decompress(e->data, uncompressed_size, src, size) !=
+        uncompressed_size){
+        ret = TDB_ERR_INVALID_TRAILS_FILE;
+        goto done;
+    }
+#else
+    (void)src;
+#endif
+    memset(&e->data[uncompressed_size], 0, BLOCK_PADDING);
+
+done:
+    free(buf);
+    if (ret)
+        tdb_cache_release(c->blocks, e);
+    else{
+        tdb_cache_put(c->blocks, e);
+        *out = e;
+    }
+    return ret;
+}
+
+tdb_error tdb_compressed_trail(const tdb *db,
+                               struct tdb_decode_state *s,
+                               uint64_t start,
+                               uint64_t end)
+{
+    const struct tdb_compressed *c = db->compressed;
+    const uint64_t block = find_block(c, start);
+    struct tdb_cache_entry *e;
+    int ret = 0;
+
+    tdb_compressed_release(db, s);
+
+    if (end > c->offsets[block + 1])
+        return TDB_ERR_INVALID_TRAILS_FILE;
+
+    if (!(e = tdb_cache_get(c->blocks, block)))
+        if ((ret = decompress_block(db, block, &e)))
+            return ret;
+
+    s->trail_block = e;
+    s->data = &e->data[start - c->offsets[block]];
+    return 0;
+}
+
+void tdb_compressed_release(const tdb *db, struct tdb_decode_state *s)
+{
+    if (s->trail_block){
+        tdb_cache_release(db->compressed->blocks, s->trail_block);
+        s->trail_block = NULL;
+    }
+}
+
+void tdb_compressed_range(const struct tdb_compressed *c,
+                          uint64_t start,
+                          uint64_t end,
+                          uint64_t *compressed_start,
+                          uint64_t *compressed_end)
+{
+    *compressed_start = c->compressed_offsets[find_block(c, start)];
+    *compressed_end = c->compressed_offsets[find_block(c, end - 1) + 1];
+}
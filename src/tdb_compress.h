@@ -0,0 +1,85 @@
+#ifndef __TDB_COMPRESS_H__
+#define __TDB_COMPRESS_H__
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "tdb_internal.h"
+
+/*
+With TDB_OPT_CONS_COMPRESSION, consecutive trails are grouped into blocks
+of about TDB_COMPRESSED_BLOCK_SIZE bytes and each block is compressed
+separately in trails.data. A trail is never split between blocks, unless
+it is larger than a block, in which case it gets a block of its own.
+
+trails.toc refers to offsets in the uncompressed trails, as if they were
+stored uncompressed. trails.blocks locates the blocks:
+
+[ codec                    ] 8 bytes
+[ number of blocks N       ] 8 bytes
+[ uncompressed offsets ... ] (N + 1) * 8 bytes
+[ compressed offsets ...   ] (N + 1) * 8 bytes
+
+Decompressed blocks are kept in a cache, see TDB_OPT_BLOCK_CACHE_SIZE.
+*/
+
+#define TDB_COMPRESSED_BLOCK_SIZE (64LLU << 10)
+
+int tdb_compression_is_supported(uint64_t codec);
+
+/* encode */
+
+struct tdb_block_writer;
+
+tdb_error tdb_block_writer_new(uint64_t codec, struct tdb_block_writer **w);
+
+void tdb_block_writer_free(struct tdb_block_writer *w);
+
+/* append a trail to the current block, writing full blocks to out */
+tdb_error tdb_block_writer_add(struct tdb_block_writer *w,
+                               FILE *out,
+                               const char *trail,
+                               uint64_t size);
+
+/* write the last block to out */
+tdb_error tdb_block_writer_flush(struct tdb_block_writer *w, FILE *out);
+
+/* write trails.blocks */
+tdb_error tdb_block_writer_store(struct tdb_block_writer *w, tdb_cons *cons);
+
+/* decode */
+
+struct tdb_compressed;
+
+tdb_error tdb_compressed_new(const struct tdb_file *blocks,
+                             uint64_t cache_size,
+                             struct tdb_compressed **c);
+
+void tdb_compressed_free(struct tdb_compressed *c);
+
+/* size of the uncompressed trails */
+uint64_t tdb_compressed_size(const struct tdb_compressed *c);
+
+void tdb_compressed_set_cache_size(struct tdb_compressed *c, uint64_t size);
+
+uint64_t tdb_compressed_cache_size(const struct tdb_compressed *c);
+
+/*
+Point s->data to the uncompressed bytes [start, end) of trails.data.
+The data stays valid until the next call or tdb_compressed_release().
+*/
+tdb_error tdb_compressed_trail(const tdb *db,
+                               struct tdb_decode_state *s,
+                               uint64_t start,
+                               uint64_t end);
+
+void tdb_compressed_release(const tdb *db, struct tdb_decode_state *s);
+
+/* the compressed bytes of trails.data that hold [start, end) */
+void tdb_compressed_range(const struct tdb_compressed *c,
+                          uint64_t start,
+                          uint64_t end,
+                          uint64_t *compressed_start,
+                          uint64_t *compressed_end);
+
+#endif /* __TDB_COMPRESS_H__ */
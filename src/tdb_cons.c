@@ -22,14 +22,47 @@
 #include "tdb_error.h"
 #include "tdb_io.h"
 #include "tdb_package.h"
+#include "tdb_compress.h"
+#include "tdb_pread.h"
+#include "tdb_huffman.h"
 #include "arena.h"
 
 #ifndef EVENTS_ARENA_INCREMENT
 #define EVENTS_ARENA_INCREMENT 1000000
 #endif
 
+#define RUNS_BUFFER_SIZE (1024 * 1024)
+
+tdb_error cons_fopen(tdb_cons *cons,
+                     const char *fname,
+                     uint64_t size,
+                     FILE **out)
+{
+    char path[TDB_MAX_PATH_SIZE];
+    int ret = 0;
+
+    /* packages are written directly, without an intermediate directory */
+    if (cons->package)
+        return cons_package_fopen(cons, fname, size, out);
+
+    TDB_PATH(path, "%s/%s", cons->root, fname);
+    TDB_OPEN(*out, path, "w");
+    if (size != TDB_CONS_UNKNOWN_SIZE)
+        TDB_TRUNCATE(*out, (off_t)size);
+done:
+    return ret;
+}
+
+tdb_error cons_fclose(tdb_cons *cons, FILE *file)
+{
+    if (cons->package)
+        return cons_package_fclose(cons, file);
+    return fclose(file) ? TDB_ERR_IO_CLOSE: 0;
+}
+
 struct jm_fold_state{
     FILE *out;
+    uint64_t base;
     uint64_t offset;
     tdb_error ret;
     uint64_t width;
@@ -47,10 +80,10 @@ static void *lexicon_store_fun(uint64_t id,
         return state;
 
     /* NOTE: vals start at 1, otherwise we would need to +1 */
-    TDB_SEEK(s->out, id * s->width);
+    TDB_SEEK(s->out, s->base + id * s->width);
     TDB_WRITE(s->out, &s->offset, s->width);
 
-    TDB_SEEK(s->out, s->offset);
+    TDB_SEEK(s->out, s->base + s->offset);
     TDB_WRITE(s->out, value, len);
 
 done:
@@ -59,8 +92,9 @@ done:
     return state;
 }
 
-static tdb_error lexicon_store(const struct judy_str_map *lexicon,
-                               const char *path)
+static tdb_error lexicon_store(tdb_cons *cons,
+                               const struct judy_str_map *lexicon,
+                               const char *fname)
 {
     /*
     Lexicon format:
@@ -73,6 +107,7 @@ static tdb_error lexicon_store(const struct judy_str_map *lexicon,
     struct jm_fold_state state;
     uint64_t count = jsm_num_keys(lexicon);
     uint64_t size = (count + 2) * 4 + jsm_values_size(lexicon);
+    long base;
     int ret = 0;
 
     state.offset = (count + 2) * 4;
@@ -90,19 +125,26 @@ static tdb_error lexicon_store(const struct judy_str_map *lexicon,
     state.out = NULL;
     state.ret = 0;
 
-    TDB_OPEN(state.out, path, "w");
-    TDB_TRUNCATE(state.out, (off_t)size);
+    TDB_CONS_OPEN(cons, state.out, fname, size);
+    /* the lexicon may be written in the middle of a package */
+    if ((base = ftell(state.out)) == -1){
+        ret = TDB_ERR_IO_WRITE;
+        goto done;
+    }
+    state.base = (uint64_t)base;
     TDB_WRITE(state.out, &count, state.width);
 
     jsm_fold(lexicon, lexicon_store_fun, &state);
     if ((ret = state.ret))
         goto done;
 
-    TDB_SEEK(state.out, (count + 1) * state.width);
+    TDB_SEEK(state.out, state.base + (count + 1) * state.width);
     TDB_WRITE(state.out, &state.offset, state.width);
+    /* package members are closed at the end of their data */
+    TDB_SEEK(state.out, state.base + size);
 
 done:
-    TDB_CLOSE_FINAL(state.out);
+    TDB_CONS_CLOSE_FINAL(cons, state.out);
     return ret;
 }
 
@@ -113,52 +155,96 @@ static tdb_error store_lexicons(tdb_cons *cons)
     char path[TDB_MAX_PATH_SIZE];
     int ret = 0;
 
-    TDB_PATH(path, "%s/fields", cons->root);
-    TDB_OPEN(out, path, "w");
-
     for (i = 0; i < cons->num_ofields; i++){
-        TDB_PATH(path, "%s/lexicon.%s", cons->root, cons->ofield_names[i]);
-        if ((ret = lexicon_store(&cons->lexicons[i], path)))
+        TDB_PATH(path, "lexicon.%s", cons->ofield_names[i]);
+        if ((ret = lexicon_store(cons, &cons->lexicons[i], path)))
             goto done;
-        TDB_FPRINTF(out, "%s\n", cons->ofield_names[i]);
     }
+
+    /* lexicon cardinalities follow the field names, see fields_open() */
+    TDB_CONS_OPEN(cons, out, "fields", TDB_CONS_UNKNOWN_SIZE);
+    for (i = 0; i < cons->num_ofields; i++)
+        TDB_FPRINTF(out, "%s\n", cons->ofield_names[i]);
     TDB_FPRINTF(out, "\n");
+    for (i = 0; i < cons->num_ofields; i++)
+        TDB_FPRINTF(out, "%"PRIu64"\n", jsm_num_keys(&cons->lexicons[i]));
 done:
-    TDB_CLOSE_FINAL(out);
+    TDB_CONS_CLOSE_FINAL(cons, out);
     return ret;
 }
 
 static tdb_error store_version(tdb_cons *cons)
 {
     FILE *out = NULL;
-    char path[TDB_MAX_PATH_SIZE];
     int ret = 0;
 
-    TDB_PATH(path, "%s/version", cons->root);
-    TDB_OPEN(out, path, "w");
-    TDB_FPRINTF(out, "%llu", TDB_VERSION_LATEST);
+    TDB_CONS_OPEN(cons, out, "version", TDB_CONS_UNKNOWN_SIZE);
+    /* older versions can't read compressed trails */
+    if (cons->compression){
+        TDB_FPRINTF(out, "%llu", TDB_VERSION_V0_2);
+    }else{
+        TDB_FPRINTF(out, "%llu", TDB_VERSION_LATEST);
+    }
 done:
-    TDB_CLOSE_FINAL(out);
+    TDB_CONS_CLOSE_FINAL(cons, out);
     return ret;
 }
 
+struct uuid_fold_state{
+    FILE *out;
+    FILE *index;
+    uint64_t idx;
+    uint64_t next_prefix;
+    uint64_t index_bits;
+    uint64_t width;
+    tdb_error ret;
+};
+
 static void *store_uuids_fun(__uint128_t key,
                              Word_t *value __attribute__((unused)),
                              void *state)
 {
-    struct jm_fold_state *s = (struct jm_fold_state*)state;
+    struct uuid_fold_state *s = (struct uuid_fold_state*)state;
+    const uint64_t prefix = tdb_uuid_prefix(key, s->index_bits);
     int ret = 0;
+
+    if (s->ret)
+        return state;
+
     TDB_WRITE(s->out, &key, 16);
+
+    /* UUIDs are folded in ascending order, so the index is written
+       sequentially as well */
+    for (; s->next_prefix <= prefix; s->next_prefix++)
+        TDB_WRITE(s->index, &s->idx, s->width);
+    ++s->idx;
 done:
     s->ret = ret;
     return s;
 }
 
+static uint64_t uuid_index_bits(uint64_t num_trails)
+{
+    /* aim at 4-8 UUIDs per prefix on average */
+    uint64_t bits = 0;
+    while (bits < TDB_UUID_INDEX_MAX_BITS && (num_trails >> (bits + 3)))
+        ++bits;
+    return bits;
+}
+
 static tdb_error store_uuids(tdb_cons *cons)
 {
-    char path[TDB_MAX_PATH_SIZE];
-    struct jm_fold_state state = {.ret = 0};
+    /*
+    UUID index format:
+    [ number of prefix bits B ] 8 bytes
+    [ trail IDs ...           ] (2^B + 1) * (4 or 8 bytes)
+
+    Entry P is the trail ID of the first UUID whose prefix is >= P, so
+    UUIDs with the prefix P are found between entries P and P + 1.
+    */
+    struct uuid_fold_state state = {.ret = 0};
     uint64_t num_trails = j128m_num_keys(&cons->trails);
+    uint64_t num_prefixes;
     int ret = 0;
 
     /* this is why num_trails < TDB_MAX)NUM_TRAILS < 2^59:
@@ -166,15 +252,27 @@ static tdb_error store_uuids(tdb_cons *cons)
     if (num_trails > TDB_MAX_NUM_TRAILS)
         return TDB_ERR_TOO_MANY_TRAILS;
 
-    TDB_PATH(path, "%s/uuids", cons->root);
-    TDB_OPEN(state.out, path, "w");
-    TDB_TRUNCATE(state.out, ((off_t)(num_trails * 16)));
+    state.index_bits = uuid_index_bits(num_trails);
+    state.width = num_trails < UINT32_MAX ? 4: 8;
+    num_prefixes = 1LLU << state.index_bits;
+
+    TDB_CONS_OPEN(cons, state.out, "uuids", num_trails * 16);
+    TDB_CONS_OPEN(cons,
+                  state.index,
+                  "uuids.index",
+                  8 + (num_prefixes + 1) * state.width);
+    TDB_WRITE(state.index, &state.index_bits, 8);
 
     j128m_fold(&cons->trails, store_uuids_fun, &state);
-    ret = state.ret;
+    if ((ret = state.ret))
+        goto done;
+
+    for (; state.next_prefix <= num_prefixes; state.next_prefix++)
+        TDB_WRITE(state.index, &num_trails, state.width);
 
 done:
-    TDB_CLOSE_FINAL(state.out);
+    TDB_CONS_CLOSE_FINAL(cons, state.index);
+    TDB_CONS_CLOSE_FINAL(cons, state.out);
     return ret;
 }
 
@@ -226,13 +324,12 @@ TDB_EXPORT tdb_cons *tdb_cons_init(void)
 {
     tdb_cons *c = calloc(1, sizeof(tdb_cons));
     if (c){
-        /*
-        this will fail if libarchive is not found but it is ok, we just
-        fall back to the directory mode
-        */
         tdb_cons_set_opt(c,
                          TDB_OPT_CONS_OUTPUT_FORMAT,
                          opt_val(TDB_OPT_CONS_OUTPUT_FORMAT_PACKAGE));
+        tdb_cons_set_opt(c,
+                         TDB_OPT_CONS_TRAIL_META,
+                         opt_val(TDB_OPT_CONS_TRAIL_META_PACKED));
     }
     return c;
 }
@@ -321,6 +418,12 @@ TDB_EXPORT tdb_error tdb_cons_open(tdb_cons *cons,
             goto done;
         }
 
+    if (!(cons->event_items = calloc(cons->num_ofields + 1,
+                                     sizeof(tdb_item)))){
+        ret = TDB_ERR_NOMEM;
+        goto done;
+    }
+
 done:
     return ret;
 }
@@ -336,12 +439,16 @@ TDB_EXPORT void tdb_cons_close(tdb_cons *cons)
                 jsm_free(&cons->lexicons[i]);
         }
         free(cons->lexicons);
+        free(cons->event_items);
         if (cons->items.fd)
             fclose(cons->items.fd);
-        if (cons->events.data)
-            free(cons->events.data);
-        if (cons->items.data)
-            free(cons->items.data);
+        if (cons->runs)
+            fclose(cons->runs);
+        free(cons->runs_buffer);
+        free(cons->run_offsets);
+        free(cons->codebook);
+        arena_free(&cons->events);
+        arena_free(&cons->items);
 
         j128m_free(&cons->trails);
         free(cons->ofield_names);
@@ -350,6 +457,143 @@ TDB_EXPORT void tdb_cons_close(tdb_cons *cons)
     }
 }
 
+static tdb_error open_runs(tdb_cons *cons)
+{
+    char path[TDB_MAX_PATH_SIZE];
+    int fd, ret = 0;
+
+    TDB_PATH(path, "%s/tmp.runs.XXXXXX", cons->root);
+    if ((fd = mkstemp(path)) == -1)
+        return TDB_ERR_IO_OPEN;
+
+    /* runs are accessed only through the handle, remove the file now */
+    unlink(path);
+
+    if (!(cons->runs = fdopen(fd, "w+"))){
+        close(fd);
+        return TDB_ERR_IO_OPEN;
+    }
+    if (!(cons->runs_buffer = malloc(RUNS_BUFFER_SIZE)))
+        return TDB_ERR_NOMEM;
+    setvbuf(cons->runs, cons->runs_buffer, _IOFBF, RUNS_BUFFER_SIZE);
+done:
+    return ret;
+}
+
+struct spill_state{
+    tdb_cons *cons;
+    struct tdb_spilled_event *buf;
+    uint64_t buf_size;
+    tdb_error ret;
+};
+
+static int compare_spilled(const void *p1, const void *p2)
+{
+    const struct tdb_spilled_event *x = (const struct tdb_spilled_event*)p1;
+    const struct tdb_spilled_event *y = (const struct tdb_spilled_event*)p2;
+
+    if (x->timestamp != y->timestamp)
+        return x->timestamp > y->timestamp ? 1: -1;
+    /* events with equal timestamps stay in the order they were added */
+    return x->event_idx > y->event_idx ? 1: -1;
+}
+
+static void *spill_trail(__uint128_t uuid, Word_t *value, void *state)
+{
+    struct spill_state *s = (struct spill_state*)state;
+    const tdb_cons *cons = s->cons;
+    uint64_t idx = *value;
+    uint64_t i, num_events = 0;
+    int ret = 0;
+
+    /* all events of this trail were spilled earlier */
+    if (s->ret || !idx)
+        return s;
+
+    /* collect the events of this trail by following back-links */
+    while (idx){
+        const struct tdb_cons_event *ev = arena_get_item(&cons->events,
+                                                         idx - 1);
+        if (num_events == s->buf_size){
+            struct tdb_spilled_event *buf;
+            uint64_t n = s->buf_size ? s->buf_size * 2: 1024;
+            if (!(buf = realloc(s->buf, n * sizeof(struct tdb_spilled_event)))){
+                ret = TDB_ERR_NOMEM;
+                goto done;
+            }
+            s->buf = buf;
+            s->buf_size = n;
+        }
+        s->buf[num_events].uuid = uuid;
+        s->buf[num_events].timestamp = tdb_cons_event_timestamp(ev);
+        s->buf[num_events].event_idx = cons->num_spilled_events + idx - 1;
+        ++num_events;
+        idx = tdb_cons_event_prev(ev);
+    }
+
+    /* back-links visit events in reverse */
+    for (i = 0; i < num_events / 2; i++){
+        struct tdb_spilled_event tmp = s->buf[i];
+        s->buf[i] = s->buf[num_events - i - 1];
+        s->buf[num_events - i - 1] = tmp;
+    }
+    for (i = 1; i < num_events; i++)
+        if (s->buf[i].timestamp < s->buf[i - 1].timestamp){
+            qsort(s->buf,
+                  num_events,
+                  sizeof(struct tdb_spilled_event),
+                  compare_spilled);
+            break;
+        }
+
+    TDB_WRITE(cons->runs, s->buf, num_events * sizeof(struct tdb_spilled_event));
+    *value = 0;
+done:
+    s->ret = ret;
+    return s;
+}
+
+/*
+Write the events in memory to a new run sorted by (uuid, timestamp) and
+free up the memory for new events. Runs are merged in groupby_uuid().
+*/
+static tdb_error spill_events(tdb_cons *cons)
+{
+    struct spill_state state = {.cons = cons};
+    uint64_t *offsets;
+    int ret = 0;
+
+    if (!cons->runs)
+        if ((ret = open_runs(cons)))
+            return ret;
+
+    if (!(offsets = realloc(cons->run_offsets,
+                            (cons->num_runs + 2) * sizeof(uint64_t))))
+        return TDB_ERR_NOMEM;
+    cons->run_offsets = offsets;
+    cons->run_offsets[0] = 0;
+
+    j128m_fold(&cons->trails, spill_trail, &state);
+    free(state.buf);
+    if ((ret = state.ret))
+        return ret;
+
+    cons->num_spilled_events += cons->events.next;
+    cons->run_offsets[++cons->num_runs] = cons->num_spilled_events;
+
+    /* keep the chunks of the arena for new events */
+    cons->events.next = 0;
+    return 0;
+}
+
+static inline tdb_error check_memory_limit(tdb_cons *cons)
+{
+    if (cons->memory_limit &&
+        cons->events.next * sizeof(struct tdb_cons_event) >= cons->memory_limit)
+        return spill_events(cons);
+    return 0;
+}
+
 /*
 Append an event in this cons.
 */
@@ -368,26 +612,9 @@ TDB_EXPORT tdb_error tdb_cons_add(tdb_cons *cons,
         if (value_lengths[i] > TDB_MAX_VALUE_SIZE)
             return TDB_ERR_VALUE_TOO_LONG;
 
-    memcpy(&uuid_key, uuid, 16);
-    uuid_ptr = j128m_insert(&cons->trails, uuid_key);
-
-    if (!(event = (struct tdb_cons_event*)arena_add_item(&cons->events)))
-        return TDB_ERR_NOMEM;
-
-    event->item_zero = cons->items.next;
-    event->num_items = 0;
-    event->timestamp = timestamp;
-    event->prev_event_idx = *uuid_ptr;
-    *uuid_ptr = cons->events.next;
-
-    if (timestamp < cons->min_timestamp)
-        cons->min_timestamp = timestamp;
-
     for (i = 0; i < cons->num_ofields; i++){
         tdb_field field = (tdb_field)(i + 1);
         tdb_val val = 0;
-        tdb_item item;
-        void *dst;
 
         if (value_lengths[i]){
             if (!(val = (tdb_val)jsm_insert(&cons->lexicons[i],
@@ -396,18 +623,31 @@ TDB_EXPORT tdb_error tdb_cons_add(tdb_cons *cons,
                 return TDB_ERR_NOMEM;
 
         }
-        item = tdb_make_item(field, val);
-        if (!(dst = arena_add_item(&cons->items)))
-            /*
-            cons->items is a file-backed arena, so this is most
-            likely caused by disk being full, hence an IO error.
-            */
-            return TDB_ERR_IO_WRITE;
-
-        memcpy(dst, &item, sizeof(tdb_item));
-        ++event->num_items;
+        cons->event_items[i] = tdb_make_item(field, val);
     }
-    return 0;
+
+    memcpy(&uuid_key, uuid, 16);
+    uuid_ptr = j128m_insert(&cons->trails, uuid_key);
+
+    if (!(event = (struct tdb_cons_event*)arena_add_item(&cons->events)))
+        return TDB_ERR_NOMEM;
+
+    if (timestamp > TDB_CONS_MAX_TIMESTAMP)
+        cons->timestamp_too_large = 1;
+    tdb_cons_event_set(event, timestamp, *uuid_ptr);
+    *uuid_ptr = cons->events.next;
+
+    if (timestamp < cons->min_timestamp)
+        cons->min_timestamp = timestamp;
+
+    if (arena_add_items(&cons->items, cons->event_items, cons->num_ofields))
+        /*
+        cons->items is a file-backed arena, so this is most
+        likely caused by disk being full, hence an IO error.
+        */
+        return TDB_ERR_IO_WRITE;
+
+    return check_memory_limit(cons);
 }
 
 /*
@@ -497,7 +737,8 @@ static uint64_t **append_lexicons(tdb_cons *cons, const tdb *db)
         struct tdb_lexicon lex;
         uint64_t *map;
 
-        tdb_lexicon_read(db, field + 1, &lex);
+        if (tdb_lexicon_read(db, field + 1, &lex))
+            goto error;
 
         if (!(map = lexicon_maps[field] = malloc(lex.size * sizeof(tdb_val))))
             goto error;
@@ -506,9 +747,15 @@ static uint64_t **append_lexicons(tdb_cons *cons, const tdb *db)
             uint64_t value_length;
             const char *value = tdb_lexicon_get(&lex, i, &value_length);
             tdb_val val;
-            if ((val = (tdb_val)jsm_insert(&cons->lexicons[field],
-                                            value,
-                                            value_length)))
+            /*
+            lexicons pruned by tdb_split() store unused values as empty
+            strings. No item refers to them, so they map to NULL.
+            */
+            if (!value_length)
+                map[i] = 0;
+            else if ((val = (tdb_val)jsm_insert(&cons->lexicons[field],
+                                                 value,
+                                                 value_length)))
                 map[i] = val;
             else
                 goto error;
@@ -522,46 +769,88 @@ error:
     return NULL;
 }
 
+struct append_buffer{
+    struct tdb_cons_event *events;
+    uint64_t num_events;
+    tdb_item *items;
+    uint64_t num_items;
+};
+
+static tdb_error reserve_append_buffer(struct append_buffer *buf,
+                                       uint64_t num_events,
+                                       uint64_t num_items)
+{
+    if (num_events > buf->num_events){
+        struct tdb_cons_event *events;
+        uint64_t n = buf->num_events ? buf->num_events: 1024;
+        while (n < num_events)
+            n *= 2;
+        if (!(events = realloc(buf->events, n * sizeof(struct tdb_cons_event))))
+            return TDB_ERR_NOMEM;
+        buf->events = events;
+        buf->num_events = n;
+    }
+    if (num_items > buf->num_items){
+        tdb_item *items;
+        uint64_t n = buf->num_items ? buf->num_items: 1024;
+        while (n < num_items)
+            n *= 2;
+        if (!(items = realloc(buf->items, n * sizeof(tdb_item))))
+            return TDB_ERR_NOMEM;
+        buf->items = items;
+        buf->num_items = n;
+    }
+    return 0;
+}
+
 /*
-Take an event from the old db, translate its items to new vals
-and append to the new cons
+Take a trail from the old db, translate its items to new vals
+and append its events to the new cons. The events and items of
+the trail are collected in buf and added to the arenas at once.
 */
-static tdb_error append_event(tdb_cons *cons,
-                              const tdb_event *event,
+static tdb_error append_trail(tdb_cons *cons,
+                              tdb_cursor *cursor,
                               Word_t *uuid_ptr,
-                              tdb_val **lexicon_maps)
+                              tdb_val **lexicon_maps,
+                              struct append_buffer *buf)
 {
+    const tdb_event *event;
+    uint64_t num_events = 0;
+    uint64_t num_items = 0;
     uint64_t i;
-    struct tdb_cons_event *new_event =
-        (struct tdb_cons_event*)arena_add_item(&cons->events);
-
-    if (!new_event)
-        return TDB_ERR_NOMEM;
-
-    new_event->item_zero = cons->items.next;
-    new_event->num_items = 0;
-    new_event->timestamp = event->timestamp;
-    new_event->prev_event_idx = *uuid_ptr;
-    *uuid_ptr = cons->events.next;
+    int ret = 0;
 
-    for (i = 0; i < event->num_items; i++){
-        tdb_val val = tdb_item_val(event->items[i]);
-        tdb_field field = tdb_item_field(event->items[i]);
-        tdb_val new_val = 0;
-        /* translate val */
-        if (val)
-            new_val = lexicon_maps[field - 1][val - 1];
-        tdb_item item = tdb_make_item(field, new_val);
-        void *dst = arena_add_item(&cons->items);
-        if (!dst)
-            /*
-            cons->items is a file-backed arena, so this is most
-            likely caused by disk being full, hence an IO error.
-            */
-            return TDB_ERR_IO_WRITE;
-        memcpy(dst, &item, sizeof(tdb_item));
-        ++new_event->num_items;
+    while ((event = tdb_cursor_next(cursor))){
+        struct tdb_cons_event *new_event;
+
+        if ((ret = reserve_append_buffer(buf,
+                                         num_events + 1,
+                                         num_items + event->num_items)))
+            return ret;
+
+        new_event = &buf->events[num_events++];
+        tdb_cons_event_set(new_event, event->timestamp, *uuid_ptr);
+        *uuid_ptr = cons->events.next + num_events;
+
+        for (i = 0; i < event->num_items; i++){
+            tdb_val val = tdb_item_val(event->items[i]);
+            tdb_field field = tdb_item_field(event->items[i]);
+            tdb_val new_val = 0;
+            /* translate val */
+            if (val)
+                new_val = lexicon_maps[field - 1][val - 1];
+            buf->items[num_items++] = tdb_make_item(field, new_val);
+        }
     }
+
+    if (arena_add_items(&cons->events, buf->events, num_events))
+        return TDB_ERR_NOMEM;
+    if (arena_add_items(&cons->items, buf->items, num_items))
+        /*
+        cons->items is a file-backed arena, so this is most
+        likely caused by disk being full, hence an IO error.
+        */
+        return TDB_ERR_IO_WRITE;
     return TDB_ERR_OK;
 }
 
@@ -574,6 +863,7 @@ in db to items in cons, without going through strings.
 static tdb_error tdb_cons_append_full_lexicon(tdb_cons *cons, const tdb *db)
 {
     tdb_val **lexicon_maps = NULL;
+    struct append_buffer buf = {.events = NULL};
     uint64_t i, trail_id;
     int ret = 0;
 
@@ -592,7 +882,6 @@ static tdb_error tdb_cons_append_full_lexicon(tdb_cons *cons, const tdb *db)
     for (trail_id = 0; trail_id < tdb_num_trails(db); trail_id++){
         __uint128_t uuid_key;
         Word_t *uuid_ptr;
-        const tdb_event *event;
 
         if ((ret = tdb_get_trail(cursor, trail_id)))
             goto done;
@@ -604,12 +893,15 @@ static tdb_error tdb_cons_append_full_lexicon(tdb_cons *cons, const tdb *db)
         if (tdb_cursor_peek(cursor)){
             memcpy(&uuid_key, tdb_get_uuid(db, trail_id), 16);
             uuid_ptr = j128m_insert(&cons->trails, uuid_key);
-            while ((event = tdb_cursor_next(cursor)))
-                if ((ret = append_event(cons, event, uuid_ptr, lexicon_maps)))
-                    goto done;
+            if ((ret = append_trail(cons, cursor, uuid_ptr, lexicon_maps, &buf)))
+                goto done;
+            if ((ret = check_memory_limit(cons)))
+                goto done;
         }
     }
 done:
+    free(buf.events);
+    free(buf.items);
     if (lexicon_maps){
         for (i = 0; i < cons->num_ofields; i++)
             free(lexicon_maps[i]);
@@ -619,10 +911,7 @@ done:
     return ret;
 }
 
-/*
-Merge an existing tdb to the new cons.
-*/
-TDB_EXPORT tdb_error tdb_cons_append(tdb_cons *cons, const tdb *db)
+static tdb_error check_fields(const tdb_cons *cons, const tdb *db)
 {
     tdb_field field;
 
@@ -636,6 +925,18 @@ TDB_EXPORT tdb_error tdb_cons_append(tdb_cons *cons, const tdb *db)
     for (field = 0; field < cons->num_ofields; field++)
         if (strcmp(cons->ofield_names[field], tdb_get_field_name(db, field + 1)))
             return TDB_ERR_APPEND_FIELDS_MISMATCH;
+    return 0;
+}
+
+/*
+Merge an existing tdb to the new cons.
+*/
+TDB_EXPORT tdb_error tdb_cons_append(tdb_cons *cons, const tdb *db)
+{
+    int ret;
+
+    if ((ret = check_fields(cons, db)))
+        return ret;
 
     /* NOTE: When you add new options in tdb, remember to add them to
     the list below if they cause only a subset of events to be returned.
@@ -657,14 +958,84 @@ TDB_EXPORT tdb_error tdb_cons_append(tdb_cons *cons, const tdb *db)
 }
 
 
+/*
+Encode trails with the codebook of db instead of building a new one,
+see TDB_OPT_CONS_CODEBOOK. Values of db are added to the empty lexicons
+first, so they get the same vals as in db and match the grams of the
+codebook. New values are encoded as literals.
+*/
+static tdb_error seed_codebook(tdb_cons *cons, const tdb *db)
+{
+    const uint64_t size = HUFF_CODEBOOK_SIZE * sizeof(struct huff_codebook);
+    tdb_field field;
+    tdb_val i;
+    int ret;
+
+    /* cons must be open and empty */
+    if (!cons->events.item_size ||
+        cons->events.next ||
+        cons->num_spilled_events)
+        return TDB_ERR_INVALID_OPTION_VALUE;
+
+    if ((ret = check_fields(cons, db)))
+        return ret;
+
+    for (field = 0; field < cons->num_ofields; field++)
+        if (jsm_num_keys(&cons->lexicons[field]))
+            return TDB_ERR_INVALID_OPTION_VALUE;
+
+    if (db->codebook.size < size)
+        return TDB_ERR_INVALID_CODEBOOK_FILE;
+
+    for (field = 0; field < cons->num_ofields; field++){
+        struct tdb_lexicon lex;
+
+        if (tdb_lexicon_read(db, field + 1, &lex))
+            return TDB_ERR_INVALID_LEXICON_FILE;
+
+        for (i = 0; i < lex.size; i++){
+            uint64_t value_length;
+            const char *value = tdb_lexicon_get(&lex, i, &value_length);
+            /* pruned lexicons repeat empty values, so vals would not match */
+            if (!value_length)
+                return TDB_ERR_INVALID_OPTION_VALUE;
+            if (!jsm_insert(&cons->lexicons[field], value, value_length))
+                return TDB_ERR_NOMEM;
+        }
+    }
+
+    if (!cons->codebook && !(cons->codebook = malloc(size)))
+        return TDB_ERR_NOMEM;
+    memcpy(cons->codebook, db->codebook.data, size);
+    return 0;
+}
+
 TDB_EXPORT tdb_error tdb_cons_finalize(tdb_cons *cons)
 {
     struct tdb_file items_mmapped;
-    uint64_t num_events = cons->events.next;
+    uint64_t num_events;
     int ret = 0;
 
     memset(&items_mmapped, 0, sizeof(struct tdb_file));
 
+    /* once events have been spilled, all of them are merged from runs */
+    if (cons->num_runs){
+        if (cons->events.next)
+            if ((ret = spill_events(cons)))
+                return ret;
+        if (fflush(cons->runs))
+            return TDB_ERR_IO_WRITE;
+    }
+    num_events = cons->num_spilled_events + cons->events.next;
+
+    /*
+    items of an event are located by its index, see tdb_internal.h, so
+    every event must have all its items. This fails only if adding items
+    failed earlier.
+    */
+    if (cons->items.next != num_events * cons->num_ofields)
+        return TDB_ERR_IO_WRITE;
+
     /* finalize event items */
     if ((ret = arena_flush(&cons->items)))
         goto done;
@@ -684,6 +1055,10 @@ TDB_EXPORT tdb_error tdb_cons_finalize(tdb_cons *cons)
             }
         }
 
+        if (cons->output_format == TDB_OPT_CONS_OUTPUT_FORMAT_PACKAGE)
+            if ((ret = cons_package_open(cons)))
+                goto done;
+
         TDB_TIMER_DEF
 
         TDB_TIMER_START
@@ -713,15 +1088,378 @@ done:
     if (cons->tempfile[0])
         unlink(cons->tempfile);
 
-    if (!ret){
-        #ifdef HAVE_ARCHIVE_H
-        if (cons->output_format == TDB_OPT_CONS_OUTPUT_FORMAT_PACKAGE)
-            ret = cons_package(cons);
-        #endif
+    if (cons->package){
+        if (!ret)
+            ret = cons_package_close(cons);
+        cons_package_free(cons);
+    }
+    return ret;
+}
+
+/*
+Write a lexicon that contains only the used values of lex: other values
+are stored as empty strings, so that vals of the used values don't
+change. The format is described in lexicon_store().
+*/
+static tdb_error prune_lexicon(tdb_cons *cons,
+                               const struct tdb_lexicon *lex,
+                               const uint64_t *used,
+                               const char *fname)
+{
+    const uint64_t count = lex->size;
+    uint64_t values_size = 0;
+    uint64_t offset, size, len;
+    uint64_t width = 4;
+    const char *value;
+    FILE *out = NULL;
+    tdb_val val;
+    int ret = 0;
+
+    for (val = 1; val <= count; val++)
+        if (used[val >> 6] & (1LLU << (val & 63))){
+            tdb_lexicon_get(lex, val - 1, &len);
+            values_size += len;
+        }
+
+    size = (count + 2) * width + values_size;
+    if (size > UINT32_MAX){
+        width = 8;
+        size = (count + 2) * width + values_size;
+    }
+
+    TDB_CONS_OPEN(cons, out, fname, size);
+    TDB_WRITE(out, &count, width);
+
+    offset = (count + 2) * width;
+    for (val = 1; val <= count; val++){
+        TDB_WRITE(out, &offset, width);
+        if (used[val >> 6] & (1LLU << (val & 63))){
+            tdb_lexicon_get(lex, val - 1, &len);
+            offset += len;
+        }
+    }
+    TDB_WRITE(out, &offset, width);
+
+    for (val = 1; val <= count; val++)
+        if (used[val >> 6] & (1LLU << (val & 63))){
+            value = tdb_lexicon_get(lex, val - 1, &len);
+            if (len)
+                TDB_WRITE(out, value, len);
+        }
+done:
+    TDB_CONS_CLOSE_FINAL(cons, out);
+    return ret;
+}
+
+/*
+Lexicons are copied as is, so items of the extracted trails keep their
+vals. The cardinalities in "fields" are those of db, see fields_open().
+If used_vals is given, only the used values are kept.
+*/
+static tdb_error copy_lexicons(tdb_cons *cons,
+                               const tdb *db,
+                               uint64_t **used_vals)
+{
+    tdb_field field;
+    FILE *out = NULL;
+    char path[TDB_MAX_PATH_SIZE];
+    int ret = 0;
+
+    for (field = 1; field < db->num_fields; field++){
+        const struct tdb_file *lexicon = &db->lexicons[field - 1];
+        struct tdb_lexicon lex;
+
+        if (tdb_lexicon_read(db, field, &lex)){
+            ret = TDB_ERR_INVALID_LEXICON_FILE;
+            goto done;
+        }
+        TDB_PATH(path, "lexicon.%s", db->field_names[field]);
+        if (used_vals){
+            if ((ret = prune_lexicon(cons, &lex, used_vals[field - 1], path)))
+                goto done;
+        }else{
+            TDB_CONS_OPEN(cons, out, path, lexicon->size);
+            TDB_WRITE(out, lexicon->data, lexicon->size);
+            TDB_CONS_CLOSE(cons, out);
+        }
+    }
+
+    TDB_CONS_OPEN(cons, out, "fields", TDB_CONS_UNKNOWN_SIZE);
+    for (field = 1; field < db->num_fields; field++)
+        TDB_FPRINTF(out, "%s\n", db->field_names[field]);
+    TDB_FPRINTF(out, "\n");
+    for (field = 1; field < db->num_fields; field++)
+        TDB_FPRINTF(out, "%"PRIu64"\n", tdb_lexicon_size(db, field) - 1);
+done:
+    TDB_CONS_CLOSE_FINAL(cons, out);
+    return ret;
+}
+
+/*
+Copy the encoded trails in the order of trail_ids. The events are
+decoded only to count them, to find their timestamps, and to mark the
+vals that are used in used_vals, if given. Trail metadata of db makes
+decoding unnecessary, unless used_vals is given.
+*/
+static tdb_error copy_trails(tdb_cons *cons,
+                             const tdb *db,
+                             const uint64_t *trail_ids,
+                             uint64_t num_trails,
+                             uint64_t **used_vals,
+                             uint64_t *num_events,
+                             uint64_t *max_timestamp)
+{
+    const tdb_event *event;
+    tdb_cursor *cursor = NULL;
+    tdb_cursor *reader = NULL;
+    uint64_t *toc = NULL;
+    tdb_trail_meta *meta = NULL;
+    uint64_t i, j, offs_size, file_offs = 0;
+    uint64_t zero = 0;
+    FILE *out = NULL;
+    int ret = 0;
+
+    if (!(toc = malloc((num_trails + 1) * 8)) ||
+        !(meta = calloc(num_trails + 1, sizeof(tdb_trail_meta))) ||
+        !(cursor = tdb_cursor_new(db)) ||
+        !(reader = tdb_cursor_new(db))){
+        ret = TDB_ERR_NOMEM;
+        goto done;
+    }
+
+    for (i = 0; i < num_trails; i++){
+        toc[i] = file_offs;
+        file_offs += tdb_get_trail_offs(db, trail_ids[i] + 1) -
+                     tdb_get_trail_offs(db, trail_ids[i]);
+    }
+    toc[num_trails] = file_offs;
+
+    /* huffman may read up to 7 bytes past the end, see encode_trails() */
+    TDB_CONS_OPEN(cons, out, "trails.data", file_offs + 8);
+    for (i = 0; i < num_trails; i++){
+        struct tdb_decode_state *s = reader->state;
+        const uint64_t start = tdb_get_trail_offs(db, trail_ids[i]);
+        const uint64_t end = tdb_get_trail_offs(db, trail_ids[i] + 1);
+
+        if (db->compressed){
+            if ((ret = tdb_compressed_trail(db, s, start, end)))
+                goto done;
+        }else if (db->pread){
+            if ((ret = tdb_pread_trail(db, s, start, end)))
+                goto done;
+        }else
+            s->data = &db->trails.data[start];
+        TDB_WRITE(out, s->data, end - start);
+
+        if (db->trail_meta.data && !used_vals)
+            tdb_trail_meta_read(db, trail_ids[i], &meta[i]);
+        else{
+            if ((ret = tdb_get_trail(cursor, trail_ids[i])))
+                goto done;
+            while ((event = tdb_cursor_next(cursor))){
+                if (!meta[i].num_events++)
+                    meta[i].min_timestamp = event->timestamp;
+                meta[i].max_timestamp = event->timestamp;
+                if (used_vals)
+                    for (j = 0; j < event->num_items; j++){
+                        const tdb_field field =
+                            tdb_item_field(event->items[j]);
+                        const tdb_val val = tdb_item_val(event->items[j]);
+                        used_vals[field - 1][val >> 6] |= 1LLU << (val & 63);
+                    }
+            }
+        }
+        *num_events += meta[i].num_events;
+        if (meta[i].max_timestamp > *max_timestamp)
+            *max_timestamp = meta[i].max_timestamp;
     }
+    TDB_WRITE(out, &zero, 8);
+    file_offs += 8;
+    TDB_CONS_CLOSE(cons, out);
+
+    offs_size = file_offs < UINT32_MAX ? 4 : 8;
+    TDB_CONS_OPEN(cons, out, "trails.toc", (num_trails + 1) * offs_size);
+    for (i = 0; i < num_trails + 1; i++)
+        TDB_WRITE(out, &toc[i], offs_size);
+    TDB_CONS_CLOSE(cons, out);
+
+    /* the new TrailDB keeps the minimum timestamp of db */
+    ret = cons_store_trail_meta(cons, meta, num_trails, db->min_timestamp);
+
+done:
+    TDB_CONS_CLOSE_FINAL(cons, out);
+    tdb_cursor_free(reader);
+    tdb_cursor_free(cursor);
+    free(meta);
+    free(toc);
     return ret;
 }
 
+static void *collect_trail_ids(__uint128_t key __attribute__((unused)),
+                               Word_t *value,
+                               void *state)
+{
+    uint64_t **next = (uint64_t**)state;
+    /* values are trail IDs + 1, see cons_extract_trails() */
+    *(*next)++ = *value - 1;
+    return state;
+}
+
+/*
+Extract trails without decoding and re-encoding them, unlike
+tdb_cons_append(). The encoded trails refer to the codebook, the
+lexicons, and the minimum timestamp of db, so the new TrailDB keeps
+them as they are and only the TOC and UUIDs are rewritten.
+*/
+tdb_error cons_extract_trails(const tdb *db,
+                              const uint64_t *trail_ids,
+                              uint64_t num_trail_ids,
+                              const char *root,
+                              int prune_lexicons)
+{
+    tdb_cons *cons = NULL;
+    const char **field_names = NULL;
+    uint64_t **used_vals = NULL;
+    uint64_t *ids = NULL;
+    tdb_field field;
+    uint64_t *next;
+    uint64_t i, num_trails;
+    uint64_t num_events = 0;
+    uint64_t max_timestamp = db->min_timestamp;
+    FILE *out = NULL;
+    int ret = 0;
+
+    /* lexicons of V0 have a different format */
+    if (db->version == TDB_VERSION_V0)
+        return TDB_ERR_INCOMPATIBLE_VERSION;
+
+    /* filtered trails must be re-encoded with tdb_cons_append() */
+    if (db->opt_event_filter || db->opt_trail_event_filters)
+        return TDB_ERR_INVALID_OPTION_VALUE;
+
+    for (i = 0; i < num_trail_ids; i++)
+        if (trail_ids[i] >= db->num_trails)
+            return TDB_ERR_INVALID_TRAIL_ID;
+
+    /* the output format follows db */
+    if (!(cons = tdb_cons_init()))
+        return TDB_ERR_NOMEM;
+    if (!db->is_package)
+        tdb_cons_set_opt(cons,
+                         TDB_OPT_CONS_OUTPUT_FORMAT,
+                         opt_val(TDB_OPT_CONS_OUTPUT_FORMAT_DIR));
+    if (!(field_names = malloc(db->num_fields * sizeof(char*)))){
+        ret = TDB_ERR_NOMEM;
+        goto done;
+    }
+    for (i = 1; i < db->num_fields; i++)
+        field_names[i - 1] = db->field_names[i];
+    if ((ret = tdb_cons_open(cons, root, field_names, db->num_fields - 1)))
+        goto done;
+
+    /*
+    trails are stored in the order of UUIDs, duplicates and deleted
+    trails are dropped
+    */
+    for (i = 0; i < num_trail_ids; i++){
+        __uint128_t uuid_key;
+        Word_t *ptr;
+
+        if (tdb_trail_is_deleted(db, trail_ids[i]))
+            continue;
+
+        memcpy(&uuid_key, tdb_get_uuid(db, trail_ids[i]), 16);
+        ptr = j128m_insert(&cons->trails, uuid_key);
+        *ptr = trail_ids[i] + 1;
+    }
+    num_trails = j128m_num_keys(&cons->trails);
+    if (!(ids = malloc(num_trails * 8 + 8))){
+        ret = TDB_ERR_NOMEM;
+        goto done;
+    }
+    next = ids;
+    j128m_fold(&cons->trails, collect_trail_ids, &next);
+
+    if (cons->output_format == TDB_OPT_CONS_OUTPUT_FORMAT_PACKAGE)
+        if ((ret = cons_package_open(cons)))
+            goto done;
+
+    if (prune_lexicons){
+        if (!(used_vals = calloc(db->num_fields, sizeof(uint64_t*)))){
+            ret = TDB_ERR_NOMEM;
+            goto done;
+        }
+        for (field = 1; field < db->num_fields; field++)
+            if (!(used_vals[field - 1] =
+                  calloc(tdb_lexicon_size(db, field) / 64 + 1, 8))){
+                ret = TDB_ERR_NOMEM;
+                goto done;
+            }
+    }
+
+    if ((ret = store_uuids(cons)))
+        goto done;
+
+    if ((ret = store_version(cons)))
+        goto done;
+
+    if ((ret = copy_trails(cons,
+                           db,
+                           ids,
+                           num_trails,
+                           used_vals,
+                           &num_events,
+                           &max_timestamp)))
+        goto done;
+
+    /* lexicons are pruned based on the vals of the copied trails */
+    if ((ret = copy_lexicons(cons, db, used_vals)))
+        goto done;
+
+    /* timestamps of trails are encoded relative to db->min_timestamp */
+    if ((ret = cons_store_info(cons,
+                               num_trails,
+                               num_events,
+                               db->min_timestamp,
+                               max_timestamp,
+                               db->max_timestamp_delta)))
+        goto done;
+
+    TDB_CONS_OPEN(cons, out, "trails.codebook", db->codebook.size);
+    if (db->codebook.size)
+        TDB_WRITE(out, db->codebook.data, db->codebook.size);
+    TDB_CONS_CLOSE(cons, out);
+
+done:
+    if (out)
+        cons_fclose(cons, out);
+
+    if (cons->tempfile[0])
+        unlink(cons->tempfile);
+
+    if (cons->package){
+        if (!ret)
+            ret = cons_package_close(cons);
+        cons_package_free(cons);
+    }
+    tdb_cons_close(cons);
+    if (used_vals)
+        for (field = 1; field < db->num_fields; field++)
+            free(used_vals[field - 1]);
+    free(used_vals);
+    free(field_names);
+    free(ids);
+    return ret;
+}
+
+TDB_EXPORT tdb_error tdb_extract_trails(const tdb *db,
+                                        const uint64_t *trail_ids,
+                                        uint64_t num_trail_ids,
+                                        const char *root)
+{
+    return cons_extract_trails(db, trail_ids, num_trail_ids, root, 0);
+}
+
 TDB_EXPORT tdb_error tdb_cons_set_opt(tdb_cons *cons,
                                       tdb_opt_key key,
                                       tdb_opt_value value)
@@ -729,9 +1467,7 @@ TDB_EXPORT tdb_error tdb_cons_set_opt(tdb_cons *cons,
     switch (key){
         case TDB_OPT_CONS_OUTPUT_FORMAT:
             switch (value.value){
-                #ifdef HAVE_ARCHIVE_H
                 case TDB_OPT_CONS_OUTPUT_FORMAT_PACKAGE:
-                #endif
                 case TDB_OPT_CONS_OUTPUT_FORMAT_DIR:
                     cons->output_format = value.value;
                     return 0;
@@ -741,6 +1477,39 @@ TDB_EXPORT tdb_error tdb_cons_set_opt(tdb_cons *cons,
         case TDB_OPT_CONS_NO_BIGRAMS:
             cons->no_bigrams = !(!(value.value));
             return 0;
+        case TDB_OPT_CONS_PACKAGE_ALIGNMENT:
+            /* 0 means no alignment beyond the 512-byte tar blocks */
+            if (value.value & (value.value - 1) ||
+                (value.value && value.value < 512) ||
+                value.value > (1LLU << 30))
+                return TDB_ERR_INVALID_OPTION_VALUE;
+            cons->package_alignment = value.value;
+            return 0;
+        case TDB_OPT_CONS_COMPRESSION:
+            if (value.value == TDB_OPT_CONS_COMPRESSION_NONE ||
+                tdb_compression_is_supported(value.value)){
+                cons->compression = value.value;
+                return 0;
+            }else
+                return TDB_ERR_INVALID_OPTION_VALUE;
+        case TDB_OPT_CONS_MEMORY_LIMIT:
+            /* 0 means no limit */
+            cons->memory_limit = value.value;
+            return 0;
+        case TDB_OPT_CONS_CODEBOOK:
+            if (!value.ptr)
+                return TDB_ERR_INVALID_OPTION_VALUE;
+            return seed_codebook(cons, (const tdb*)value.ptr);
+        case TDB_OPT_CONS_TRAIL_META:
+            switch (value.value){
+                case TDB_OPT_CONS_TRAIL_META_NONE:
+                case TDB_OPT_CONS_TRAIL_META_PLAIN:
+                case TDB_OPT_CONS_TRAIL_META_PACKED:
+                    cons->trail_meta = value.value;
+                    return 0;
+                default:
+                    return TDB_ERR_INVALID_OPTION_VALUE;
+            }
         default:
             return TDB_ERR_UNKNOWN_OPTION;
     }
@@ -757,6 +1526,18 @@ TDB_EXPORT tdb_error tdb_cons_get_opt(tdb_cons *cons,
         case TDB_OPT_CONS_NO_BIGRAMS:
             value->value = cons->no_bigrams;
             return 0;
+        case TDB_OPT_CONS_PACKAGE_ALIGNMENT:
+            value->value = cons->package_alignment;
+            return 0;
+        case TDB_OPT_CONS_COMPRESSION:
+            value->value = cons->compression;
+            return 0;
+        case TDB_OPT_CONS_MEMORY_LIMIT:
+            value->value = cons->memory_limit;
+            return 0;
+        case TDB_OPT_CONS_TRAIL_META:
+            value->value = cons->trail_meta;
+            return 0;
         default:
             return TDB_ERR_UNKNOWN_OPTION;
     }
@@ -1,20 +1,19 @@
-#ifdef HAVE_ARCHIVE_H
 
-#define _DEFAULT_SOURCE /* mkstemp() */
+#define _DEFAULT_SOURCE /* ftruncate(), pwrite() */
 #define _GNU_SOURCE
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
 
 #include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 
-#include <archive.h>
-#include <archive_entry.h>
-
 #include "tdb_package.h"
 
 /*
@@ -29,10 +28,73 @@ static const char *DATA_FILES[] = {"fields",
                                    "trails.codebook",
                                    "trails.toc",
                                    "trails.data",
-                                   "uuids"};
+                                   "trails.blocks",
+                                   "trails.meta",
+                                   "uuids",
+                                   "uuids.index"};
 
 static const char TOC_FILE[] = "tar.toc";
 
+/* sections that are scanned and benefit from aligned mmaps */
+static const char *ALIGNED_FILES[] = {"trails.toc",
+                                      "trails.data",
+                                      "uuids"};
+static const char ALIGNED_PREFIX[] = "lexicon.";
+
+#define TAR_BLOCK_SIZE 512
+#define TAR_RECORD_SIZE 10240
+#define TAR_NAME_SIZE 100
+#define TAR_LONGLINK "././@LongLink"
+#define TAR_PAX_GLOBAL "pax_global_header"
+
+/*
+The package is written as a GNU tar file without an intermediate copy:
+Header files and the TOC are written to their reserved slots in the
+beginning of the file, all other files are appended after them. A file
+that is being written occupies a region [offset, offset + size) of the
+package. Its tar header is written when the file is closed.
+
+Files whose size is known when they are opened get a region of their own
+right away, so many of them can be written at the same time. Files of
+an unknown size grow at the end of the package, so only one of them can
+be written at a time.
+*/
+struct package_member{
+    FILE *file;
+    char *fname;
+    uint64_t header_offset;
+    uint64_t offset;
+    uint64_t size;
+    int is_header_file;
+    struct package_member *next;
+};
+
+struct package_file{
+    char *fname;
+    uint64_t offset;
+    uint64_t size;
+};
+
+struct tdb_cons_package{
+    char path[TDB_MAX_PATH_SIZE];
+    int fd;
+
+    /* end of the last member */
+    uint64_t end;
+
+    /* members that are currently open */
+    struct package_member *open_members;
+    int has_unsized_member;
+
+    struct package_file *toc;
+    uint64_t toc_len;
+    uint64_t toc_max_size;
+    uint64_t num_header_files;
+
+    /* TDB_OPT_CONS_PACKAGE_ALIGNMENT */
+    uint64_t alignment;
+};
+
 static inline void debug_print(char __attribute__((unused)) *fmt, ...)
 {
 #ifdef TDB_PACKAGE_DEBUG
@@ -43,392 +105,485 @@ static inline void debug_print(char __attribute__((unused)) *fmt, ...)
 #endif
 }
 
-static inline tdb_error write_toc_entry(FILE *toc_file,
-                                        const char *fname,
-                                        uint64_t offset,
-                                        uint64_t size)
+static inline uint64_t tar_blocks(uint64_t size)
 {
-    int ret = 0;
-    TDB_FPRINTF(toc_file, "%s %"PRIu64" %"PRIu64"\n", fname, offset, size);
-done:
-    return ret;
+    return (size + TAR_BLOCK_SIZE - 1) & ~((uint64_t)TAR_BLOCK_SIZE - 1);
 }
 
-static tdb_error write_header(struct archive *tar,
-                              struct archive_entry *entry,
-                              const char *fname,
-                              uint64_t size)
+static uint64_t header_size(const char *fname)
 {
-    if (size > INT64_MAX)
-        return TDB_ERR_IO_PACKAGE;
-
-    archive_entry_clear(entry);
-    archive_entry_set_pathname(entry, fname);
-    archive_entry_set_size(entry, (int64_t)size);
-    archive_entry_set_filetype(entry, AE_IFREG);
-    archive_entry_set_perm(entry, 0644);
-    if (archive_write_header(tar, entry) != ARCHIVE_OK)
-        return TDB_ERR_IO_PACKAGE;
-    return 0;
+    uint64_t len = strlen(fname);
+    /* long names are stored in a GNU LongLink entry before the header */
+    if (len >= TAR_NAME_SIZE)
+        return 2 * TAR_BLOCK_SIZE + tar_blocks(len + 1);
+    else
+        return TAR_BLOCK_SIZE;
 }
 
-static tdb_error write_file_entry(struct archive *tar,
-                                  struct archive_entry *entry,
-                                  const char *src,
-                                  const char *root,
-                                  FILE *toc_file)
+static void tar_octal(char *dst, uint64_t width, uint64_t value)
 {
-    const uint64_t BUFFER_SIZE = 65536;
-    char buffer[BUFFER_SIZE];
-    char path[TDB_MAX_PATH_SIZE];
-    struct stat stats;
-    int fd = 0;
-    int ret = 0;
-    uint64_t num_left;
+    if (value >> (3 * (width - 1))){
+        /* GNU base-256 encoding for values that don't fit in octal */
+        uint64_t i;
+        memset(dst, 0, width);
+        dst[0] = (char)0x80;
+        for (i = width - 1; i > 0 && value; i--){
+            dst[i] = (char)(value & 255);
+            value >>= 8;
+        }
+    }else{
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%0*"PRIo64, (int)(width - 1), value);
+        memcpy(dst, buf, width);
+    }
+}
 
-    TDB_PATH(path, "%s/%s", root, src);
+static void tar_header(char block[TAR_BLOCK_SIZE],
+                       const char *fname,
+                       uint64_t size,
+                       char type)
+{
+    uint64_t i, checksum = 0;
+
+    memset(block, 0, TAR_BLOCK_SIZE);
+    strncpy(block, fname, TAR_NAME_SIZE);
+    tar_octal(&block[100], 8, 0644);
+    tar_octal(&block[108], 8, 0);
+    tar_octal(&block[116], 8, 0);
+    tar_octal(&block[124], 12, size);
+    tar_octal(&block[136], 12, (uint64_t)time(NULL));
+    block[156] = type;
+    memcpy(&block[257], "ustar  ", 8);
+
+    memset(&block[148], ' ', 8);
+    for (i = 0; i < TAR_BLOCK_SIZE; i++)
+        checksum += (uint8_t)block[i];
+    tar_octal(&block[148], 7, checksum);
+}
 
-    if ((fd = open(path, O_RDONLY)) == -1){
-        debug_print("opening source file %s failed\n", path);
-        ret = TDB_ERR_IO_PACKAGE;
-        goto done;
-    }
-    if (fstat(fd, &stats)){
-        debug_print("fstat on source file %s failed\n", path);
-        ret = TDB_ERR_IO_PACKAGE;
-        goto done;
+static tdb_error pwrite_all(int fd, const char *buf, uint64_t size, uint64_t offset)
+{
+    while (size){
+        ssize_t w = pwrite(fd, buf, size, (off_t)offset);
+        if (w < 1)
+            return TDB_ERR_IO_PACKAGE;
+        buf += w;
+        size -= (uint64_t)w;
+        offset += (uint64_t)w;
     }
+    return 0;
+}
 
-    if ((ret = write_header(tar, entry, src, (uint64_t)stats.st_size))){
-        debug_print("write_header for %s failed\n", src);
-        goto done;
-    }
+static tdb_error write_header(const struct tdb_cons_package *pkg,
+                              uint64_t header_offset,
+                              const char *fname,
+                              uint64_t size)
+{
+    char block[TAR_BLOCK_SIZE];
+    uint64_t len = strlen(fname);
+    int ret = 0;
 
-    if ((ret = write_toc_entry(toc_file,
-                               src,
-                               (uint64_t)archive_filter_bytes(tar, -1),
-                               (uint64_t)stats.st_size))){
-        debug_print("write_toc_entry for source file %s failed\n", src);
-        goto done;
+    if (len >= TAR_NAME_SIZE){
+        tar_header(block, TAR_LONGLINK, len + 1, 'L');
+        if ((ret = pwrite_all(pkg->fd, block, TAR_BLOCK_SIZE, header_offset)))
+            return ret;
+        /* the name is padded with zeroes, which the region has already */
+        header_offset += TAR_BLOCK_SIZE;
+        if ((ret = pwrite_all(pkg->fd, fname, len, header_offset)))
+            return ret;
+        header_offset += tar_blocks(len + 1);
     }
+    tar_header(block, fname, size, '0');
+    return pwrite_all(pkg->fd, block, TAR_BLOCK_SIZE, header_offset);
+}
 
-    for (num_left = (uint64_t)stats.st_size; num_left > 0;){
-        ssize_t r = read(fd, buffer, BUFFER_SIZE);
-        if (r < 1){
-            debug_print("reading source file %s failed\n", path);
-            ret = TDB_ERR_IO_PACKAGE;
-            goto done;
-        }
-        if (archive_write_data(tar, buffer, (size_t)r) != r){
-            debug_print("writing file %s failed\n", src);
-            ret = TDB_ERR_IO_PACKAGE;
-            goto done;
-        }
-        num_left -= (uint64_t)r;
-    }
+/*
+A gap before an aligned file is filled with a pax global header that
+contains a single comment record spanning the gap, which tar readers
+ignore. The comment consists mostly of zeroes, so it stays a hole.
+*/
+static tdb_error write_padding(const struct tdb_cons_package *pkg,
+                               uint64_t offset,
+                               uint64_t gap)
+{
+    char block[TAR_BLOCK_SIZE];
+    const uint64_t size = gap - TAR_BLOCK_SIZE;
+    int ret = 0;
 
-    /*
-    once the file has been successfully appended to the archive,
-    we delete the source to save disk space
-    */
-    if (unlink(path)){
-        ret = TDB_ERR_IO_PACKAGE;
-        debug_print("unlinking %s failed\n", path);
-        goto done;
+    tar_header(block, TAR_PAX_GLOBAL, size, 'g');
+    if ((ret = pwrite_all(pkg->fd, block, TAR_BLOCK_SIZE, offset)))
+        return ret;
+    if (size){
+        /* a pax record is "<length> <key>=<value>\n" */
+        int len = snprintf(block, TAR_BLOCK_SIZE, "%"PRIu64" comment=", size);
+        offset += TAR_BLOCK_SIZE;
+        if ((ret = pwrite_all(pkg->fd, block, (uint64_t)len, offset)))
+            return ret;
+        ret = pwrite_all(pkg->fd, "\n", 1, offset + size - 1);
     }
-done:
-    if (fd)
-        close(fd);
     return ret;
 }
 
-static tdb_error write_entries(struct archive *tar,
-                               struct archive_entry *entry,
-                               const char **files,
-                               uint64_t num_files,
-                               const tdb_cons *cons,
-                               FILE *toc_file)
+static int is_aligned_file(const char *fname)
 {
     uint64_t i;
-    int ret = 0;
+    for (i = 0; i < sizeof(ALIGNED_FILES) / sizeof(ALIGNED_FILES[0]); i++)
+        if (!strcmp(fname, ALIGNED_FILES[i]))
+            return 1;
+    return !strncmp(fname, ALIGNED_PREFIX, strlen(ALIGNED_PREFIX));
+}
 
-    for (i = 0; i < num_files; i++)
-        if ((ret = write_file_entry(tar,
-                                    entry,
-                                    files[i],
-                                    cons->root,
-                                    toc_file)))
-            goto done;
-done:
-    return ret;
+static tdb_error add_toc_entry(struct tdb_cons_package *pkg,
+                               const char *fname,
+                               uint64_t offset,
+                               uint64_t size)
+{
+    struct package_file *toc;
+    if (!(toc = realloc(pkg->toc, (pkg->toc_len + 1) * sizeof(toc[0]))))
+        return TDB_ERR_NOMEM;
+    pkg->toc = toc;
+    if (!(toc[pkg->toc_len].fname = strdup(fname)))
+        return TDB_ERR_NOMEM;
+    toc[pkg->toc_len].offset = offset;
+    toc[pkg->toc_len].size = size;
+    ++pkg->toc_len;
+    return 0;
 }
 
-static tdb_error init_tar_toc(struct archive *tar,
-                              struct archive_entry *entry,
-                              const tdb_cons *cons,
-                              FILE *toc_file,
-                              uint64_t *toc_offset,
-                              uint64_t *toc_max_size)
+static uint64_t toc_size(uint64_t num_files, uint64_t names_size)
+{
+    return TOC_HEADER_SIZE +
+           pkg_toc_num_slots(num_files) * 8 +
+           num_files * sizeof(struct pkg_toc_entry) +
+           names_size;
+}
+
+static uint64_t toc_max_size(const tdb_cons *cons)
 {
     /*
     We need to preallocate enough space for tar.toc file. Since we don't
-    know the exact offsets yet, we allocate the absolute maximum the toc
-    can take.
+    know which files will be written, we allocate the absolute maximum
+    the toc can take.
     */
-    /* VALUE_SIZE = len(' %d %d\n' % (2**64, 2**64)) */
-    static const uint64_t VALUE_SIZE = 43;
     static const uint64_t LEXICON_PREFIX_LEN = 8; /* = len("lexicon.") */
-    uint64_t i, size = strlen(TOC_FILE) + VALUE_SIZE + strlen(TDB_TAR_MAGIC);
-    char *buffer = NULL;
-    int ret = 0;
+    uint64_t i, num_files = 1, names_size = strlen(TOC_FILE);
 
     for (i = 0; i < sizeof(HEADER_FILES) / sizeof(HEADER_FILES[0]); i++)
-        size += strlen(HEADER_FILES[i]) + VALUE_SIZE;
+        names_size += strlen(HEADER_FILES[i]);
+    num_files += i;
 
     for (i = 0; i < sizeof(DATA_FILES) / sizeof(DATA_FILES[0]); i++)
-        size += strlen(DATA_FILES[i]) + VALUE_SIZE;
+        names_size += strlen(DATA_FILES[i]);
+    num_files += i;
 
     for (i = 0; i < cons->num_ofields; i++)
-        size += strlen(cons->ofield_names[i]) + LEXICON_PREFIX_LEN + VALUE_SIZE;
+        names_size += strlen(cons->ofield_names[i]) + LEXICON_PREFIX_LEN;
+    num_files += i;
 
-    *toc_max_size = ++size; /* empty line in the end */
+    return toc_size(num_files, names_size);
+}
 
-    if ((ret = write_header(tar, entry, TOC_FILE, size))){
-        debug_print("write_header for TOC_FILE failed\n");
-        goto done;
-    }
+static int header_file_index(const char *fname)
+{
+    uint64_t i;
+    for (i = 0; i < sizeof(HEADER_FILES) / sizeof(HEADER_FILES[0]); i++)
+        if (!strcmp(fname, HEADER_FILES[i]))
+            return (int)i;
+    return -1;
+}
+
+tdb_error cons_package_open(tdb_cons *cons)
+{
+    struct tdb_cons_package *pkg;
+    int ret = 0;
+
+    if (!(pkg = calloc(1, sizeof(struct tdb_cons_package))))
+        return TDB_ERR_NOMEM;
+    pkg->fd = -1;
+    pkg->alignment = cons->package_alignment;
+    cons->package = pkg;
 
     /*
-    archives are unreadable if the TOC is not found exactly at the right
-    offset. Assert that this requirement is not violated.
+    the cons owns its root directory, so the name is unique. Unlike
+    mkstemp(), which creates files as 0600, open() applies the umask, so
+    packages get the same mode as the files of directory TrailDBs
     */
-    *toc_offset = (uint64_t)archive_filter_bytes(tar, -1);
-    if (*toc_offset != TOC_FILE_OFFSET){
-        debug_print("assert failed: invalid toc offset: %"PRIu64"\n",
-                    *toc_offset);
-        ret = TDB_ERR_IO_PACKAGE;
+    if (tdb_path(pkg->path, "%s/tmp.package", cons->root)){
+        pkg->path[0] = 0;
+        ret = TDB_ERR_PATH_TOO_LONG;
         goto done;
     }
-
-    if ((ret = write_toc_entry(toc_file,
-                               TOC_FILE,
-                               *toc_offset,
-                               size))){
-        debug_print("write_toc_entry for TOC_FILE failed\n");
+    if ((pkg->fd = open(pkg->path, O_RDWR | O_CREAT | O_TRUNC, 0666)) == -1){
+        debug_print("open(%s) failed\n", pkg->path);
+        pkg->path[0] = 0;
+        ret = TDB_ERR_IO_PACKAGE;
         goto done;
     }
 
-    /* we just need an array of null bytes */
-    if (!(buffer = calloc(1, size))){
-        ret = TDB_ERR_NOMEM;
-        goto done;
-    }
-    if (archive_write_data(tar, buffer, size) != (ssize_t)size){
-        debug_print("reserving %"PRIu64" bytes for TOC_FILE failed\n", size);
-        ret = TDB_ERR_IO_PACKAGE;
+    /*
+    each header file occupies one header block and one data block,
+    the TOC follows them
+    */
+    pkg->toc_max_size = toc_max_size(cons);
+    pkg->end = TOC_FILE_OFFSET + tar_blocks(pkg->toc_max_size);
+    if ((ret = write_header(pkg,
+                            TOC_FILE_OFFSET - TAR_BLOCK_SIZE,
+                            TOC_FILE,
+                            pkg->toc_max_size)))
         goto done;
-    }
+    ret = add_toc_entry(pkg, TOC_FILE, TOC_FILE_OFFSET, pkg->toc_max_size);
 done:
-    free(buffer);
     return ret;
 }
 
-static tdb_error write_lexicons(struct archive *tar,
-                                struct archive_entry *entry,
-                                const tdb_cons *cons,
-                                FILE *toc_file)
+tdb_error cons_package_fopen(tdb_cons *cons,
+                             const char *fname,
+                             uint64_t size,
+                             FILE **out)
 {
-    char path[TDB_MAX_PATH_SIZE];
-    uint64_t i;
+    struct tdb_cons_package *pkg = cons->package;
+    struct package_member *m;
+    int idx = header_file_index(fname);
     int ret = 0;
 
-    for (i = 0; i < cons->num_ofields; i++){
-        TDB_PATH(path, "lexicon.%s", cons->ofield_names[i]);
-        if ((ret = write_file_entry(tar, entry, path, cons->root, toc_file)))
+    if (!(m = calloc(1, sizeof(struct package_member))))
+        return TDB_ERR_NOMEM;
+    if (!(m->fname = strdup(fname))){
+        free(m);
+        return TDB_ERR_NOMEM;
+    }
+
+    m->size = size;
+    if (idx >= 0){
+        /* header files are small and have a slot of their own */
+        m->is_header_file = 1;
+        m->header_offset = (uint64_t)idx * 2 * TAR_BLOCK_SIZE;
+        m->offset = m->header_offset + TAR_BLOCK_SIZE;
+    }else{
+        if (pkg->has_unsized_member){
+            debug_print("can't open %s while a file is growing\n", fname);
+            ret = TDB_ERR_IO_PACKAGE;
             goto done;
+        }
+        m->header_offset = pkg->end;
+        m->offset = pkg->end + header_size(fname);
+
+        /*
+        align the data of large sections, so that they can be mapped
+        with huge pages. Sections smaller than the alignment are not
+        worth the padding.
+        */
+        if (pkg->alignment > TAR_BLOCK_SIZE &&
+            is_aligned_file(fname) &&
+            size >= pkg->alignment){
+
+            const uint64_t mask = pkg->alignment - 1;
+            const uint64_t gap = ((m->offset + mask) & ~mask) - m->offset;
+            if (gap){
+                if ((ret = write_padding(pkg, pkg->end, gap)))
+                    goto done;
+                m->header_offset += gap;
+                m->offset += gap;
+            }
+        }
+        if (size == TDB_CONS_UNKNOWN_SIZE)
+            pkg->has_unsized_member = 1;
+        else
+            pkg->end = m->offset + tar_blocks(size);
+    }
+
+    /*
+    each member gets a stream of its own, so that members of
+    a known size can be written concurrently
+    */
+    if (!(m->file = fopen(pkg->path, "r+"))){
+        ret = TDB_ERR_IO_OPEN;
+        goto done;
+    }
+    if (fseek(m->file, (long)m->offset, SEEK_SET) == -1){
+        ret = TDB_ERR_IO_PACKAGE;
+        goto done;
     }
+
+    m->next = pkg->open_members;
+    pkg->open_members = m;
+    *out = m->file;
+    return 0;
 done:
+    if (m->file)
+        fclose(m->file);
+    free(m->fname);
+    free(m);
     return ret;
 }
 
-static tdb_error write_tar_toc(int fd,
-                               FILE *toc_file,
-                               uint64_t toc_offset,
-                               uint64_t toc_max_size)
+tdb_error cons_package_fclose(tdb_cons *cons, FILE *file)
 {
-    /*
-    we rewind back to the position of the TOC_FILE and actually
-    fill in the contents of the file
-    */
-    const uint64_t BUFFER_SIZE = 65536;
-    char buffer[BUFFER_SIZE];
-    uint64_t n, i, toc_size;
+    struct tdb_cons_package *pkg = cons->package;
+    struct package_member **prev = &pkg->open_members;
+    struct package_member *m;
     int ret = 0;
-    long offset;
-    /* find an empty line denoting EOF in toc_file */
-    TDB_FPRINTF(toc_file, "\n");
-    if ((offset = ftell(toc_file)) == -1){
-        debug_print("ftell(toc_file) failed\n");
-        ret = TDB_ERR_IO_PACKAGE;
+    long pos;
+
+    for (m = pkg->open_members; m && m->file != file; m = m->next)
+        prev = &m->next;
+    if (!m)
+        return TDB_ERR_IO_PACKAGE;
+    *prev = m->next;
+
+    /* unsized members are written sequentially: their size is the position */
+    pos = ftell(m->file);
+    if (fclose(m->file)){
+        ret = TDB_ERR_IO_CLOSE;
         goto done;
     }
-    toc_size = (uint64_t)offset;
-
-    /* assert that our max_size estimate is not broken */
-    if (toc_size > toc_max_size){
-        debug_print("assert failed: toc_size %"PRIu64" > %"PRIu64"\n",
-                    toc_size,
-                    toc_max_size);
+    if (pos == -1){
         ret = TDB_ERR_IO_PACKAGE;
         goto done;
     }
-    rewind(toc_file);
 
-    if (lseek(fd, (off_t)toc_offset, SEEK_SET) != (off_t)toc_offset){
-        debug_print("lseek(fd) failed\n");
+    if (m->size == TDB_CONS_UNKNOWN_SIZE){
+        m->size = (uint64_t)pos - m->offset;
+        if (!m->is_header_file){
+            pkg->end = m->offset + tar_blocks(m->size);
+            pkg->has_unsized_member = 0;
+        }
+    }else if ((uint64_t)pos != m->offset + m->size){
+        /*
+        a member larger than its region has overwritten the next one,
+        a smaller one would leave garbage in the package
+        */
+        debug_print("file %s has size %"PRIu64", expected %"PRIu64"\n",
+                    m->fname,
+                    (uint64_t)pos - m->offset,
+                    m->size);
         ret = TDB_ERR_IO_PACKAGE;
         goto done;
     }
-
-    for (n = 0; n < toc_size;){
-        size_t r = fread(buffer, 1, BUFFER_SIZE, toc_file);
-        if (r < 1){
-            debug_print("fread() toc_file failed\n");
-            ret = TDB_ERR_IO_READ;
+    if (m->is_header_file){
+        if (m->size > TAR_BLOCK_SIZE){
+            debug_print("header file %s is too large\n", m->fname);
+            ret = TDB_ERR_IO_PACKAGE;
             goto done;
         }
-        for (i = 0; i < r;){
-            ssize_t w = write(fd, &buffer[i], r - i);
-            if (w < 1){
-                debug_print("write(fd) failed\n");
-                ret = TDB_ERR_IO_PACKAGE;
-                goto done;
-            }
-            i += (uint64_t)w;
-        }
-        n += r;
+        ++pkg->num_header_files;
     }
 
+    if ((ret = write_header(pkg, m->header_offset, m->fname, m->size)))
+        goto done;
+    ret = add_toc_entry(pkg, m->fname, m->offset, m->size);
 done:
+    free(m->fname);
+    free(m);
     return ret;
 }
 
-tdb_error cons_package(const tdb_cons *cons)
+static tdb_error write_toc(struct tdb_cons_package *pkg)
 {
-    char dst_path[TDB_MAX_PATH_SIZE];
-    char path[TDB_MAX_PATH_SIZE];
-    struct archive *tar = NULL;
-    int fd = 0;
+    /* see tdb_package.h for the binary TOC format */
+    struct pkg_toc_entry *files;
+    uint64_t *header, *slots;
+    char *buf, *names;
+    uint64_t i, size, num_slots, names_size = 0;
     int ret = 0;
-    FILE *toc_file;
-    struct archive_entry *entry = archive_entry_new();
-    uint64_t toc_offset = 0;
-    uint64_t toc_max_size = 0;
 
-    if (!entry)
-        return TDB_ERR_NOMEM;
-
-    /* 1) open archive */
+    for (i = 0; i < pkg->toc_len; i++)
+        names_size += strlen(pkg->toc[i].fname);
 
-    if (!(tar = archive_write_new())){
-        debug_print("archive_write_new() failed\n");
-        ret = TDB_ERR_NOMEM;
-        goto done;
-    }
-    if (archive_write_set_format_gnutar(tar) != ARCHIVE_OK){
-        debug_print("archive_write_set_format_gnutar() failed\n");
-        ret = TDB_ERR_IO_PACKAGE;
-        goto done;
-    }
-    TDB_PATH(dst_path, "%s.tdb.XXXXXX", cons->root);
-    if ((fd = mkstemp(dst_path)) == -1){
-        debug_print("mkstemp(%s) failed\n", dst_path);
-        ret = TDB_ERR_IO_PACKAGE;
-        goto done;
+    /* assert that our max_size estimate is not broken */
+    if ((size = toc_size(pkg->toc_len, names_size)) > pkg->toc_max_size){
+        debug_print("assert failed: toc_size %"PRIu64" > %"PRIu64"\n",
+                    size,
+                    pkg->toc_max_size);
+        return TDB_ERR_IO_PACKAGE;
     }
-    if (archive_write_open_fd(tar, fd) != ARCHIVE_OK){
-        debug_print("archive_write_open_fd(%s) failed\n", dst_path);
-        ret = TDB_ERR_IO_PACKAGE;
-        goto done;
+    if (!(buf = calloc(1, size)))
+        return TDB_ERR_NOMEM;
+
+    num_slots = pkg_toc_num_slots(pkg->toc_len);
+    memcpy(buf, TDB_TAR_MAGIC_V2, strlen(TDB_TAR_MAGIC_V2));
+    header = (uint64_t*)&buf[TOC_MAGIC_SIZE];
+    header[0] = pkg->toc_len;
+    header[1] = num_slots;
+    header[2] = names_size;
+    slots = (uint64_t*)&buf[TOC_HEADER_SIZE];
+    files = (struct pkg_toc_entry*)&slots[num_slots];
+    names = (char*)&files[pkg->toc_len];
+
+    for (names_size = 0, i = 0; i < pkg->toc_len; i++){
+        const uint64_t len = strlen(pkg->toc[i].fname);
+        uint64_t slot = pkg_toc_hash(pkg->toc[i].fname, len) & (num_slots - 1);
+
+        memcpy(&names[names_size], pkg->toc[i].fname, len);
+        files[i].name_offset = names_size;
+        files[i].name_len = len;
+        files[i].offset = pkg->toc[i].offset;
+        files[i].size = pkg->toc[i].size;
+        names_size += len;
+
+        /* file names are unique, so we only need to find an empty slot */
+        while (slots[slot])
+            slot = (slot + 1) & (num_slots - 1);
+        slots[slot] = i + 1;
     }
 
-    /* open TOC_FILE */
-    TDB_PATH(path, "%s/%s", cons->root, TOC_FILE);
-    TDB_OPEN(toc_file, path, "w+");
-    TDB_FPRINTF(toc_file, TDB_TAR_MAGIC);
-
-    /* 2) write header files */
-    if ((ret = write_entries(tar,
-                             entry,
-                             HEADER_FILES,
-                             sizeof(HEADER_FILES) / sizeof(HEADER_FILES[0]),
-                             cons,
-                             toc_file)))
-        goto done;
+    ret = pwrite_all(pkg->fd, buf, size, TOC_FILE_OFFSET);
+    free(buf);
+    return ret;
+}
 
-    /* 3) write tar toc */
-    if ((ret = init_tar_toc(tar,
-                            entry,
-                            cons,
-                            toc_file,
-                            &toc_offset,
-                            &toc_max_size)))
-        goto done;
+tdb_error cons_package_close(tdb_cons *cons)
+{
+    struct tdb_cons_package *pkg = cons->package;
+    char path[TDB_MAX_PATH_SIZE];
+    uint64_t size;
+    int ret = 0;
 
-    /* 4) write lexicons */
-    if ((ret = write_lexicons(tar, entry, cons, toc_file)))
+    if (pkg->open_members ||
+        pkg->num_header_files != sizeof(HEADER_FILES) / sizeof(HEADER_FILES[0])){
+        debug_print("package is incomplete\n");
+        ret = TDB_ERR_IO_PACKAGE;
         goto done;
+    }
 
-    /* 5) write data */
-    if ((ret = write_entries(tar,
-                             entry,
-                             DATA_FILES,
-                             sizeof(DATA_FILES) / sizeof(DATA_FILES[0]),
-                             cons,
-                             toc_file)))
+    /* the TOC is written last, when all offsets are known */
+    if ((ret = write_toc(pkg)))
         goto done;
 
-    /* 6) finalize archive */
-    if (archive_write_free(tar) != ARCHIVE_OK){
+    /*
+    a tar archive ends with two empty blocks, padded to a full record.
+    The file doesn't have any data at this point, so we can just extend it.
+    */
+    size = pkg->end + 2 * TAR_BLOCK_SIZE;
+    size = ((size + TAR_RECORD_SIZE - 1) / TAR_RECORD_SIZE) * TAR_RECORD_SIZE;
+    if (ftruncate(pkg->fd, (off_t)size)){
         ret = TDB_ERR_IO_PACKAGE;
-        /* don't call archive_write_free twice */
-        tar = NULL;
         goto done;
     }
-    tar = NULL;
-
-    /* 7) write toc */
-    if ((ret = write_tar_toc(fd, toc_file, toc_offset, toc_max_size)))
-        goto done;
-
-    /* delete TOC_FILE */
-    fclose(toc_file);
-    unlink(path);
 
     /* fsync() is required to ensure integrity of the package */
-    if (fsync(fd)){
+    if (fsync(pkg->fd)){
         debug_print("fsync failed\n");
         ret = TDB_ERR_IO_CLOSE;
         goto done;
     }
 
-    if (close(fd)){
+    if (close(pkg->fd)){
         debug_print("close failed\n");
         ret = TDB_ERR_IO_CLOSE;
         /* never call close() twice, even if it fails */
-        fd = 0;
+        pkg->fd = -1;
         goto done;
     }
+    pkg->fd = -1;
 
-    fd = 0;
-
-    /* 9) rename archive */
     TDB_PATH(path, "%s.tdb", cons->root);
-    if (rename(dst_path, path)){
-        debug_print("rename to %s -> %s failed\n", dst_path, path);
+    if (rename(pkg->path, path)){
+        debug_print("rename to %s -> %s failed\n", pkg->path, path);
         ret = TDB_ERR_IO_CLOSE;
         goto done;
     }
+    pkg->path[0] = 0;
 
     /*
     rmdir() failing (most often because the directory is not empty), is not
@@ -437,17 +592,31 @@ tdb_error cons_package(const tdb_cons *cons)
     */
     if (rmdir(cons->root))
         debug_print("rmdir(%s) failed\n", cons->root);
-
 done:
-    archive_entry_free(entry);
-
-    if (fd)
-        close(fd);
-    if (tar){
-        if (archive_write_free(tar) != ARCHIVE_OK)
-            ret = TDB_ERR_IO_PACKAGE;
-    }
     return ret;
 }
 
-#endif /* HAVE_ARCHIVE_H */
+void cons_package_free(tdb_cons *cons)
+{
+    struct tdb_cons_package *pkg = cons->package;
+    if (pkg){
+        uint64_t i;
+        while (pkg->open_members){
+            struct package_member *m = pkg->open_members;
+            pkg->open_members = m->next;
+            fclose(m->file);
+            free(m->fname);
+            free(m);
+        }
+        for (i = 0; i < pkg->toc_len; i++)
+            free(pkg->toc[i].fname);
+        free(pkg->toc);
+        if (pkg->fd != -1)
+            close(pkg->fd);
+        /* remove an unfinished package */
+        if (pkg->path[0])
+            unlink(pkg->path);
+        free(pkg);
+        cons->package = NULL;
+    }
+}
@@ -1,17 +1,19 @@
+#define _DEFAULT_SOURCE /* madvise() */
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
 #include "tdb_internal.h"
 #include "tdb_huffman.h"
+#include "tdb_cache.h"
+#include "tdb_pread.h"
+#include "tdb_compress.h"
 
 #define CURSOR_FILTER 1
 #define TRAIL_FILTER 2
 
-static inline uint64_t tdb_get_trail_offs(const tdb *db, uint64_t trail_id)
-{
-    if (db->trails.size < UINT32_MAX)
-        return ((const uint32_t*)db->toc.data)[trail_id];
-    else
-        return ((const uint64_t*)db->toc.data)[trail_id];
-}
-
 static int event_satisfies_filter(const tdb_item *event,
                                   uint64_t timestamp,
                                   const tdb_item *filter,
@@ -60,6 +62,168 @@ static int event_satisfies_filter(const tdb_item *event,
     return 1;
 }
 
+/*
+A clause that consists of time ranges only can't match any event of a
+trail if none of the ranges overlaps the timestamps of the trail, so the
+trail can be skipped without decoding it.
+*/
+static int trail_may_satisfy_filter(const tdb *db,
+                                    uint64_t trail_id,
+                                    const struct tdb_event_filter *filter)
+{
+    const tdb_item *items = filter->items;
+    tdb_trail_meta meta;
+    uint64_t i = 0;
+
+    if (!db->trail_meta.data || (filter->options & TDB_FILTER_MATCH_ALL))
+        return 1;
+
+    tdb_trail_meta_read(db, trail_id, &meta);
+    while (i < filter->count){
+        uint64_t next_clause = i + 1 + items[i];
+        int has_items = 0;
+        int overlaps = 0;
+
+        if (next_clause > filter->count)
+            return 1;
+
+        for (++i; i < next_clause; i += 2){
+            if (items[i] & TDB_EVENT_TIME_RANGE){
+                if (items[i + 1] <= meta.max_timestamp &&
+                    meta.min_timestamp < items[i + 2])
+                    overlaps = 1;
+                ++i;
+            }else
+                has_items = 1;
+        }
+        if (!has_items && !overlaps)
+            return 0;
+        i = next_clause;
+    }
+    return 1;
+}
+
+static tdb_error init_trail_state(tdb_cursor *cursor, uint64_t trail_id)
+{
+    struct tdb_decode_state *s = cursor->state;
+    const tdb *db = s->db;
+    const uint64_t start = tdb_get_trail_offs(db, trail_id);
+    const uint64_t end = tdb_get_trail_offs(db, trail_id + 1);
+    tdb_field field;
+    tdb_error err;
+
+    /*
+    edge encoding: some fields may be inherited from previous events.
+    Keep track what we have seen in the past. Start with NULL values.
+    */
+    for (field = 1; field < db->num_fields; field++)
+        s->previous_items[field] = tdb_make_item(field, 0);
+
+    if (db->compressed){
+        if ((err = tdb_compressed_trail(db, s, start, end)))
+            return err;
+    }else if (db->pread){
+        if ((err = tdb_pread_trail(db, s, start, end)))
+            return err;
+    }else
+        s->data = &db->trails.data[start];
+    s->size = 8 * (end - start) - read_bits(s->data, 0, 3);
+    s->offset = 3;
+    s->tstamp = db->min_timestamp;
+
+    s->trail_id = trail_id;
+    cursor->num_events_left = 0;
+    cursor->next_event = s->events_buffer;
+    return 0;
+}
+
+/*
+Decode the full trail, batch by batch, to a new cache entry that uses
+the same [ timestamp | num_items | items ... ] layout as events_buffer,
+so cursors can return events directly from the entry.
+
+Returns NULL if the decoded trail is larger than the cache. Note that
+this consumes the cursor.
+*/
+static struct tdb_cache_entry *decode_trail(tdb_cursor *cursor,
+                                            struct tdb_cache *cache,
+                                            uint64_t trail_id)
+{
+    const uint64_t max_size = tdb_cache_max_size(cache);
+    struct tdb_cache_entry *e, *new_e;
+    uint64_t size = 0;
+    uint64_t alloc_size = 0;
+    uint64_t num_events = 0;
+
+    if (!max_size)
+        return NULL;
+
+    if (!(e = tdb_cache_entry_new(trail_id, 0)))
+        return NULL;
+
+    while (_tdb_cursor_next_batch(cursor)){
+        uint64_t i, batch_size = 0;
+
+        for (i = 0; i < cursor->num_events_left; i++){
+            const tdb_event *ev =
+                (const tdb_event*)&cursor->next_event[batch_size];
+            batch_size += sizeof(tdb_event) +
+                          ev->num_items * sizeof(tdb_item);
+        }
+
+        if (size + batch_size > max_size)
+            goto fail;
+
+        if (size + batch_size > alloc_size){
+            alloc_size = size + batch_size > alloc_size * 2 ?
+                         size + batch_size: alloc_size * 2;
+            if (!(new_e = tdb_cache_entry_resize(e, alloc_size)))
+                goto fail;
+            e = new_e;
+        }
+
+        memcpy(&e->data[size], cursor->next_event, batch_size);
+        size += batch_size;
+        num_events += cursor->num_events_left;
+    }
+
+    if (!(new_e = tdb_cache_entry_resize(e, size)))
+        goto fail;
+
+    new_e->value = num_events;
+    return new_e;
+fail:
+    tdb_cache_release(cache, e);
+    return NULL;
+}
+
+static tdb_error get_cached_trail(tdb_cursor *cursor, uint64_t trail_id)
+{
+    struct tdb_decode_state *s = cursor->state;
+    struct tdb_cache *cache = s->db->trail_cache;
+    struct tdb_cache_entry *e;
+
+    if (!(e = tdb_cache_get(cache, trail_id))){
+        if ((e = decode_trail(cursor, cache, trail_id)))
+            tdb_cache_put(cache, e);
+        else{
+            /* the trail can't be cached, decode it as usual */
+            return init_trail_state(cursor, trail_id);
+        }
+    }
+
+    /*
+    return events directly from the cache entry. The cursor holds a
+    reference to the entry until the next tdb_get_trail() call, so it
+    stays valid even if it is evicted meanwhile.
+    */
+    s->cached_trail = e;
+    s->size = s->offset = 0;
+    cursor->next_event = e->data;
+    cursor->num_events_left = e->value;
+    return 0;
+}
+
 
 TDB_EXPORT tdb_cursor *tdb_cursor_new(const tdb *db)
 {
@@ -95,6 +259,20 @@ err:
 TDB_EXPORT void tdb_cursor_free(tdb_cursor *c)
 {
     if (c){
+        if (c->state->cached_trail)
+            tdb_cache_release(c->state->db->trail_cache,
+                              c->state->cached_trail);
+        /*
+        db is not accessed unless the cursor holds a block, so a cursor
+        can be freed after tdb_close() as before
+        */
+        if (c->state->trail_block){
+            if (c->state->db->compressed)
+                tdb_compressed_release(c->state->db, c->state);
+            else
+                tdb_pread_release(c->state->db, c->state);
+        }
+        free(c->state->trail_buf);
         free(c->state->events_buffer);
         free(c->state);
         free(c);
@@ -126,12 +304,14 @@ TDB_EXPORT tdb_error tdb_get_trail(tdb_cursor *cursor,
     const tdb *db = s->db;
     tdb_error err = 0;
 
+    if (s->cached_trail){
+        tdb_cache_release(db->trail_cache, s->cached_trail);
+        s->cached_trail = NULL;
+    }
+
     if (trail_id < db->num_trails){
         /* initialize cursor for a new trail */
 
-        uint64_t trail_size;
-        tdb_field field;
-
         /*
         db->opt_event_filter may have changed since the last
         tdb_get_trail call, so we will always reset it. Also
@@ -180,50 +360,208 @@ TDB_EXPORT tdb_error tdb_get_trail(tdb_cursor *cursor,
             }
         }
 
-        if (s->filter && (s->filter->options & TDB_FILTER_MATCH_NONE)){
+        if ((s->filter && (s->filter->options & TDB_FILTER_MATCH_NONE)) ||
+            tdb_trail_is_deleted(db, trail_id) ||
+            (s->filter && !trail_may_satisfy_filter(db, trail_id, s->filter))){
             /*
-            no need to evaluate anything if the filter matches nothing
+            no need to evaluate anything if the filter matches nothing,
+            the trail has been deleted, or it is outside the time ranges
+            of the filter
             */
             err = 0;
             goto done;
         }else{
-            /*
-            edge encoding: some fields may be inherited from previous events.
-            Keep track what we have seen in the past. Start with NULL values.
-            */
-            for (field = 1; field < db->num_fields; field++)
-                s->previous_items[field] = tdb_make_item(field, 0);
-
-            s->data = &db->trails.data[tdb_get_trail_offs(db, trail_id)];
-            trail_size = tdb_get_trail_offs(db, trail_id + 1) -
-                         tdb_get_trail_offs(db, trail_id);
-            s->size = 8 * trail_size - read_bits(s->data, 0, 3);
-            s->offset = 3;
-            s->tstamp = db->min_timestamp;
-
-            s->trail_id = trail_id;
-            cursor->num_events_left = 0;
-            cursor->next_event = s->events_buffer;
+            if ((err = init_trail_state(cursor, trail_id)))
+                goto done;
+            if (db->trail_cache && !s->filter && !s->edge_encoded)
+                if ((err = get_cached_trail(cursor, trail_id)))
+                    goto done;
             return 0;
         }
     }else
         err = TDB_ERR_INVALID_TRAIL_ID;
 done:
+    tdb_cursor_clear(cursor);
+    return err;
+}
+
+/* leave the cursor without events, like at the end of a trail */
+void tdb_cursor_clear(tdb_cursor *cursor)
+{
+    struct tdb_decode_state *s = cursor->state;
+
+    if (s->cached_trail){
+        tdb_cache_release(s->db->trail_cache, s->cached_trail);
+        s->cached_trail = NULL;
+    }
     cursor->num_events_left = 0;
     cursor->next_event = NULL;
     s->size = 0;
     s->offset = 0;
-    return err;
+}
+
+/*
+Page faults block, so a cursor that jumps between trails reads one page
+at a time. MADV_WILLNEED starts reading pages in the background instead,
+which allows many reads to be in flight. Trails that are adjacent in
+memory are merged to a single range.
+*/
+static void readahead_flush(struct trail_readahead *ra)
+{
+    const tdb *db = ra->db;
+
+    if (ra->start < ra->end){
+        uint64_t start = ra->start;
+        uint64_t end = ra->end;
+
+        /* read the blocks that contain the trails */
+        if (db->compressed)
+            tdb_compressed_range(db->compressed, start, end, &start, &end);
+
+        if (db->pread)
+            tdb_pread_advise(db->pread, start, end, POSIX_FADV_WILLNEED);
+        else{
+            const uintptr_t page_mask = (uintptr_t)getpagesize() - 1;
+            const uintptr_t addr =
+                (uintptr_t)&db->trails.data[start] & ~page_mask;
+            madvise((void*)addr,
+                    (uintptr_t)&db->trails.data[end] - addr,
+                    MADV_WILLNEED);
+        }
+        ++ra->num_flushed;
+    }
+    ra->start = ra->end = 0;
+}
+
+static void readahead_add(struct trail_readahead *ra,
+                          const tdb *db,
+                          uint64_t trail_id)
+{
+    /* merge ranges that are at most a page apart */
+    const uint64_t gap = (uint64_t)getpagesize();
+    const uint64_t start = tdb_get_trail_offs(db, trail_id);
+    const uint64_t end = tdb_get_trail_offs(db, trail_id + 1);
+
+    if (ra->db == db &&
+        ra->start < ra->end &&
+        start <= ra->end + gap &&
+        end + gap >= ra->start){
+
+        ra->start = start < ra->start ? start: ra->start;
+        ra->end = end > ra->end ? end: ra->end;
+    }else{
+        if (ra->db)
+            readahead_flush(ra);
+        ra->db = db;
+        ra->start = start;
+        ra->end = end;
+    }
+}
+
+void trail_readahead_cursor(struct trail_readahead *ra,
+                            const tdb_cursor *cursor)
+{
+    const struct tdb_decode_state *s = cursor->state;
+
+    /* nothing to read if the trail was cached or it is consumed */
+    if (!s->cached_trail && s->offset < s->size)
+        readahead_add(ra, s->db, s->trail_id);
+}
+
+void trail_readahead_finish(struct trail_readahead *ra)
+{
+    /*
+    a single range of trails is read sequentially, so the kernel reads
+    it ahead without advice. The system call would cost more than it saves
+    when trails are short.
+    */
+    if (ra->num_flushed)
+        readahead_flush(ra);
+}
+
+TDB_EXPORT tdb_error tdb_prefetch_trails(const tdb *db,
+                                         const uint64_t *trail_ids,
+                                         uint64_t num_trails)
+{
+    struct trail_readahead ra;
+    uint64_t i;
+
+    memset(&ra, 0, sizeof(ra));
+    for (i = 0; i < num_trails; i++)
+        /* e.g. TDB_UNKNOWN_TRAIL_ID from tdb_get_trail_ids() */
+        if (trail_ids[i] < db->num_trails &&
+            !tdb_trail_is_deleted(db, trail_ids[i]))
+            readahead_add(&ra, db, trail_ids[i]);
+    if (ra.db)
+        readahead_flush(&ra);
+    return 0;
 }
 
 TDB_EXPORT uint64_t tdb_get_trail_length(tdb_cursor *cursor)
 {
-    uint64_t count = 0;
+    struct tdb_decode_state *s = cursor->state;
+    uint64_t count;
+
+    /*
+    the length of an unfiltered trail that hasn't been read yet is
+    known without decoding it, see init_trail_state()
+    */
+    if (s->db->trail_meta.data &&
+        !s->filter &&
+        s->offset == 3 &&
+        !cursor->num_events_left){
+
+        tdb_trail_meta meta;
+        tdb_trail_meta_read(s->db, s->trail_id, &meta);
+        tdb_cursor_clear(cursor);
+        return meta.num_events;
+    }
+
+    /* events may be available already if the trail was cached */
+    count = cursor->num_events_left;
     while (_tdb_cursor_next_batch(cursor))
         count += cursor->num_events_left;
     return count;
 }
 
+TDB_EXPORT tdb_error tdb_get_trail_meta(const tdb *db,
+                                        uint64_t trail_id,
+                                        tdb_trail_meta *meta)
+{
+    const tdb_event *event;
+    tdb_cursor *cursor;
+    tdb_error err;
+
+    if (trail_id >= db->num_trails)
+        return TDB_ERR_INVALID_TRAIL_ID;
+
+    memset(meta, 0, sizeof(tdb_trail_meta));
+    if (tdb_trail_is_deleted(db, trail_id))
+        return 0;
+
+    if (db->trail_meta.data){
+        tdb_trail_meta_read(db, trail_id, meta);
+        return 0;
+    }
+
+    /*
+    older TrailDBs have no metadata, so the trail is decoded. Filters
+    don't apply, since tdb_get_trail() isn't used.
+    */
+    if (!(cursor = tdb_cursor_new(db)))
+        return TDB_ERR_NOMEM;
+
+    if (!(err = init_trail_state(cursor, trail_id)))
+        while ((event = tdb_cursor_next(cursor))){
+            if (!meta->num_events++)
+                meta->min_timestamp = event->timestamp;
+            meta->max_timestamp = event->timestamp;
+        }
+
+    tdb_cursor_free(cursor);
+    return err;
+}
+
 TDB_EXPORT int _tdb_cursor_next_batch(tdb_cursor *cursor)
 {
     struct tdb_decode_state *s = cursor->state;
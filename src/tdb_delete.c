@@ -0,0 +1,246 @@
+#define _DEFAULT_SOURCE /* getpid() */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "tdb_internal.h"
+#include "tdb_error.h"
+#include "tdb_io.h"
+
+/*
+Deleted trails are marked in the "deleted" sidecar, so deleting trails
+doesn't rewrite the TrailDB:
+
+[ number of trails N ] 8 bytes
+[ bitmap ...         ] (N / 64 + 1) * 8 bytes, bit i is set if trail i
+                       is deleted
+
+Lookups and cursors skip deleted trails, see tdb_trail_is_deleted().
+The trails are dropped physically by tdb_compact().
+*/
+
+static uint64_t deleted_size(const tdb *db)
+{
+    return (db->num_trails / 64 + 1) * 8;
+}
+
+static uint64_t deleted_count(const tdb *db, const uint64_t *deleted)
+{
+    uint64_t i, count = 0;
+    for (i = 0; i < deleted_size(db) / 8; i++)
+        count += (uint64_t)__builtin_popcountll(deleted[i]);
+    return count;
+}
+
+/*
+Read the sidecar at path to deleted, which must be zeroed. A missing
+sidecar means that no trails are deleted.
+*/
+static tdb_error deleted_read(const tdb *db,
+                              const char *path,
+                              uint64_t *deleted)
+{
+    const uint64_t size = deleted_size(db);
+    uint64_t num_trails;
+    FILE *in = NULL;
+    int ret = 0;
+
+    if (!(in = fopen(path, "r"))){
+        if (errno != ENOENT)
+            ret = TDB_ERR_IO_OPEN;
+        goto done;
+    }
+
+    if (fread(&num_trails, 8, 1, in) != 1 ||
+        num_trails != db->num_trails ||
+        fread(deleted, size, 1, in) != 1 ||
+        fgetc(in) != EOF ||
+        deleted[size / 8 - 1] >> (db->num_trails & 63))
+        ret = TDB_ERR_INVALID_DELETIONS_FILE;
+done:
+    if (in)
+        fclose(in);
+    return ret;
+}
+
+/*
+Unlike uuids.order, a broken sidecar can't be ignored: deleted trails
+would appear again
+*/
+tdb_error tdb_deleted_open(tdb *db)
+{
+    char path[TDB_MAX_PATH_SIZE];
+    uint64_t *deleted = NULL;
+    int ret = 0;
+
+    if ((ret = tdb_sidecar_path(db, path, "deleted")))
+        goto done;
+
+    if (!(deleted = calloc(1, deleted_size(db)))){
+        ret = TDB_ERR_NOMEM;
+        goto done;
+    }
+
+    if ((ret = deleted_read(db, path, deleted)))
+        goto done;
+
+    if ((db->num_deleted = deleted_count(db, deleted))){
+        db->deleted = deleted;
+        deleted = NULL;
+    }
+done:
+    free(deleted);
+    return ret;
+}
+
+/* write the sidecar atomically, readers never see a partial file */
+static tdb_error deleted_store(const tdb *db,
+                               const char *path,
+                               const uint64_t *deleted)
+{
+    char tmp_path[TDB_MAX_PATH_SIZE];
+    FILE *out = NULL;
+    int ret = 0;
+
+    TDB_PATH(tmp_path, "%s.tmp.%d", path, (int)getpid());
+
+    TDB_OPEN(out, tmp_path, "w");
+    TDB_WRITE(out, &db->num_trails, 8);
+    TDB_WRITE(out, deleted, deleted_size(db));
+
+    /* out must not be closed again in done, even if fclose fails */
+    ret = fclose(out) ? TDB_ERR_IO_CLOSE: 0;
+    out = NULL;
+    if (!ret && rename(tmp_path, path))
+        ret = TDB_ERR_IO_WRITE;
+    if (ret)
+        unlink(tmp_path);
+done:
+    if (out){
+        fclose(out);
+        unlink(tmp_path);
+    }
+    return ret;
+}
+
+/*
+Deleters serialize on a lock file next to the sidecar and merge their
+deletions with the current sidecar, so that concurrent deleters, in this
+process or others, don't overwrite each other's deletions.
+
+Bits are only ever set, so the bitmap of db is updated in place: cursors
+in other threads see each word either before or after the update, and
+the bitmap is never freed before tdb_close().
+*/
+TDB_EXPORT tdb_error tdb_delete_trails(tdb *db,
+                                       const uint8_t *uuids,
+                                       uint64_t num_uuids)
+{
+    char path[TDB_MAX_PATH_SIZE];
+    char lock_path[TDB_MAX_PATH_SIZE];
+    const uint64_t size = deleted_size(db);
+    uint64_t *trail_ids = NULL;
+    uint64_t *deleted = NULL;
+    uint64_t *current;
+    uint64_t i, num_new = 0;
+    int lock_fd = -1;
+    int ret = 0;
+
+    if (!num_uuids || !db->num_trails)
+        return 0;
+
+    if ((ret = tdb_sidecar_path(db, path, "deleted")) ||
+        (ret = tdb_sidecar_path(db, lock_path, "deleted.lock")))
+        return ret;
+
+    if (!(trail_ids = malloc(num_uuids * 8)) || !(deleted = calloc(1, size))){
+        ret = TDB_ERR_NOMEM;
+        goto done;
+    }
+
+    /* unknown and already deleted UUIDs are ignored */
+    ret = tdb_get_trail_ids(db, uuids, num_uuids, trail_ids);
+    if (ret && ret != TDB_ERR_UNKNOWN_UUID)
+        goto done;
+    ret = 0;
+
+    if ((lock_fd = open(lock_path, O_RDWR | O_CREAT, 0644)) == -1){
+        ret = TDB_ERR_IO_OPEN;
+        goto done;
+    }
+    if (flock(lock_fd, LOCK_EX)){
+        ret = TDB_ERR_IO_OPEN;
+        goto done;
+    }
+
+    /* the sidecar may have changed since db was opened */
+    if ((ret = deleted_read(db, path, deleted)))
+        goto done;
+
+    for (i = 0; i < num_uuids; i++){
+        const uint64_t id = trail_ids[i];
+        if (id != TDB_UNKNOWN_TRAIL_ID &&
+            !(deleted[id >> 6] & (1LLU << (id & 63)))){
+            deleted[id >> 6] |= 1LLU << (id & 63);
+            ++num_new;
+        }
+    }
+    if ((current = db->deleted))
+        for (i = 0; i < size / 8; i++)
+            if (current[i] & ~deleted[i]){
+                deleted[i] |= current[i];
+                ++num_new;
+            }
+
+    /* db changes only if the deletions were persisted */
+    if (num_new && (ret = deleted_store(db, path, deleted)))
+        goto done;
+
+    if (current){
+        for (i = 0; i < size / 8; i++)
+            if (deleted[i] & ~current[i])
+                __atomic_or_fetch(&current[i], deleted[i], __ATOMIC_RELAXED);
+    }else{
+        __atomic_store_n(&db->deleted, deleted, __ATOMIC_RELEASE);
+        deleted = NULL;
+    }
+    __atomic_store_n(&db->num_deleted,
+                     deleted_count(db, db->deleted),
+                     __ATOMIC_RELAXED);
+done:
+    /* closing the descriptor releases the lock */
+    if (lock_fd != -1)
+        close(lock_fd);
+    free(trail_ids);
+    free(deleted);
+    return ret;
+}
+
+TDB_EXPORT uint64_t tdb_num_deleted_trails(const tdb *db)
+{
+    return __atomic_load_n(&db->num_deleted, __ATOMIC_RELAXED);
+}
+
+TDB_EXPORT tdb_error tdb_compact(const tdb *db, const char *root)
+{
+    uint64_t *trail_ids;
+    uint64_t i, num_trails = 0;
+    tdb_error ret;
+
+    if (!(trail_ids = malloc(db->num_trails * 8 + 8)))
+        return TDB_ERR_NOMEM;
+
+    for (i = 0; i < db->num_trails; i++)
+        if (!tdb_trail_is_deleted(db, i))
+            trail_ids[num_trails++] = i;
+
+    ret = cons_extract_trails(db, trail_ids, num_trails, root, 0);
+    free(trail_ids);
+    return ret;
+}
@@ -20,9 +20,13 @@
 #include "tdb_huffman.h"
 #include "tdb_error.h"
 #include "tdb_io.h"
+#include "tdb_compress.h"
 
 #define EDGE_INCREMENT     1000000
 #define GROUPBUF_INCREMENT 1000000
+/* read buffers of merged runs, in events */
+#define RUN_BUFFER_MIN     1024
+#define RUN_BUFFER_MAX     65536
 #define READ_BUFFER_SIZE  (1000000 * sizeof(struct tdb_grouped_event))
 #define WRITE_BUFFER_SIZE (8 * 1024 * 1024)
 
@@ -35,7 +39,8 @@ struct jm_fold_state{
     uint64_t buf_size;
 
     uint64_t trail_id;
-    const struct tdb_cons_event *events;
+    const struct arena *events;
+    const uint64_t num_ofields;
     const uint64_t min_timestamp;
     uint64_t max_timestamp;
     uint64_t max_timedelta;
@@ -55,6 +60,72 @@ static int compare(const void *p1, const void *p2)
     return 0;
 }
 
+static int is_reverse_sorted(const struct tdb_grouped_event *events,
+                             uint64_t num_events)
+{
+    uint64_t i;
+    for (i = 1; i < num_events; i++)
+        if (events[i].timestamp > events[i - 1].timestamp)
+            return 0;
+    return 1;
+}
+
+static void reverse_events(struct tdb_grouped_event *events,
+                           uint64_t num_events)
+{
+    uint64_t i, j;
+    for (i = 0, j = num_events; i + 1 < j; i++, j--){
+        struct tdb_grouped_event tmp = events[i];
+        events[i] = events[j - 1];
+        events[j - 1] = tmp;
+    }
+}
+
+/*
+Delta-encode timestamps of the trail in s->buf, sorted by time, and
+write it to the grouped file.
+*/
+static tdb_error write_trail(struct jm_fold_state *s, uint64_t num_events)
+{
+    uint64_t j, prev_timestamp = s->min_timestamp;
+    int ret = 0;
+
+    for (j = 0; j < num_events; j++){
+        uint64_t timestamp = s->buf[j].timestamp;
+        uint64_t delta = timestamp - prev_timestamp;
+        if (delta < TDB_MAX_TIMEDELTA){
+            if (timestamp > s->max_timestamp)
+                s->max_timestamp = timestamp;
+            if (delta > s->max_timedelta)
+                s->max_timedelta = delta;
+            prev_timestamp = timestamp;
+            /* convert the delta value to a proper item */
+            s->buf[j].timestamp = tdb_make_item(0, delta);
+        }else{
+            ret = TDB_ERR_TIMESTAMP_TOO_LARGE;
+            goto done;
+        }
+    }
+
+    TDB_WRITE(s->grouped_w,
+              s->buf,
+              num_events * sizeof(struct tdb_grouped_event));
+    ++s->trail_id;
+done:
+    return ret;
+}
+
+static tdb_error reserve_groupbuf(struct jm_fold_state *s, uint64_t size)
+{
+    if (size > s->buf_size){
+        s->buf_size += GROUPBUF_INCREMENT;
+        if (!(s->buf = realloc(s->buf,
+                s->buf_size * sizeof(struct tdb_grouped_event))))
+            return TDB_ERR_NOMEM;
+    }
+    return 0;
+}
+
 static void *groupby_uuid_handle_one_trail(
     __uint128_t uuid __attribute__((unused)),
     Word_t *value,
@@ -62,7 +133,8 @@ static void *groupby_uuid_handle_one_trail(
 {
     struct jm_fold_state *s = (struct jm_fold_state*)state;
     /* find the last event belonging to this trail */
-    const struct tdb_cons_event *ev = &s->events[*value - 1];
+    uint64_t idx = *value - 1;
+    const struct tdb_cons_event *ev = arena_get_item(s->events, idx);
     uint64_t j = 0;
     uint64_t num_events = 0;
     int ret = 0;
@@ -73,18 +145,12 @@ static void *groupby_uuid_handle_one_trail(
     /* loop through all events belonging to this trail,
        following back-links */
     while (1){
-        if (j >= s->buf_size){
-            s->buf_size += GROUPBUF_INCREMENT;
-            if (!(s->buf = realloc(s->buf,
-                    s->buf_size * sizeof(struct tdb_grouped_event)))){
-                ret = TDB_ERR_NOMEM;
-                goto done;
-            }
-        }
+        if ((ret = reserve_groupbuf(s, j + 1)))
+            goto done;
         s->buf[j].trail_id = s->trail_id;
-        s->buf[j].item_zero = ev->item_zero;
-        s->buf[j].num_items = ev->num_items;
-        s->buf[j].timestamp = ev->timestamp;
+        s->buf[j].item_zero = idx * s->num_ofields;
+        s->buf[j].num_items = s->num_ofields;
+        s->buf[j].timestamp = tdb_cons_event_timestamp(ev);
 
         /* TODO write a test for an extra long (>2^32) trail */
         if (++j == TDB_MAX_TRAIL_LENGTH){
@@ -92,50 +158,192 @@ static void *groupby_uuid_handle_one_trail(
             goto done;
         }
 
-        if (ev->prev_event_idx)
-            ev = &s->events[ev->prev_event_idx - 1];
+        if ((idx = tdb_cons_event_prev(ev)))
+            ev = arena_get_item(s->events, --idx);
         else
             break;
     }
     num_events = j;
 
     /* sort events of this trail by time */
-    /* TODO make this stable sort */
-    /* TODO this could really benefit from Timsort since raw data
-       is often partially sorted */
-    qsort(s->buf, num_events, sizeof(struct tdb_grouped_event), compare);
+    if (is_reverse_sorted(s->buf, num_events))
+        /*
+        events were added in time order, e.g. by tdb_cons_append(),
+        so the back-links visited them in reverse
+        */
+        reverse_events(s->buf, num_events);
+    else
+        /* TODO make this stable sort */
+        qsort(s->buf, num_events, sizeof(struct tdb_grouped_event), compare);
+
+    ret = write_trail(s, num_events);
+done:
+    s->ret = ret;
+    return s;
+}
 
-    /* delta-encode timestamps */
-    uint64_t prev_timestamp = s->min_timestamp;
-    for (j = 0; j < num_events; j++){
-        uint64_t timestamp = s->buf[j].timestamp;
-        uint64_t delta = timestamp - prev_timestamp;
-        if (delta < TDB_MAX_TIMEDELTA){
-            if (timestamp > s->max_timestamp)
-                s->max_timestamp = timestamp;
-            if (delta > s->max_timedelta)
-                s->max_timedelta = delta;
-            prev_timestamp = timestamp;
-            /* convert the delta value to a proper item */
-            s->buf[j].timestamp = tdb_make_item(0, delta);
-        }else{
-            ret = TDB_ERR_TIMESTAMP_TOO_LARGE;
+struct run_reader{
+    struct tdb_spilled_event *buf;
+    uint64_t buf_size;
+    uint64_t pos;
+    uint64_t num_buffered;
+    /* the next event to read and the end of the run in cons->runs */
+    uint64_t next;
+    uint64_t end;
+};
+
+static inline int spilled_less(const struct tdb_spilled_event *x,
+                               const struct tdb_spilled_event *y)
+{
+    if (x->uuid != y->uuid)
+        return x->uuid < y->uuid;
+    if (x->timestamp != y->timestamp)
+        return x->timestamp < y->timestamp;
+    return x->event_idx < y->event_idx;
+}
+
+static tdb_error run_reader_fill(struct run_reader *r, int fd)
+{
+    uint64_t n = r->end - r->next;
+    uint64_t size, offset = 0;
+
+    if (n > r->buf_size)
+        n = r->buf_size;
+    size = n * sizeof(struct tdb_spilled_event);
+
+    while (offset < size){
+        ssize_t res = pread(fd,
+                            (char*)r->buf + offset,
+                            size - offset,
+                            (off_t)(r->next * sizeof(struct tdb_spilled_event) +
+                                    offset));
+        if (res <= 0)
+            return TDB_ERR_IO_READ;
+        offset += (uint64_t)res;
+    }
+    r->next += n;
+    r->num_buffered = n;
+    r->pos = 0;
+    return 0;
+}
+
+static void heap_sift_down(struct run_reader **heap,
+                           uint64_t num,
+                           uint64_t i)
+{
+    while (1){
+        uint64_t min = i;
+        uint64_t left = i * 2 + 1;
+        uint64_t right = left + 1;
+        if (left < num && spilled_less(&heap[left]->buf[heap[left]->pos],
+                                       &heap[min]->buf[heap[min]->pos]))
+            min = left;
+        if (right < num && spilled_less(&heap[right]->buf[heap[right]->pos],
+                                        &heap[min]->buf[heap[min]->pos]))
+            min = right;
+        if (min == i)
+            return;
+        struct run_reader *tmp = heap[i];
+        heap[i] = heap[min];
+        heap[min] = tmp;
+        i = min;
+    }
+}
+
+/*
+k-way merge of the runs of spilled events, see spill_events() in
+tdb_cons.c. Runs are sorted by (uuid, timestamp, event_idx), so trails
+come out sorted by time and in the same order as cons->trails is folded
+in groupby_uuid_handle_one_trail().
+*/
+static tdb_error merge_runs(const tdb_cons *cons, struct jm_fold_state *s)
+{
+    const int fd = fileno(cons->runs);
+    const uint64_t num_runs = cons->num_runs;
+    struct run_reader *readers = NULL;
+    struct run_reader **heap = NULL;
+    uint64_t i, buf_size, num_heap = 0;
+    uint64_t j = 0;
+    __uint128_t uuid = 0;
+    int ret = 0;
+
+    /* split the memory limit between read buffers */
+    buf_size = cons->memory_limit / num_runs / sizeof(struct tdb_spilled_event);
+    if (buf_size < RUN_BUFFER_MIN)
+        buf_size = RUN_BUFFER_MIN;
+    if (buf_size > RUN_BUFFER_MAX)
+        buf_size = RUN_BUFFER_MAX;
+
+    if (!(readers = calloc(num_runs, sizeof(struct run_reader))) ||
+        !(heap = calloc(num_runs, sizeof(struct run_reader*)))){
+        ret = TDB_ERR_NOMEM;
+        goto done;
+    }
+
+    for (i = 0; i < num_runs; i++){
+        struct run_reader *r = &readers[i];
+        r->next = cons->run_offsets[i];
+        r->end = cons->run_offsets[i + 1];
+        r->buf_size = buf_size;
+        if (r->next == r->end)
+            continue;
+        if (!(r->buf = malloc(buf_size * sizeof(struct tdb_spilled_event)))){
+            ret = TDB_ERR_NOMEM;
             goto done;
         }
+        if ((ret = run_reader_fill(r, fd)))
+            goto done;
+        heap[num_heap++] = r;
     }
+    for (i = num_heap; i > 0; i--)
+        heap_sift_down(heap, num_heap, i - 1);
 
-    TDB_WRITE(s->grouped_w,
-              s->buf,
-              num_events * sizeof(struct tdb_grouped_event));
-    ++s->trail_id;
+    while (num_heap){
+        struct run_reader *r = heap[0];
+        const struct tdb_spilled_event *ev = &r->buf[r->pos];
+
+        if (j && ev->uuid != uuid){
+            if ((ret = write_trail(s, j)))
+                goto done;
+            j = 0;
+        }
+        uuid = ev->uuid;
+
+        if ((ret = reserve_groupbuf(s, j + 1)))
+            goto done;
+        s->buf[j].trail_id = s->trail_id;
+        s->buf[j].item_zero = ev->event_idx * s->num_ofields;
+        s->buf[j].num_items = s->num_ofields;
+        s->buf[j].timestamp = ev->timestamp;
+
+        if (++j == TDB_MAX_TRAIL_LENGTH){
+            ret = TDB_ERR_TRAIL_TOO_LONG;
+            goto done;
+        }
+
+        if (++r->pos == r->num_buffered){
+            if (r->next < r->end){
+                if ((ret = run_reader_fill(r, fd)))
+                    goto done;
+            }else
+                heap[0] = heap[--num_heap];
+        }
+        heap_sift_down(heap, num_heap, 0);
+    }
+    if (j)
+        ret = write_trail(s, j);
 
 done:
-    s->ret = ret;
-    return s;
+    if (readers)
+        for (i = 0; i < num_runs; i++)
+            free(readers[i].buf);
+    free(readers);
+    free(heap);
+    return ret;
 }
 
 static tdb_error groupby_uuid(FILE *grouped_w,
-                              const struct tdb_cons_event *events,
+                              const struct arena *events,
                               tdb_cons *cons,
                               uint64_t *num_trails,
                               uint64_t *max_timestamp,
@@ -144,6 +352,7 @@ static tdb_error groupby_uuid(FILE *grouped_w,
     struct jm_fold_state state = {
         .grouped_w = grouped_w,
         .events = events,
+        .num_ofields = cons->num_ofields,
         .min_timestamp = cons->min_timestamp
     };
 
@@ -151,7 +360,14 @@ static tdb_error groupby_uuid(FILE *grouped_w,
     if (cons->min_timestamp >= TDB_MAX_TIMEDELTA)
         return TDB_ERR_TIMESTAMP_TOO_LARGE;
 
-    j128m_fold(&cons->trails, groupby_uuid_handle_one_trail, &state);
+    /* timestamps of events are truncated to 48 bits, see tdb_internal.h */
+    if (cons->timestamp_too_large)
+        return TDB_ERR_TIMESTAMP_TOO_LARGE;
+
+    if (cons->num_runs)
+        state.ret = merge_runs(cons, &state);
+    else
+        j128m_fold(&cons->trails, groupby_uuid_handle_one_trail, &state);
 
     *num_trails = state.trail_id;
     *max_timestamp = state.max_timestamp;
@@ -188,12 +404,12 @@ tdb_error edge_encode_items(const tdb_item *items,
     return 0;
 }
 
-static tdb_error store_info(const char *path,
-                            uint64_t num_trails,
-                            uint64_t num_events,
-                            uint64_t min_timestamp,
-                            uint64_t max_timestamp,
-                            uint64_t max_timedelta)
+tdb_error cons_store_info(tdb_cons *cons,
+                          uint64_t num_trails,
+                          uint64_t num_events,
+                          uint64_t min_timestamp,
+                          uint64_t max_timestamp,
+                          uint64_t max_timedelta)
 {
     FILE *out = NULL;
     int ret = 0;
@@ -202,7 +418,7 @@ static tdb_error store_info(const char *path,
     bytes, so it occupies a constant amount of space in a
     tar package.
     */
-    TDB_OPEN(out, path, "w");
+    TDB_CONS_OPEN(cons, out, "info", TDB_CONS_UNKNOWN_SIZE);
     TDB_FPRINTF(out,
                 "%"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64"\n",
                 num_trails,
@@ -211,20 +427,81 @@ static tdb_error store_info(const char *path,
                 max_timestamp,
                 max_timedelta);
 done:
-    TDB_CLOSE_FINAL(out);
+    TDB_CONS_CLOSE_FINAL(cons, out);
+    return ret;
+}
+
+static uint32_t bits_needed(uint64_t max_value)
+{
+    return max_value ? 64 - (uint32_t)__builtin_clzll(max_value): 0;
+}
+
+/* meta has absolute timestamps, see tdb_trail_meta_read() */
+tdb_error cons_store_trail_meta(tdb_cons *cons,
+                                const tdb_trail_meta *meta,
+                                uint64_t num_trails,
+                                uint64_t min_timestamp)
+{
+    uint64_t header[] = {num_trails, 64, 64, 64};
+    uint64_t i, offs, size;
+    char *buf = NULL;
+    FILE *out = NULL;
+    int ret = 0;
+
+    if (cons->trail_meta == TDB_OPT_CONS_TRAIL_META_NONE)
+        return 0;
+
+    if (cons->trail_meta == TDB_OPT_CONS_TRAIL_META_PACKED){
+        uint64_t max_events = 0, max_first = 0, max_span = 0;
+        for (i = 0; i < num_trails; i++){
+            const uint64_t first = meta[i].min_timestamp - min_timestamp;
+            const uint64_t span = meta[i].max_timestamp -
+                                  meta[i].min_timestamp;
+            if (meta[i].num_events > max_events)
+                max_events = meta[i].num_events;
+            if (first > max_first)
+                max_first = first;
+            if (span > max_span)
+                max_span = span;
+        }
+        header[1] = bits_needed(max_events);
+        header[2] = bits_needed(max_first);
+        header[3] = bits_needed(max_span);
+    }
+
+    /* write_bits64() may touch 8 bytes past the last record */
+    size = (num_trails * (header[1] + header[2] + header[3]) + 7) / 8 + 8;
+    if (!(buf = calloc(1, size))){
+        ret = TDB_ERR_NOMEM;
+        goto done;
+    }
+    for (offs = 0, i = 0; i < num_trails; i++){
+        write_bits64(buf, offs, meta[i].num_events);
+        offs += header[1];
+        write_bits64(buf, offs, meta[i].min_timestamp - min_timestamp);
+        offs += header[2];
+        write_bits64(buf, offs, meta[i].max_timestamp - meta[i].min_timestamp);
+        offs += header[3];
+    }
+
+    TDB_CONS_OPEN(cons, out, "trails.meta", sizeof(header) + size);
+    TDB_WRITE(out, header, sizeof(header));
+    TDB_WRITE(out, buf, size);
+done:
+    free(buf);
+    TDB_CONS_CLOSE_FINAL(cons, out);
     return ret;
 }
 
-static tdb_error encode_trails(const tdb_item *items,
+static tdb_error encode_trails(tdb_cons *cons,
+                               const tdb_item *items,
                                FILE *grouped,
                                uint64_t num_events,
                                uint64_t num_trails,
                                uint64_t num_fields,
-                               const struct judy_128_map *codemap,
-                               const struct judy_128_map *gram_freqs,
-                               const struct field_stats *fstats,
-                               const char *path,
-                               const char *toc_path)
+                               const struct huff_encoder *encoder,
+                               const struct hash_128_map *bigram_freqs,
+                               const struct field_stats *fstats)
 {
     __uint128_t *grams = NULL;
     tdb_item *prev_items = NULL;
@@ -236,20 +513,26 @@ static tdb_error encode_trails(const tdb_item *items,
     FILE *out = NULL;
     uint64_t file_offs = 0;
     uint64_t *toc = NULL;
+    tdb_trail_meta *meta = NULL;
     struct gram_bufs gbufs;
     struct tdb_grouped_event ev;
     int ret = 0;
     char *write_buf = NULL;
+    struct tdb_block_writer *blocks = NULL;
 
     if ((ret = init_gram_bufs(&gbufs, num_fields)))
         goto done;
 
+    if (cons->compression)
+        if ((ret = tdb_block_writer_new(cons->compression, &blocks)))
+            goto done;
+
     if (!(write_buf = malloc(WRITE_BUFFER_SIZE))){
         ret = TDB_ERR_NOMEM;
         goto done;
     }
 
-    TDB_OPEN(out, path, "w");
+    TDB_CONS_OPEN(cons, out, "trails.data", TDB_CONS_UNKNOWN_SIZE);
     setvbuf(out, write_buf, _IOFBF, WRITE_BUFFER_SIZE);
 
     if (!(buf = calloc(1, buf_size / 8 + 8))){
@@ -268,6 +551,10 @@ static tdb_error encode_trails(const tdb_item *items,
         ret = TDB_ERR_NOMEM;
         goto done;
     }
+    if (!(meta = calloc(num_trails + 1, sizeof(tdb_trail_meta)))){
+        ret = TDB_ERR_NOMEM;
+        goto done;
+    }
 
     rewind(grouped);
     if (num_events)
@@ -282,6 +569,7 @@ static tdb_error encode_trails(const tdb_item *items,
            should ignore. */
         uint64_t offs = 3;
         uint64_t trail_id = ev.trail_id;
+        uint64_t timestamp = cons->min_timestamp;
         uint64_t n, m, trail_size;
 
         toc[trail_id] = file_offs;
@@ -289,6 +577,12 @@ static tdb_error encode_trails(const tdb_item *items,
 
         while (ev.trail_id == trail_id){
 
+            /* timestamps are delta-encoded, see write_trail() */
+            timestamp += tdb_item_val(ev.timestamp);
+            if (!meta[trail_id].num_events++)
+                meta[trail_id].min_timestamp = timestamp;
+            meta[trail_id].max_timestamp = timestamp;
+
             /* 1) produce an edge-encoded set of items for this event */
             if ((ret = edge_encode_items(items,
                                          &encoded,
@@ -301,7 +595,7 @@ static tdb_error encode_trails(const tdb_item *items,
             /* 2) cover the encoded set with a set of unigrams and bigrams */
             if ((ret = choose_grams_one_event(encoded,
                                               n,
-                                              gram_freqs,
+                                              bigram_freqs,
                                               &gbufs,
                                               grams,
                                               &m,
@@ -322,7 +616,7 @@ static tdb_error encode_trails(const tdb_item *items,
             }
 
             /* 3) huffman-encode grams */
-            huff_encode_grams(codemap,
+            huff_encode_grams(encoder,
                               grams,
                               m,
                               buf,
@@ -344,7 +638,11 @@ static tdb_error encode_trails(const tdb_item *items,
         }
 
         /* append trail to the end of file */
-        TDB_WRITE(out, buf, trail_size);
+        if (blocks){
+            if ((ret = tdb_block_writer_add(blocks, out, buf, trail_size)))
+                goto done;
+        }else
+            TDB_WRITE(out, buf, trail_size);
 
         file_offs += trail_size;
         memset(buf, 0, trail_size);
@@ -354,21 +652,35 @@ static tdb_error encode_trails(const tdb_item *items,
        trail length with toc[i + 1] - toc[i]. */
     toc[num_trails] = file_offs;
 
-    /* write an extra 8 null bytes: huffman may require up to 7 when reading */
-    uint64_t zero = 0;
-    TDB_WRITE(out, &zero, 8);
-    file_offs += 8;
-    TDB_CLOSE(out);
+    if (blocks){
+        /* decompressed blocks are padded when they are read */
+        if ((ret = tdb_block_writer_flush(blocks, out)))
+            goto done;
+        TDB_CONS_CLOSE(cons, out);
+        if ((ret = tdb_block_writer_store(blocks, cons)))
+            goto done;
+    }else{
+        /* write an extra 8 null bytes: huffman may require up to 7 when reading */
+        uint64_t zero = 0;
+        TDB_WRITE(out, &zero, 8);
+        file_offs += 8;
+        TDB_CONS_CLOSE(cons, out);
+    }
 
-    TDB_OPEN(out, toc_path, "w");
     size_t offs_size = file_offs < UINT32_MAX ? 4 : 8;
+    TDB_CONS_OPEN(cons, out, "trails.toc", (num_trails + 1) * offs_size);
     for (i = 0; i < num_trails + 1; i++)
         TDB_WRITE(out, &toc[i], offs_size);
+    TDB_CONS_CLOSE(cons, out);
+
+    ret = cons_store_trail_meta(cons, meta, num_trails, cons->min_timestamp);
 
 done:
-    TDB_CLOSE_FINAL(out);
+    TDB_CONS_CLOSE_FINAL(cons, out);
 
+    free(meta);
     free(write_buf);
+    tdb_block_writer_free(blocks);
     free_gram_bufs(&gbufs);
     free(grams);
     free(encoded);
@@ -379,33 +691,31 @@ done:
     return ret;
 }
 
-static tdb_error store_codebook(const struct judy_128_map *codemap,
-                                const char *path)
+static tdb_error store_codebook(tdb_cons *cons,
+                                const struct judy_128_map *codemap)
 {
     FILE *out = NULL;
     uint32_t size;
     struct huff_codebook *book = huff_create_codebook(codemap, &size);
     int ret = 0;
 
-    TDB_OPEN(out, path, "w");
+    TDB_CONS_OPEN(cons, out, "trails.codebook", size);
     TDB_WRITE(out, book, size);
 
 done:
-    TDB_CLOSE_FINAL(out);
+    TDB_CONS_CLOSE_FINAL(cons, out);
     free(book);
     return ret;
 }
 
 tdb_error tdb_encode(tdb_cons *cons, const tdb_item *items)
 {
-    char path[TDB_MAX_PATH_SIZE];
     char grouped_path[TDB_MAX_PATH_SIZE];
-    char toc_path[TDB_MAX_PATH_SIZE];
     char *root = cons->root;
     char *read_buf = NULL;
     struct field_stats *fstats = NULL;
     uint64_t num_trails = 0;
-    uint64_t num_events = cons->events.next;
+    uint64_t num_events = cons->num_spilled_events + cons->events.next;
     uint64_t num_fields = cons->num_ofields + 1;
     uint64_t max_timestamp = 0;
     uint64_t max_timedelta = 0;
@@ -414,6 +724,8 @@ tdb_error tdb_encode(tdb_cons *cons, const tdb_item *items)
     Pvoid_t unigram_freqs = NULL;
     struct judy_128_map gram_freqs;
     struct judy_128_map codemap;
+    struct hash_128_map bigram_freqs;
+    struct huff_encoder encoder;
     Word_t tmp;
     FILE *grouped_w = NULL;
     FILE *grouped_r = NULL;
@@ -422,6 +734,8 @@ tdb_error tdb_encode(tdb_cons *cons, const tdb_item *items)
 
     j128m_init(&gram_freqs);
     j128m_init(&codemap);
+    memset(&bigram_freqs, 0, sizeof(struct hash_128_map));
+    memset(&encoder, 0, sizeof(struct huff_encoder));
 
     if (!(field_cardinalities = calloc(cons->num_ofields, 8))){
         ret = TDB_ERR_NOMEM;
@@ -445,9 +759,9 @@ tdb_error tdb_encode(tdb_cons *cons, const tdb_item *items)
         goto done;
     }
 
-    if (cons->events.data)
+    if (num_events)
         if ((ret = groupby_uuid(grouped_w,
-                                (struct tdb_cons_event*)cons->events.data,
+                                &cons->events,
                                 cons,
                                 &num_trails,
                                 &max_timestamp,
@@ -458,8 +772,7 @@ tdb_error tdb_encode(tdb_cons *cons, const tdb_item *items)
     not the most clean separation of ownership here, but these objects
     can be huge so keeping them around unecessarily is expensive
     */
-    free(cons->events.data);
-    cons->events.data = NULL;
+    arena_free(&cons->events);
     j128m_free(&cons->trails);
 
     TDB_CLOSE(grouped_w);
@@ -476,73 +789,88 @@ tdb_error tdb_encode(tdb_cons *cons, const tdb_item *items)
 
     /* 2. store metatadata */
     TDB_TIMER_START
-    TDB_PATH(path, "%s/info", root);
-    if ((ret = store_info(path,
-                          num_trails,
-                          num_events,
-                          cons->min_timestamp,
-                          max_timestamp,
-                          max_timedelta)))
+    if ((ret = cons_store_info(cons,
+                               num_trails,
+                               num_events,
+                               cons->min_timestamp,
+                               max_timestamp,
+                               max_timedelta)))
         goto done;
     TDB_TIMER_END("trail/info");
 
-    /* 3. collect value (unigram) freqs, including delta-encoded timestamps */
-    TDB_TIMER_START
-    unigram_freqs = collect_unigrams(grouped_r, num_events, items, num_fields);
-    if (num_events > 0 && !unigram_freqs){
-        ret = TDB_ERR_NOMEM;
-        goto done;
-    }
-    TDB_TIMER_END("trail/collect_unigrams");
-
-    /* 4. construct uni/bi-grams */
-    tdb_opt_value dont_build_bigrams;
-    tdb_cons_get_opt(cons, TDB_OPT_CONS_NO_BIGRAMS, &dont_build_bigrams);
+    if (cons->codebook){
+        /* 3-5. skip statistics: use the codebook given to the cons */
+        TDB_TIMER_START
+        if ((ret = huff_read_codebook(cons->codebook, &codemap, &gram_freqs)))
+            goto done;
+        TDB_TIMER_END("trail/read_codebook");
+    }else{
+        /* 3. collect value (unigram) freqs, including delta-encoded timestamps */
+        TDB_TIMER_START
+        unigram_freqs = collect_unigrams(grouped_r, num_events, items, num_fields);
+        if (num_events > 0 && !unigram_freqs){
+            ret = TDB_ERR_NOMEM;
+            goto done;
+        }
+        TDB_TIMER_END("trail/collect_unigrams");
+
+        /* 4. construct uni/bi-grams */
+        tdb_opt_value dont_build_bigrams;
+        tdb_cons_get_opt(cons, TDB_OPT_CONS_NO_BIGRAMS, &dont_build_bigrams);
+
+        TDB_TIMER_START
+        if ((ret = make_grams(grouped_r,
+                              num_events,
+                              items,
+                              num_fields,
+                              unigram_freqs,
+                              &gram_freqs,
+                              dont_build_bigrams.value)))
+            goto done;
+        TDB_TIMER_END("trail/gram_freqs");
 
-    TDB_TIMER_START
-    if ((ret = make_grams(grouped_r,
-                          num_events,
-                          items,
-                          num_fields,
-                          unigram_freqs,
-                          &gram_freqs,
-                          dont_build_bigrams.value)))
-        goto done;
-    TDB_TIMER_END("trail/gram_freqs");
+        /* 5. build a huffman codebook for encoding grams */
+        TDB_TIMER_START
+        if ((ret = huff_create_codemap(&gram_freqs, &codemap)))
+            goto done;
+        TDB_TIMER_END("trail/huff_create_codemap");
+    }
 
-    /* 5. build a huffman codebook and stats struct for encoding grams */
     TDB_TIMER_START
-    if ((ret = huff_create_codemap(&gram_freqs, &codemap)))
-        goto done;
     if (!(fstats = huff_field_stats(field_cardinalities,
                                     num_fields,
                                     max_timedelta))){
         ret = TDB_ERR_NOMEM;
         goto done;
     }
-    TDB_TIMER_END("trail/huff_create_codemap");
+    /* compile the codemap and bigram frequencies to flat tables */
+    if ((ret = huff_encoder_init(&encoder,
+                                 &codemap,
+                                 field_cardinalities,
+                                 num_fields)))
+        goto done;
+    if ((ret = make_bigram_freqs(&gram_freqs, &bigram_freqs)))
+        goto done;
+    j128m_free(&gram_freqs);
+    TDB_TIMER_END("trail/huff_encoder_init");
 
     /* 6. encode and write trails to disk */
     TDB_TIMER_START
-    TDB_PATH(path, "%s/trails.data", root);
-    TDB_PATH(toc_path, "%s/trails.toc", root);
-    if ((ret = encode_trails(items,
+    if ((ret = encode_trails(cons,
+                             items,
                              grouped_r,
                              num_events,
                              num_trails,
                              num_fields,
-                             &codemap,
-                             &gram_freqs,
-                             fstats,
-                             path,
-                             toc_path)))
+                             &encoder,
+                             &bigram_freqs,
+                             fstats)))
         goto done;
     TDB_TIMER_END("trail/encode_trails");
 
     /* 7. write huffman codebook to disk */
     TDB_TIMER_START
-    tdb_path(path, "%s/trails.codebook", root);
-    if ((ret = store_codebook(&codemap, path)))
+    if ((ret = store_codebook(cons, &codemap)))
         goto done;
     TDB_TIMER_END("trail/store_codebook");
 
@@ -551,6 +879,8 @@ done:
     TDB_CLOSE_FINAL(grouped_r);
     j128m_free(&gram_freqs);
     j128m_free(&codemap);
+    h128m_free(&bigram_freqs);
+    huff_encoder_free(&encoder);
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wsign-compare"
     JLFA(tmp, unigram_freqs);
@@ -38,6 +38,7 @@ typedef int (*event_op)(const tdb_item *encoded,
 struct ngram_state{
     Pvoid_t candidates;
     struct judy_128_map ngram_freqs;
+    struct hash_128_map bigram_freqs;
     Pvoid_t final_freqs;
     __uint128_t *grams;
     struct gram_bufs gbufs;
@@ -175,19 +176,38 @@ void free_gram_bufs(struct gram_bufs *b)
     free(b->covered);
 }
 
+static void *bigram_freqs_fun(__uint128_t gram, Word_t *value, void *state)
+{
+    struct hash_128_map *bigram_freqs = (struct hash_128_map*)state;
+    if (HUFF_IS_BIGRAM(gram))
+        h128m_set(bigram_freqs, gram, *value);
+    return bigram_freqs;
+}
+
+/* copy the frequencies of bigrams in gram_freqs to a flat map
+   for choose_grams_one_event() */
+tdb_error make_bigram_freqs(const struct judy_128_map *gram_freqs,
+                            struct hash_128_map *bigram_freqs)
+{
+    int ret = 0;
+    if ((ret = h128m_init(bigram_freqs, j128m_num_keys(gram_freqs))))
+        return ret;
+    j128m_fold(gram_freqs, bigram_freqs_fun, bigram_freqs);
+    return 0;
+}
+
 /* given a set of edge-encoded values (encoded), choose a set of unigrams
    and bigrams that cover the original set. In essence, this tries to
    solve Weigted Exact Cover Problem for the universe of 'encoded'. */
 tdb_error choose_grams_one_event(const tdb_item *encoded,
                                  uint64_t num_encoded,
-                                 const struct judy_128_map *gram_freqs,
+                                 const struct hash_128_map *bigram_freqs,
                                  struct gram_bufs *g,
                                  __uint128_t *grams,
                                  uint64_t *num_grams,
                                  const struct tdb_grouped_event *ev)
 {
     uint64_t i, j, k, n = 0;
-    Word_t *ptr;
     uint64_t unigram1 = ev->timestamp;
     int ret = 0;
 
@@ -218,10 +238,10 @@ tdb_error choose_grams_one_event(const tdb_item *encoded,
         for (;j < num_encoded; j++){
             __uint128_t bigram = unigram1;
             bigram |= ((__uint128_t)encoded[j]) << 64;
-            ptr = j128m_get(gram_freqs, bigram);
-            if (ptr){
+            uint64_t score = h128m_get(bigram_freqs, bigram);
+            if (score){
                 g->chosen[k] = bigram;
-                g->scores[k++] = *ptr;
+                g->scores[k++] = score;
             }
         }
     }
@@ -285,7 +305,7 @@ static tdb_error choose_grams(const tdb_item *encoded,
 
     if ((ret = choose_grams_one_event(encoded,
                                       num_encoded,
-                                      &g->ngram_freqs,
+                                      &g->bigram_freqs,
                                       &g->gbufs,
                                       g->grams,
                                       &n,
@@ -422,6 +442,11 @@ tdb_error make_grams(FILE *grouped,
 
     /* TODO: choose_grams below could also be optimized when !no_bigrams is true. */
 
+    /* choose_grams_one_event() only looks up bigrams */
+    if ((ret = make_bigram_freqs(&g.ngram_freqs, &g.bigram_freqs)))
+        goto done;
+    j128m_free(&g.ngram_freqs);
+
     /* collect frequencies of non-overlapping bigrams and unigrams
        (exact covering set for each event), store in final_freqs */
     TDB_TIMER_START
@@ -436,6 +461,7 @@ done:
     J1FA(tmp, g.candidates);
 #pragma GCC diagnostic pop
     j128m_free(&g.ngram_freqs);
+    h128m_free(&g.bigram_freqs);
     free_gram_bufs(&g.gbufs);
     free(g.grams);
 
@@ -9,6 +9,7 @@
 
 #include "tdb_types.h"
 #include "judy_128_map.h"
+#include "hash_128_map.h"
 
 struct gram_bufs{
     __uint128_t *chosen;
@@ -23,9 +24,12 @@ struct gram_bufs{
 int init_gram_bufs(struct gram_bufs *b, uint64_t num_fields);
 void free_gram_bufs(struct gram_bufs *b);
 
+int make_bigram_freqs(const struct judy_128_map *gram_freqs,
+                      struct hash_128_map *bigram_freqs);
+
 int choose_grams_one_event(const tdb_item *encoded,
                            uint64_t num_encoded,
-                           const struct judy_128_map *gram_freqs,
+                           const struct hash_128_map *bigram_freqs,
                            struct gram_bufs *g,
                            __uint128_t *grams,
                            uint64_t *num_grams,
@@ -39,6 +39,8 @@ typedef enum{
     TDB_ERR_INVALID_TRAILS_FILE = -135,
     TDB_ERR_INVALID_LEXICON_FILE = -136,
     TDB_ERR_INVALID_PACKAGE = -137,
+    TDB_ERR_INVALID_DELETIONS_FILE = -138,
+    TDB_ERR_INVALID_MANIFEST_FILE = -139,
 
     /* tdb_cons */
 
@@ -17,6 +17,10 @@
 
 #define MIN(a,b) ((a)>(b)?(b):(a))
 
+/* limits for the directly indexed unigram codes of huff_encoder */
+#define HUFF_MAX_DENSE_FIELD_SIZE (1LLU << 20)
+#define HUFF_MAX_DENSE_SIZE (1LLU << 24)
+
 struct hnode{
     __uint128_t symbol;
     uint32_t code;
@@ -286,7 +290,85 @@ done:
     return ret;
 }
 
-static inline void encode_gram(const struct judy_128_map *codemap,
+static void *encoder_codes_fun(__uint128_t gram, Word_t *value, void *state)
+{
+    struct huff_encoder *encoder = (struct huff_encoder*)state;
+    const tdb_field field = tdb_item_field(HUFF_BIGRAM_TO_ITEM(gram));
+    const tdb_val val = tdb_item_val(HUFF_BIGRAM_TO_ITEM(gram));
+
+    if (!HUFF_IS_BIGRAM(gram) && val < encoder->field_sizes[field])
+        encoder->unigram_codes[encoder->field_offsets[field] + val] =
+            (uint32_t)*value;
+    else
+        h128m_set(&encoder->codes, gram, *value);
+    return encoder;
+}
+
+int huff_encoder_init(struct huff_encoder *encoder,
+                      const struct judy_128_map *codemap,
+                      const uint64_t *field_cardinalities,
+                      uint64_t num_fields)
+{
+    uint64_t i, total = 0;
+    int ret = 0;
+
+    memset(encoder, 0, sizeof(struct huff_encoder));
+
+    if (!(encoder->field_offsets = calloc(num_fields, 8)) ||
+        !(encoder->field_sizes = calloc(num_fields, 8))){
+        ret = TDB_ERR_NOMEM;
+        goto done;
+    }
+
+    /*
+    timestamp deltas (field 0) may be sparse, so they are always kept in
+    the hash map, as are fields that would make the tables too large
+    */
+    for (i = 1; i < num_fields; i++){
+        const uint64_t size = field_cardinalities[i - 1] + 1;
+        if (size <= HUFF_MAX_DENSE_FIELD_SIZE &&
+            total + size <= HUFF_MAX_DENSE_SIZE){
+            encoder->field_offsets[i] = total;
+            encoder->field_sizes[i] = size;
+            total += size;
+        }
+    }
+
+    if (!(encoder->unigram_codes = calloc(total ? total: 1, 4))){
+        ret = TDB_ERR_NOMEM;
+        goto done;
+    }
+    if ((ret = h128m_init(&encoder->codes, j128m_num_keys(codemap))))
+        goto done;
+    j128m_fold(codemap, encoder_codes_fun, encoder);
+done:
+    if (ret)
+        huff_encoder_free(encoder);
+    return ret;
+}
+
+void huff_encoder_free(struct huff_encoder *encoder)
+{
+    free(encoder->unigram_codes);
+    free(encoder->field_offsets);
+    free(encoder->field_sizes);
+    h128m_free(&encoder->codes);
+    memset(encoder, 0, sizeof(struct huff_encoder));
+}
+
+static inline uint64_t encoder_get(const struct huff_encoder *encoder,
+                                   __uint128_t gram)
+{
+    if (!HUFF_IS_BIGRAM(gram)){
+        const tdb_field field = tdb_item_field(HUFF_BIGRAM_TO_ITEM(gram));
+        const tdb_val val = tdb_item_val(HUFF_BIGRAM_TO_ITEM(gram));
+        if (val < encoder->field_sizes[field])
+            return encoder->unigram_codes[encoder->field_offsets[field] + val];
+    }
+    return h128m_get(&encoder->codes, gram);
+}
+
+static inline void encode_gram(const struct huff_encoder *encoder,
                                __uint128_t gram,
                                char *buf,
                                uint64_t *offs,
@@ -298,22 +380,22 @@ static inline void encode_gram(const struct judy_128_map *codemap,
                                   fstats->field_bits[field];
 
     uint64_t huff_code, huff_bits;
-    Word_t *ptr = j128m_get(codemap, gram);
+    uint64_t code = encoder_get(encoder, gram);
 
-    if (ptr){
+    if (code){
         /* codeword: prefix code by an up bit */
-        huff_code = 1U | (((uint32_t)HUFF_CODE(*ptr)) << 1U);
-        huff_bits = HUFF_BITS(*ptr) + 1;
+        huff_code = 1U | (((uint32_t)HUFF_CODE(code)) << 1U);
+        huff_bits = HUFF_BITS(code) + 1;
     }
 
-    if (ptr && (HUFF_IS_BIGRAM(gram) || huff_bits < literal_bits)){
+    if (code && (HUFF_IS_BIGRAM(gram) || huff_bits < literal_bits)){
         /* write huffman-coded codeword */
         write_bits(buf, *offs, huff_code);
         *offs += huff_bits;
     }else if (HUFF_IS_BIGRAM(gram)){
         /* non-huffman bigrams are encoded as two unigrams */
-        encode_gram(codemap, HUFF_BIGRAM_TO_ITEM(gram), buf, offs, fstats);
-        encode_gram(codemap, HUFF_BIGRAM_OTHER_ITEM(gram), buf, offs, fstats);
+        encode_gram(encoder, HUFF_BIGRAM_TO_ITEM(gram), buf, offs, fstats);
+        encode_gram(encoder, HUFF_BIGRAM_OTHER_ITEM(gram), buf, offs, fstats);
     }else{
         /* write literal:
            [0 (1 bit) | field (field_bits) | value (field_bits[field])]
@@ -328,7 +410,7 @@ static inline void encode_gram(const struct judy_128_map *codemap,
     }
 }
 
-void huff_encode_grams(const struct judy_128_map *codemap,
+void huff_encode_grams(const struct huff_encoder *encoder,
                        const __uint128_t *grams,
                        uint64_t num_grams,
                        char *buf,
@@ -337,7 +419,7 @@ void huff_encode_grams(const struct judy_128_map *codemap,
 {
     uint64_t i = 0;
     for (i = 0; i < num_grams; i++)
-        encode_gram(codemap, grams[i], buf, offs, fstats);
+        encode_gram(encoder, grams[i], buf, offs, fstats);
 }
 
 static void *create_codebook_fun(__uint128_t symbol, Word_t *value, void *state)
@@ -370,6 +452,39 @@ struct huff_codebook *huff_create_codebook(const struct judy_128_map *codemap,
     return book;
 }
 
+/*
+The inverse of huff_create_codebook(): add the codes of book to codemap.
+gram_freqs gets a frequency for each gram that is consistent with the
+length of its code, so choose_grams_one_event() prefers the bigrams with
+the shortest codes.
+*/
+int huff_read_codebook(const struct huff_codebook *book,
+                       struct judy_128_map *codemap,
+                       struct judy_128_map *gram_freqs)
+{
+    uint32_t k;
+    for (k = 0; k < HUFF_CODEBOOK_SIZE; k++){
+        const __uint128_t symbol = book[k].symbol;
+        const uint32_t n = book[k].bits;
+        Word_t *ptr;
+
+        /*
+        a code of n bits fills the slots code | (j << n), see
+        create_codebook_fun(), so the slot of j = 0 is the code
+        */
+        if (!n || n > 16 || k >= (1U << n))
+            continue;
+
+        if (!(ptr = j128m_insert(codemap, symbol)))
+            return TDB_ERR_NOMEM;
+        *ptr = k | (n << 16);
+        if (!(ptr = j128m_insert(gram_freqs, symbol)))
+            return TDB_ERR_NOMEM;
+        *ptr = 1LLU << (16 - n);
+    }
+    return 0;
+}
+
 /*
 this function converts old 64-bit symbols in v0 to new 128-bit
 symbols in v1
@@ -412,7 +527,9 @@ int huff_convert_v0_codebook(struct tdb_file *codebook)
         new[i].bits = old[i].bits;
     }
 
-    munmap(codebook->ptr, codebook->mmap_size);
+    /* the codebook may point to a whole package mapping */
+    if (codebook->ptr)
+        munmap(codebook->ptr, codebook->mmap_size);
     codebook->data = codebook->ptr = p;
     codebook->size = codebook->mmap_size = size;
 
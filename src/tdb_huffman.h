@@ -5,6 +5,7 @@
 #include <stdint.h>
 
 #include "judy_128_map.h"
+#include "hash_128_map.h"
 #include "tdb_types.h"
 #include "tdb_bits.h"
 #include "tdb_internal.h"
@@ -27,12 +28,33 @@ struct field_stats{
     uint32_t field_bits[0];
 };
 
+/*
+The codemap compiled to flat tables for huff_encode_grams(): codes of
+unigrams of fields with a small enough cardinality are indexed directly
+by the value, codes of other grams (timestamp deltas, bigrams, values of
+large fields) are in a hash map.
+*/
+struct huff_encoder{
+    uint32_t *unigram_codes;
+    /* unigram_codes of field are at field_offsets[field] */
+    uint64_t *field_offsets;
+    uint64_t *field_sizes;
+    struct hash_128_map codes;
+};
+
 /* ENCODE */
 
 int huff_create_codemap(const struct judy_128_map *gram_freqs,
                         struct judy_128_map *codemap);
 
-void huff_encode_grams(const struct judy_128_map *codemap,
+int huff_encoder_init(struct huff_encoder *encoder,
+                      const struct judy_128_map *codemap,
+                      const uint64_t *field_cardinalities,
+                      uint64_t num_fields);
+
+void huff_encoder_free(struct huff_encoder *encoder);
+
+void huff_encode_grams(const struct huff_encoder *encoder,
                        const __uint128_t *grams,
                        uint64_t num_grams,
                        char *buf,
@@ -42,6 +64,10 @@ void huff_encode_grams(const struct judy_128_map *codemap,
 struct huff_codebook *huff_create_codebook(const struct judy_128_map *codemap,
                                            uint32_t *size);
 
+int huff_read_codebook(const struct huff_codebook *book,
+                       struct judy_128_map *codemap,
+                       struct judy_128_map *gram_freqs);
+
 struct field_stats *huff_field_stats(const uint64_t *field_cardinalities,
                                      uint64_t num_fields,
                                      uint64_t max_timestamp);
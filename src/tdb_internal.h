@@ -3,6 +3,7 @@
 #define __TDB_INTERNAL_H__
 
 #include <stdint.h>
+#include <pthread.h>
 
 #include <Judy.h>
 
@@ -12,6 +13,8 @@
 #include "judy_128_map.h"
 #include "tdb_profile.h"
 #include "tdb_io.h"
+#include "tdb_cache.h"
+#include "tdb_bits.h"
 
 #define TDB_EXPORT __attribute__((visibility("default")))
 
@@ -22,13 +25,45 @@ Nothing has been tested on 32-bit systems so it is
 better to fail loudly for now.
 */
 
+/*
+Events of tdb_cons are packed in 12 bytes: a 48-bit timestamp and a 48-bit
+back-link to the previous event of the same trail (a 1-based index to
+cons->events, 0 for the first event). Every event has exactly num_ofields
+items, so the items of event i are at i * num_ofields in cons->items and
+they are not stored in the event.
+
+Valid timestamps are less than 2 * TDB_MAX_TIMEDELTA, see groupby_uuid(),
+so 48 bits are enough. Larger timestamps make tdb_cons_finalize() fail.
+*/
+#define TDB_CONS_MAX_TIMESTAMP ((1LLU << 48) - 1)
+
 struct tdb_cons_event{
-    uint64_t item_zero;
-    uint64_t num_items;
-    uint64_t timestamp;
-    uint64_t prev_event_idx;
+    uint32_t timestamp_lo;
+    uint32_t prev_event_idx_lo;
+    /* timestamp in the low 16 bits, prev_event_idx in the high 16 bits */
+    uint32_t hi;
 };
 
+static inline uint64_t tdb_cons_event_timestamp(const struct tdb_cons_event *e)
+{
+    return e->timestamp_lo | ((uint64_t)(e->hi & 65535U) << 32);
+}
+
+static inline uint64_t tdb_cons_event_prev(const struct tdb_cons_event *e)
+{
+    return e->prev_event_idx_lo | ((uint64_t)(e->hi >> 16) << 32);
+}
+
+static inline void tdb_cons_event_set(struct tdb_cons_event *e,
+                                      uint64_t timestamp,
+                                      uint64_t prev_event_idx)
+{
+    e->timestamp_lo = (uint32_t)timestamp;
+    e->prev_event_idx_lo = (uint32_t)prev_event_idx;
+    e->hi = (uint32_t)((timestamp >> 32) & 65535U) |
+            (uint32_t)(((prev_event_idx >> 32) & 65535U) << 16);
+}
+
 #define TDB_FILTER_MATCH_ALL 1
 #define TDB_FILTER_MATCH_NONE 2
 
@@ -83,9 +118,29 @@ struct tdb_decode_state{
 
     int edge_encoded;
 
+    /* decoded trail from db->trail_cache, referenced by next_event */
+    struct tdb_cache_entry *cached_trail;
+
+    /* TDB_OPT_PREAD_CACHE_SIZE: the block or the buffer data points to */
+    struct tdb_cache_entry *trail_block;
+    char *trail_buf;
+    uint64_t trail_buf_size;
+
     tdb_item previous_items[0];
 };
 
+/*
+uuids.index is a prefix table over the sorted UUIDs (see store_uuids()
+in tdb_cons.c). UUIDs are compared as little-endian 128-bit integers,
+so the prefix consists of the most significant bits of the integer.
+*/
+#define TDB_UUID_INDEX_MAX_BITS 24
+
+static inline uint64_t tdb_uuid_prefix(__uint128_t key, uint64_t bits)
+{
+    return bits ? (uint64_t)(key >> (128 - bits)): 0;
+}
+
 struct tdb_grouped_event{
     uint64_t item_zero;
     uint64_t num_items;
@@ -93,6 +148,18 @@ struct tdb_grouped_event{
     uint64_t trail_id;
 };
 
+/*
+Events that exceed TDB_OPT_CONS_MEMORY_LIMIT are written to cons->runs
+in runs sorted by (uuid, timestamp, event_idx). event_idx is the index
+of the event among all events added to the cons, so its items are at
+event_idx * num_ofields in cons->items.
+*/
+struct tdb_spilled_event{
+    __uint128_t uuid;
+    uint64_t timestamp;
+    uint64_t event_idx;
+};
+
 struct _tdb_cons {
     char *root;
     struct arena events;
@@ -101,17 +168,42 @@ struct _tdb_cons {
     char **ofield_names;
 
     uint64_t min_timestamp;
+    /* an event had a timestamp larger than TDB_CONS_MAX_TIMESTAMP */
+    int timestamp_too_large;
     uint64_t num_ofields;
 
+    /*
+    trails maps a UUID to its last event in events or to 0 if all its
+    events have been spilled to runs
+    */
     struct judy_128_map trails;
     struct judy_str_map *lexicons;
+    /* items of the event being added by tdb_cons_add() */
+    tdb_item *event_items;
 
     char tempfile[TDB_MAX_PATH_SIZE];
 
+    /* sorted runs of spilled events, see spill_events() */
+    FILE *runs;
+    char *runs_buffer;
+    uint64_t *run_offsets;
+    uint64_t num_runs;
+    uint64_t num_spilled_events;
+
+    /* encode trails with this codebook, see seed_codebook() */
+    struct huff_codebook *codebook;
+
+    /* output package, only while finalizing */
+    struct tdb_cons_package *package;
+
     /* options */
 
     uint64_t output_format;
     uint64_t no_bigrams;
+    uint64_t package_alignment;
+    uint64_t compression;
+    uint64_t memory_limit;
+    uint64_t trail_meta;
 };
 
 struct tdb_file {
@@ -132,6 +224,39 @@ struct tdb_lexicon {
     const char *data;
 };
 
+/*
+V0 doesn't guarantee that UUIDs are ordered. Trail IDs in the order
+of UUIDs are loaded from the uuids.order sidecar or built lazily on the
+first lookup.
+*/
+struct tdb_uuid_order{
+    pthread_mutex_t lock;
+    const uint64_t *order;
+    struct tdb_file file;
+    uint64_t *buf;
+    int failed;
+};
+
+/*
+Lexicons of TrailDBs that store field cardinalities are mapped on first
+use, see tdb_lexicon_read()
+*/
+struct tdb_lazy_lexicons{
+    pthread_mutex_t lock;
+    uint64_t *cardinalities;
+    /* locations of lexicons in a package */
+    uint64_t *offsets;
+    uint64_t *sizes;
+    /*
+    the package is mapped through a descriptor opened in tdb_open(), so
+    that lexicons don't depend on the path (-1 with a whole package map)
+    */
+    int fd;
+};
+
+struct tdb_pread;
+struct tdb_compressed;
+
 struct _tdb {
     uint64_t min_timestamp;
     uint64_t max_timestamp;
@@ -141,20 +266,42 @@ struct _tdb {
     uint64_t num_fields;
 
     struct tdb_file uuids;
+    struct tdb_file uuid_index;
     struct tdb_file codebook;
     struct tdb_file trails;
+    /* size of the uncompressed trails, offsets in toc refer to these */
+    uint64_t trails_size;
     struct tdb_file toc;
+    /* optional, see tdb_trail_meta_read() */
+    struct tdb_file trail_meta;
+    uint32_t trail_meta_bits[3];
     struct tdb_file *lexicons;
+    struct tdb_lazy_lexicons *lazy_lexicons;
 
     char **field_names;
     struct field_stats *field_stats;
 
+    uint64_t uuid_index_bits;
+
     uint64_t version;
 
+    /* root path of this TrailDB, used to locate sidecar files */
+    char *root;
+    int is_package;
+
+    /* V0 only, see tdb_get_trail_id() */
+    struct tdb_uuid_order *uuid_order;
+
+    /* a bitmap of trails deleted with tdb_delete_trails(), or NULL */
+    uint64_t *deleted;
+    uint64_t num_deleted;
+
     /* tdb_package */
 
     FILE *package_handle;
     void *package_toc;
+    /* the whole package, if TDB_OPT_MMAP_WHOLE_PACKAGE is set */
+    struct tdb_file package;
 
     /* options */
 
@@ -168,9 +315,96 @@ struct _tdb {
     /* trail-level event filters */
     Pvoid_t opt_trail_event_filters;
 
+    /* TDB_OPT_TRAIL_CACHE_SIZE */
+    struct tdb_cache *trail_cache;
+
+    /* TDB_OPT_PREAD_CACHE_SIZE, trails.data is not mapped if set */
+    struct tdb_pread *pread;
+    uint64_t opt_pread_cache_size;
+
+    /* TDB_VERSION_V0_2, see tdb_compress.h */
+    struct tdb_compressed *compressed;
+    /* TDB_OPT_BLOCK_CACHE_SIZE */
+    uint64_t opt_block_cache_size;
+
+    /* TDB_OPT_PERSIST_UUID_ORDER */
+    int opt_persist_uuid_order;
+    /* TDB_OPT_MMAP_HUGEPAGES */
+    int opt_mmap_hugepages;
+    /* TDB_OPT_MMAP_POPULATE */
+    int opt_mmap_populate;
+    /* TDB_OPT_MMAP_WHOLE_PACKAGE */
+    int opt_mmap_whole_package;
+};
+
+/*
+deleted trails are not found by UUID and they have no events. The bitmap
+may be updated by tdb_delete_trails() in another thread.
+*/
+static inline int tdb_trail_is_deleted(const tdb *db, uint64_t trail_id)
+{
+    const uint64_t *deleted = __atomic_load_n(&db->deleted, __ATOMIC_ACQUIRE);
+    return deleted &&
+           (__atomic_load_n(&deleted[trail_id >> 6], __ATOMIC_RELAXED) &
+            (1LLU << (trail_id & 63)));
+}
+
+/* the offset of a trail in the uncompressed trails.data */
+static inline uint64_t tdb_get_trail_offs(const tdb *db, uint64_t trail_id)
+{
+    if (db->trails_size < UINT32_MAX)
+        return ((const uint32_t*)db->toc.data)[trail_id];
+    else
+        return ((const uint64_t*)db->toc.data)[trail_id];
+}
+
+/*
+trails.meta stores the number of events and the first and the last
+timestamp of each trail, so they are known without decoding the trail:
+
+[ number of trails N ]   8 bytes
+[ bits of num_events ]   8 bytes
+[ bits of first      ]   8 bytes
+[ bits of last       ]   8 bytes
+[ records ...        ]   N bit-packed records of [ num_events | first | last ]
+[ padding            ]   8 zero bytes, see tdb_bits.h
+
+first is relative to min_timestamp and last is relative to first. Each
+field takes as many bits as its largest value needs, or 64 bits with
+TDB_OPT_CONS_TRAIL_META_PLAIN, so records can be accessed in O(1).
+*/
+#define TDB_TRAIL_META_HEADER_SIZE 32
+
+static inline void tdb_trail_meta_read(const tdb *db,
+                                       uint64_t trail_id,
+                                       tdb_trail_meta *meta)
+{
+    const uint32_t *bits = db->trail_meta_bits;
+    const char *src = &db->trail_meta.data[TDB_TRAIL_META_HEADER_SIZE];
+    uint64_t offs = trail_id * (bits[0] + bits[1] + bits[2]);
+
+    meta->num_events = read_bits64(src, offs, bits[0]);
+    offs += bits[0];
+    meta->min_timestamp = db->min_timestamp + read_bits64(src, offs, bits[1]);
+    offs += bits[1];
+    meta->max_timestamp = meta->min_timestamp + read_bits64(src, offs, bits[2]);
+}
+
+int tdb_lexicon_read(const tdb *db, tdb_field field, struct tdb_lexicon *lex);
+
+/* ranges of trails to be read ahead, see tdb_prefetch_trails() */
+struct trail_readahead{
+    const tdb *db;
+    /* a range of trails.data, uncompressed offsets as in trails.toc */
+    uint64_t start;
+    uint64_t end;
+    uint64_t num_flushed;
 };
 
-void tdb_lexicon_read(const tdb *db, tdb_field field, struct tdb_lexicon *lex);
+void trail_readahead_cursor(struct trail_readahead *ra,
+                            const tdb_cursor *cursor);
+
+void trail_readahead_finish(struct trail_readahead *ra);
 
 const char *tdb_lexicon_get(const struct tdb_lexicon *lex,
                             tdb_val i,
@@ -178,6 +412,55 @@ const char *tdb_lexicon_get(const struct tdb_lexicon *lex,
 
 tdb_error tdb_encode(tdb_cons *cons, const tdb_item *items);
 
+/* size of an output file that is not known in advance */
+#define TDB_CONS_UNKNOWN_SIZE UINT64_MAX
+
+tdb_error cons_fopen(tdb_cons *cons,
+                     const char *fname,
+                     uint64_t size,
+                     FILE **out);
+
+tdb_error cons_fclose(tdb_cons *cons, FILE *file);
+
+#define TDB_CONS_OPEN(cons, file, fname, size)\
+    if ((ret = cons_fopen(cons, fname, size, &file)))\
+        goto done;
+
+#define TDB_CONS_CLOSE(cons, file)\
+    {\
+        if (file && cons_fclose(cons, file)){\
+            file = NULL;\
+            ret = TDB_ERR_IO_CLOSE;\
+            goto done;\
+        }\
+        file = NULL;\
+    }
+
+#define TDB_CONS_CLOSE_FINAL(cons, file)\
+    {\
+        if (file && cons_fclose(cons, file))\
+            return TDB_ERR_IO_CLOSE;\
+        file = NULL;\
+    }
+
+tdb_error cons_store_info(tdb_cons *cons,
+                          uint64_t num_trails,
+                          uint64_t num_events,
+                          uint64_t min_timestamp,
+                          uint64_t max_timestamp,
+                          uint64_t max_timedelta);
+
+tdb_error cons_store_trail_meta(tdb_cons *cons,
+                                const tdb_trail_meta *meta,
+                                uint64_t num_trails,
+                                uint64_t min_timestamp);
+
+tdb_error cons_extract_trails(const tdb *db,
+                              const uint64_t *trail_ids,
+                              uint64_t num_trail_ids,
+                              const char *root,
+                              int prune_lexicons);
+
 tdb_error edge_encode_items(const tdb_item *items,
                             tdb_item **encoded,
                             uint64_t *num_encoded,
@@ -190,6 +473,16 @@ int file_mmap(const char *path,
               struct tdb_file *dst,
               const tdb *db);
 
+void *tdb_mmap(uint64_t size, int fd, uint64_t offset, const tdb *db);
+
+tdb_error tdb_sidecar_path(const tdb *db,
+                           char path[TDB_MAX_PATH_SIZE],
+                           const char *name);
+
+tdb_error tdb_deleted_open(tdb *db);
+
+void tdb_cursor_clear(tdb_cursor *cursor);
+
 int is_fieldname_invalid(const char* field);
 
 #endif /* __TDB_INTERNAL_H__ */
@@ -1,115 +1,478 @@
 
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "traildb.h"
 #include "tdb_internal.h"
 
-#include "pqueue/pqueue.h"
-
 /*
 Multi-cursor merges events from K cursors (trails) in a single
 stream of timestamp ordered events on the fly. Merging is done with
-a simple priority queue (heap), implemented by the pqueue library.
+a loser tree (tournament tree): Each internal node of the tree stores
+the loser of the match between its two subtrees and the overall winner
+is stored separately. When the winner advances to its next event, only
+the matches on the path from its leaf to the root need to be replayed,
+which takes exactly log2(K) comparisons - about half of what a binary
+heap needs.
+
+Ties are broken by the cursor index, so events with equal timestamps
+are returned in the order of cursors.
 
 A key feature of multi-cursor is that it performs merging in a
 zero-copy fashion by relying on the event buffers of underlying
 cursors. A downside of this performance optimization is that the
 buffer/event lifetime needs to be managed carefully.
 
-If the buffer of an underlying cursor is exhausted temporarily, the
-cursor can't be refreshed right away since this would invalidate
-the past events. Instead, the cursor is marked as dirty in
-popped_node, so it can be reinstered when multi-cursor is called
-the next time.
+If the buffer of the winning cursor is exhausted, the cursor can't be
+refreshed right away since this would invalidate the past events.
+Instead, the winner is marked as dirty, so it can be refilled and
+replayed when multi-cursor is called the next time.
+
+A parallel multi-cursor (tdb_multi_cursor_new_parallel) decodes the
+underlying cursors on a pool of worker threads, so that the calling
+thread only merges. In tdb_multi_cursor_reset(), the decoding state of
+each underlying cursor is copied to a private prefetch slot with two
+event buffers: While the merge consumes events from the front buffer,
+a worker decodes the next batch to the back buffer. When the front
+buffer is exhausted, the buffers are swapped and the next batch is
+queued. Events stay valid until the next call as above, since the
+buffers are swapped only when the cursor is refilled.
 */
 
-struct mcursor_node{
-    pqueue_pri_t timestamp;
-    size_t pos;
-    tdb_cursor *cursor;
-    uint64_t index;
+enum prefetch_status{
+    PREFETCH_IDLE,
+    PREFETCH_QUEUED,
+    PREFETCH_READY
+};
+
+struct prefetch_slot{
+    /* the cursor that is merged, it points at the front buffer */
+    tdb_cursor cursor;
+
+    /* the cursor given by the user, copied on reset */
+    tdb_cursor *source;
+
+    /* private decoding state, used by workers only */
+    struct tdb_decode_state *state;
+    uint64_t state_size;
+
+    /* front is -1 when the merge consumes events of the source cursor */
+    void *buffers[2];
+    int front;
+
+    /* protected by prefetch->lock */
+    enum prefetch_status status;
+    uint64_t num_ready;
+};
+
+struct prefetch{
+    struct prefetch_slot *slots;
+    uint64_t num_slots;
+
+    pthread_t *threads;
+    uint64_t num_threads;
+
+    pthread_mutex_t lock;
+    /* signaled when a job is queued */
+    pthread_cond_t job_queued;
+    /* signaled when a job is done */
+    pthread_cond_t job_done;
+
+    /* FIFO of slot indices, each slot is queued at most once */
+    uint64_t *queue;
+    uint64_t queue_head;
+    uint64_t queue_len;
+
+    /* number of queued jobs that are not done yet */
+    uint64_t num_pending;
+    int shutdown;
+};
+
+struct mcursor_leaf{
+    uint64_t timestamp;
+    int is_active;
 };
 
 struct tdb_multi_cursor{
-    /* priority queue */
-    pqueue_t *queue;
-    struct mcursor_node *nodes;
-    uint64_t num_nodes;
+    tdb_cursor **cursors;
+    uint64_t num_cursors;
 
-    /* node that needs to be reinserted on the next call */
-    struct mcursor_node *popped_node;
+    /* num_leaves is num_cursors rounded up to the next power of two */
+    struct mcursor_leaf *leaves;
+    uint64_t num_leaves;
+
+    /*
+    tree[0] is the index of the winning leaf, tree[1...num_leaves - 1]
+    are losers of internal nodes. The children of node i are nodes
+    2i and 2i + 1, leaf j is node num_leaves + j.
+    */
+    uint64_t *tree;
+
+    /* scratch space for building the tree in tdb_multi_cursor_reset() */
+    uint64_t *winners;
+
+    /* the winner needs to be refilled and replayed on the next call */
+    int is_dirty;
+
+    /* NULL unless created with tdb_multi_cursor_new_parallel() */
+    struct prefetch *prefetch;
 
     /* returned event buffer */
     tdb_multi_event current_event;
 };
 
-/* pqueue callback functions */
+/* does leaf a come before leaf b? exhausted leaves come last */
+static inline int leaf_less(const struct mcursor_leaf *leaves,
+                            uint64_t a,
+                            uint64_t b)
+{
+    if (leaves[a].is_active != leaves[b].is_active)
+        return leaves[a].is_active;
+    return leaves[a].timestamp < leaves[b].timestamp ||
+           (leaves[a].timestamp == leaves[b].timestamp && a < b);
+}
 
-static int cmp_pri(pqueue_pri_t next, pqueue_pri_t cur)
+/* NOTE: the caller must hold pf->lock */
+static void prefetch_queue_locked(struct prefetch *pf, uint64_t idx)
 {
-	return next > cur;
+    uint64_t tail = (pf->queue_head + pf->queue_len) % pf->num_slots;
+    pf->queue[tail] = idx;
+    ++pf->queue_len;
+    ++pf->num_pending;
+    pf->slots[idx].status = PREFETCH_QUEUED;
 }
 
-static pqueue_pri_t get_pri(void *a)
+static void *prefetch_worker(void *arg)
 {
-	return ((struct mcursor_node*)a)->timestamp;
+    struct prefetch *pf = (struct prefetch*)arg;
+
+    pthread_mutex_lock(&pf->lock);
+    while (1){
+        struct prefetch_slot *slot;
+        tdb_cursor shell;
+
+        while (!pf->queue_len && !pf->shutdown)
+            pthread_cond_wait(&pf->job_queued, &pf->lock);
+        if (pf->shutdown)
+            break;
+
+        slot = &pf->slots[pf->queue[pf->queue_head]];
+        pf->queue_head = (pf->queue_head + 1) % pf->num_slots;
+        --pf->queue_len;
+        pthread_mutex_unlock(&pf->lock);
+
+        /* decode the next batch to the back buffer */
+        slot->state->events_buffer = slot->buffers[slot->front == 0 ? 1: 0];
+        shell.state = slot->state;
+        shell.num_events_left = 0;
+        _tdb_cursor_next_batch(&shell);
+
+        pthread_mutex_lock(&pf->lock);
+        slot->num_ready = shell.num_events_left;
+        slot->status = PREFETCH_READY;
+        --pf->num_pending;
+        pthread_cond_broadcast(&pf->job_done);
+    }
+    pthread_mutex_unlock(&pf->lock);
+    return NULL;
 }
 
-static void set_pri(void *a, pqueue_pri_t timestamp)
+/*
+Swap the buffers of an exhausted cursor and queue decoding of the
+next batch
+*/
+static void prefetch_swap(struct prefetch *pf, uint64_t idx)
 {
-	((struct mcursor_node*)a)->timestamp = timestamp;
+    struct prefetch_slot *slot = &pf->slots[idx];
+
+    if (slot->cursor.num_events_left)
+        return;
+
+    pthread_mutex_lock(&pf->lock);
+    while (slot->status == PREFETCH_QUEUED)
+        pthread_cond_wait(&pf->job_done, &pf->lock);
+
+    if (slot->status == PREFETCH_READY){
+        slot->status = PREFETCH_IDLE;
+        if (slot->num_ready){
+            slot->front = slot->front == 0 ? 1: 0;
+            slot->cursor.next_event = slot->buffers[slot->front];
+            slot->cursor.num_events_left = slot->num_ready;
+            prefetch_queue_locked(pf, idx);
+            pthread_cond_signal(&pf->job_queued);
+        }
+    }
+    pthread_mutex_unlock(&pf->lock);
 }
 
-static size_t get_pos(void *a)
+/* wait until workers are not using any of the slots */
+static void prefetch_wait(struct prefetch *pf)
 {
-	return ((struct mcursor_node*)a)->pos;
+    pthread_mutex_lock(&pf->lock);
+    while (pf->num_pending)
+        pthread_cond_wait(&pf->job_done, &pf->lock);
+    pthread_mutex_unlock(&pf->lock);
 }
 
-static void set_pos(void *a, size_t pos)
+/* take over the current state of the source cursors */
+static void prefetch_reset(struct prefetch *pf)
 {
-    ((struct mcursor_node*)a)->pos = pos;
+    uint64_t i;
+
+    prefetch_wait(pf);
+
+    pthread_mutex_lock(&pf->lock);
+    for (i = 0; i < pf->num_slots; i++){
+        struct prefetch_slot *slot = &pf->slots[i];
+        const tdb_cursor *source = slot->source;
+
+        /*
+        the merge starts with events that are left in the source cursor.
+        They stay valid as long as the source cursor is not used.
+        */
+        slot->cursor.next_event = source->next_event;
+        slot->cursor.num_events_left = source->num_events_left;
+        slot->front = -1;
+        slot->status = PREFETCH_IDLE;
+
+        /*
+        the private state continues decoding where the source cursor is.
+        The trail cache entry and the pread block or buffer, if any,
+        remain owned by the source cursor.
+        */
+        memcpy(slot->state, source->state, slot->state_size);
+        slot->state->cached_trail = NULL;
+        slot->state->trail_block = NULL;
+        slot->state->trail_buf = NULL;
+        slot->state->trail_buf_size = 0;
+
+        if (slot->state->offset < slot->state->size)
+            prefetch_queue_locked(pf, i);
+    }
+    pthread_cond_broadcast(&pf->job_queued);
+    pthread_mutex_unlock(&pf->lock);
 }
 
-static void print_entry(FILE *out, void *a)
+static void prefetch_free(struct prefetch *pf)
 {
-    struct mcursor_node *node = (struct mcursor_node*)a;
-    fprintf(out,
-            "node[%"PRIu64"] timestamp %"PRIu64"\n",
-            node->index,
-            (uint64_t)node->timestamp);
+    uint64_t i;
+
+    if (pf->threads){
+        pthread_mutex_lock(&pf->lock);
+        pf->shutdown = 1;
+        pthread_cond_broadcast(&pf->job_queued);
+        pthread_mutex_unlock(&pf->lock);
+
+        for (i = 0; i < pf->num_threads; i++)
+            pthread_join(pf->threads[i], NULL);
+
+        pthread_cond_destroy(&pf->job_done);
+        pthread_cond_destroy(&pf->job_queued);
+        pthread_mutex_destroy(&pf->lock);
+    }
+
+    if (pf->slots)
+        for (i = 0; i < pf->num_slots; i++){
+            free(pf->slots[i].state);
+            free(pf->slots[i].buffers[0]);
+            free(pf->slots[i].buffers[1]);
+        }
+
+    free(pf->slots);
+    free(pf->threads);
+    free(pf->queue);
+    free(pf);
 }
 
-TDB_EXPORT tdb_multi_cursor *tdb_multi_cursor_new(tdb_cursor **cursors,
-                                                  uint64_t num_cursors)
+static struct prefetch *prefetch_new(tdb_cursor **cursors,
+                                     uint64_t num_cursors,
+                                     uint64_t num_threads)
+{
+    struct prefetch *pf;
+    uint64_t i;
+
+    if (!(pf = calloc(1, sizeof(struct prefetch))))
+        return NULL;
+
+    pf->num_slots = num_cursors;
+    if (!(pf->slots = calloc(num_cursors, sizeof(struct prefetch_slot))))
+        goto err;
+
+    if (!(pf->queue = calloc(num_cursors, sizeof(uint64_t))))
+        goto err;
+
+    for (i = 0; i < num_cursors; i++){
+        struct prefetch_slot *slot = &pf->slots[i];
+        const struct tdb_decode_state *state = cursors[i]->state;
+        uint64_t buffer_size = state->events_buffer_len *
+                               (state->db->num_fields + 1) *
+                               sizeof(tdb_item);
+
+        slot->source = cursors[i];
+        slot->state_size = sizeof(struct tdb_decode_state) +
+                           state->db->num_fields * sizeof(tdb_item);
+        slot->front = -1;
+
+        if (!(slot->state = calloc(1, slot->state_size)))
+            goto err;
+        slot->state->db = state->db;
+        slot->cursor.state = slot->state;
+        if (!(slot->buffers[0] = malloc(buffer_size)))
+            goto err;
+        if (!(slot->buffers[1] = malloc(buffer_size)))
+            goto err;
+    }
+
+    if (pthread_mutex_init(&pf->lock, NULL))
+        goto err;
+    if (pthread_cond_init(&pf->job_queued, NULL)){
+        pthread_mutex_destroy(&pf->lock);
+        goto err;
+    }
+    if (pthread_cond_init(&pf->job_done, NULL)){
+        pthread_cond_destroy(&pf->job_queued);
+        pthread_mutex_destroy(&pf->lock);
+        goto err;
+    }
+
+    /* from here on, prefetch_free() shuts down the started threads */
+    if (!(pf->threads = calloc(num_threads, sizeof(pthread_t)))){
+        pthread_cond_destroy(&pf->job_done);
+        pthread_cond_destroy(&pf->job_queued);
+        pthread_mutex_destroy(&pf->lock);
+        goto err;
+    }
+
+    for (i = 0; i < num_threads; i++){
+        if (pthread_create(&pf->threads[i], NULL, prefetch_worker, pf))
+            goto err;
+        ++pf->num_threads;
+    }
+
+    return pf;
+err:
+    prefetch_free(pf);
+    return NULL;
+}
+
+/* update the leaf from the next event of its cursor */
+static inline void leaf_refill(tdb_multi_cursor *mc, uint64_t leaf)
+{
+    const tdb_event *event = NULL;
+
+    if (leaf < mc->num_cursors){
+        if (mc->prefetch){
+            /*
+            never decode on this thread: take the next batch
+            from the prefetch slot instead
+            */
+            prefetch_swap(mc->prefetch, leaf);
+            if (mc->cursors[leaf]->num_events_left)
+                event = (const tdb_event*)mc->cursors[leaf]->next_event;
+        }else
+            event = tdb_cursor_peek(mc->cursors[leaf]);
+    }
+
+    if (event){
+        mc->leaves[leaf].timestamp = event->timestamp;
+        mc->leaves[leaf].is_active = 1;
+    }else
+        mc->leaves[leaf].is_active = 0;
+}
+
+/*
+Replay the matches on the path from the leaf to the root, after
+the key of the leaf (the current winner) has changed
+*/
+static inline void replay(tdb_multi_cursor *mc, uint64_t leaf)
+{
+    const struct mcursor_leaf *leaves = mc->leaves;
+    uint64_t *tree = mc->tree;
+    uint64_t winner = leaf;
+    uint64_t node = (mc->num_leaves + leaf) >> 1;
+
+    for (; node; node >>= 1)
+        if (leaf_less(leaves, tree[node], winner)){
+            uint64_t tmp = tree[node];
+            tree[node] = winner;
+            winner = tmp;
+        }
+    tree[0] = winner;
+}
+
+/*
+Refill the winner after its buffer was exhausted
+(see the top of this file for an explanation)
+*/
+static inline void refill_dirty(tdb_multi_cursor *mc)
+{
+    if (mc->is_dirty){
+        leaf_refill(mc, mc->tree[0]);
+        replay(mc, mc->tree[0]);
+        mc->is_dirty = 0;
+    }
+}
+
+/*
+The runner-up is the best loser on the path from the winner to the root.
+Return num_leaves if there are no other active leaves.
+*/
+static inline uint64_t runner_up(const tdb_multi_cursor *mc)
+{
+    const struct mcursor_leaf *leaves = mc->leaves;
+    uint64_t node = (mc->num_leaves + mc->tree[0]) >> 1;
+    uint64_t best = mc->num_leaves;
+
+    for (; node; node >>= 1){
+        uint64_t leaf = mc->tree[node];
+        if (leaves[leaf].is_active &&
+            (best == mc->num_leaves || leaf_less(leaves, leaf, best)))
+            best = leaf;
+    }
+    return best;
+}
+
+static tdb_multi_cursor *multi_cursor_new(tdb_cursor **cursors,
+                                          uint64_t num_cursors,
+                                          uint64_t num_threads)
 {
     tdb_multi_cursor *mc = NULL;
     uint64_t i;
 
-    if (num_cursors > SIZE_MAX - 1)
+    if (num_cursors > (SIZE_MAX >> 1) / sizeof(uint64_t))
         return NULL;
 
     if (!(mc = calloc(1, sizeof(struct tdb_multi_cursor))))
         goto err;
 
-    if (!(mc->nodes = calloc(num_cursors, sizeof(struct mcursor_node))))
+    mc->num_cursors = num_cursors;
+    for (mc->num_leaves = 1; mc->num_leaves < num_cursors;)
+        mc->num_leaves <<= 1;
+
+    if (!(mc->cursors = calloc(mc->num_leaves, sizeof(tdb_cursor*))))
         goto err;
 
-    if (!(mc->queue = pqueue_init(num_cursors,
-                                  cmp_pri,
-                                  get_pri,
-                                  set_pri,
-                                  get_pos,
-                                  set_pos)))
+    if (!(mc->leaves = calloc(mc->num_leaves, sizeof(struct mcursor_leaf))))
         goto err;
 
-    mc->num_nodes = num_cursors;
+    if (!(mc->tree = calloc(mc->num_leaves, sizeof(uint64_t))))
+        goto err;
+
+    if (!(mc->winners = calloc(mc->num_leaves * 2, sizeof(uint64_t))))
+        goto err;
+
+    if (num_threads && num_cursors){
+        if (!(mc->prefetch = prefetch_new(cursors, num_cursors, num_threads)))
+            goto err;
+        for (i = 0; i < num_cursors; i++)
+            mc->cursors[i] = &mc->prefetch->slots[i].cursor;
+    }else
+        for (i = 0; i < num_cursors; i++)
+            mc->cursors[i] = cursors[i];
 
-    for (i = 0; i < num_cursors; i++){
-        mc->nodes[i].cursor = cursors[i];
-        mc->nodes[i].index = i;
-    }
     tdb_multi_cursor_reset(mc);
 
     return mc;
@@ -118,60 +481,80 @@ err:
     return NULL;
 }
 
+TDB_EXPORT tdb_multi_cursor *tdb_multi_cursor_new(tdb_cursor **cursors,
+                                                  uint64_t num_cursors)
+{
+    return multi_cursor_new(cursors, num_cursors, 0);
+}
+
+TDB_EXPORT tdb_multi_cursor *tdb_multi_cursor_new_parallel(
+    tdb_cursor **cursors,
+    uint64_t num_cursors,
+    uint64_t num_threads)
+{
+    return multi_cursor_new(cursors, num_cursors, num_threads);
+}
+
 /*
-Reinitialize the priority queue after the state of the underlying cursors
+Rebuild the tree after the state of the underlying cursors
 has changed, e.g. after tdb_get_trail().
 */
 TDB_EXPORT void tdb_multi_cursor_reset(tdb_multi_cursor *mc)
 {
+    uint64_t *winners = mc->winners;
+    struct trail_readahead ra;
     uint64_t i;
 
-    pqueue_reset(mc->queue);
-    for (i = 0; i < mc->num_nodes; i++){
-        const tdb_event *event = tdb_cursor_peek(mc->nodes[i].cursor);
-        if (event){
-            mc->nodes[i].timestamp = event->timestamp;
-            /*
-            we can ignore the return value of pqueue_insert since it
-            won't need to call realloc()
-            */
-            pqueue_insert(mc->queue, &mc->nodes[i]);
-        }
+    /*
+    the trails of all cursors are needed at once, so start reading them
+    before the first batches are decoded
+    */
+    memset(&ra, 0, sizeof(ra));
+    for (i = 0; i < mc->num_cursors; i++)
+        if (mc->prefetch)
+            trail_readahead_cursor(&ra, mc->prefetch->slots[i].source);
+        else
+            trail_readahead_cursor(&ra, mc->cursors[i]);
+    trail_readahead_finish(&ra);
+
+    if (mc->prefetch)
+        prefetch_reset(mc->prefetch);
+
+    for (i = 0; i < mc->num_leaves; i++){
+        leaf_refill(mc, i);
+        winners[mc->num_leaves + i] = i;
     }
-    mc->popped_node = NULL;
-}
 
-/*
-Reinsert exhausted cursor in the heap
-(see the top of this file for an explanation)
-*/
-static inline void reinsert_popped(tdb_multi_cursor *mc)
-{
-    if (mc->popped_node){
-        const tdb_event *event = tdb_cursor_peek(mc->popped_node->cursor);
-        if (event){
-            mc->popped_node->timestamp = event->timestamp;
-            pqueue_insert(mc->queue, mc->popped_node);
+    /* play all matches bottom-up */
+    for (i = mc->num_leaves - 1; i > 0; i--){
+        uint64_t left = winners[2 * i];
+        uint64_t right = winners[2 * i + 1];
+        if (leaf_less(mc->leaves, right, left)){
+            winners[i] = right;
+            mc->tree[i] = left;
+        }else{
+            winners[i] = left;
+            mc->tree[i] = right;
         }
-        mc->popped_node = NULL;
     }
+    mc->tree[0] = mc->num_leaves > 1 ? winners[1]: 0;
+    mc->is_dirty = 0;
 }
 
 /* Peek the next event to be returned */
 TDB_EXPORT const tdb_multi_event *tdb_multi_cursor_peek(tdb_multi_cursor *mc)
 {
-    const tdb_event *next_event;
-    struct mcursor_node *node;
+    uint64_t winner;
 
-    reinsert_popped(mc);
-    node = (struct mcursor_node*)pqueue_peek(mc->queue);
+    refill_dirty(mc);
+    winner = mc->tree[0];
 
-    if (!node)
+    if (!mc->leaves[winner].is_active)
         return NULL;
 
-    mc->current_event.event = tdb_cursor_peek(node->cursor);
-    mc->current_event.db = node->cursor->state->db;
-    mc->current_event.cursor_idx = node->index;
+    mc->current_event.event = tdb_cursor_peek(mc->cursors[winner]);
+    mc->current_event.db = mc->cursors[winner]->state->db;
+    mc->current_event.cursor_idx = winner;
 
     return &mc->current_event;
 }
@@ -179,34 +562,35 @@ TDB_EXPORT const tdb_multi_event *tdb_multi_cursor_peek(tdb_multi_cursor *mc)
 /* Return the next event */
 TDB_EXPORT const tdb_multi_event *tdb_multi_cursor_next(tdb_multi_cursor *mc)
 {
-    struct mcursor_node *node;
+    tdb_cursor *cursor;
+    uint64_t winner;
 
-    reinsert_popped(mc);
-    node = (struct mcursor_node*)pqueue_peek(mc->queue);
+    refill_dirty(mc);
+    winner = mc->tree[0];
 
-    if (!node)
+    if (!mc->leaves[winner].is_active)
         return NULL;
 
-    mc->current_event.event = tdb_cursor_next(node->cursor);
-    mc->current_event.db = node->cursor->state->db;
-    mc->current_event.cursor_idx = node->index;
+    cursor = mc->cursors[winner];
+    mc->current_event.event = tdb_cursor_next(cursor);
+    mc->current_event.db = cursor->state->db;
+    mc->current_event.cursor_idx = winner;
 
-    if (node->cursor->num_events_left){
+    if (cursor->num_events_left){
         /*
         the event buffer of the cursor has remaining events,
-        so we can just update the heap with the next timestamp
+        so we can just replay the winner with the next timestamp
         */
-        const tdb_event *next_event = (const tdb_event*)node->cursor->next_event;
-        pqueue_change_priority(mc->queue, next_event->timestamp, node);
-    }else{
+        const tdb_event *next_event = (const tdb_event*)cursor->next_event;
+        mc->leaves[winner].timestamp = next_event->timestamp;
+        replay(mc, winner);
+    }else
         /*
         the event buffer of the cursor is empty. We don't know
-        the next timestamp, so mark this cursor as dirty in popped_node
+        the next timestamp, so mark the winner as dirty
         (calling tdb_cursor_peek() would invalidate mc->current_event.event)
         */
-        pqueue_pop(mc->queue);
-        mc->popped_node = node;
-    }
+        mc->is_dirty = 1;
 
     return &mc->current_event;
 }
@@ -219,9 +603,10 @@ TDB_EXPORT uint64_t tdb_multi_cursor_next_batch(tdb_multi_cursor *mc,
                                                 tdb_multi_event *events,
                                                 uint64_t max_events)
 {
+    const struct mcursor_leaf *leaves = mc->leaves;
     uint64_t n = 0;
 
-    reinsert_popped(mc);
+    refill_dirty(mc);
 
     /*
     next batch relies on the following heuristic:
@@ -229,60 +614,50 @@ TDB_EXPORT uint64_t tdb_multi_cursor_next_batch(tdb_multi_cursor *mc,
     timestamp is smaller than those of any other cursor, e.g. if there is
     a cursor for each daily traildb.
 
-    Updating the heap for every single event is expensive and unnecessary
-    in this case. It suffices to update the heap only when we switch cursors.
-    This logic is implemented by popping the current cursor and peeking the
-    next one: We can consume the current cursor as long as its timestamps are
-    smaller than that of the next cursor.
+    Replaying the tree for every single event is unnecessary in this case.
+    It suffices to find the runner-up once when we switch cursors: We can
+    consume the winner, without comparing it against any other cursor,
+    as long as its timestamps come before that of the runner-up. The tree
+    is replayed only once per run.
     */
     while (n < max_events){
-        struct mcursor_node *current =
-            (struct mcursor_node*)pqueue_pop(mc->queue);
-        struct mcursor_node *next =
-            (struct mcursor_node*)pqueue_peek(mc->queue);
+        const uint64_t winner = mc->tree[0];
+        uint64_t next, next_timestamp = UINT64_MAX;
         tdb_cursor *cur;
-        uint64_t next_timestamp = 0;
-        int is_last = 0;
 
-        if (current)
-            cur = current->cursor;
-        else
-            /* heap is empty - all cursors exhausted */
+        if (!leaves[winner].is_active)
+            /* all cursors exhausted */
             break;
 
-        if (next)
+        cur = mc->cursors[winner];
+        if ((next = runner_up(mc)) < mc->num_leaves){
             /*
-            consume the current cursor while timestamps are smaller than
-            next_timestamp
+            consume the winner while timestamps are smaller than
+            next_timestamp. Ties are broken by the cursor index, so
+            the winner may consume an equal timestamp only if its
+            index is smaller. Note that winner > next implies that
+            the winner's timestamp is smaller, so next_timestamp > 0.
             */
-            next_timestamp = next->timestamp;
-        else
-            /*
-            no next timestamp - current is the last one. We can consume
-            current until its end
-            */
-            is_last = 1;
+            next_timestamp = leaves[next].timestamp;
+            if (winner > next)
+                --next_timestamp;
+        }
 
         while (1){
             if (cur->num_events_left){
                 /* there are events left in the buffer */
                 const tdb_event *event = (const tdb_event*)cur->next_event;
 
-                if (n < max_events &&
-                    (is_last || event->timestamp <= next_timestamp)){
-
+                if (n < max_events && event->timestamp <= next_timestamp){
                     events[n].event = event;
                     events[n].db = cur->state->db;
-                    events[n].cursor_idx = current->index;
+                    events[n].cursor_idx = winner;
                     ++n;
                     tdb_cursor_next(cur);
                 }else{
-                    /*
-                    update the timestamp of the current cursor and
-                    return it to the heap
-                    */
-                    current->timestamp = event->timestamp;
-                    pqueue_insert(mc->queue, current);
+                    /* replay the winner with its next timestamp */
+                    mc->leaves[winner].timestamp = event->timestamp;
+                    replay(mc, winner);
                     break;
                 }
             }else{
@@ -290,7 +665,7 @@ TDB_EXPORT uint64_t tdb_multi_cursor_next_batch(tdb_multi_cursor *mc,
                 no events left in the buffer, we must stop iterating
                 to avoid the previous events from becoming invalid
                 */
-                mc->popped_node = current;
+                mc->is_dirty = 1;
                 goto done;
             }
         }
@@ -302,9 +677,12 @@ done:
 TDB_EXPORT void tdb_multi_cursor_free(tdb_multi_cursor *mc)
 {
     if (mc){
-        if (mc->queue)
-            pqueue_free(mc->queue);
-        free(mc->nodes);
+        if (mc->prefetch)
+            prefetch_free(mc->prefetch);
+        free(mc->cursors);
+        free(mc->leaves);
+        free(mc->tree);
+        free(mc->winners);
         free(mc);
     }
 }
@@ -14,98 +14,257 @@
 
 
 struct pkg_toc{
-    char *fname;
-    uint64_t offset;
-    uint64_t size;
+    const uint64_t *slots;
+    uint64_t num_slots;
+    const struct pkg_toc_entry *files;
+    uint64_t num_files;
+    const char *names;
+    uint64_t names_size;
+
+    /* a binary TOC is mmapped, a text TOC is parsed to the heap */
+    struct tdb_file file;
+    uint64_t *text_slots;
+    struct pkg_toc_entry *text_files;
+    char *text_names;
 };
 
-static uint64_t toc_count_lines(FILE *f)
+static int toc_find(const struct pkg_toc *toc,
+                    const char *fname,
+                    uint64_t len,
+                    uint64_t *idx)
 {
-    char *buf = NULL;
+    const uint64_t mask = toc->num_slots - 1;
+    uint64_t i, slot = pkg_toc_hash(fname, len) & mask;
+
+    for (i = 0; i < toc->num_slots && toc->slots[slot]; i++){
+        const struct pkg_toc_entry *e = &toc->files[toc->slots[slot] - 1];
+        if (e->name_len == len && !memcmp(&toc->names[e->name_offset], fname, len)){
+            *idx = toc->slots[slot] - 1;
+            return 0;
+        }
+        slot = (slot + 1) & mask;
+    }
+    *idx = slot;
+    return -1;
+}
+
+static tdb_error toc_parse_text(FILE *f, struct pkg_toc *toc)
+{
+    /*
+    The text TOC (VER 1) consists of lines "name offset size",
+    terminated by an empty line. We parse it into the same layout
+    as the binary TOC.
+    */
+    struct pkg_toc_entry *files = NULL;
+    uint64_t *slots = NULL;
+    char *names = NULL;
+    char *line = NULL;
     size_t n = 0;
-    uint64_t num_lines = 0;
+    uint64_t i, num_alloc = 0, names_alloc = 0;
+    int ret = 0;
 
-    if (getline(&buf, &n, f) == -1)
-        goto done;
+    toc->num_files = toc->names_size = 0;
 
-    if (strcmp(buf, TDB_TAR_MAGIC))
+    /* ignore magic line */
+    if (getline(&line, &n, f) == -1){
+        ret = TDB_ERR_IO_READ;
         goto done;
+    }
 
     while (1){
-        if (getline(&buf, &n, f) == -1){
-            num_lines = 0;
+        char *saveptr = NULL;
+        char *name, *offset, *size;
+        uint64_t len;
+
+        if (getline(&line, &n, f) == -1){
+            ret = TDB_ERR_INVALID_PACKAGE;
             goto done;
         }
-        if (buf[0] == '\n')
+        if (line[0] == '\n')
             break;
-        ++num_lines;
+
+        if (!(name = strtok_r(line, " ", &saveptr)) ||
+            !(offset = strtok_r(NULL, " ", &saveptr)) ||
+            !(size = strtok_r(NULL, " ", &saveptr))){
+            ret = TDB_ERR_INVALID_PACKAGE;
+            goto done;
+        }
+
+        len = strlen(name);
+        if (toc->num_files == num_alloc){
+            void *p;
+            num_alloc = num_alloc ? num_alloc * 2: 64;
+            if (!(p = realloc(files, num_alloc * sizeof(files[0])))){
+                ret = TDB_ERR_NOMEM;
+                goto done;
+            }
+            files = (struct pkg_toc_entry*)p;
+        }
+        if (toc->names_size + len > names_alloc){
+            void *p;
+            names_alloc = (names_alloc + len) * 2;
+            if (!(p = realloc(names, names_alloc))){
+                ret = TDB_ERR_NOMEM;
+                goto done;
+            }
+            names = (char*)p;
+        }
+        memcpy(&names[toc->names_size], name, len);
+        files[toc->num_files].name_offset = toc->names_size;
+        files[toc->num_files].name_len = len;
+        files[toc->num_files].offset = strtoull(offset, NULL, 10);
+        files[toc->num_files].size = strtoull(size, NULL, 10);
+        toc->names_size += len;
+        ++toc->num_files;
+    }
+
+    if (!toc->num_files){
+        ret = TDB_ERR_INVALID_PACKAGE;
+        goto done;
+    }
+
+    toc->num_slots = pkg_toc_num_slots(toc->num_files);
+    if (!(slots = calloc(toc->num_slots, 8))){
+        ret = TDB_ERR_NOMEM;
+        goto done;
+    }
+    toc->slots = toc->text_slots = slots;
+    toc->files = toc->text_files = files;
+    toc->names = toc->text_names = names;
+
+    for (i = 0; i < toc->num_files; i++){
+        uint64_t slot;
+        /* like a linear scan, the first file of the same name wins */
+        if (toc_find(toc, &names[files[i].name_offset], files[i].name_len, &slot))
+            slots[slot] = i + 1;
     }
 done:
-    free(buf);
-    return num_lines;
+    free(line);
+    if (ret){
+        free(files);
+        free(names);
+        free(slots);
+        toc->slots = toc->text_slots = NULL;
+        toc->files = toc->text_files = NULL;
+        toc->names = toc->text_names = NULL;
+    }
+    return ret;
 }
 
-static tdb_error toc_parse(FILE *f, struct pkg_toc *toc, uint64_t num_lines)
+static tdb_error toc_map_binary(FILE *f, struct pkg_toc *toc, const tdb *db)
 {
-    char *buf = NULL;
-    size_t n = 0;
-    uint64_t i;
-    char *saveptr = NULL;
+    uint64_t header[3];
+    uint64_t i, size;
+    const char *data;
+    struct stat stats;
 
-    /* ignore magic line */
-    if (getline(&buf, &n, f) == -1)
-        return TDB_ERR_IO_READ;
+    if (fseek(f, TOC_FILE_OFFSET + TOC_MAGIC_SIZE, SEEK_SET) == -1)
+        return TDB_ERR_INVALID_PACKAGE;
+    if (fread(header, sizeof(header), 1, f) != 1)
+        return TDB_ERR_INVALID_PACKAGE;
 
-    for (i = 0; i < num_lines; i++){
-        if (getline(&buf, &n, f) == -1)
-            return TDB_ERR_IO_READ;
+    toc->num_files = header[0];
+    toc->num_slots = header[1];
+    toc->names_size = header[2];
 
-        char *tok = strtok_r(buf, " ", &saveptr);
-        if (tok == NULL) {
-            return TDB_ERR_INVALID_PACKAGE;
-        }
-        toc[i].fname = strdup(tok);
+    /* the limits guard against overflows below */
+    if (!toc->num_files ||
+        toc->num_slots <= toc->num_files ||
+        toc->num_slots > UINT32_MAX ||
+        (toc->num_slots & (toc->num_slots - 1)) ||
+        toc->names_size > UINT32_MAX)
+        return TDB_ERR_INVALID_PACKAGE;
 
-        tok = strtok_r(NULL, " ", &saveptr);
-        if (tok == NULL) {
-            return TDB_ERR_INVALID_PACKAGE;
-        }
-        toc[i].offset = strtoull(tok, NULL, 10);
+    size = TOC_HEADER_SIZE +
+           toc->num_slots * 8 +
+           toc->num_files * sizeof(struct pkg_toc_entry) +
+           toc->names_size;
 
-        tok = strtok_r(NULL, " ", &saveptr);
-        if (tok == NULL) {
+    if (fstat(fileno(f), &stats) || TOC_FILE_OFFSET + size > (uint64_t)stats.st_size)
+        return TDB_ERR_INVALID_PACKAGE;
+
+    if (package_mmap_region(fileno(f), TOC_FILE_OFFSET, size, &toc->file, db)){
+        toc->file.ptr = NULL;
+        return TDB_ERR_INVALID_PACKAGE;
+    }
+    data = toc->file.data;
+
+    data += TOC_HEADER_SIZE;
+    toc->slots = (const uint64_t*)data;
+    data += toc->num_slots * 8;
+    toc->files = (const struct pkg_toc_entry*)data;
+    data += toc->num_files * sizeof(struct pkg_toc_entry);
+    toc->names = data;
+
+    for (i = 0; i < toc->num_slots; i++)
+        if (toc->slots[i] > toc->num_files)
             return TDB_ERR_INVALID_PACKAGE;
-        }
-        toc[i].size = strtoull(tok, NULL, 10);
+    for (i = 0; i < toc->num_files; i++)
+        if (toc->files[i].name_offset > toc->names_size ||
+            toc->files[i].name_len > toc->names_size - toc->files[i].name_offset)
+            return TDB_ERR_INVALID_PACKAGE;
+    return 0;
+}
+
+static tdb_error map_whole_package(tdb *db)
+{
+    struct stat stats;
+    int fd = fileno(db->package_handle);
+
+    if (fstat(fd, &stats) || !stats.st_size)
+        return TDB_ERR_INVALID_PACKAGE;
+
+    db->package.size = db->package.mmap_size = (uint64_t)stats.st_size;
+    db->package.ptr = tdb_mmap(db->package.size, fd, 0, db);
+    if (db->package.ptr == MAP_FAILED){
+        db->package.ptr = NULL;
+        return TDB_ERR_IO_READ;
     }
-    free(buf);
+    db->package.data = db->package.ptr;
     return 0;
 }
 
 tdb_error open_package(tdb *db, const char *root)
 {
+    char magic[TOC_MAGIC_SIZE];
+    struct pkg_toc *toc;
     int ret = 0;
-    uint64_t num_lines;
 
     TDB_OPEN(db->package_handle, root, "r");
-    if (fseek(db->package_handle, TOC_FILE_OFFSET, SEEK_SET) == -1){
-        ret = TDB_ERR_INVALID_PACKAGE;
-        goto done;
-    }
-    if (!(num_lines = toc_count_lines(db->package_handle))){
-        ret = TDB_ERR_INVALID_PACKAGE;
+
+    /*
+    With TDB_OPT_MMAP_WHOLE_PACKAGE, the package is mapped once and all
+    files, including the TOC, point to the mapping. This saves a mapping
+    per file, which makes opening and closing TrailDBs cheaper.
+    */
+    if (db->opt_mmap_whole_package && (ret = map_whole_package(db)))
         goto done;
-    }
-    if (!(db->package_toc = calloc(num_lines + 1, sizeof(struct pkg_toc)))){
+
+    if (!(toc = calloc(1, sizeof(struct pkg_toc)))){
         ret = TDB_ERR_NOMEM;
         goto done;
     }
+    db->package_toc = toc;
+
     if (fseek(db->package_handle, TOC_FILE_OFFSET, SEEK_SET) == -1){
         ret = TDB_ERR_INVALID_PACKAGE;
         goto done;
     }
-    if ((ret = toc_parse(db->package_handle, db->package_toc, num_lines)))
+    if (fread(magic, TOC_MAGIC_SIZE, 1, db->package_handle) != 1){
+        ret = TDB_ERR_INVALID_PACKAGE;
         goto done;
+    }
+
+    if (!memcmp(magic, TDB_TAR_MAGIC_V2, strlen(TDB_TAR_MAGIC_V2)))
+        ret = toc_map_binary(db->package_handle, toc, db);
+    else if (!memcmp(magic, TDB_TAR_MAGIC, strlen(TDB_TAR_MAGIC))){
+        if (fseek(db->package_handle, TOC_FILE_OFFSET, SEEK_SET) == -1){
+            ret = TDB_ERR_INVALID_PACKAGE;
+            goto done;
+        }
+        ret = toc_parse_text(db->package_handle, toc);
+    }else
+        ret = TDB_ERR_INVALID_PACKAGE;
 done:
     return ret;
 }
@@ -114,35 +273,31 @@ void free_package(tdb *db)
 {
     if (db->package_toc){
         struct pkg_toc *toc = (struct pkg_toc*)db->package_toc;
-        uint64_t i;
-        for (i = 0; toc[i].fname; i++)
-            free(toc[i].fname);
-        free(db->package_toc);
+        /* a binary TOC in the whole package mapping has no ptr */
+        if (toc->file.ptr)
+            munmap(toc->file.ptr, toc->file.mmap_size);
+        free(toc->text_slots);
+        free(toc->text_files);
+        free(toc->text_names);
+        free(toc);
     }
     if (db->package_handle)
         fclose(db->package_handle);
 }
 
-static int toc_get(const tdb *db,
+int package_locate(const tdb *db,
                    const char *fname,
                    uint64_t *offset,
                    uint64_t *size)
 {
     const struct pkg_toc *toc = (const struct pkg_toc*)db->package_toc;
-    uint64_t i;
-    /*
-    NOTE we find the matching file using a linear scan below.
-    This shouldn't be a problem UNLESS there are a very large number of fields
-    and lexicon.* files, in which case the list can get long. It should be easy
-    to replace this with a faster search like JudySL, if needed.
-    */
-    for (i = 0; toc[i].fname; i++)
-        if (!strcmp(toc[i].fname, fname)){
-            *offset = toc[i].offset;
-            *size = toc[i].size;
-            return 0;
-        }
-    return -1;
+    uint64_t idx;
+
+    if (toc_find(toc, fname, strlen(fname), &idx))
+        return -1;
+    *offset = toc->files[idx].offset;
+    *size = toc->files[idx].size;
+    return 0;
 }
 
 FILE *package_fopen(const char *fname,
@@ -150,7 +305,7 @@ FILE *package_fopen(const char *fname,
                     const tdb *db)
 {
     uint64_t offset, size;
-    if (toc_get(db, fname, &offset, &size))
+    if (package_locate(db, fname, &offset, &size))
         return NULL;
     if (fseek(db->package_handle, (off_t)offset, SEEK_SET) == -1)
         return NULL;
@@ -163,32 +318,48 @@ int package_fclose(FILE *f __attribute__((unused)))
     return 0;
 }
 
-int package_mmap(const char *fname,
+int package_open(const char *fname,
                  const char *root __attribute__((unused)),
-                 struct tdb_file *dst,
-                 const tdb *db)
+                 const tdb *db,
+                 uint64_t *offset,
+                 uint64_t *size)
 {
+    if (package_locate(db, fname, offset, size))
+        return -1;
+    /* db->package_handle is closed at the end of tdb_open() */
+    return dup(fileno(db->package_handle));
+}
+
+int package_mmap_region(int fd,
+                        uint64_t offset,
+                        uint64_t size,
+                        struct tdb_file *dst,
+                        const tdb *db)
+{
+    uint64_t shift;
+
+    if (db && db->package.ptr){
+        /* point to the whole package mapping, there's nothing to unmap */
+        if (offset > db->package.size || size > db->package.size - offset)
+            return -1;
+        dst->ptr = NULL;
+        dst->mmap_size = 0;
+        dst->data = &db->package.data[offset];
+        dst->size = size;
+        return 0;
+    }
+
     /*
     we need to page-align offsets for mmap() and adjust data pointers
     accordingly. dst->mmap_size and dst->ptr correspond to the page-aligned
     values, dst->size and dst->data to the values containing the actual data.
     */
-
-    int fd = fileno(db->package_handle);
-    uint64_t offset, shift;
-    if (toc_get(db, fname, &offset, &dst->size))
-        return -1;
-
     shift = offset & ((uint64_t)(getpagesize() - 1));
-    dst->mmap_size = dst->size + shift;
+    dst->size = size;
+    dst->mmap_size = size + shift;
     offset -= shift;
 
-    dst->ptr = mmap(NULL,
-                    dst->mmap_size,
-                    PROT_READ,
-                    MAP_SHARED,
-                    fd,
-                    (off_t)offset);
+    dst->ptr = tdb_mmap(dst->mmap_size, fd, offset, db);
 
     if (dst->ptr == MAP_FAILED)
         return -1;
@@ -196,3 +367,19 @@ int package_mmap(const char *fname,
     dst->data = &dst->ptr[shift];
     return 0;
 }
+
+int package_mmap(const char *fname,
+                 const char *root __attribute__((unused)),
+                 struct tdb_file *dst,
+                 const tdb *db)
+{
+    uint64_t offset, size;
+    if (package_locate(db, fname, &offset, &size))
+        return -1;
+
+    return package_mmap_region(fileno(db->package_handle),
+                               offset,
+                               size,
+                               dst,
+                               db);
+}
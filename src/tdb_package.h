@@ -4,13 +4,64 @@
 
 #include <stdio.h>
 
+#include "xxhash/xxhash.h"
+
 #include "tdb_internal.h"
 #include "tdb_error.h"
 
 #define TDB_TAR_MAGIC "TAR TOC FOR TDB VER 1\n"
+#define TDB_TAR_MAGIC_V2 "TAR TOC FOR TDB VER 2\n"
 #define TOC_FILE_OFFSET 2560 /* = (len(HEADER_FILES) * 2 + 1) * 512 */
 
-tdb_error cons_package(const tdb_cons *cons);
+/*
+Binary TOC format (VER 2), found at TOC_FILE_OFFSET:
+[ magic, padded with zeroes ] 24 bytes
+[ number of files N         ] 8 bytes
+[ number of hash slots H    ] 8 bytes, a power of two > N
+[ size of names S           ] 8 bytes
+[ hash slots ...            ] H * 8 bytes, index of a file + 1, or 0
+[ files ...                 ] N * sizeof(struct pkg_toc_entry)
+[ names ...                 ] S bytes
+
+A file name is found by linear probing, starting from the slot
+pkg_toc_hash(name) & (H - 1).
+*/
+#define TOC_MAGIC_SIZE 24
+#define TOC_HEADER_SIZE (TOC_MAGIC_SIZE + 24)
+
+struct pkg_toc_entry{
+    uint64_t name_offset;
+    uint64_t name_len;
+    uint64_t offset;
+    uint64_t size;
+};
+
+static inline uint64_t pkg_toc_hash(const char *name, uint64_t len)
+{
+    return XXH64(name, len, 0);
+}
+
+static inline uint64_t pkg_toc_num_slots(uint64_t num_files)
+{
+    /* keep the load factor below 0.5 */
+    uint64_t num_slots = 4;
+    while (num_slots < num_files * 2)
+        num_slots *= 2;
+    return num_slots;
+}
+
+tdb_error cons_package_open(tdb_cons *cons);
+
+tdb_error cons_package_fopen(tdb_cons *cons,
+                             const char *fname,
+                             uint64_t size,
+                             FILE **out);
+
+tdb_error cons_package_fclose(tdb_cons *cons, FILE *file);
+
+tdb_error cons_package_close(tdb_cons *cons);
+
+void cons_package_free(tdb_cons *cons);
 
 tdb_error open_package(tdb *db, const char *root);
 
@@ -20,9 +71,26 @@ FILE *package_fopen(const char *fname, const char *root, const tdb *db);
 
 int package_fclose(FILE *f);
 
+int package_open(const char *fname,
+                 const char *root,
+                 const tdb *db,
+                 uint64_t *offset,
+                 uint64_t *size);
+
 int package_mmap(const char *fname,
                  const char *root,
                  struct tdb_file *dst,
                  const tdb *db);
 
+int package_locate(const tdb *db,
+                   const char *fname,
+                   uint64_t *offset,
+                   uint64_t *size);
+
+int package_mmap_region(int fd,
+                        uint64_t offset,
+                        uint64_t size,
+                        struct tdb_file *dst,
+                        const tdb *db);
+
 #endif /* __TDB_PACKAGE_H__ */
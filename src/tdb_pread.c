@@ -0,0 +1,212 @@
+#define _DEFAULT_SOURCE /* pread(), posix_fadvise() */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "tdb_cache.h"
+#include "tdb_pread.h"
+
+/*
+Reading trails with pread() instead of page faults is useful on storage
+with a high latency, e.g. network-mounted disks: a page fault blocks the
+thread, whereas tdb_prefetch_trails() can have the kernel read many
+ranges at once with posix_fadvise().
+
+trails.data is read in blocks of BLOCK_SIZE bytes that are cached in
+a tdb_cache. Each block is followed by BLOCK_PADDING bytes of the next
+block, so a trail that ends in a block can be decoded in place:
+huff_decode_value() may read 64 bits at the last bit offset of a trail,
+see read_bits64() in tdb_bits.h. Trails that cross block boundaries are
+copied to a buffer of the cursor. Trails larger than a block are read
+directly, without polluting the cache.
+*/
+
+#define BLOCK_SIZE (64LLU << 10)
+#define BLOCK_PADDING 16
+
+struct tdb_pread{
+    int fd;
+    /* trails.data is at this offset in a package */
+    uint64_t offset;
+    uint64_t size;
+    struct tdb_cache *blocks;
+};
+
+struct tdb_pread *tdb_pread_new(int fd,
+                                uint64_t offset,
+                                uint64_t size,
+                                uint64_t cache_size)
+{
+    struct tdb_pread *p;
+
+    if (!(p = calloc(1, sizeof(struct tdb_pread))))
+        return NULL;
+    if (!(p->blocks = tdb_cache_new(cache_size))){
+        free(p);
+        return NULL;
+    }
+    p->fd = fd;
+    p->offset = offset;
+    p->size = size;
+    return p;
+}
+
+void tdb_pread_free(struct tdb_pread *p)
+{
+    if (p){
+        close(p->fd);
+        tdb_cache_free(p->blocks);
+        free(p);
+    }
+}
+
+/* read size bytes from start, padded with zeroes to dst_size bytes */
+static tdb_error read_range(const struct tdb_pread *p,
+                            char *dst,
+                            uint64_t start,
+                            uint64_t size,
+                            uint64_t dst_size)
+{
+    uint64_t offset = p->offset + start;
+    uint64_t n = 0;
+
+    if (start < p->size)
+        n = size < p->size - start ? size: p->size - start;
+    memset(&dst[n], 0, dst_size - n);
+
+    while (n){
+        ssize_t len = pread(p->fd, dst, n, (off_t)offset);
+        if (len == -1){
+            if (errno == EINTR)
+                continue;
+            return TDB_ERR_IO_READ;
+        }else if (len == 0)
+            return TDB_ERR_IO_READ;
+        dst += len;
+        offset += (uint64_t)len;
+        n -= (uint64_t)len;
+    }
+    return 0;
+}
+
+tdb_error tdb_pread_read(const struct tdb_pread *p,
+                        char *dst,
+                        uint64_t start,
+                        uint64_t size)
+{
+    return read_range(p, dst, start, size, size);
+}
+
+static tdb_error get_block(const struct tdb_pread *p,
+                           uint64_t block,
+                           struct tdb_cache_entry **out)
+{
+    struct tdb_cache_entry *e;
+    int ret = 0;
+
+    if ((e = tdb_cache_get(p->blocks, block))){
+        *out = e;
+        return 0;
+    }
+
+    if (!(e = tdb_cache_entry_new(block, BLOCK_SIZE + BLOCK_PADDING)))
+        return TDB_ERR_NOMEM;
+
+    if ((ret = read_range(p,
+                          e->data,
+                          block * BLOCK_SIZE,
+                          BLOCK_SIZE + BLOCK_PADDING,
+                          BLOCK_SIZE + BLOCK_PADDING))){
+        tdb_cache_release(p->blocks, e);
+        return ret;
+    }
+
+    tdb_cache_put(p->blocks, e);
+    *out = e;
+    return 0;
+}
+
+static tdb_error reserve_buffer(struct tdb_decode_state *s, uint64_t size)
+{
+    if (size > s->trail_buf_size){
+        char *buf;
+        if (!(buf = realloc(s->trail_buf, size)))
+            return TDB_ERR_NOMEM;
+        s->trail_buf = buf;
+        s->trail_buf_size = size;
+    }
+    return 0;
+}
+
+tdb_error tdb_pread_trail(const tdb *db,
+                          struct tdb_decode_state *s,
+                          uint64_t start,
+                          uint64_t end)
+{
+    const struct tdb_pread *p = db->pread;
+    const uint64_t first = start / BLOCK_SIZE;
+    const uint64_t size = end - start;
+    struct tdb_cache_entry *e;
+    uint64_t block;
+    int ret = 0;
+
+    tdb_pread_release(db, s);
+
+    if (end <= (first + 1) * BLOCK_SIZE){
+        /* the common case: decode the trail in the cached block */
+        if ((ret = get_block(p, first, &e)))
+            return ret;
+        s->trail_block = e;
+        s->data = &e->data[start - first * BLOCK_SIZE];
+        return 0;
+    }
+
+    if ((ret = reserve_buffer(s, size + BLOCK_PADDING)))
+        return ret;
+
+    if (size > BLOCK_SIZE){
+        if ((ret = read_range(p, s->trail_buf, start, size, size + BLOCK_PADDING)))
+            return ret;
+    }else{
+        /* copy the trail from two consecutive blocks */
+        memset(&s->trail_buf[size], 0, BLOCK_PADDING);
+        for (block = first; block * BLOCK_SIZE < end; block++){
+            const uint64_t block_start = block * BLOCK_SIZE;
+            const uint64_t from = start > block_start ? start: block_start;
+            const uint64_t to = end < block_start + BLOCK_SIZE ?
+                                end: block_start + BLOCK_SIZE;
+
+            if ((ret = get_block(p, block, &e)))
+                return ret;
+            memcpy(&s->trail_buf[from - start],
+                   &e->data[from - block_start],
+                   to - from);
+            tdb_cache_release(p->blocks, e);
+        }
+    }
+    s->data = s->trail_buf;
+    return 0;
+}
+
+void tdb_pread_release(const tdb *db, struct tdb_decode_state *s)
+{
+    if (s->trail_block){
+        tdb_cache_release(db->pread->blocks, s->trail_block);
+        s->trail_block = NULL;
+    }
+}
+
+void tdb_pread_advise(const struct tdb_pread *p,
+                      uint64_t start,
+                      uint64_t end,
+                      int advice)
+{
+    if (start < end)
+        posix_fadvise(p->fd,
+                      (off_t)(p->offset + start),
+                      (off_t)(end - start),
+                      advice);
+}
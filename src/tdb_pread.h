@@ -0,0 +1,45 @@
+#ifndef __TDB_PREAD_H__
+#define __TDB_PREAD_H__
+
+#include <stdint.h>
+
+#include "tdb_internal.h"
+
+/*
+With TDB_OPT_PREAD_CACHE_SIZE, trails.data is not mapped. Trails are
+read with pread() in fixed-size blocks that are kept in a block cache.
+*/
+
+struct tdb_pread;
+
+struct tdb_pread *tdb_pread_new(int fd,
+                                uint64_t offset,
+                                uint64_t size,
+                                uint64_t cache_size);
+
+void tdb_pread_free(struct tdb_pread *p);
+
+/*
+Point s->data to the bytes [start, end) of trails.data. The data stays
+valid until the next call or tdb_pread_release().
+*/
+tdb_error tdb_pread_trail(const tdb *db,
+                          struct tdb_decode_state *s,
+                          uint64_t start,
+                          uint64_t end);
+
+void tdb_pread_release(const tdb *db, struct tdb_decode_state *s);
+
+/* read the bytes [start, start + size) of trails.data without caching */
+tdb_error tdb_pread_read(const struct tdb_pread *p,
+                         char *dst,
+                         uint64_t start,
+                         uint64_t size);
+
+/* posix_fadvise() the bytes [start, end) of trails.data */
+void tdb_pread_advise(const struct tdb_pread *p,
+                      uint64_t start,
+                      uint64_t end,
+                      int advice);
+
+#endif /* __TDB_PREAD_H__ */
@@ -0,0 +1,803 @@
+#define _DEFAULT_SOURCE /* strdup() */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "traildb.h"
+#include "tdb_internal.h"
+#include "tdb_io.h"
+
+/*
+A segmented TrailDB is a directory of immutable TrailDBs, segments, and
+a manifest that lists them, one decimal number per line:
+
+[ next segment ID ]
+[ segment ID      ] for each segment, from the oldest to the newest
+
+Segments are stored as segment.<ID> or segment.<ID>.tdb. The manifest is
+replaced atomically, so a new segment is complete before it is listed
+and segments merged by tdb_segments_compact() are removed only after
+they are no longer listed.
+
+Segments are reference counted: a cursor keeps the segments it was
+created with, so segments can be added and compacted while cursors are
+used in other threads.
+
+Many handles, in this process or others, may open the same directory.
+Writers of the manifest hold an exclusive flock() on manifest.lock and
+re-read the manifest before changing it, readers hold a shared one
+while they read the manifest and open its segments. Compactions are
+serialized by compact.lock, so two handles never merge the same
+segments.
+*/
+
+struct segment{
+    tdb *db;
+    uint64_t id;
+    uint64_t num_refs;
+};
+
+struct tdb_segments{
+    pthread_mutex_t lock;
+    /* compactions run one at a time, without holding lock */
+    pthread_mutex_t compact_lock;
+    char *root;
+    struct segment **segments;
+    uint64_t num_segments;
+    uint64_t next_id;
+};
+
+struct tdb_segments_cursor{
+    struct segment **segments;
+    uint64_t num_segments;
+    tdb_cursor **cursors;
+    tdb_multi_cursor *mc;
+    /* the next trail of each segment, see tdb_segments_next_trail() */
+    uint64_t *next_trails;
+    uint8_t uuid[16];
+};
+
+static struct segment *segment_retain(struct segment *seg)
+{
+    __atomic_add_fetch(&seg->num_refs, 1, __ATOMIC_RELAXED);
+    return seg;
+}
+
+static void segment_release(struct segment *seg)
+{
+    if (!__atomic_sub_fetch(&seg->num_refs, 1, __ATOMIC_ACQ_REL)){
+        tdb_close(seg->db);
+        free(seg);
+    }
+}
+
+static tdb_error segment_open(const tdb_segments *sg,
+                              uint64_t id,
+                              struct segment **seg)
+{
+    char path[TDB_MAX_PATH_SIZE];
+    tdb *db = NULL;
+    int ret = 0;
+
+    TDB_PATH(path, "%s/segment.%"PRIu64, sg->root, id);
+    if (!(db = tdb_init())){
+        ret = TDB_ERR_NOMEM;
+        goto done;
+    }
+    if ((ret = tdb_open(db, path)))
+        goto done;
+
+    /* UUIDs must be sorted, see tdb_segments_next_trail() */
+    if (db->version == TDB_VERSION_V0){
+        ret = TDB_ERR_INCOMPATIBLE_VERSION;
+        goto done;
+    }
+
+    if (!(*seg = malloc(sizeof(struct segment)))){
+        ret = TDB_ERR_NOMEM;
+        goto done;
+    }
+    (*seg)->db = db;
+    (*seg)->id = id;
+    (*seg)->num_refs = 1;
+    return 0;
+done:
+    tdb_close(db);
+    return ret;
+}
+
+/* all segments must have the same fields as the first one */
+static tdb_error check_fields(const tdb *first, const tdb *db)
+{
+    tdb_field field;
+
+    if (!first)
+        return 0;
+
+    if (first->num_fields != db->num_fields)
+        return TDB_ERR_APPEND_FIELDS_MISMATCH;
+
+    for (field = 1; field < db->num_fields; field++)
+        if (strcmp(first->field_names[field], db->field_names[field]))
+            return TDB_ERR_APPEND_FIELDS_MISMATCH;
+    return 0;
+}
+
+static tdb_error add_segment(tdb_segments *sg, struct segment *seg)
+{
+    struct segment **segments;
+
+    if (!(segments = realloc(sg->segments,
+                             (sg->num_segments + 1) * sizeof(seg))))
+        return TDB_ERR_NOMEM;
+
+    segments[sg->num_segments++] = seg;
+    sg->segments = segments;
+    return 0;
+}
+
+/* write the manifest atomically, readers never see a partial file */
+static tdb_error manifest_store(const tdb_segments *sg,
+                                struct segment **segments,
+                                uint64_t num_segments,
+                                uint64_t next_id)
+{
+    char path[TDB_MAX_PATH_SIZE];
+    char tmp_path[TDB_MAX_PATH_SIZE];
+    FILE *out = NULL;
+    uint64_t i;
+    int ret = 0;
+
+    TDB_PATH(path, "%s/manifest", sg->root);
+    TDB_PATH(tmp_path, "%s.tmp.%d", path, (int)getpid());
+
+    TDB_OPEN(out, tmp_path, "w");
+    TDB_FPRINTF(out, "%"PRIu64"\n", next_id);
+    for (i = 0; i < num_segments; i++)
+        TDB_FPRINTF(out, "%"PRIu64"\n", segments[i]->id);
+
+    ret = fclose(out) ? TDB_ERR_IO_CLOSE: 0;
+    out = NULL;
+    if (!ret && rename(tmp_path, path))
+        ret = TDB_ERR_IO_WRITE;
+    if (ret)
+        unlink(tmp_path);
+done:
+    if (out){
+        fclose(out);
+        unlink(tmp_path);
+    }
+    return ret;
+}
+
+/* a missing manifest is a new segmented TrailDB */
+static tdb_error manifest_read(const tdb_segments *sg,
+                               uint64_t *next_id,
+                               uint64_t **ids,
+                               uint64_t *num_ids)
+{
+    char path[TDB_MAX_PATH_SIZE];
+    FILE *in = NULL;
+    uint64_t *new_ids;
+    uint64_t id, size = 0;
+    int ret = 0;
+    int n;
+
+    *next_id = *num_ids = 0;
+    *ids = NULL;
+
+    TDB_PATH(path, "%s/manifest", sg->root);
+    if (!(in = fopen(path, "r"))){
+        if (errno != ENOENT)
+            ret = TDB_ERR_IO_OPEN;
+        goto done;
+    }
+
+    if (fscanf(in, "%"SCNu64, next_id) != 1){
+        ret = TDB_ERR_INVALID_MANIFEST_FILE;
+        goto done;
+    }
+
+    while ((n = fscanf(in, "%"SCNu64, &id)) == 1){
+        if (id >= *next_id){
+            ret = TDB_ERR_INVALID_MANIFEST_FILE;
+            goto done;
+        }
+        if (*num_ids == size){
+            size = size ? size * 2: 16;
+            if (!(new_ids = realloc(*ids, size * 8))){
+                ret = TDB_ERR_NOMEM;
+                goto done;
+            }
+            *ids = new_ids;
+        }
+        (*ids)[(*num_ids)++] = id;
+    }
+    if (n != EOF)
+        ret = TDB_ERR_INVALID_MANIFEST_FILE;
+done:
+    if (in)
+        fclose(in);
+    return ret;
+}
+
+/*
+Make the list of segments match the manifest, which other handles may
+have changed. Segments that are still listed are kept, new ones are
+opened and unlisted ones are released: cursors keep them readable even
+if their files are gone. Called with sg->lock and manifest.lock held.
+*/
+static tdb_error manifest_sync(tdb_segments *sg)
+{
+    struct segment **segments = NULL;
+    struct segment *seg;
+    uint64_t *ids = NULL;
+    uint64_t i, j, next_id, num_ids, num_segments = 0;
+    int ret = 0;
+
+    if ((ret = manifest_read(sg, &next_id, &ids, &num_ids)))
+        goto done;
+
+    if (!(segments = malloc((num_ids + 1) * sizeof(seg)))){
+        ret = TDB_ERR_NOMEM;
+        goto done;
+    }
+
+    for (i = 0; i < num_ids; i++){
+        for (seg = NULL, j = 0; j < sg->num_segments && !seg; j++)
+            if (sg->segments[j]->id == ids[i])
+                seg = segment_retain(sg->segments[j]);
+        if (!seg){
+            if ((ret = segment_open(sg, ids[i], &seg)))
+                goto done;
+            if ((ret = check_fields(num_segments ? segments[0]->db: NULL,
+                                    seg->db))){
+                segment_release(seg);
+                goto done;
+            }
+        }
+        segments[num_segments++] = seg;
+    }
+
+    for (i = 0; i < sg->num_segments; i++)
+        segment_release(sg->segments[i]);
+    free(sg->segments);
+    sg->segments = segments;
+    sg->num_segments = num_segments;
+    sg->next_id = next_id;
+    segments = NULL;
+    num_segments = 0;
+done:
+    for (i = 0; i < num_segments; i++)
+        segment_release(segments[i]);
+    free(segments);
+    free(ids);
+    return ret;
+}
+
+/* closing the descriptor releases the lock */
+static tdb_error lock_file(const tdb_segments *sg,
+                           const char *name,
+                           int operation,
+                           int *fd)
+{
+    char path[TDB_MAX_PATH_SIZE];
+    int ret = 0;
+
+    TDB_PATH(path, "%s/%s", sg->root, name);
+    if ((*fd = open(path, O_RDONLY | O_CREAT, 0644)) == -1){
+        ret = TDB_ERR_IO_OPEN;
+        goto done;
+    }
+    if (flock(*fd, operation)){
+        close(*fd);
+        *fd = -1;
+        ret = TDB_ERR_IO_OPEN;
+    }
+done:
+    return ret;
+}
+
+static void unlock_file(int *fd)
+{
+    if (*fd != -1){
+        close(*fd);
+        *fd = -1;
+    }
+}
+
+/*
+Reserve an ID for a new segment. The next ID is stored before the
+segment is written, so a leftover of a failed write is never reused.
+Called with manifest.lock held, after manifest_sync().
+*/
+static tdb_error reserve_id(tdb_segments *sg, uint64_t *id)
+{
+    int ret = manifest_store(sg,
+                             sg->segments,
+                             sg->num_segments,
+                             sg->next_id + 1);
+    if (!ret)
+        *id = sg->next_id++;
+    return ret;
+}
+
+/* TrailDB directories are flat, so a single level is enough */
+static void remove_tree(const char *path)
+{
+    char entry_path[TDB_MAX_PATH_SIZE];
+    struct dirent *entry;
+    DIR *dir;
+
+    if ((dir = opendir(path))){
+        while ((entry = readdir(dir)))
+            if (strcmp(entry->d_name, ".") && strcmp(entry->d_name, ".."))
+                if (!tdb_path(entry_path, "%s/%s", path, entry->d_name))
+                    unlink(entry_path);
+        closedir(dir);
+        rmdir(path);
+    }else
+        unlink(path);
+}
+
+/*
+Remove the files of a segment: its directory, or its package with the
+sidecars next to it. This is best-effort, leftovers are never listed.
+*/
+static void remove_segment_files(const tdb_segments *sg, uint64_t id)
+{
+    char prefix[32];
+    char path[TDB_MAX_PATH_SIZE];
+    struct dirent *entry;
+    uint64_t len;
+    DIR *dir;
+
+    len = (uint64_t)snprintf(prefix, sizeof(prefix), "segment.%"PRIu64, id);
+    if (!(dir = opendir(sg->root)))
+        return;
+
+    while ((entry = readdir(dir)))
+        if (!strncmp(entry->d_name, prefix, len) &&
+            (!entry->d_name[len] || entry->d_name[len] == '.'))
+            if (!tdb_path(path, "%s/%s", sg->root, entry->d_name))
+                remove_tree(path);
+    closedir(dir);
+}
+
+TDB_EXPORT tdb_segments *tdb_segments_init(void)
+{
+    tdb_segments *sg;
+
+    if (!(sg = calloc(1, sizeof(tdb_segments))))
+        return NULL;
+
+    pthread_mutex_init(&sg->lock, NULL);
+    pthread_mutex_init(&sg->compact_lock, NULL);
+    return sg;
+}
+
+TDB_EXPORT tdb_error tdb_segments_open(tdb_segments *sg, const char *root)
+{
+    if (!sg)
+        return TDB_ERR_HANDLE_IS_NULL;
+
+    if (sg->root)
+        return TDB_ERR_HANDLE_ALREADY_OPENED;
+
+    /* create the directory of a new segmented TrailDB, if necessary */
+    mkdir(root, 0755);
+    if (!(sg->root = strdup(root)))
+        return TDB_ERR_NOMEM;
+
+    return tdb_segments_reload(sg);
+}
+
+TDB_EXPORT tdb_error tdb_segments_reload(tdb_segments *sg)
+{
+    int lock_fd = -1;
+    int ret;
+
+    pthread_mutex_lock(&sg->lock);
+    /* a compaction can't remove the listed segments before they are open */
+    if (!(ret = lock_file(sg, "manifest.lock", LOCK_SH, &lock_fd)))
+        ret = manifest_sync(sg);
+    unlock_file(&lock_fd);
+    pthread_mutex_unlock(&sg->lock);
+    return ret;
+}
+
+TDB_EXPORT void tdb_segments_close(tdb_segments *sg)
+{
+    uint64_t i;
+
+    if (sg){
+        for (i = 0; i < sg->num_segments; i++)
+            segment_release(sg->segments[i]);
+        pthread_mutex_destroy(&sg->lock);
+        pthread_mutex_destroy(&sg->compact_lock);
+        free(sg->segments);
+        free(sg->root);
+        free(sg);
+    }
+}
+
+TDB_EXPORT tdb_error tdb_segments_add(tdb_segments *sg, const char *root)
+{
+    char src[TDB_MAX_PATH_SIZE];
+    char dst[TDB_MAX_PATH_SIZE];
+    struct segment *seg = NULL;
+    struct stat stats;
+    uint64_t id;
+    int is_added = 0;
+    int lock_fd = -1;
+    int ret = 0;
+
+    /* like in tdb_open(), a package may be given without its suffix */
+    TDB_PATH(src, "%s", root);
+    if (stat(src, &stats) == -1){
+        TDB_PATH(src, "%s.tdb", root);
+        if (stat(src, &stats) == -1)
+            return TDB_ERR_IO_OPEN;
+    }
+
+    pthread_mutex_lock(&sg->lock);
+
+    if ((ret = lock_file(sg, "manifest.lock", LOCK_EX, &lock_fd)))
+        goto done;
+
+    if ((ret = manifest_sync(sg)) || (ret = reserve_id(sg, &id)))
+        goto done;
+
+    if (S_ISDIR(stats.st_mode)){
+        TDB_PATH(dst, "%s/segment.%"PRIu64, sg->root, id);
+    }else{
+        TDB_PATH(dst, "%s/segment.%"PRIu64".tdb", sg->root, id);
+    }
+
+    if (rename(src, dst)){
+        ret = TDB_ERR_IO_WRITE;
+        goto done;
+    }
+    is_added = 1;
+
+    if ((ret = segment_open(sg, id, &seg)))
+        goto done;
+
+    if ((ret = check_fields(sg->num_segments ? sg->segments[0]->db: NULL,
+                            seg->db)))
+        goto done;
+
+    if ((ret = add_segment(sg, seg)))
+        goto done;
+
+    if ((ret = manifest_store(sg, sg->segments, sg->num_segments, sg->next_id)))
+        --sg->num_segments;
+done:
+    if (ret){
+        if (seg)
+            segment_release(seg);
+        /* give the TrailDB back to the caller */
+        if (is_added)
+            rename(dst, src);
+    }
+    unlock_file(&lock_fd);
+    pthread_mutex_unlock(&sg->lock);
+    return ret;
+}
+
+TDB_EXPORT uint64_t tdb_segments_num_segments(tdb_segments *sg)
+{
+    uint64_t num_segments;
+
+    pthread_mutex_lock(&sg->lock);
+    num_segments = sg->num_segments;
+    pthread_mutex_unlock(&sg->lock);
+    return num_segments;
+}
+
+/*
+Merge segments with less than max_events events to a new segment that
+replaces the oldest of them. The segments are merged without holding
+sg->lock or manifest.lock, so readers and tdb_segments_add() are not
+blocked.
+*/
+TDB_EXPORT tdb_error tdb_segments_compact(tdb_segments *sg,
+                                          uint64_t max_events)
+{
+    char path[TDB_MAX_PATH_SIZE];
+    struct segment **merged = NULL;
+    struct segment **segments = NULL;
+    struct segment *seg = NULL;
+    const char **field_names = NULL;
+    tdb_cons *cons = NULL;
+    const tdb *first;
+    uint64_t i, j, id, num_merged = 0, num_segments = 0;
+    int is_reserved = 0;
+    int compact_fd = -1;
+    int lock_fd = -1;
+    int ret = 0;
+
+    pthread_mutex_lock(&sg->compact_lock);
+
+    /* compactions of other handles would merge the same segments */
+    if ((ret = lock_file(sg, "compact.lock", LOCK_EX, &compact_fd)))
+        goto done;
+
+    pthread_mutex_lock(&sg->lock);
+    if (!(ret = lock_file(sg, "manifest.lock", LOCK_EX, &lock_fd)) &&
+        !(ret = manifest_sync(sg))){
+        if (!(merged = malloc((sg->num_segments + 1) * sizeof(seg))))
+            ret = TDB_ERR_NOMEM;
+        else{
+            for (i = 0; i < sg->num_segments; i++)
+                if (tdb_num_events(sg->segments[i]->db) < max_events)
+                    merged[num_merged++] = segment_retain(sg->segments[i]);
+            if (num_merged > 1 && !(ret = reserve_id(sg, &id)))
+                is_reserved = 1;
+        }
+    }
+    unlock_file(&lock_fd);
+    pthread_mutex_unlock(&sg->lock);
+
+    if (!is_reserved)
+        goto done;
+
+    first = merged[0]->db;
+    if (!(field_names = malloc(first->num_fields * sizeof(char*))) ||
+        !(cons = tdb_cons_init())){
+        ret = TDB_ERR_NOMEM;
+        goto done;
+    }
+    for (i = 1; i < first->num_fields; i++)
+        field_names[i - 1] = first->field_names[i];
+
+    /* the new segment has the format of the oldest merged segment */
+    if (!first->is_package)
+        tdb_cons_set_opt(cons,
+                         TDB_OPT_CONS_OUTPUT_FORMAT,
+                         opt_val(TDB_OPT_CONS_OUTPUT_FORMAT_DIR));
+
+    TDB_PATH(path, "%s/segment.%"PRIu64, sg->root, id);
+    if ((ret = tdb_cons_open(cons, path, field_names, first->num_fields - 1)))
+        goto done;
+
+    /* events of the same trail are merged in time order by the cons */
+    for (i = 0; i < num_merged; i++)
+        if ((ret = tdb_cons_append(cons, merged[i]->db)))
+            goto done;
+
+    if ((ret = tdb_cons_finalize(cons)))
+        goto done;
+
+    if ((ret = segment_open(sg, id, &seg)))
+        goto done;
+
+    pthread_mutex_lock(&sg->lock);
+    if (!(ret = lock_file(sg, "manifest.lock", LOCK_EX, &lock_fd)) &&
+        !(ret = manifest_sync(sg)) &&
+        !(segments = malloc(sg->num_segments * sizeof(seg))))
+        ret = TDB_ERR_NOMEM;
+    if (segments){
+        /*
+        segments may have been added meanwhile, merged ones remain: only
+        compactions remove segments and they are serialized
+        */
+        for (i = 0, j = 0; i < sg->num_segments; i++){
+            if (j < num_merged && sg->segments[i] == merged[j]){
+                if (!j++)
+                    segments[num_segments++] = seg;
+            }else
+                segments[num_segments++] = sg->segments[i];
+        }
+        if (j != num_merged)
+            ret = TDB_ERR_INVALID_MANIFEST_FILE;
+        else if (!(ret = manifest_store(sg,
+                                        segments,
+                                        num_segments,
+                                        sg->next_id))){
+            /* release the references of the list */
+            for (i = 0; i < num_merged; i++)
+                segment_release(merged[i]);
+            free(sg->segments);
+            sg->segments = segments;
+            sg->num_segments = num_segments;
+            segments = NULL;
+            seg = NULL;
+        }
+    }
+    pthread_mutex_unlock(&sg->lock);
+
+    /*
+    cursors keep the merged segments open, their files can go. Readers
+    that saw the old manifest opened them before manifest.lock was taken
+    */
+    if (!ret)
+        for (i = 0; i < num_merged; i++)
+            remove_segment_files(sg, merged[i]->id);
+    unlock_file(&lock_fd);
+done:
+    if (cons)
+        tdb_cons_close(cons);
+    if (seg)
+        segment_release(seg);
+    if (ret && is_reserved)
+        remove_segment_files(sg, id);
+    for (i = 0; i < num_merged; i++)
+        segment_release(merged[i]);
+    free(merged);
+    free(segments);
+    free(field_names);
+    unlock_file(&lock_fd);
+    unlock_file(&compact_fd);
+    pthread_mutex_unlock(&sg->compact_lock);
+    return ret;
+}
+
+TDB_EXPORT tdb_segments_cursor *tdb_segments_cursor_new(tdb_segments *sg)
+{
+    tdb_segments_cursor *c;
+    uint64_t i;
+
+    if (!(c = calloc(1, sizeof(tdb_segments_cursor))))
+        return NULL;
+
+    /* the cursor reads the segments that exist now */
+    pthread_mutex_lock(&sg->lock);
+    if ((c->segments = malloc((sg->num_segments + 1) *
+                              sizeof(struct segment*)))){
+        c->num_segments = sg->num_segments;
+        for (i = 0; i < sg->num_segments; i++)
+            c->segments[i] = segment_retain(sg->segments[i]);
+    }
+    pthread_mutex_unlock(&sg->lock);
+
+    if (!c->segments)
+        goto err;
+
+    if (!(c->cursors = calloc(c->num_segments + 1, sizeof(tdb_cursor*))))
+        goto err;
+
+    if (!(c->next_trails = calloc(c->num_segments + 1, 8)))
+        goto err;
+
+    for (i = 0; i < c->num_segments; i++)
+        if (!(c->cursors[i] = tdb_cursor_new(c->segments[i]->db)))
+            goto err;
+
+    if (c->num_segments)
+        if (!(c->mc = tdb_multi_cursor_new(c->cursors, c->num_segments)))
+            goto err;
+
+    return c;
+err:
+    tdb_segments_cursor_free(c);
+    return NULL;
+}
+
+TDB_EXPORT void tdb_segments_cursor_free(tdb_segments_cursor *c)
+{
+    uint64_t i;
+
+    if (c){
+        if (c->mc)
+            tdb_multi_cursor_free(c->mc);
+        if (c->cursors)
+            for (i = 0; i < c->num_segments; i++)
+                if (c->cursors[i])
+                    tdb_cursor_free(c->cursors[i]);
+        for (i = 0; i < c->num_segments; i++)
+            segment_release(c->segments[i]);
+        free(c->segments);
+        free(c->cursors);
+        free(c->next_trails);
+        free(c);
+    }
+}
+
+TDB_EXPORT tdb_error tdb_segments_get_trail(tdb_segments_cursor *c,
+                                            const uint8_t uuid[16])
+{
+    uint64_t i, trail_id;
+    int found = 0;
+    tdb_error err;
+
+    for (i = 0; i < c->num_segments; i++){
+        if (tdb_get_trail_id(c->segments[i]->db, uuid, &trail_id))
+            tdb_cursor_clear(c->cursors[i]);
+        else{
+            if ((err = tdb_get_trail(c->cursors[i], trail_id)))
+                return err;
+            found = 1;
+        }
+    }
+    if (c->mc)
+        tdb_multi_cursor_reset(c->mc);
+    return found ? 0: TDB_ERR_UNKNOWN_UUID;
+}
+
+/* does the next trail of segment i have the UUID key */
+static int is_next_trail(const tdb_segments_cursor *c,
+                         uint64_t i,
+                         __uint128_t key)
+{
+    const tdb *db = c->segments[i]->db;
+    const uint64_t next = c->next_trails[i];
+    __uint128_t next_key;
+
+    if (next < db->num_trails){
+        memcpy(&next_key, tdb_get_uuid(db, next), 16);
+        return next_key == key;
+    }
+    return 0;
+}
+
+/*
+UUIDs are sorted in every segment, so trails are visited in the order of
+UUIDs by merging the segments. After the last trail, the enumeration
+starts over.
+*/
+TDB_EXPORT tdb_error tdb_segments_next_trail(tdb_segments_cursor *c,
+                                             const uint8_t **uuid)
+{
+    __uint128_t key, min_key = 0;
+    uint64_t i;
+    int found = 0;
+    tdb_error err;
+
+    *uuid = NULL;
+    for (i = 0; i < c->num_segments; i++){
+        const tdb *db = c->segments[i]->db;
+        uint64_t *next = &c->next_trails[i];
+
+        while (*next < db->num_trails && tdb_trail_is_deleted(db, *next))
+            ++*next;
+        if (*next < db->num_trails){
+            memcpy(&key, tdb_get_uuid(db, *next), 16);
+            if (!found || key < min_key){
+                min_key = key;
+                found = 1;
+            }
+        }
+    }
+    if (!found){
+        for (i = 0; i < c->num_segments; i++){
+            tdb_cursor_clear(c->cursors[i]);
+            c->next_trails[i] = 0;
+        }
+        return 0;
+    }
+
+    for (i = 0; i < c->num_segments; i++){
+        if (is_next_trail(c, i, min_key)){
+            if ((err = tdb_get_trail(c->cursors[i], c->next_trails[i])))
+                return err;
+        }else
+            tdb_cursor_clear(c->cursors[i]);
+    }
+
+    /* advance only after all segments succeeded, so errors can be retried */
+    for (i = 0; i < c->num_segments; i++)
+        if (is_next_trail(c, i, min_key))
+            ++c->next_trails[i];
+    tdb_multi_cursor_reset(c->mc);
+
+    memcpy(c->uuid, &min_key, 16);
+    *uuid = c->uuid;
+    return 0;
+}
+
+TDB_EXPORT const tdb_multi_event *tdb_segments_cursor_next(
+    tdb_segments_cursor *c)
+{
+    return c->mc ? tdb_multi_cursor_next(c->mc): NULL;
+}
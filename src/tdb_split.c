@@ -0,0 +1,135 @@
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "traildb.h"
+#include "tdb_internal.h"
+#include "xxhash/xxhash.h"
+
+/*
+Split partitions the trails of a TrailDB to shards and writes each shard
+with cons_extract_trails(), so trails are copied without re-encoding.
+Shards are independent, so they are written on a pool of worker threads
+that take the next unwritten shard until all shards are done.
+*/
+
+struct split_shard{
+    const char *root;
+    uint64_t *trail_ids;
+    uint64_t num_trails;
+    tdb_error ret;
+};
+
+struct split{
+    const tdb *db;
+    struct split_shard *shards;
+    uint64_t num_shards;
+    uint64_t next_shard;
+    int prune_lexicons;
+};
+
+static void *split_worker(void *arg)
+{
+    struct split *sp = (struct split*)arg;
+    uint64_t idx;
+
+    while ((idx = __atomic_fetch_add(&sp->next_shard,
+                                     1,
+                                     __ATOMIC_RELAXED)) < sp->num_shards){
+        struct split_shard *shard = &sp->shards[idx];
+        shard->ret = cons_extract_trails(sp->db,
+                                         shard->trail_ids,
+                                         shard->num_trails,
+                                         shard->root,
+                                         sp->prune_lexicons);
+    }
+    return NULL;
+}
+
+/*
+The shard of a trail. UUID ranges contain an equal number of trails,
+since trails are sorted by UUID.
+*/
+static uint64_t split_shard_of(const tdb *db,
+                               uint64_t trail_id,
+                               uint64_t num_shards,
+                               uint64_t flags)
+{
+    if (flags & TDB_SPLIT_UUID_HASH)
+        return XXH64(tdb_get_uuid(db, trail_id), 16, 0) % num_shards;
+    else
+        return (uint64_t)(((__uint128_t)trail_id * num_shards) /
+                          db->num_trails);
+}
+
+TDB_EXPORT tdb_error tdb_split(const tdb *db,
+                               const char **roots,
+                               uint64_t num_shards,
+                               uint64_t flags,
+                               uint64_t num_threads)
+{
+    struct split sp = {.db = db,
+                       .num_shards = num_shards,
+                       .prune_lexicons = !!(flags & TDB_SPLIT_PRUNE_LEXICONS)};
+    pthread_t *threads = NULL;
+    uint64_t *trail_ids = NULL;
+    uint64_t i, offset, num_started = 0;
+    tdb_error ret = 0;
+
+    if (!num_shards || !num_threads)
+        return TDB_ERR_INVALID_OPTION_VALUE;
+
+    /* UUIDs of V0 are not sorted, see cons_extract_trails() */
+    if (db->version == TDB_VERSION_V0)
+        return TDB_ERR_INCOMPATIBLE_VERSION;
+
+    if (num_threads > num_shards)
+        num_threads = num_shards;
+
+    if (!(sp.shards = calloc(num_shards, sizeof(struct split_shard))) ||
+        !(trail_ids = malloc(db->num_trails * 8 + 8)) ||
+        !(threads = calloc(num_threads, sizeof(pthread_t)))){
+        ret = TDB_ERR_NOMEM;
+        goto done;
+    }
+
+    /* count trails per shard first, so shards can share trail_ids */
+    for (i = 0; i < db->num_trails; i++)
+        ++sp.shards[split_shard_of(db, i, num_shards, flags)].num_trails;
+
+    for (offset = 0, i = 0; i < num_shards; i++){
+        sp.shards[i].root = roots[i];
+        sp.shards[i].trail_ids = &trail_ids[offset];
+        offset += sp.shards[i].num_trails;
+        sp.shards[i].num_trails = 0;
+    }
+
+    for (i = 0; i < db->num_trails; i++){
+        struct split_shard *shard =
+            &sp.shards[split_shard_of(db, i, num_shards, flags)];
+        shard->trail_ids[shard->num_trails++] = i;
+    }
+
+    for (; num_started < num_threads; num_started++)
+        if (pthread_create(&threads[num_started], NULL, split_worker, &sp))
+            break;
+
+    /* started threads write all shards, otherwise this thread does */
+    if (!num_started)
+        split_worker(&sp);
+
+    for (i = 0; i < num_started; i++)
+        pthread_join(threads[i], NULL);
+
+    for (i = 0; i < num_shards; i++)
+        if ((ret = sp.shards[i].ret))
+            break;
+done:
+    free(threads);
+    free(trail_ids);
+    free(sp.shards);
+    return ret;
+}
@@ -65,6 +65,31 @@ typedef struct{
 
 typedef struct tdb_multi_cursor tdb_multi_cursor;
 
+typedef struct tdb_catalog tdb_catalog;
+
+typedef struct tdb_segments tdb_segments;
+typedef struct tdb_segments_cursor tdb_segments_cursor;
+
+typedef struct{
+    uint64_t num_trails;
+    uint64_t num_events;
+    uint64_t num_fields;
+    uint64_t min_timestamp;
+    uint64_t max_timestamp;
+    uint64_t version;
+    /* num_fields names, valid for the lifetime of the catalog */
+    const char * const *field_names;
+    /* num_fields sizes as in tdb_lexicon_size(), valid likewise */
+    const uint64_t *lexicon_sizes;
+} tdb_catalog_info;
+
+/* see tdb_get_trail_meta() */
+typedef struct{
+    uint64_t num_events;
+    uint64_t min_timestamp;
+    uint64_t max_timestamp;
+} tdb_trail_meta;
+
 #define tdb_item_field32(item) (item & 127)
 #define tdb_item_val32(item)   ((item >> 8) & UINT32_MAX)
 #define tdb_item_is32(item)    (!(item & 128))
@@ -104,10 +129,24 @@ typedef enum{
     TDB_OPT_ONLY_DIFF_ITEMS = 100,
     TDB_OPT_EVENT_FILTER = 101,
     TDB_OPT_CURSOR_EVENT_BUFFER_SIZE = 102,
+    TDB_OPT_TRAIL_CACHE_SIZE = 103,
+    TDB_OPT_TRAIL_CACHE_HITS = 104,
+    TDB_OPT_TRAIL_CACHE_MISSES = 105,
+    TDB_OPT_PERSIST_UUID_ORDER = 106,
+    TDB_OPT_MMAP_HUGEPAGES = 107,
+    TDB_OPT_MMAP_POPULATE = 108,
+    TDB_OPT_MMAP_WHOLE_PACKAGE = 109,
+    TDB_OPT_PREAD_CACHE_SIZE = 110,
+    TDB_OPT_BLOCK_CACHE_SIZE = 111,
 
     /* writing */
     TDB_OPT_CONS_OUTPUT_FORMAT = 1001,
     TDB_OPT_CONS_NO_BIGRAMS = 1002,
+    TDB_OPT_CONS_PACKAGE_ALIGNMENT = 1003,
+    TDB_OPT_CONS_COMPRESSION = 1004,
+    TDB_OPT_CONS_MEMORY_LIMIT = 1005,
+    TDB_OPT_CONS_CODEBOOK = 1006,
+    TDB_OPT_CONS_TRAIL_META = 1007,
 
 } tdb_opt_key;
 
@@ -122,6 +161,15 @@ static const tdb_opt_value TDB_FALSE __attribute__((unused)) = {.value = 0};
 #define opt_val(x) ((tdb_opt_value){.value = x})
 #define TDB_OPT_CONS_OUTPUT_FORMAT_DIR 0
 #define TDB_OPT_CONS_OUTPUT_FORMAT_PACKAGE 1
+#define TDB_OPT_CONS_COMPRESSION_NONE 0
+#define TDB_OPT_CONS_COMPRESSION_ZSTD 1
+#define TDB_OPT_CONS_TRAIL_META_NONE 0
+#define TDB_OPT_CONS_TRAIL_META_PLAIN 1
+#define TDB_OPT_CONS_TRAIL_META_PACKED 2
+
+/* flags of tdb_split() */
+#define TDB_SPLIT_UUID_HASH 1
+#define TDB_SPLIT_PRUNE_LEXICONS 2
 
 typedef enum {
     TDB_EVENT_FILTER_UNKNOWN_TERM = 0,
@@ -11,7 +11,14 @@
 
 #define TDB_VERSION_V0 0LLU
 #define TDB_VERSION_V0_1 1LLU
+/* block-compressed trails, written only with TDB_OPT_CONS_COMPRESSION */
+#define TDB_VERSION_V0_2 2LLU
+/* the version of uncompressed TrailDBs */
 #define TDB_VERSION_LATEST TDB_VERSION_V0_1
+/* the newest version that tdb_open() can read */
+#define TDB_VERSION_MAX TDB_VERSION_V0_2
+
+#define TDB_UNKNOWN_TRAIL_ID UINT64_MAX
 
 /*
 -----------------------
@@ -54,6 +61,36 @@ tdb_error tdb_cons_append(tdb_cons *cons, const tdb *db);
 /* Finalize a constructor */
 tdb_error tdb_cons_finalize(tdb_cons *cons);
 
+/*
+Write the given trails of an existing TrailDB to a new TrailDB without
+re-encoding them. Event filters are not supported.
+*/
+tdb_error tdb_extract_trails(const tdb *db,
+                             const uint64_t *trail_ids,
+                             uint64_t num_trail_ids,
+                             const char *root);
+
+/*
+Split an existing TrailDB to num_shards TrailDBs, one for each root,
+using num_threads threads. Trails are split by UUID ranges unless
+TDB_SPLIT_UUID_HASH is given.
+*/
+tdb_error tdb_split(const tdb *db,
+                    const char **roots,
+                    uint64_t num_shards,
+                    uint64_t flags,
+                    uint64_t num_threads);
+
+/*
+Delete trails given a list of UUIDs, num_uuids * 16 bytes. Deletions are
+stored next to the TrailDB, which is not rewritten. Unknown UUIDs are
+ignored.
+*/
+tdb_error tdb_delete_trails(tdb *db, const uint8_t *uuids, uint64_t num_uuids);
+
+/* Write the trails of an existing TrailDB without deleted trails */
+tdb_error tdb_compact(const tdb *db, const char *root);
+
 /*
 ---------------------------------
 Open TrailDBs and access metadata
@@ -75,12 +112,23 @@ void tdb_dontneed(const tdb *db);
 /* Inform the operating system that this TrailDB will be needed soon */
 void tdb_willneed(const tdb *db);
 
+/*
+Inform the operating system that the given trails will be needed soon.
+Trail IDs that don't exist, like TDB_UNKNOWN_TRAIL_ID, are ignored
+*/
+tdb_error tdb_prefetch_trails(const tdb *db,
+                              const uint64_t *trail_ids,
+                              uint64_t num_trails);
+
 /* Get the number of trails */
 uint64_t tdb_num_trails(const tdb *db);
 
 /* Get the number of events */
 uint64_t tdb_num_events(const tdb *db);
 
+/* Get the number of deleted trails, included in tdb_num_trails() */
+uint64_t tdb_num_deleted_trails(const tdb *db);
+
 /* Get the number of fields */
 uint64_t tdb_num_fields(const tdb *db);
 
@@ -162,6 +210,15 @@ tdb_error tdb_get_trail_id(const tdb *db,
                            const uint8_t uuid[16],
                            uint64_t *trail_id);
 
+/*
+Get Trail IDs given a list of UUIDs, num_uuids * 16 bytes. Unknown UUIDs
+are marked with TDB_UNKNOWN_TRAIL_ID
+*/
+tdb_error tdb_get_trail_ids(const tdb *db,
+                            const uint8_t *uuids,
+                            uint64_t num_uuids,
+                            uint64_t *trail_ids);
+
 /* Translate a hex-encoded UUID to a raw 16-byte UUID */
 tdb_error tdb_uuid_raw(const uint8_t hexuuid[32], uint8_t uuid[16]);
 
@@ -246,6 +303,14 @@ tdb_error tdb_get_trail(tdb_cursor *cursor, uint64_t trail_id);
 /* Get the number of events remaining in this cursor */
 uint64_t tdb_get_trail_length(tdb_cursor *cursor);
 
+/*
+Get the number of events and the first and the last timestamp of a trail.
+O(1) if the TrailDB has trail metadata, see TDB_OPT_CONS_TRAIL_META
+*/
+tdb_error tdb_get_trail_meta(const tdb *db,
+                             uint64_t trail_id,
+                             tdb_trail_meta *meta);
+
 /* Set an event filter for this cursor */
 tdb_error tdb_cursor_set_event_filter(tdb_cursor *cursor,
                                       const struct tdb_event_filter *filter);
@@ -266,6 +331,14 @@ Multi cursor
 tdb_multi_cursor *tdb_multi_cursor_new(tdb_cursor **cursors,
                                        uint64_t num_cursors);
 
+/*
+Create a new multicursor that decodes the underlying cursors
+on num_threads worker threads
+*/
+tdb_multi_cursor *tdb_multi_cursor_new_parallel(tdb_cursor **cursors,
+                                                uint64_t num_cursors,
+                                                uint64_t num_threads);
+
 /*
 Reset the multicursor to reflect the underlying status of individual
 cursors. Call after tdb_get_trail() or tdb_cursor_next()
@@ -289,6 +362,91 @@ const tdb_multi_event *tdb_multi_cursor_peek(tdb_multi_cursor *mcursor);
 /* Free multicursors */
 void tdb_multi_cursor_free(tdb_multi_cursor *mcursor);
 
+/*
+-------
+Catalog
+-------
+*/
+
+/* Create a catalog that keeps at most max_open TrailDBs open */
+tdb_catalog *tdb_catalog_new(uint64_t max_open);
+
+/* Free a catalog and close its TrailDBs */
+void tdb_catalog_free(tdb_catalog *catalog);
+
+/*
+Get an open TrailDB, opening it if necessary. The handle must be
+returned with tdb_catalog_release()
+*/
+tdb_error tdb_catalog_get(tdb_catalog *catalog,
+                          const char *root,
+                          const tdb **db);
+
+/* Release a TrailDB returned by tdb_catalog_get() */
+void tdb_catalog_release(tdb_catalog *catalog, const tdb *db);
+
+/* Get metadata of a TrailDB without keeping it open */
+tdb_error tdb_catalog_get_info(tdb_catalog *catalog,
+                               const char *root,
+                               tdb_catalog_info *info);
+
+/* Get the number of open TrailDBs in the catalog */
+uint64_t tdb_catalog_num_open(tdb_catalog *catalog);
+
+/*
+------------------
+Segmented TrailDBs
+------------------
+*/
+
+/* Init a new handle for a segmented TrailDB */
+tdb_segments *tdb_segments_init(void);
+
+/* Open a segmented TrailDB in the directory root, create it if needed */
+tdb_error tdb_segments_open(tdb_segments *sg, const char *root);
+
+/* Close a segmented TrailDB */
+void tdb_segments_close(tdb_segments *sg);
+
+/* Reload the list of segments, which other handles may have changed */
+tdb_error tdb_segments_reload(tdb_segments *sg);
+
+/*
+Add a finalized TrailDB as the newest segment. The TrailDB is moved
+to the directory of segments
+*/
+tdb_error tdb_segments_add(tdb_segments *sg, const char *root);
+
+/* Get the number of segments */
+uint64_t tdb_segments_num_segments(tdb_segments *sg);
+
+/*
+Merge segments that have less than max_events events to a single
+segment. Safe to call in a background thread
+*/
+tdb_error tdb_segments_compact(tdb_segments *sg, uint64_t max_events);
+
+/* Create a cursor over the current segments */
+tdb_segments_cursor *tdb_segments_cursor_new(tdb_segments *sg);
+
+/* Free a cursor */
+void tdb_segments_cursor_free(tdb_segments_cursor *c);
+
+/* Reset the cursor to the trail of the given UUID in all segments */
+tdb_error tdb_segments_get_trail(tdb_segments_cursor *c,
+                                 const uint8_t uuid[16]);
+
+/*
+Reset the cursor to the next trail in the order of UUIDs. Sets uuid to
+the UUID of the trail or NULL if all trails have been visited, after
+which the enumeration starts over
+*/
+tdb_error tdb_segments_next_trail(tdb_segments_cursor *c,
+                                  const uint8_t **uuid);
+
+/* Return the next event of the trail in the timestamp order */
+const tdb_multi_event *tdb_segments_cursor_next(tdb_segments_cursor *c);
+
 /*
 Return the next event from the cursor
 
@@ -11,11 +11,12 @@
 
 static struct tdbcli_options options;
 
-static const char *OPS[] = {"make", "dump", "index", "merge"};
+static const char *OPS[] = {"make", "dump", "index", "merge", "split"};
 #define OP_MAKE 0
 #define OP_DUMP 1
 #define OP_INDEX 2
 #define OP_MERGE 3
+#define OP_SPLIT 4
 
 long int safely_to_int(const char *str, const char *field)
 {
@@ -40,6 +41,7 @@ static void print_usage_and_exit()
 "dump    dump an existing TrailDB to an output file\n"
 "index   create an index for an existing TrailDB to speed up --filter\n"
 "merge   merges a set of TrailDBs into a new TrailDB\n"
+"split   split an existing TrailDB into shards\n"
 "\n"
 "OPTIONS:\n"
 "-c --csv          read input as CSV or output CSV (default)\n"
@@ -55,6 +57,8 @@ static void print_usage_and_exit()
 "                    (default: a.tdb)\n"
 "                   for 'merge' this is not supported\n"
 "                    give a list of tdbs as args\n"
+"                   for 'split' this is the TrailDB to be split\n"
+"                    (default: a.tdb)\n"
 "-o --output       write output to the given file:\n"
 "                   for 'make' this is the TrailDB to be created\n"
 "                    (default: a.tdb)\n"
@@ -64,6 +68,8 @@ static void print_usage_and_exit()
 "                    (default: <input.tdb>.index or <input>/index)\n"
 "                   for 'merge' this is the TrailDB to be created\n"
 "                    (default: a.tdb)\n"
+"                   for 'split' this is the prefix of shards, which are\n"
+"                    named <output>.0, <output>.1, ... (default: a)\n"
 "-T --threads      number of threads in parallel operations\n"
 "                    (default: autodetect the number of cores)\n"
 "-u --uuids        uuid specification -- see below for details\n"
@@ -78,6 +84,14 @@ static void print_usage_and_exit()
 "                   'pkg' for the default one-file format,\n"
 "                   'dir' for a directory\n"
 "--no-bigrams      when building TrailDBS, do not build and compress with bigrams\n"
+"--compress        when building TrailDBs, compress trails in blocks with zstd:\n"
+"                   smaller TrailDBs that are slower to read\n"
+"--shards          number of shards for 'split'\n"
+"--split-by        how 'split' assigns trails to shards:\n"
+"                   'range' for equal-sized ranges of UUIDs (default),\n"
+"                   'hash' for a hash of UUIDs\n"
+"--prune-lexicons  when splitting, keep only the values of a shard in its\n"
+"                   lexicons\n"
 "-v --verbose      print diagnostic output to stderr\n"
 "\n"
 "UUIDS SPECIFICATION:\n"
@@ -167,6 +181,10 @@ static int initialize(int argc, char **argv, int op)
         {"index-path", required_argument, 0, -6},
         {"no-index", no_argument, 0, -7},
         {"no-bigrams", no_argument, 0, -8},
+        {"compress", no_argument, 0, -9},
+        {"shards", required_argument, 0, -10},
+        {"split-by", required_argument, 0, -11},
+        {"prune-lexicons", no_argument, 0, -12},
         {0, 0, 0, 0}
     };
 
@@ -183,6 +201,9 @@ static int initialize(int argc, char **argv, int op)
     }else if (op == OP_INDEX){
         options.input = DEFAULT_DUMP_INPUT;
         options.output = NULL;
+    }else if (op == OP_SPLIT){
+        options.input = DEFAULT_DUMP_INPUT;
+        options.output = DEFAULT_MAKE_OUTPUT;
     }
 
     options.format = FORMAT_CSV;
@@ -262,6 +283,28 @@ static int initialize(int argc, char **argv, int op)
             case -8:
                 options.no_bigrams = 1;
                 break;
+            case -9:
+                options.compress = 1;
+                break;
+            case -10:
+                errno = 0;
+                options.num_shards = strtoull(optarg, NULL, 10);
+                if (errno || !options.num_shards)
+                    DIE("Invalid value for --shards: '%s'\n", optarg);
+                break;
+            case -11:
+                if (!strcmp(optarg, "hash"))
+                    options.split_flags |= TDB_SPLIT_UUID_HASH;
+                else if (!strcmp(optarg, "range"))
+                    options.split_flags &= ~(uint64_t)TDB_SPLIT_UUID_HASH;
+                else{
+                    DIE("Unknown split mode: '%s'.\n"
+                        "Expected 'range' or 'hash'.\n", optarg);
+                }
+                break;
+            case -12:
+                options.split_flags |= TDB_SPLIT_PRUNE_LEXICONS;
+                break;
             default:
                 print_usage_and_exit();
         }
@@ -309,6 +352,8 @@ int main(int argc, char **argv)
             return op_merge(&options,
                             (const char**)&argv[idx],
                             argc - idx);
+        case OP_SPLIT:
+            return op_split(&options);
         default:
             print_usage_and_exit();
     }
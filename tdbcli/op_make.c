@@ -385,8 +385,7 @@ int op_make(struct tdbcli_options *opt)
         if (tdb_cons_set_opt(cons,
                              TDB_OPT_CONS_OUTPUT_FORMAT,
                              opt_val(opt->output_format)))
-            DIE("Invalid --tdb-format. "
-                "Maybe TrailDB was compiled without libarchive");
+            DIE("Invalid --tdb-format.");
 
     if (opt->no_bigrams)
         if (tdb_cons_set_opt(cons,
@@ -396,6 +395,13 @@ int op_make(struct tdbcli_options *opt)
                 "TrailDB library doesn't understand TDB_OPT_CONS_NO_BIGRAMS; "
                 "library not up-to-date?");
 
+    if (opt->compress)
+        if (tdb_cons_set_opt(cons,
+                             TDB_OPT_CONS_COMPRESSION,
+                             opt_val(TDB_OPT_CONS_COMPRESSION_ZSTD)))
+            DIE("Invalid --compress. "
+                "TrailDB library was built without zstd.");
+
     if (strcmp(opt->input, "-")){
         if (!(input = fopen(opt->input, "r")))
             DIE("Could not open input file %s", opt->input);
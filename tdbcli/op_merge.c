@@ -217,8 +217,7 @@ int op_merge(struct tdbcli_options *opt,
         if (tdb_cons_set_opt(cons,
                              TDB_OPT_CONS_OUTPUT_FORMAT,
                              opt_val(opt->output_format)))
-            DIE("Invalid --tdb-format. "
-                "Maybe TrailDB was compiled without libarchive");
+            DIE("Invalid --tdb-format.");
 
     /* apply --filter and --uuids */
     for (i = 0; i < num_inputs; i++)
@@ -232,6 +231,13 @@ int op_merge(struct tdbcli_options *opt,
                 "TrailDB library doesn't understand TDB_OPT_CONS_NO_BIGRAMS; "
                 "library not up-to-date?");
 
+    if (opt->compress)
+        if (tdb_cons_set_opt(cons,
+                             TDB_OPT_CONS_COMPRESSION,
+                             opt_val(TDB_OPT_CONS_COMPRESSION_ZSTD)))
+            DIE("Invalid --compress. "
+                "TrailDB library was built without zstd.");
+
     for (i = 0; i < num_inputs; i++){
         if (equal_fields){
             if ((err = tdb_cons_append(cons, dbs[i])))
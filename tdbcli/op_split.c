@@ -0,0 +1,66 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <sys/time.h>
+
+#include <traildb.h>
+#include <tdb_io.h>
+
+#include "tdbcli.h"
+
+int op_split(struct tdbcli_options *opt)
+{
+    struct timeval start_time, end_time;
+    char (*paths)[TDB_MAX_PATH_SIZE];
+    const char **roots;
+    tdb *db = tdb_init();
+    tdb_error err;
+    uint64_t i;
+
+    if (!opt->num_shards)
+        DIE("Specify the number of shards with --shards");
+
+    if (!db)
+        DIE("Out of memory");
+
+    if ((err = tdb_open(db, opt->input)))
+        DIE("Opening a tdb at %s failed: %s", opt->input, tdb_error_str(err));
+
+    if (!(paths = malloc(opt->num_shards * TDB_MAX_PATH_SIZE)) ||
+        !(roots = malloc(opt->num_shards * sizeof(char*))))
+        DIE("Out of memory");
+
+    /* shards are written in the format of the input */
+    for (i = 0; i < opt->num_shards; i++){
+        if (tdb_path(paths[i], "%s.%"PRIu64, opt->output, i))
+            DIE("Path too long: %s", opt->output);
+        roots[i] = paths[i];
+    }
+
+    if (opt->verbose)
+        fprintf(stderr,
+                "Splitting will use %u threads (change it with -T).\n",
+                opt->num_threads);
+
+    gettimeofday(&start_time, NULL);
+    if ((err = tdb_split(db,
+                         roots,
+                         opt->num_shards,
+                         opt->split_flags,
+                         opt->num_threads)))
+        DIE("Splitting %s failed: %s", opt->input, tdb_error_str(err));
+    gettimeofday(&end_time, NULL);
+
+    if (opt->verbose)
+        fprintf(stderr,
+                "Split %s to %"PRIu64" shards in %lu seconds.\n",
+                opt->input,
+                opt->num_shards,
+                (unsigned long)(end_time.tv_sec - start_time.tv_sec));
+
+    free(roots);
+    free(paths);
+    tdb_close(db);
+    return 0;
+}
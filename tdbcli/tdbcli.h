@@ -27,6 +27,7 @@ struct tdbcli_options{
 
     /* compression */
     int no_bigrams;
+    int compress;
 
     /* fields */
     Pvoid_t csv_input_fields;
@@ -42,6 +43,10 @@ struct tdbcli_options{
     /* uuids */
     const char *uuids;
 
+    /* split */
+    uint64_t num_shards;
+    uint64_t split_flags;
+
     /* csv */
     int csv_has_header;
 
@@ -72,4 +77,6 @@ int op_merge(struct tdbcli_options *opt,
              const char **inputs,
              uint32_t num_inputs);
 
+int op_split(struct tdbcli_options *opt);
+
 #endif /* __TDB_CLI_H__ */
@@ -0,0 +1,96 @@
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include <traildb.h>
+#include <tdb_io.h>
+#include "tdb_test.h"
+
+#define NUM_TRAILS 1000
+#define NUM_EVENTS 20
+
+/*
+tdb_cons_append() adds whole trails at once: check that they are linked
+correctly with events added before and after, also with equal timestamps
+*/
+
+static void add_events(tdb_cons *c, uint64_t offset)
+{
+    static uint8_t uuid[16];
+    char buf1[32];
+    char buf2[32];
+    const char *values[] = {buf1, buf2};
+    uint64_t lengths[2];
+    uint64_t i, j;
+
+    for (i = 0; i < NUM_TRAILS; i++){
+        memcpy(uuid, &i, 8);
+        for (j = 0; j < NUM_EVENTS; j++){
+            lengths[0] = (uint64_t)sprintf(buf1, "%"PRIu64, offset + j);
+            lengths[1] = (uint64_t)sprintf(buf2, "%"PRIu64, i % 10);
+            assert(tdb_cons_add(c, uuid, offset + j * 3 + i, values, lengths) == 0);
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    char path[TDB_MAX_PATH_SIZE];
+    const char *root = getenv("TDB_TMP_DIR");
+    const char *fields[] = {"a", "b"};
+    const tdb_event *event;
+    uint64_t i, n, prev;
+
+    assert(tdb_path(path, "%s.src", root) == 0);
+    tdb_cons* c = tdb_cons_init();
+    test_cons_settings(c);
+    assert(tdb_cons_open(c, path, fields, 2) == 0);
+    add_events(c, 0);
+    assert(tdb_cons_finalize(c) == 0);
+    tdb_cons_close(c);
+
+    tdb* src = tdb_init();
+    assert(tdb_open(src, path) == 0);
+
+    c = tdb_cons_init();
+    test_cons_settings(c);
+    assert(tdb_cons_open(c, root, fields, 2) == 0);
+    add_events(c, 1);
+    assert(tdb_cons_append(c, src) == 0);
+    add_events(c, 2);
+    assert(tdb_cons_append(c, src) == 0);
+    assert(tdb_cons_finalize(c) == 0);
+    tdb_cons_close(c);
+
+    tdb* db = tdb_init();
+    assert(tdb_open(db, root) == 0);
+    assert(tdb_num_trails(db) == NUM_TRAILS);
+    assert(tdb_num_events(db) == NUM_TRAILS * NUM_EVENTS * 4);
+
+    tdb_cursor *cursor = tdb_cursor_new(db);
+    for (i = 0; i < tdb_num_trails(db); i++){
+        uint64_t trail_id;
+        static uint8_t uuid[16];
+        memcpy(uuid, &i, 8);
+        assert(tdb_get_trail_id(db, uuid, &trail_id) == 0);
+        assert(tdb_get_trail(cursor, trail_id) == 0);
+        for (n = 0, prev = 0; (event = tdb_cursor_next(cursor)); n++){
+            uint64_t length;
+            const char *value;
+
+            assert(event->timestamp >= prev);
+            prev = event->timestamp;
+            value = tdb_get_item_value(db, event->items[1], &length);
+            assert(length == 1 && value[0] == '0' + (char)(i % 10));
+        }
+        assert(n == NUM_EVENTS * 4);
+    }
+    tdb_cursor_free(cursor);
+    tdb_close(db);
+    tdb_close(src);
+    return 0;
+}
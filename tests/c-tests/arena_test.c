@@ -0,0 +1,68 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <assert.h>
+
+#include <arena.h>
+
+#include "tdb_test.h"
+
+#define NUM_ITEMS 100000
+#define INCREMENT 100
+
+int main(int argc, char **argv)
+{
+    struct arena a;
+    uint64_t items[1000];
+    uint64_t i, j, *ptr;
+    uint64_t *first;
+
+    memset(&a, 0, sizeof(struct arena));
+    a.item_size = sizeof(uint64_t);
+    a.arena_increment = INCREMENT;
+
+    /* single items */
+    assert((first = arena_add_item(&a)));
+    *first = 0;
+    for (i = 1; i < NUM_ITEMS; i++){
+        assert((ptr = arena_add_item(&a)));
+        *ptr = i;
+    }
+    assert(a.next == NUM_ITEMS);
+    assert(a.size >= NUM_ITEMS);
+
+    /* chunks are not moved when the arena grows */
+    assert(arena_get_item(&a, 0) == first);
+
+    /* batches that span chunks */
+    for (i = NUM_ITEMS; i < NUM_ITEMS * 2; i += j){
+        for (j = 0; j < 1000 && i + j < NUM_ITEMS * 2; j++)
+            items[j] = i + j;
+        /* batches of different sizes */
+        j = j > (i % 997) + 1 ? (i % 997) + 1: j;
+        assert(arena_add_items(&a, items, j) == 0);
+    }
+    assert(a.next == NUM_ITEMS * 2);
+
+    for (i = 0; i < NUM_ITEMS * 2; i++)
+        assert(*(uint64_t*)arena_get_item(&a, i) == i);
+
+    /* chunks are reused after rewinding the arena */
+    a.next = 0;
+    for (i = 0; i < NUM_ITEMS; i += j){
+        for (j = 0; j < 1000 && i + j < NUM_ITEMS; j++)
+            items[j] = NUM_ITEMS - (i + j);
+        assert(arena_add_items(&a, items, j) == 0);
+    }
+    assert(a.next == NUM_ITEMS);
+    assert(a.size >= NUM_ITEMS * 2);
+    for (i = 0; i < NUM_ITEMS; i++)
+        assert(*(uint64_t*)arena_get_item(&a, i) == NUM_ITEMS - i);
+
+    arena_free(&a);
+    assert(a.chunks == NULL);
+    assert(a.size == 0);
+    return 0;
+}
@@ -0,0 +1,183 @@
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/stat.h>
+
+#include <traildb.h>
+#include <tdb_io.h>
+#include "tdb_test.h"
+
+#define NUM_TRAILS 2000
+#define NUM_LARGE_TRAILS 2
+#define LARGE_TRAIL_LENGTH 50000
+#define NUM_CURSORS 4
+
+static void create_tdb(const char *root, int compress)
+{
+    static uint8_t uuid[16];
+    const char *fields[] = {"page", "id"};
+    char buf1[32];
+    char buf2[32];
+    const char *values[] = {buf1, buf2};
+    uint64_t lengths[2];
+    uint64_t i, j, num_events;
+    tdb_opt_value value;
+
+    tdb_cons* c = tdb_cons_init();
+    test_cons_settings(c);
+    if (compress){
+        assert(tdb_cons_set_opt(c,
+                                TDB_OPT_CONS_COMPRESSION,
+                                opt_val(TDB_OPT_CONS_COMPRESSION_ZSTD)) == 0);
+        assert(tdb_cons_get_opt(c, TDB_OPT_CONS_COMPRESSION, &value) == 0);
+        assert(value.value == TDB_OPT_CONS_COMPRESSION_ZSTD);
+    }else
+        assert(tdb_cons_set_opt(c,
+                                TDB_OPT_CONS_COMPRESSION,
+                                opt_val(TDB_OPT_CONS_COMPRESSION_NONE)) == 0);
+    assert(tdb_cons_set_opt(c, TDB_OPT_CONS_COMPRESSION, opt_val(1000)) ==
+           TDB_ERR_INVALID_OPTION_VALUE);
+    assert(tdb_cons_open(c, root, fields, 2) == 0);
+
+    for (i = 0; i < NUM_TRAILS + NUM_LARGE_TRAILS; i++){
+        memcpy(uuid, &i, 8);
+        /* similar trails repeat the same pages */
+        if (i < NUM_TRAILS)
+            num_events = (i * 13) % 100 + 1;
+        else
+            num_events = LARGE_TRAIL_LENGTH;
+        for (j = 0; j < num_events; j++){
+            lengths[0] = (uint64_t)sprintf(buf1, "page%"PRIu64, j % 7);
+            lengths[1] = (uint64_t)sprintf(buf2, "%"PRIu64, (j * 31) % 5000);
+            assert(tdb_cons_add(c, uuid, j * 60, values, lengths) == 0);
+        }
+    }
+    assert(tdb_cons_finalize(c) == 0);
+    tdb_cons_close(c);
+}
+
+/* size of trails.data, or 0 if the TrailDB is a package */
+static uint64_t trails_size(const char *root)
+{
+    char path[TDB_MAX_PATH_SIZE];
+    struct stat stats;
+
+    assert(tdb_path(path, "%s/trails.data", root) == 0);
+    if (stat(path, &stats))
+        return 0;
+    return (uint64_t)stats.st_size;
+}
+
+static void compare_trail(tdb_cursor *c1, tdb_cursor *c2, uint64_t trail_id)
+{
+    const tdb_event *e1, *e2;
+
+    assert(tdb_get_trail(c1, trail_id) == 0);
+    assert(tdb_get_trail(c2, trail_id) == 0);
+    while ((e1 = tdb_cursor_next(c1))){
+        assert((e2 = tdb_cursor_next(c2)) != NULL);
+        assert(e1->timestamp == e2->timestamp);
+        assert(e1->num_items == e2->num_items);
+        assert(!memcmp(e1->items, e2->items, e1->num_items * sizeof(tdb_item)));
+    }
+    assert(tdb_cursor_next(c2) == NULL);
+}
+
+static uint64_t merge_trails(const tdb *db, uint64_t first)
+{
+    tdb_cursor *cursors[NUM_CURSORS];
+    const tdb_multi_event *mevent;
+    tdb_multi_cursor *mc;
+    uint64_t i, n = 0;
+
+    for (i = 0; i < NUM_CURSORS; i++){
+        assert((cursors[i] = tdb_cursor_new(db)) != NULL);
+        assert(tdb_get_trail(cursors[i], first + i * 500) == 0);
+    }
+    assert((mc = tdb_multi_cursor_new_parallel(cursors, NUM_CURSORS, 2)));
+    while ((mevent = tdb_multi_cursor_next(mc)))
+        n += mevent->event->timestamp + mevent->event->items[1];
+    tdb_multi_cursor_free(mc);
+    for (i = 0; i < NUM_CURSORS; i++)
+        tdb_cursor_free(cursors[i]);
+    return n;
+}
+
+static void test_compressed(const char *plain_root,
+                            const char *root,
+                            tdb_opt_key key,
+                            uint64_t value)
+{
+    tdb *db = tdb_init();
+    tdb *cdb = tdb_init();
+    tdb_cursor *c1, *c2;
+    uint64_t trail_ids[NUM_TRAILS];
+    uint64_t i;
+
+    assert(tdb_open(db, plain_root) == 0);
+    if (key)
+        assert(tdb_set_opt(cdb, key, opt_val(value)) == 0);
+    assert(tdb_open(cdb, root) == 0);
+    assert(tdb_version(db) == TDB_VERSION_LATEST);
+    assert(tdb_version(cdb) == TDB_VERSION_V0_2);
+    assert(tdb_num_trails(cdb) == tdb_num_trails(db));
+    assert(tdb_num_events(cdb) == tdb_num_events(db));
+    c1 = tdb_cursor_new(db);
+    c2 = tdb_cursor_new(cdb);
+
+    /* all trails, including trails larger than a block */
+    for (i = 0; i < tdb_num_trails(db); i++)
+        compare_trail(c1, c2, i);
+
+    /* prefetched trails in a random order */
+    for (i = 0; i < NUM_TRAILS; i++)
+        trail_ids[i] = (i * 7919) % tdb_num_trails(db);
+    assert(tdb_prefetch_trails(cdb, trail_ids, NUM_TRAILS) == 0);
+    for (i = 0; i < NUM_TRAILS; i++)
+        compare_trail(c1, c2, trail_ids[i]);
+
+    for (i = 0; i < 500; i += 50)
+        assert(merge_trails(cdb, i) == merge_trails(db, i));
+
+    assert(tdb_get_trail(c2, tdb_num_trails(db)) == TDB_ERR_INVALID_TRAIL_ID);
+
+    tdb_cursor_free(c1);
+    tdb_cursor_free(c2);
+    tdb_close(db);
+    tdb_close(cdb);
+}
+
+int main(int argc, char** argv)
+{
+    char plain_root[TDB_MAX_PATH_SIZE];
+    char root[TDB_MAX_PATH_SIZE];
+    tdb_opt_value value;
+    tdb *db;
+
+    assert(tdb_path(plain_root, "%s/plain", getenv("TDB_TMP_DIR")) == 0);
+    assert(tdb_path(root, "%s/compressed", getenv("TDB_TMP_DIR")) == 0);
+    create_tdb(plain_root, 0);
+    create_tdb(root, 1);
+
+    assert(trails_size(root) <= trails_size(plain_root) * 3 / 4);
+
+    db = tdb_init();
+    assert(tdb_get_opt(db, TDB_OPT_BLOCK_CACHE_SIZE, &value) == 0);
+    assert(value.value == 64LLU << 20);
+    assert(tdb_set_opt(db, TDB_OPT_BLOCK_CACHE_SIZE, opt_val(0)) ==
+           TDB_ERR_INVALID_OPTION_VALUE);
+    tdb_close(db);
+
+    test_compressed(plain_root, root, 0, 0);
+    /* every trail decompresses its block */
+    test_compressed(plain_root, root, TDB_OPT_BLOCK_CACHE_SIZE, 1);
+    /* decompressed trails are cached */
+    test_compressed(plain_root, root, TDB_OPT_TRAIL_CACHE_SIZE, 1LLU << 20);
+    /* compressed blocks are read with pread() */
+    test_compressed(plain_root, root, TDB_OPT_PREAD_CACHE_SIZE, 1LLU << 20);
+    return 0;
+}
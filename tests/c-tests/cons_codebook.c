@@ -0,0 +1,169 @@
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include <traildb.h>
+#include <tdb_io.h>
+#include "tdb_test.h"
+
+#define NUM_TRAILS 500
+#define NUM_EVENTS 30
+
+/*
+A cons seeded with TDB_OPT_CONS_CODEBOOK encodes trails with the codebook
+of an existing TrailDB: values it hasn't seen are encoded as literals
+*/
+
+static void add_events(tdb_cons *c, uint64_t num_values)
+{
+    static uint8_t uuid[16];
+    char buf1[32];
+    char buf2[32];
+    const char *values[] = {buf1, buf2};
+    uint64_t lengths[2];
+    uint64_t i, j;
+
+    for (i = 0; i < NUM_TRAILS; i++){
+        memcpy(uuid, &i, 8);
+        for (j = 0; j < NUM_EVENTS; j++){
+            lengths[0] = (uint64_t)sprintf(buf1, "%"PRIu64, (i * j) % num_values);
+            lengths[1] = (uint64_t)sprintf(buf2, "%"PRIu64, j % 3);
+            assert(tdb_cons_add(c, uuid, i + j * 10, values, lengths) == 0);
+        }
+    }
+}
+
+/* the codebook of a directory, NULL for packages */
+static char *read_codebook(const char *root, uint64_t *size)
+{
+    char path[TDB_MAX_PATH_SIZE];
+    char *buf;
+    FILE *f;
+
+    assert(tdb_path(path, "%s/trails.codebook", root) == 0);
+    if (!(f = fopen(path, "r")))
+        return NULL;
+    assert(fseek(f, 0, SEEK_END) == 0);
+    *size = (uint64_t)ftell(f);
+    rewind(f);
+    assert((buf = malloc(*size)));
+    assert(fread(buf, *size, 1, f) == 1);
+    fclose(f);
+    return buf;
+}
+
+static void check_events(const tdb *db, uint64_t num_values)
+{
+    const tdb_event *event;
+    uint64_t i, j;
+    tdb_cursor *cursor = tdb_cursor_new(db);
+
+    assert(tdb_num_trails(db) == NUM_TRAILS);
+    for (i = 0; i < NUM_TRAILS; i++){
+        assert(tdb_get_trail(cursor, i) == 0);
+        for (j = 0; (event = tdb_cursor_next(cursor)); j++){
+            char buf[32];
+            uint64_t len;
+            const char *value;
+
+            assert(event->timestamp == i + j * 10);
+            value = tdb_get_item_value(db, event->items[0], &len);
+            assert(len == (uint64_t)sprintf(buf, "%"PRIu64, (i * j) % num_values));
+            assert(memcmp(value, buf, len) == 0);
+            value = tdb_get_item_value(db, event->items[1], &len);
+            assert(len == 1 && value[0] == '0' + (char)(j % 3));
+        }
+        assert(j == NUM_EVENTS);
+    }
+    tdb_cursor_free(cursor);
+}
+
+int main(int argc, char** argv)
+{
+    char path[TDB_MAX_PATH_SIZE];
+    char seeded[TDB_MAX_PATH_SIZE];
+    const char *root = getenv("TDB_TMP_DIR");
+    const char *fields[] = {"a", "b"};
+    const char *other_fields[] = {"a", "c"};
+    char *book1, *book2;
+    uint64_t size1, size2;
+    tdb_field field;
+    uint64_t i;
+
+    assert(tdb_path(path, "%s.model", root) == 0);
+    assert(tdb_path(seeded, "%s.seeded", root) == 0);
+    tdb_cons *c = tdb_cons_init();
+    test_cons_settings(c);
+    assert(tdb_cons_open(c, path, fields, 2) == 0);
+    add_events(c, 100);
+    assert(tdb_cons_finalize(c) == 0);
+    tdb_cons_close(c);
+
+    tdb *model = tdb_init();
+    assert(tdb_open(model, path) == 0);
+
+    /* fields must match */
+    c = tdb_cons_init();
+    test_cons_settings(c);
+    assert(tdb_cons_open(c, root, other_fields, 2) == 0);
+    assert(tdb_cons_set_opt(c, TDB_OPT_CONS_CODEBOOK, opt_val(0)) ==
+           TDB_ERR_INVALID_OPTION_VALUE);
+    assert(tdb_cons_set_opt(c,
+                            TDB_OPT_CONS_CODEBOOK,
+                            (tdb_opt_value){.ptr = model}) ==
+           TDB_ERR_APPEND_FIELDS_MISMATCH);
+    tdb_cons_close(c);
+
+    /* the cons must be empty */
+    c = tdb_cons_init();
+    test_cons_settings(c);
+    assert(tdb_cons_open(c, root, fields, 2) == 0);
+    add_events(c, 10);
+    assert(tdb_cons_set_opt(c,
+                            TDB_OPT_CONS_CODEBOOK,
+                            (tdb_opt_value){.ptr = model}) ==
+           TDB_ERR_INVALID_OPTION_VALUE);
+    tdb_cons_close(c);
+
+    /* values 100..149 are not in the model */
+    c = tdb_cons_init();
+    test_cons_settings(c);
+    assert(tdb_cons_open(c, seeded, fields, 2) == 0);
+    assert(tdb_cons_set_opt(c,
+                            TDB_OPT_CONS_CODEBOOK,
+                            (tdb_opt_value){.ptr = model}) == 0);
+    add_events(c, 150);
+    assert(tdb_cons_finalize(c) == 0);
+    tdb_cons_close(c);
+
+    tdb *db = tdb_init();
+    assert(tdb_open(db, seeded) == 0);
+    check_events(db, 150);
+
+    /* values of the model keep their items */
+    for (field = 1; field < 3; field++){
+        assert(tdb_lexicon_size(db, field) >= tdb_lexicon_size(model, field));
+        for (i = 1; i < tdb_lexicon_size(model, field); i++){
+            uint64_t len;
+            tdb_item item = tdb_make_item(field, i);
+            const char *value = tdb_get_item_value(model, item, &len);
+            assert(tdb_get_item(db, field, value, len) == item);
+        }
+    }
+
+    /* the codebook is stored as is */
+    if ((book1 = read_codebook(path, &size1))){
+        assert((book2 = read_codebook(seeded, &size2)));
+        assert(size1 == size2 && memcmp(book1, book2, size1) == 0);
+        free(book1);
+        free(book2);
+    }
+
+    tdb_close(db);
+    tdb_close(model);
+    return 0;
+}
@@ -0,0 +1,130 @@
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include <traildb.h>
+#include <tdb_io.h>
+#include "tdb_test.h"
+
+#define NUM_TRAILS 1000
+#define NUM_EVENTS 50
+
+/*
+A cons with TDB_OPT_CONS_MEMORY_LIMIT spills events to disk in sorted
+runs: check that it produces the same TrailDB as a cons without a limit
+*/
+
+static void add_events(tdb_cons *c, uint64_t round)
+{
+    static uint8_t uuid[16];
+    char buf1[32];
+    char buf2[32];
+    const char *values[] = {buf1, buf2};
+    uint64_t lengths[2];
+    uint64_t i, j;
+
+    /* interleave trails and add events out of order */
+    for (j = 0; j < NUM_EVENTS; j++)
+        for (i = 0; i < NUM_TRAILS; i++){
+            uint64_t timestamp = ((j * 7919) % NUM_EVENTS) * 10 + round;
+            memcpy(uuid, &i, 8);
+            memcpy(&uuid[8], &i, 8);
+            lengths[0] = (uint64_t)sprintf(buf1, "%"PRIu64, timestamp);
+            lengths[1] = (uint64_t)sprintf(buf2, "%"PRIu64, i % 10);
+            assert(tdb_cons_add(c, uuid, timestamp, values, lengths) == 0);
+        }
+}
+
+static tdb *make_tdb(const char *path, uint64_t memory_limit, const tdb *src)
+{
+    const char *fields[] = {"a", "b"};
+    tdb_opt_value value;
+    tdb_cons *c = tdb_cons_init();
+    tdb *db = tdb_init();
+
+    test_cons_settings(c);
+    assert(tdb_cons_set_opt(c,
+                            TDB_OPT_CONS_MEMORY_LIMIT,
+                            opt_val(memory_limit)) == 0);
+    assert(tdb_cons_get_opt(c, TDB_OPT_CONS_MEMORY_LIMIT, &value) == 0);
+    assert(value.value == memory_limit);
+    assert(tdb_cons_open(c, path, fields, 2) == 0);
+
+    add_events(c, 0);
+    if (src)
+        assert(tdb_cons_append(c, src) == 0);
+    add_events(c, 5);
+    assert(tdb_cons_finalize(c) == 0);
+    tdb_cons_close(c);
+
+    assert(tdb_open(db, path) == 0);
+    return db;
+}
+
+static void compare_tdbs(const tdb *db1, const tdb *db2)
+{
+    const tdb_event *ev1, *ev2;
+    uint64_t i, j;
+
+    assert(tdb_num_trails(db1) == tdb_num_trails(db2));
+    assert(tdb_num_events(db1) == tdb_num_events(db2));
+    assert(tdb_min_timestamp(db1) == tdb_min_timestamp(db2));
+    assert(tdb_max_timestamp(db1) == tdb_max_timestamp(db2));
+
+    tdb_cursor *c1 = tdb_cursor_new(db1);
+    tdb_cursor *c2 = tdb_cursor_new(db2);
+
+    for (i = 0; i < tdb_num_trails(db1); i++){
+        uint64_t prev = 0;
+        assert(memcmp(tdb_get_uuid(db1, i), tdb_get_uuid(db2, i), 16) == 0);
+        assert(tdb_get_trail(c1, i) == 0);
+        assert(tdb_get_trail(c2, i) == 0);
+        while ((ev1 = tdb_cursor_next(c1))){
+            assert((ev2 = tdb_cursor_next(c2)));
+            assert(ev1->timestamp == ev2->timestamp);
+            assert(ev1->timestamp >= prev);
+            prev = ev1->timestamp;
+            assert(ev1->num_items == ev2->num_items);
+            for (j = 0; j < ev1->num_items; j++){
+                uint64_t len1, len2;
+                const char *val1 = tdb_get_item_value(db1, ev1->items[j], &len1);
+                const char *val2 = tdb_get_item_value(db2, ev2->items[j], &len2);
+                assert(len1 == len2 && memcmp(val1, val2, len1) == 0);
+            }
+        }
+        assert(tdb_cursor_next(c2) == NULL);
+    }
+    tdb_cursor_free(c1);
+    tdb_cursor_free(c2);
+}
+
+int main(int argc, char** argv)
+{
+    char path[TDB_MAX_PATH_SIZE];
+    const char *root = getenv("TDB_TMP_DIR");
+
+    assert(tdb_path(path, "%s.src", root) == 0);
+    tdb *src = make_tdb(path, 0, NULL);
+
+    assert(tdb_path(path, "%s.unlimited", root) == 0);
+    tdb *unlimited = make_tdb(path, 0, src);
+
+    /* many small runs */
+    assert(tdb_path(path, "%s.limited", root) == 0);
+    tdb *limited = make_tdb(path, 10000, src);
+    compare_tdbs(unlimited, limited);
+    tdb_close(limited);
+
+    /* a limit that is never reached */
+    limited = make_tdb(root, 1LLU << 40, src);
+    compare_tdbs(unlimited, limited);
+    tdb_close(limited);
+
+    tdb_close(unlimited);
+    tdb_close(src);
+    return 0;
+}
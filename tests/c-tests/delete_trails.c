@@ -0,0 +1,188 @@
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include <traildb.h>
+#include <tdb_io.h>
+#include <tdb_internal.h>
+#include "tdb_test.h"
+
+#define NUM_TRAILS 1000
+#define NUM_EVENTS 5
+
+/*
+Deleted trails are skipped by lookups and cursors, survive reopening,
+and are dropped by tdb_compact() and tdb_cons_append()
+*/
+
+static void make_uuid(uint8_t uuid[16], uint64_t i)
+{
+    memset(uuid, 0, 16);
+    memcpy(uuid, &i, 8);
+}
+
+static int is_deleted(uint64_t i)
+{
+    return i % 3 == 0;
+}
+
+static void create_tdb(const char *root)
+{
+    uint8_t uuid[16];
+    const char *fields[] = {"a"};
+    const char *values[] = {"x"};
+    uint64_t lengths[] = {1};
+    uint64_t i, j;
+
+    tdb_cons* c = tdb_cons_init();
+    test_cons_settings(c);
+    assert(tdb_cons_open(c, root, fields, 1) == 0);
+    for (i = 0; i < NUM_TRAILS; i++){
+        make_uuid(uuid, i);
+        for (j = 0; j < NUM_EVENTS; j++)
+            assert(tdb_cons_add(c, uuid, i + j, values, lengths) == 0);
+    }
+    assert(tdb_cons_finalize(c) == 0);
+    tdb_cons_close(c);
+}
+
+static void check_deleted(const tdb *db)
+{
+    uint8_t uuid[16];
+    uint8_t *uuids = malloc(NUM_TRAILS * 16);
+    uint64_t *trail_ids = malloc(NUM_TRAILS * 8);
+    uint64_t i, trail_id;
+    tdb_cursor *cursor = tdb_cursor_new(db);
+
+    assert(uuids && trail_ids);
+    assert(tdb_num_trails(db) == NUM_TRAILS);
+    assert(tdb_num_deleted_trails(db) == NUM_TRAILS / 3 + 1);
+
+    for (i = 0; i < NUM_TRAILS; i++){
+        make_uuid(uuid, i);
+        make_uuid(&uuids[i * 16], i);
+        if (is_deleted(i)){
+            assert(tdb_get_trail_id(db, uuid, &trail_id) ==
+                   TDB_ERR_UNKNOWN_UUID);
+        }else{
+            assert(tdb_get_trail_id(db, uuid, &trail_id) == 0);
+            assert(trail_id == i);
+        }
+        assert(tdb_get_trail(cursor, i) == 0);
+        assert(tdb_get_trail_length(cursor) ==
+               (is_deleted(i) ? 0: NUM_EVENTS));
+    }
+
+    assert(tdb_get_trail_ids(db, uuids, NUM_TRAILS, trail_ids) ==
+           TDB_ERR_UNKNOWN_UUID);
+    for (i = 0; i < NUM_TRAILS; i++)
+        assert(trail_ids[i] == (is_deleted(i) ? TDB_UNKNOWN_TRAIL_ID: i));
+
+    tdb_cursor_free(cursor);
+    free(trail_ids);
+    free(uuids);
+}
+
+static void check_compacted(const char *root)
+{
+    uint8_t uuid[16];
+    uint64_t i, trail_id;
+    tdb *db = tdb_init();
+
+    assert(tdb_open(db, root) == 0);
+    assert(tdb_num_trails(db) == NUM_TRAILS - (NUM_TRAILS / 3 + 1));
+    assert(tdb_num_events(db) == tdb_num_trails(db) * NUM_EVENTS);
+    assert(tdb_num_deleted_trails(db) == 0);
+    for (i = 0; i < NUM_TRAILS; i++){
+        make_uuid(uuid, i);
+        assert(tdb_get_trail_id(db, uuid, &trail_id) ==
+               (is_deleted(i) ? TDB_ERR_UNKNOWN_UUID: 0));
+    }
+    tdb_close(db);
+}
+
+int main(int argc, char** argv)
+{
+    char path[TDB_MAX_PATH_SIZE];
+    char compacted[TDB_MAX_PATH_SIZE];
+    const char *root = getenv("TDB_TMP_DIR");
+    uint8_t *uuids = malloc(NUM_TRAILS * 16);
+    uint64_t i, n = 0;
+    const char *fields[] = {"a"};
+    tdb *db, *db2;
+    FILE *f;
+
+    assert(uuids);
+    assert(tdb_path(path, "%s.src", root) == 0);
+    create_tdb(path);
+
+    db = tdb_init();
+    assert(tdb_open(db, path) == 0);
+    assert(tdb_num_deleted_trails(db) == 0);
+
+    /* delete in two batches, with duplicates and unknown UUIDs */
+    for (i = 0; i < NUM_TRAILS; i += 3)
+        make_uuid(&uuids[n++ * 16], i);
+    make_uuid(&uuids[n++ * 16], NUM_TRAILS + 1);
+    assert(tdb_delete_trails(db, uuids, n / 2) == 0);
+    assert(tdb_num_deleted_trails(db) == n / 2);
+    assert(tdb_delete_trails(db, uuids, n) == 0);
+    check_deleted(db);
+    tdb_close(db);
+
+    /* deletions are persisted */
+    db = tdb_init();
+    assert(tdb_open(db, path) == 0);
+    check_deleted(db);
+
+    assert(tdb_path(compacted, "%s.compacted", root) == 0);
+    assert(tdb_compact(db, compacted) == 0);
+    check_compacted(compacted);
+
+    tdb_cons *c = tdb_cons_init();
+    test_cons_settings(c);
+    assert(tdb_path(compacted, "%s.appended", root) == 0);
+    assert(tdb_cons_open(c, compacted, fields, 1) == 0);
+    assert(tdb_cons_append(c, db) == 0);
+    assert(tdb_cons_finalize(c) == 0);
+    tdb_cons_close(c);
+    check_compacted(compacted);
+
+    /* a broken bitmap fails, instead of resurrecting deleted trails */
+    tdb_close(db);
+    db = tdb_init();
+    assert(tdb_open(db, path) == 0);
+    assert(tdb_sidecar_path(db, compacted, "deleted") == 0);
+    tdb_close(db);
+    assert((f = fopen(compacted, "r+")));
+    assert(fseek(f, -1, SEEK_END) == 0);
+    assert(fputc(0xff, f) != EOF);
+    fclose(f);
+    db = tdb_init();
+    assert(tdb_open(db, path) == TDB_ERR_INVALID_DELETIONS_FILE);
+    tdb_close(db);
+
+    /* deleters with handles of their own don't lose each other's trails */
+    assert(tdb_path(path, "%s.shared", root) == 0);
+    create_tdb(path);
+    db = tdb_init();
+    db2 = tdb_init();
+    assert(tdb_open(db, path) == 0);
+    assert(tdb_open(db2, path) == 0);
+    for (i = 0; i < n; i++)
+        assert(tdb_delete_trails(i & 1 ? db2: db, &uuids[i * 16], 1) == 0);
+    check_deleted(db2);
+    tdb_close(db);
+    tdb_close(db2);
+    db = tdb_init();
+    assert(tdb_open(db, path) == 0);
+    check_deleted(db);
+    tdb_close(db);
+
+    free(uuids);
+    return 0;
+}
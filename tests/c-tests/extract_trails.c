@@ -0,0 +1,180 @@
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include <traildb.h>
+#include <tdb_io.h>
+#include "tdb_test.h"
+
+#define NUM_TRAILS 1000
+
+/*
+tdb_extract_trails() copies encoded trails as is: the extracted trails
+must decode to the same events and items as in the source
+*/
+
+static tdb *create_tdb(const char *root, int compress)
+{
+    static uint8_t uuid[16];
+    const char *fields[] = {"page", "id"};
+    char buf1[32];
+    char buf2[32];
+    const char *values[] = {buf1, buf2};
+    uint64_t lengths[2];
+    uint64_t i, j;
+    tdb *db = tdb_init();
+
+    tdb_cons* c = tdb_cons_init();
+    test_cons_settings(c);
+    if (compress)
+        assert(tdb_cons_set_opt(c,
+                                TDB_OPT_CONS_COMPRESSION,
+                                opt_val(TDB_OPT_CONS_COMPRESSION_ZSTD)) == 0);
+    assert(tdb_cons_open(c, root, fields, 2) == 0);
+
+    for (i = 0; i < NUM_TRAILS; i++){
+        /* UUIDs are not in the order of trail IDs */
+        uint64_t key = (i * 7919) % NUM_TRAILS;
+        memcpy(uuid, &key, 8);
+        for (j = 0; j < (i * 13) % 50 + 1; j++){
+            lengths[0] = (uint64_t)sprintf(buf1, "page%"PRIu64, j % 7);
+            lengths[1] = (uint64_t)sprintf(buf2, "%"PRIu64, (i * j) % 5000);
+            assert(tdb_cons_add(c, uuid, 1000 + i + j * 60, values, lengths) == 0);
+        }
+    }
+    assert(tdb_cons_finalize(c) == 0);
+    tdb_cons_close(c);
+
+    assert(tdb_open(db, root) == 0);
+    return db;
+}
+
+static void compare_trail(tdb_cursor *c1,
+                          uint64_t trail_id1,
+                          tdb_cursor *c2,
+                          uint64_t trail_id2,
+                          uint64_t *num_events,
+                          uint64_t *max_timestamp)
+{
+    const tdb_event *e1, *e2;
+
+    assert(tdb_get_trail(c1, trail_id1) == 0);
+    assert(tdb_get_trail(c2, trail_id2) == 0);
+    while ((e1 = tdb_cursor_next(c1))){
+        assert((e2 = tdb_cursor_next(c2)) != NULL);
+        assert(e1->timestamp == e2->timestamp);
+        assert(e1->num_items == e2->num_items);
+        assert(!memcmp(e1->items, e2->items, e1->num_items * sizeof(tdb_item)));
+        ++*num_events;
+        if (e1->timestamp > *max_timestamp)
+            *max_timestamp = e1->timestamp;
+    }
+    assert(tdb_cursor_next(c2) == NULL);
+}
+
+static void test_extract(const tdb *src, const char *root)
+{
+    uint64_t trail_ids[NUM_TRAILS];
+    uint64_t i, n = 0;
+    uint64_t num_events = 0;
+    uint64_t max_timestamp = 0;
+    uint64_t trail_id;
+    tdb *db = tdb_init();
+
+    /* every third trail in a reverse order, with duplicates */
+    for (i = 0; i < NUM_TRAILS; i += 3)
+        trail_ids[n++] = NUM_TRAILS - 1 - i;
+    trail_ids[n++] = NUM_TRAILS - 1;
+    trail_ids[n++] = 0;
+
+    assert(tdb_extract_trails(src, trail_ids, n, root) == 0);
+    assert(tdb_open(db, root) == 0);
+    assert(tdb_num_trails(db) == n - 2);
+    assert(tdb_num_fields(db) == tdb_num_fields(src));
+    assert(tdb_min_timestamp(db) == tdb_min_timestamp(src));
+    assert(tdb_lexicon_size(db, 2) == tdb_lexicon_size(src, 2));
+
+    tdb_cursor *c1 = tdb_cursor_new(src);
+    tdb_cursor *c2 = tdb_cursor_new(db);
+
+    for (i = 0; i < n - 2; i++){
+        const uint8_t *uuid = tdb_get_uuid(src, trail_ids[i]);
+        assert(tdb_get_trail_id(db, uuid, &trail_id) == 0);
+        compare_trail(c1,
+                      trail_ids[i],
+                      c2,
+                      trail_id,
+                      &num_events,
+                      &max_timestamp);
+    }
+    /* trails are stored in the order of UUIDs */
+    for (i = 1; i < tdb_num_trails(db); i++){
+        __uint128_t prev, cur;
+        memcpy(&prev, tdb_get_uuid(db, i - 1), 16);
+        memcpy(&cur, tdb_get_uuid(db, i), 16);
+        assert(prev < cur);
+    }
+    assert(tdb_num_events(db) == num_events);
+    assert(tdb_max_timestamp(db) == max_timestamp);
+
+    tdb_cursor_free(c1);
+    tdb_cursor_free(c2);
+    tdb_close(db);
+}
+
+int main(int argc, char** argv)
+{
+    char path[TDB_MAX_PATH_SIZE];
+    const char *root = getenv("TDB_TMP_DIR");
+    uint64_t trail_id = NUM_TRAILS;
+    tdb *db;
+
+    assert(tdb_path(path, "%s.src", root) == 0);
+    tdb *src = create_tdb(path, 0);
+
+    assert(tdb_path(path, "%s.extracted", root) == 0);
+    test_extract(src, path);
+
+    assert(tdb_extract_trails(src, &trail_id, 1, path) ==
+           TDB_ERR_INVALID_TRAIL_ID);
+
+    /* trails are copied without filtering */
+    struct tdb_event_filter *f = tdb_event_filter_new();
+    assert(tdb_event_filter_add_term(f, tdb_make_item(1, 1), 0) == 0);
+    assert(tdb_set_opt(src, TDB_OPT_EVENT_FILTER, (tdb_opt_value){.ptr = f}) == 0);
+    assert(tdb_extract_trails(src, NULL, 0, path) ==
+           TDB_ERR_INVALID_OPTION_VALUE);
+    assert(tdb_set_opt(src, TDB_OPT_EVENT_FILTER, (tdb_opt_value){.ptr = NULL}) == 0);
+    tdb_event_filter_free(f);
+
+    /* no trails */
+    assert(tdb_path(path, "%s.empty", root) == 0);
+    assert(tdb_extract_trails(src, NULL, 0, path) == 0);
+    db = tdb_init();
+    assert(tdb_open(db, path) == 0);
+    assert(tdb_num_trails(db) == 0);
+    assert(tdb_num_events(db) == 0);
+    tdb_close(db);
+    tdb_close(src);
+
+    /* trails are read with pread() */
+    assert(tdb_path(path, "%s.src", root) == 0);
+    src = tdb_init();
+    assert(tdb_set_opt(src, TDB_OPT_PREAD_CACHE_SIZE, opt_val(1LLU << 20)) == 0);
+    assert(tdb_open(src, path) == 0);
+    assert(tdb_path(path, "%s.pread", root) == 0);
+    test_extract(src, path);
+    tdb_close(src);
+
+    /* compressed trails are extracted uncompressed */
+    assert(tdb_path(path, "%s.zstd", root) == 0);
+    src = create_tdb(path, 1);
+    assert(tdb_path(path, "%s.unzstd", root) == 0);
+    test_extract(src, path);
+    tdb_close(src);
+    return 0;
+}
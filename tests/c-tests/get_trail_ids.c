@@ -0,0 +1,125 @@
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+
+#include <traildb.h>
+#include <tdb_io.h>
+#include "tdb_test.h"
+
+#define NUM_TRAILS 20000
+#define NUM_QUERIES (NUM_TRAILS * 2)
+
+static uint64_t rand_state = 88172645463325252LLU;
+
+static uint64_t xorshift64(void)
+{
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 7;
+    rand_state ^= rand_state << 17;
+    return rand_state;
+}
+
+static void random_uuid(uint8_t uuid[16])
+{
+    uint64_t x = xorshift64();
+    memcpy(uuid, &x, 8);
+    x = xorshift64();
+    memcpy(&uuid[8], &x, 8);
+}
+
+static void test_lookups(const tdb *db, uint8_t *queries)
+{
+    uint64_t *trail_ids = malloc(NUM_QUERIES * 8);
+    uint64_t i, trail_id;
+
+    assert(trail_ids != NULL);
+    assert(tdb_num_trails(db) == NUM_TRAILS);
+
+    /* all UUIDs in the db are found one by one */
+    for (i = 0; i < NUM_TRAILS; i++){
+        assert(tdb_get_trail_id(db, tdb_get_uuid(db, i), &trail_id) == 0);
+        assert(trail_id == i);
+    }
+
+    /* half of the queries are unknown UUIDs */
+    assert(tdb_get_trail_ids(db, queries, NUM_QUERIES, trail_ids) ==
+           TDB_ERR_UNKNOWN_UUID);
+
+    for (i = 0; i < NUM_QUERIES; i++){
+        if (tdb_get_trail_id(db, &queries[i * 16], &trail_id))
+            assert(trail_ids[i] == TDB_UNKNOWN_TRAIL_ID);
+        else{
+            assert(trail_ids[i] == trail_id);
+            assert(!memcmp(tdb_get_uuid(db, trail_id), &queries[i * 16], 16));
+        }
+    }
+
+    /* only known UUIDs, including duplicates */
+    for (i = 0; i < NUM_TRAILS; i++)
+        memcpy(&queries[i * 16], tdb_get_uuid(db, (i * 7919) % NUM_TRAILS), 16);
+    assert(tdb_get_trail_ids(db, queries, NUM_TRAILS, trail_ids) == 0);
+    for (i = 0; i < NUM_TRAILS; i++)
+        assert(trail_ids[i] == (i * 7919) % NUM_TRAILS);
+
+    assert(tdb_get_trail_ids(db, queries, 0, trail_ids) == 0);
+
+    free(trail_ids);
+}
+
+int main(int argc, char **argv)
+{
+    char path[TDB_MAX_PATH_SIZE];
+    const char *root = getenv("TDB_TMP_DIR");
+    uint8_t *queries = malloc(NUM_QUERIES * 16);
+    uint64_t i;
+    FILE *f;
+
+    assert(queries != NULL);
+
+    tdb_cons* c = tdb_cons_init();
+    test_cons_settings(c);
+    assert(tdb_cons_open(c, root, NULL, 0) == 0);
+    for (i = 0; i < NUM_QUERIES; i++){
+        random_uuid(&queries[i * 16]);
+        if (i & 1)
+            assert(tdb_cons_add(c, &queries[i * 16], i, NULL, NULL) == 0);
+    }
+    assert(tdb_cons_finalize(c) == 0);
+    tdb_cons_close(c);
+
+    tdb* t = tdb_init();
+    assert(tdb_open(t, root) == 0);
+    test_lookups(t, queries);
+    tdb_close(t);
+
+    /* a corrupted UUID index is rejected */
+    tdb_path(path, "%s/uuids.index", root);
+    if ((f = fopen(path, "r+"))){
+        const uint32_t bad = UINT32_MAX;
+        assert(fseek(f, 8 + 4, SEEK_SET) == 0);
+        assert(fwrite(&bad, 4, 1, f) == 1);
+        assert(fclose(f) == 0);
+        t = tdb_init();
+        assert(tdb_open(t, root) == TDB_ERR_INVALID_UUIDS_FILE);
+        tdb_close(t);
+    }
+
+    /* older TrailDBs don't have the UUID index */
+    if (!unlink(path)){
+        for (i = 0; i < NUM_QUERIES; i++)
+            random_uuid(&queries[i * 16]);
+        t = tdb_init();
+        assert(tdb_open(t, root) == 0);
+        for (i = 0; i < NUM_TRAILS; i++)
+            memcpy(&queries[i * 32], tdb_get_uuid(t, i), 16);
+        test_lookups(t, queries);
+        tdb_close(t);
+    }
+
+    free(queries);
+    return 0;
+}
@@ -0,0 +1,79 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <assert.h>
+#include <float.h>
+
+#define DSFMT_MEXP 521
+#include <dsfmt/dSFMT.h>
+
+#include <hash_128_map.h>
+
+#include "tdb_test.h"
+
+#define NUM_ITER 1000000
+
+static __uint128_t gen_key(uint64_t idx, dsfmt_t *state)
+{
+    double rand = dsfmt_genrand_close_open(state) * DBL_MAX;
+    __uint128_t ret = idx;
+    ret <<= 64;
+    memcpy(&ret, &rand, 8);
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    struct hash_128_map hm;
+    dsfmt_t state;
+    uint64_t i;
+
+    assert(h128m_init(&hm, NUM_ITER) == 0);
+
+    /* test set */
+
+    dsfmt_init_gen_rand(&state, 123);
+    for (i = 0; i < NUM_ITER; i++)
+        h128m_set(&hm, gen_key(i, &state), i + 1);
+    assert(hm.num_keys == NUM_ITER);
+
+    /* test get */
+
+    dsfmt_init_gen_rand(&state, 123);
+    for (i = 0; i < NUM_ITER; i++)
+        assert(h128m_get(&hm, gen_key(i, &state)) == i + 1);
+    for (;i < NUM_ITER * 2; i++)
+        assert(h128m_get(&hm, gen_key(i, &state)) == 0);
+
+    /* test overwrite */
+
+    dsfmt_init_gen_rand(&state, 123);
+    for (i = 0; i < NUM_ITER; i++)
+        if (i & 1)
+            h128m_set(&hm, gen_key(i, &state), 1);
+        else
+            gen_key(i, &state);
+    assert(hm.num_keys == NUM_ITER);
+    dsfmt_init_gen_rand(&state, 123);
+    for (i = 0; i < NUM_ITER; i++)
+        assert(h128m_get(&hm, gen_key(i, &state)) == (i & 1 ? 1: i + 1));
+    h128m_free(&hm);
+
+    /* keys that differ only in the high or the low half, and zero */
+
+    assert(h128m_init(&hm, 3) == 0);
+    assert(h128m_get(&hm, 0) == 0);
+    h128m_set(&hm, 0, 1);
+    h128m_set(&hm, 5, 2);
+    h128m_set(&hm, ((__uint128_t)5) << 64, 3);
+    assert(hm.num_keys == 3);
+    assert(h128m_get(&hm, 0) == 1);
+    assert(h128m_get(&hm, 5) == 2);
+    assert(h128m_get(&hm, ((__uint128_t)5) << 64) == 3);
+    assert(h128m_get(&hm, (((__uint128_t)5) << 64) | 5) == 0);
+    h128m_free(&hm);
+
+    return 0;
+}
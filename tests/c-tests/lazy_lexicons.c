@@ -0,0 +1,224 @@
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <traildb.h>
+#include <tdb_io.h>
+#include "tdb_test.h"
+
+#define NUM_FIELDS 50
+#define NUM_TRAILS 100
+#define NUM_THREADS 4
+
+static char names[NUM_FIELDS][16];
+
+/* field i has i + 1 distinct values */
+static void make_value(char *buf, uint64_t field, uint64_t trail)
+{
+    sprintf(buf, "%"PRIu64"-%"PRIu64, field, trail % (field + 1));
+}
+
+/* values of trail i are those of trail i + shift in the first TrailDB */
+static void create_tdb(const char *root, const char **fields, uint64_t shift)
+{
+    const char *values[NUM_FIELDS];
+    char bufs[NUM_FIELDS][32];
+    uint64_t lengths[NUM_FIELDS];
+    uint8_t uuid[16];
+    uint64_t i, j;
+
+    tdb_cons* c = tdb_cons_init();
+    test_cons_settings(c);
+    assert(tdb_cons_open(c, root, fields, NUM_FIELDS) == 0);
+    memset(uuid, 0, 16);
+    for (i = 0; i < NUM_TRAILS; i++){
+        memcpy(uuid, &i, 8);
+        for (j = 0; j < NUM_FIELDS; j++){
+            values[j] = bufs[j];
+            make_value(bufs[j], j, i + shift);
+            lengths[j] = strlen(bufs[j]);
+        }
+        assert(tdb_cons_add(c, uuid, i, values, lengths) == 0);
+    }
+    assert(tdb_cons_finalize(c) == 0);
+    tdb_cons_close(c);
+}
+
+static void *test_values(void *arg)
+{
+    const tdb *db = (const tdb*)arg;
+    char buf[32];
+    uint64_t i, j, trail_id, len;
+    uint8_t uuid[16];
+    tdb_cursor *cursor = tdb_cursor_new(db);
+    const tdb_event *event;
+
+    memset(uuid, 0, 16);
+    for (i = 0; i < NUM_TRAILS; i++){
+        memcpy(uuid, &i, 8);
+        assert(tdb_get_trail_id(db, uuid, &trail_id) == 0);
+        assert(tdb_get_trail(cursor, trail_id) == 0);
+        assert((event = tdb_cursor_next(cursor)) != NULL);
+        for (j = 0; j < NUM_FIELDS; j++){
+            const char *value = tdb_get_item_value(db, event->items[j], &len);
+            make_value(buf, j, i);
+            assert(value && len == strlen(buf) && !memcmp(value, buf, len));
+            assert(tdb_get_item(db, j + 1, buf, len) == event->items[j]);
+        }
+    }
+    tdb_cursor_free(cursor);
+    return NULL;
+}
+
+static void test_handle(tdb *t)
+{
+    pthread_t threads[NUM_THREADS];
+    uint64_t i;
+
+    assert(tdb_num_fields(t) == NUM_FIELDS + 1);
+
+    /* cardinalities are available before lexicons are used */
+    for (i = 0; i < NUM_FIELDS; i++)
+        assert(tdb_lexicon_size(t, i + 1) == i + 2);
+
+    /* lexicons are mapped concurrently on first use */
+    for (i = 0; i < NUM_THREADS; i++)
+        assert(pthread_create(&threads[i], NULL, test_values, t) == 0);
+    for (i = 0; i < NUM_THREADS; i++)
+        assert(pthread_join(threads[i], NULL) == 0);
+
+    tdb_willneed(t);
+}
+
+static void test_tdb(const char *root)
+{
+    tdb* t = tdb_init();
+    assert(tdb_open(t, root) == 0);
+    test_handle(t);
+    tdb_close(t);
+}
+
+/*
+An open handle reads its own lexicons after the TrailDB is replaced by
+another one with different values, and after it is removed
+*/
+static void test_replaced(const char *tmp, const char **fields)
+{
+    char root[TDB_MAX_PATH_SIZE];
+    char path[TDB_MAX_PATH_SIZE];
+    char other[TDB_MAX_PATH_SIZE];
+    char saved[TDB_MAX_PATH_SIZE];
+    tdb* t = tdb_init();
+    tdb* t2 = tdb_init();
+    uint64_t i;
+    int is_package;
+
+    tdb_path(root, "%s.replaced", tmp);
+    tdb_path(other, "%s.other", root);
+    tdb_path(saved, "%s.saved", root);
+    create_tdb(root, fields, 0);
+    create_tdb(other, fields, 1);
+
+    tdb_path(path, "%s.tdb", root);
+    if ((is_package = !access(path, F_OK)))
+        tdb_path(other, "%s.other.tdb", root);
+    else
+        tdb_path(path, "%s", root);
+
+    assert(tdb_open(t, root) == 0);
+    assert(tdb_open(t2, root) == 0);
+    if (is_package)
+        /* replace the package atomically, keeping the original around */
+        assert(link(path, saved) == 0);
+    else
+        assert(rename(path, saved) == 0);
+    assert(rename(other, path) == 0);
+    test_handle(t);
+
+    /* the original is removed */
+    if (is_package)
+        assert(unlink(saved) == 0);
+    else
+        for (i = 0; i < NUM_FIELDS; i++){
+            tdb_path(path, "%s/lexicon.%s", saved, fields[i]);
+            assert(unlink(path) == 0);
+        }
+    test_handle(t2);
+    tdb_close(t);
+    tdb_close(t2);
+}
+
+/* rewrite the fields file, keeping only the names and appending extra */
+static void rewrite_fields(const char *root, const char *extra)
+{
+    char path[TDB_MAX_PATH_SIZE];
+    uint64_t i;
+    FILE *f;
+
+    tdb_path(path, "%s/fields", root);
+    assert((f = fopen(path, "w")) != NULL);
+    for (i = 0; i < NUM_FIELDS; i++)
+        assert(fprintf(f, "%s\n", names[i]) > 0);
+    assert(fprintf(f, "\n%s", extra) >= 0);
+    assert(fclose(f) == 0);
+}
+
+int main(int argc, char** argv)
+{
+    char path[TDB_MAX_PATH_SIZE];
+    char moved[TDB_MAX_PATH_SIZE];
+    const char *root = getenv("TDB_TMP_DIR");
+    const char *fields[NUM_FIELDS];
+    uint64_t i, len;
+    FILE *f;
+
+    for (i = 0; i < NUM_FIELDS; i++){
+        sprintf(names[i], "field%"PRIu64, i);
+        fields[i] = names[i];
+    }
+
+    create_tdb(root, fields, 0);
+    test_tdb(root);
+    test_replaced(root, fields);
+
+    /* the rest works only for directories */
+    tdb_path(path, "%s/fields", root);
+    if (access(path, F_OK))
+        return 0;
+
+    /* TrailDBs without cardinalities map lexicons in tdb_open() */
+    rewrite_fields(root, "");
+    test_tdb(root);
+
+    /* so do TrailDBs with broken cardinalities */
+    rewrite_fields(root, "1\n2\nthree\n");
+    test_tdb(root);
+
+    /* lexicons of a directory are mapped in tdb_open() in any case */
+    rewrite_fields(root, "");
+    assert((f = fopen(path, "a")) != NULL);
+    for (i = 0; i < NUM_FIELDS; i++)
+        assert(fprintf(f, "%"PRIu64"\n", i + 1) > 0);
+    assert(fclose(f) == 0);
+    test_tdb(root);
+
+    tdb_path(path, "%s/lexicon.%s", root, names[3]);
+    tdb_path(moved, "%s/moved", root);
+    assert(rename(path, moved) == 0);
+    tdb* t = tdb_init();
+    assert(tdb_open(t, root) == TDB_ERR_INVALID_LEXICON_FILE);
+    tdb_close(t);
+    assert(rename(moved, path) == 0);
+
+    t = tdb_init();
+    assert(tdb_open(t, root) == 0);
+    assert(tdb_get_value(t, 4, 1, &len) != NULL);
+    tdb_close(t);
+    return 0;
+}
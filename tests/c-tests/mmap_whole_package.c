@@ -0,0 +1,180 @@
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include <traildb.h>
+#include <tdb_io.h>
+#include "tdb_test.h"
+
+#define NUM_FIELDS 20
+#define NUM_TRAILS 1000
+#define NUM_EVENTS 5
+
+static char names[NUM_FIELDS][16];
+
+/* count mappings of the given file, or return -1 without /proc */
+static int count_mappings(const char *path)
+{
+    char line[TDB_MAX_PATH_SIZE + 256];
+    const char *fname = strrchr(path, '/') ? strrchr(path, '/') + 1: path;
+    int num = 0;
+    FILE *f;
+
+    if (!(f = fopen("/proc/self/maps", "r")))
+        return -1;
+    while (fgets(line, sizeof(line), f)){
+        const char *p = strstr(line, fname);
+        if (p && p[strlen(fname)] == '\n')
+            ++num;
+    }
+    fclose(f);
+    return num;
+}
+
+static tdb *open_tdb(const char *path, int whole_package)
+{
+    tdb_opt_value value;
+    tdb* t = tdb_init();
+
+    assert(tdb_set_opt(t,
+                       TDB_OPT_MMAP_WHOLE_PACKAGE,
+                       opt_val(whole_package)) == 0);
+    assert(tdb_open(t, path) == 0);
+    assert(tdb_get_opt(t, TDB_OPT_MMAP_WHOLE_PACKAGE, &value) == 0);
+    assert(value.value == (uint64_t)whole_package);
+    return t;
+}
+
+/* the handles must return identical trails and values */
+static void compare_tdbs(const tdb *t0, const tdb *t1)
+{
+    tdb_cursor *c0 = tdb_cursor_new(t0);
+    tdb_cursor *c1 = tdb_cursor_new(t1);
+    const tdb_event *e0, *e1;
+    uint64_t i, j, trail_id, len0, len1;
+
+    assert(tdb_num_trails(t0) == tdb_num_trails(t1));
+    assert(tdb_num_events(t0) == tdb_num_events(t1));
+    assert(tdb_num_fields(t0) == tdb_num_fields(t1));
+
+    for (i = 0; i < tdb_num_trails(t0); i++){
+        assert(!memcmp(tdb_get_uuid(t0, i), tdb_get_uuid(t1, i), 16));
+        assert(tdb_get_trail_id(t1, tdb_get_uuid(t0, i), &trail_id) == 0);
+        assert(trail_id == i);
+
+        assert(tdb_get_trail(c0, i) == 0);
+        assert(tdb_get_trail(c1, i) == 0);
+        while ((e0 = tdb_cursor_next(c0))){
+            assert((e1 = tdb_cursor_next(c1)) != NULL);
+            assert(e0->timestamp == e1->timestamp);
+            assert(e0->num_items == e1->num_items);
+            for (j = 0; j < e0->num_items; j++){
+                const char *v0 = tdb_get_item_value(t0, e0->items[j], &len0);
+                const char *v1 = tdb_get_item_value(t1, e1->items[j], &len1);
+                assert(e0->items[j] == e1->items[j]);
+                assert(len0 == len1 && !memcmp(v0, v1, len0));
+            }
+        }
+        assert(tdb_cursor_next(c1) == NULL);
+    }
+    tdb_cursor_free(c0);
+    tdb_cursor_free(c1);
+}
+
+int main(int argc, char** argv)
+{
+    char root[TDB_MAX_PATH_SIZE];
+    char path[TDB_MAX_PATH_SIZE];
+    const char *fields[NUM_FIELDS];
+    const char *values[NUM_FIELDS];
+    char bufs[NUM_FIELDS][32];
+    uint64_t lengths[NUM_FIELDS];
+    uint8_t uuid[16];
+    uint64_t i, j, k;
+
+    for (i = 0; i < NUM_FIELDS; i++){
+        sprintf(names[i], "field%"PRIu64, i);
+        fields[i] = names[i];
+        values[i] = bufs[i];
+    }
+
+    tdb_path(root, "%s/whole", getenv("TDB_TMP_DIR"));
+    tdb_cons* c = tdb_cons_init();
+    test_cons_settings(c);
+    assert(tdb_cons_open(c, root, fields, NUM_FIELDS) == 0);
+    assert(tdb_cons_set_opt(c,
+                            TDB_OPT_CONS_OUTPUT_FORMAT,
+                            opt_val(TDB_OPT_CONS_OUTPUT_FORMAT_PACKAGE)) == 0);
+    memset(uuid, 0, 16);
+    for (i = 0; i < NUM_TRAILS; i++){
+        memcpy(uuid, &i, 8);
+        for (k = 0; k < NUM_EVENTS; k++){
+            for (j = 0; j < NUM_FIELDS; j++){
+                sprintf(bufs[j], "%"PRIu64, (i * k) % (j * 10 + 1));
+                lengths[j] = strlen(bufs[j]);
+            }
+            assert(tdb_cons_add(c, uuid, i * 10 + k, values, lengths) == 0);
+        }
+    }
+    assert(tdb_cons_finalize(c) == 0);
+    tdb_cons_close(c);
+    tdb_path(path, "%s.tdb", root);
+
+    tdb *t0 = open_tdb(path, 0);
+    tdb *t1 = open_tdb(path, 1);
+
+    /* lexicons are mapped lazily, the package is mapped once */
+    if (count_mappings(path) != -1){
+        tdb_close(t0);
+        assert(count_mappings(path) == 1);
+        t0 = open_tdb(path, 0);
+    }
+    compare_tdbs(t0, t1);
+
+    /* advising the whole mapping */
+    assert(tdb_set_opt(t1, TDB_OPT_MMAP_POPULATE, TDB_TRUE) == 0);
+    tdb_willneed(t1);
+    tdb_dontneed(t1);
+    compare_tdbs(t0, t1);
+    tdb_close(t1);
+    if (count_mappings(path) != -1)
+        assert(count_mappings(path) > 1);
+    tdb_close(t0);
+
+    /* works with huge page alignment */
+    t0 = open_tdb(path, 0);
+    t1 = tdb_init();
+    assert(tdb_set_opt(t1, TDB_OPT_MMAP_HUGEPAGES, TDB_TRUE) == 0);
+    assert(tdb_set_opt(t1, TDB_OPT_MMAP_WHOLE_PACKAGE, TDB_TRUE) == 0);
+    assert(tdb_open(t1, path) == 0);
+    compare_tdbs(t0, t1);
+    tdb_close(t0);
+    tdb_close(t1);
+
+    /* the option is ignored for directories */
+    c = tdb_cons_init();
+    test_cons_settings(c);
+    assert(tdb_cons_open(c, root, fields, NUM_FIELDS) == 0);
+    assert(tdb_cons_set_opt(c,
+                            TDB_OPT_CONS_OUTPUT_FORMAT,
+                            opt_val(TDB_OPT_CONS_OUTPUT_FORMAT_DIR)) == 0);
+    for (i = 0; i < 10; i++){
+        memcpy(uuid, &i, 8);
+        for (j = 0; j < NUM_FIELDS; j++)
+            lengths[j] = 0;
+        assert(tdb_cons_add(c, uuid, i, values, lengths) == 0);
+    }
+    assert(tdb_cons_finalize(c) == 0);
+    tdb_cons_close(c);
+
+    t0 = open_tdb(root, 0);
+    t1 = open_tdb(root, 1);
+    compare_tdbs(t0, t1);
+    tdb_close(t0);
+    tdb_close(t1);
+    return 0;
+}
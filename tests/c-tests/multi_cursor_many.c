@@ -0,0 +1,214 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+
+#include <traildb.h>
+
+#include "tdb_test.h"
+
+#define NUM_TRAILS 1500
+#define MAX_TRAIL_LENGTH 40
+
+/* many cursors with lots of equal timestamps across cursors */
+
+struct ref_event{
+    uint64_t timestamp;
+    uint64_t cursor_idx;
+    uint64_t seq;
+};
+
+static int ref_event_cmp(const void *a, const void *b)
+{
+    const struct ref_event *aa = (const struct ref_event*)a;
+    const struct ref_event *bb = (const struct ref_event*)b;
+
+    if (aa->timestamp != bb->timestamp)
+        return aa->timestamp > bb->timestamp ? 1: -1;
+    if (aa->cursor_idx != bb->cursor_idx)
+        return aa->cursor_idx > bb->cursor_idx ? 1: -1;
+    if (aa->seq != bb->seq)
+        return aa->seq > bb->seq ? 1: -1;
+    return 0;
+}
+
+static void reset_cursors(tdb_cursor **cursors, tdb_multi_cursor *mc)
+{
+    uint64_t i;
+    for (i = 0; i < NUM_TRAILS; i++)
+        assert(tdb_get_trail(cursors[i], i) == 0);
+    tdb_multi_cursor_reset(mc);
+}
+
+static void check_event(const tdb_multi_event *mevent,
+                        const struct ref_event *ref)
+{
+    const char *val;
+    uint64_t len;
+    uint32_t seq;
+
+    assert(mevent->event->timestamp == ref->timestamp);
+    assert(mevent->cursor_idx == ref->cursor_idx);
+
+    /* the value identifies the event within its trail */
+    assert(mevent->event->num_items == 1);
+    val = tdb_get_item_value(mevent->db, mevent->event->items[0], &len);
+    assert(len == 4);
+    memcpy(&seq, val, 4);
+    assert(seq == ref->seq);
+}
+
+/* num_threads = 0 tests a serial multi-cursor */
+static void test_merge(const tdb *t,
+                       uint64_t num_threads,
+                       const struct ref_event *ref,
+                       uint64_t num_events,
+                       tdb_multi_event *mevents)
+{
+    const uint64_t BATCH_SIZES[] = {1, 7, 100000};
+    const tdb_multi_event *mevent;
+    tdb_cursor *cursors[NUM_TRAILS];
+    tdb_multi_cursor *mc;
+    uint64_t i, j, k;
+
+    for (i = 0; i < NUM_TRAILS; i++){
+        assert((cursors[i] = tdb_cursor_new(t)) != NULL);
+        assert(tdb_get_trail(cursors[i], i) == 0);
+    }
+    if (num_threads)
+        mc = tdb_multi_cursor_new_parallel(cursors, NUM_TRAILS, num_threads);
+    else
+        mc = tdb_multi_cursor_new(cursors, NUM_TRAILS);
+    assert(mc != NULL);
+
+    /* tdb_multi_cursor_next, repeated to test resetting */
+    for (k = 0; k < 2; k++){
+        reset_cursors(cursors, mc);
+        for (j = 0; (mevent = tdb_multi_cursor_next(mc)); j++){
+            assert(j < num_events);
+            check_event(mevent, &ref[j]);
+            mevent = tdb_multi_cursor_peek(mc);
+            if (j + 1 < num_events)
+                check_event(mevent, &ref[j + 1]);
+            else
+                assert(mevent == NULL);
+        }
+        assert(j == num_events);
+    }
+
+    /* tdb_multi_cursor_next_batch */
+    for (k = 0; k < sizeof(BATCH_SIZES) / sizeof(BATCH_SIZES[0]); k++){
+        uint64_t n, total = 0;
+        reset_cursors(cursors, mc);
+        while ((n = tdb_multi_cursor_next_batch(mc,
+                                                mevents,
+                                                BATCH_SIZES[k]))){
+            assert(n <= BATCH_SIZES[k]);
+            assert(total + n <= num_events);
+            for (j = 0; j < n; j++)
+                check_event(&mevents[j], &ref[total + j]);
+            total += n;
+        }
+        assert(total == num_events);
+    }
+
+    /* reset in the middle of a trail */
+    reset_cursors(cursors, mc);
+    assert(tdb_multi_cursor_next_batch(mc, mevents, 100) > 0);
+    reset_cursors(cursors, mc);
+    for (j = 0; j < 100; j++)
+        check_event(tdb_multi_cursor_next(mc), &ref[j]);
+
+    tdb_multi_cursor_free(mc);
+    for (i = 0; i < NUM_TRAILS; i++)
+        tdb_cursor_free(cursors[i]);
+}
+
+int main(int argc, char** argv)
+{
+    static uint8_t uuid[16];
+    const char *root = getenv("TDB_TMP_DIR");
+    const char *fields[] = {"seq"};
+    const uint64_t BUFFER_SIZES[] = {1, 3, 1000};
+    const uint64_t NUM_THREADS[] = {0, 1, 4};
+    char val[4];
+    const char *values[] = {val};
+    uint64_t lengths[] = {4};
+    struct ref_event *ref;
+    tdb_multi_event *mevents;
+    uint64_t i, j, num_events = 0;
+
+    tdb_cons* c = tdb_cons_init();
+    test_cons_settings(c);
+    assert(tdb_cons_open(c, root, fields, 1) == 0);
+
+    assert((ref = malloc(NUM_TRAILS * MAX_TRAIL_LENGTH *
+                         sizeof(struct ref_event))) != NULL);
+    assert((mevents = malloc(NUM_TRAILS * MAX_TRAIL_LENGTH *
+                             sizeof(tdb_multi_event))) != NULL);
+
+    /*
+    trail i contains events at timestamps (i % 13) + 2j, so that
+    trails overlap heavily. Each event has a distinct value within
+    the trail, which is assigned in the timestamp order.
+    */
+    for (i = 0; i < NUM_TRAILS; i++){
+        memcpy(uuid, &i, 8);
+        for (j = 0; j < i % MAX_TRAIL_LENGTH + 1; j++){
+            uint32_t seq = (uint32_t)j;
+            memcpy(val, &seq, 4);
+            assert(tdb_cons_add(c, uuid, (i % 13) + 2 * j, values, lengths) == 0);
+            ref[num_events].timestamp = (i % 13) + 2 * j;
+            ref[num_events].seq = j;
+            /* the cursor index is the trail ID, assigned below */
+            ref[num_events].cursor_idx = i;
+            ++num_events;
+        }
+    }
+    assert(tdb_cons_finalize(c) == 0);
+    tdb_cons_close(c);
+
+    tdb* t = tdb_init();
+    assert(tdb_open(t, root) == 0);
+    assert(tdb_num_trails(t) == NUM_TRAILS);
+
+    /* map UUIDs to trail IDs and sort the ground truth */
+    for (i = 0; i < num_events; i++){
+        uint64_t trail_id;
+        memcpy(uuid, &ref[i].cursor_idx, 8);
+        assert(tdb_get_trail_id(t, uuid, &trail_id) == 0);
+        ref[i].cursor_idx = trail_id;
+    }
+    qsort(ref, num_events, sizeof(struct ref_event), ref_event_cmp);
+
+    for (i = 0; i < sizeof(BUFFER_SIZES) / sizeof(BUFFER_SIZES[0]); i++){
+        assert(tdb_set_opt(t,
+                           TDB_OPT_CURSOR_EVENT_BUFFER_SIZE,
+                           opt_val(BUFFER_SIZES[i])) == 0);
+        for (j = 0; j < sizeof(NUM_THREADS) / sizeof(NUM_THREADS[0]); j++)
+            test_merge(t, NUM_THREADS[j], ref, num_events, mevents);
+    }
+
+    /*
+    with the trail cache, cursors have events available right after
+    tdb_get_trail(), which the parallel multi-cursor must consume first
+    */
+    assert(tdb_set_opt(t, TDB_OPT_TRAIL_CACHE_SIZE, opt_val(1 << 24)) == 0);
+    assert(tdb_set_opt(t, TDB_OPT_CURSOR_EVENT_BUFFER_SIZE, opt_val(3)) == 0);
+    for (j = 0; j < sizeof(NUM_THREADS) / sizeof(NUM_THREADS[0]); j++)
+        test_merge(t, NUM_THREADS[j], ref, num_events, mevents);
+
+    /* an empty multi-cursor */
+    tdb_multi_cursor *empty = tdb_multi_cursor_new(NULL, 0);
+    assert(empty != NULL);
+    assert(tdb_multi_cursor_next(empty) == NULL);
+    assert(tdb_multi_cursor_peek(empty) == NULL);
+    assert(tdb_multi_cursor_next_batch(empty, mevents, 10) == 0);
+    tdb_multi_cursor_free(empty);
+
+    tdb_close(t);
+    free(mevents);
+    free(ref);
+    return 0;
+}
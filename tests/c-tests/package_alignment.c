@@ -0,0 +1,144 @@
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include <traildb.h>
+#include <tdb_package.h>
+#include "tdb_test.h"
+
+/* enough trails for uuids and the lexicon to exceed the alignment */
+#define NUM_TRAILS 140000
+#define ALIGNMENT (1LLU << 21)
+
+/* find the data offset of a file in the binary TOC */
+static uint64_t file_offset(const char *path, const char *fname)
+{
+    uint64_t header[3];
+    uint64_t i, offset = 0;
+    struct pkg_toc_entry *files;
+    char *names;
+    FILE *f;
+
+    assert((f = fopen(path, "r")) != NULL);
+    assert(fseek(f, TOC_FILE_OFFSET + TOC_MAGIC_SIZE, SEEK_SET) == 0);
+    assert(fread(header, sizeof(header), 1, f) == 1);
+    assert(fseek(f, (long)(header[1] * 8), SEEK_CUR) == 0);
+
+    assert((files = malloc(header[0] * sizeof(files[0]))) != NULL);
+    assert((names = malloc(header[2])) != NULL);
+    assert(fread(files, sizeof(files[0]), header[0], f) == header[0]);
+    assert(fread(names, 1, header[2], f) == header[2]);
+    assert(fclose(f) == 0);
+
+    for (i = 0; i < header[0]; i++)
+        if (files[i].name_len == strlen(fname) &&
+            !memcmp(&names[files[i].name_offset], fname, strlen(fname)))
+            offset = files[i].offset;
+
+    free(files);
+    free(names);
+    assert(offset);
+    return offset;
+}
+
+static void test_tdb(tdb *t)
+{
+    tdb_cursor *cursor = tdb_cursor_new(t);
+    const tdb_event *event;
+    uint8_t uuid[16];
+    uint64_t i, trail_id, len;
+    const char *value;
+
+    assert(tdb_num_trails(t) == NUM_TRAILS);
+    memset(uuid, 0, 16);
+    for (i = 0; i < NUM_TRAILS; i += 997){
+        memcpy(uuid, &i, 8);
+        memcpy(&uuid[8], &i, 8);
+        assert(tdb_get_trail_id(t, uuid, &trail_id) == 0);
+        assert(memcmp(tdb_get_uuid(t, trail_id), uuid, 16) == 0);
+        assert(tdb_get_trail(cursor, trail_id) == 0);
+        assert((event = tdb_cursor_next(cursor)) != NULL);
+        assert(event->timestamp == i);
+        value = tdb_get_item_value(t, event->items[0], &len);
+        assert(len == 16 && !memcmp(value, uuid, 16));
+        assert(tdb_cursor_next(cursor) == NULL);
+    }
+    tdb_cursor_free(cursor);
+}
+
+int main(int argc, char** argv)
+{
+    char root[TDB_MAX_PATH_SIZE];
+    char path[TDB_MAX_PATH_SIZE];
+    const char *fields[] = {"value"};
+    uint8_t uuid[16];
+    const char *values[] = {(const char*)uuid};
+    uint64_t lengths[] = {16};
+    tdb_opt_value value;
+    uint64_t i;
+
+    tdb_path(root, "%s/package", getenv("TDB_TMP_DIR"));
+    tdb_cons* c = tdb_cons_init();
+    assert(tdb_cons_open(c, root, fields, 1) == 0);
+    assert(tdb_cons_set_opt(c,
+                            TDB_OPT_CONS_OUTPUT_FORMAT,
+                            opt_val(TDB_OPT_CONS_OUTPUT_FORMAT_PACKAGE)) == 0);
+
+    /* alignments must be powers of two and multiples of tar blocks */
+    assert(tdb_cons_set_opt(c,
+                            TDB_OPT_CONS_PACKAGE_ALIGNMENT,
+                            opt_val(3 << 20)) == TDB_ERR_INVALID_OPTION_VALUE);
+    assert(tdb_cons_set_opt(c,
+                            TDB_OPT_CONS_PACKAGE_ALIGNMENT,
+                            opt_val(256)) == TDB_ERR_INVALID_OPTION_VALUE);
+    assert(tdb_cons_set_opt(c,
+                            TDB_OPT_CONS_PACKAGE_ALIGNMENT,
+                            opt_val(ALIGNMENT)) == 0);
+    assert(tdb_cons_get_opt(c, TDB_OPT_CONS_PACKAGE_ALIGNMENT, &value) == 0);
+    assert(value.value == ALIGNMENT);
+
+    memset(uuid, 0, 16);
+    for (i = 0; i < NUM_TRAILS; i++){
+        memcpy(uuid, &i, 8);
+        memcpy(&uuid[8], &i, 8);
+        assert(tdb_cons_add(c, uuid, i, values, lengths) == 0);
+    }
+    assert(tdb_cons_finalize(c) == 0);
+    tdb_cons_close(c);
+
+    tdb_path(path, "%s.tdb", root);
+    assert(file_offset(path, "trails.data") % ALIGNMENT == 0);
+    assert(file_offset(path, "uuids") % ALIGNMENT == 0);
+    assert(file_offset(path, "lexicon.value") % ALIGNMENT == 0);
+    /* the header files stay at their fixed offsets */
+    assert(file_offset(path, "version") == 512);
+    assert(file_offset(path, "info") == 1536);
+
+    /* mapping options given before tdb_open() */
+    tdb* t = tdb_init();
+    assert(tdb_set_opt(t, TDB_OPT_MMAP_HUGEPAGES, TDB_TRUE) == 0);
+    assert(tdb_set_opt(t, TDB_OPT_MMAP_POPULATE, TDB_TRUE) == 0);
+    assert(tdb_open(t, path) == 0);
+    assert(tdb_get_opt(t, TDB_OPT_MMAP_HUGEPAGES, &value) == 0);
+    assert(value.value == 1);
+    assert(tdb_get_opt(t, TDB_OPT_MMAP_POPULATE, &value) == 0);
+    assert(value.value == 1);
+    test_tdb(t);
+    tdb_close(t);
+
+    /* mapping options given after tdb_open() */
+    t = tdb_init();
+    assert(tdb_open(t, path) == 0);
+    assert(tdb_get_opt(t, TDB_OPT_MMAP_HUGEPAGES, &value) == 0);
+    assert(value.value == 0);
+    assert(tdb_set_opt(t, TDB_OPT_MMAP_HUGEPAGES, TDB_TRUE) == 0);
+    assert(tdb_set_opt(t, TDB_OPT_MMAP_POPULATE, TDB_TRUE) == 0);
+    test_tdb(t);
+    tdb_close(t);
+
+    return 0;
+}
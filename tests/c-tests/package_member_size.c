@@ -0,0 +1,51 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include <traildb.h>
+#include <tdb_io.h>
+#include <tdb_internal.h>
+#include <tdb_package.h>
+
+/*
+Package members opened with a known size must be written exactly: a
+larger member would overwrite the next one
+*/
+
+static tdb_error write_member(tdb_cons *cons,
+                              const char *fname,
+                              uint64_t size,
+                              uint64_t written)
+{
+    const char buf[16] = {0};
+    FILE *f;
+
+    assert(written <= sizeof(buf));
+    assert(cons_package_fopen(cons, fname, size, &f) == 0);
+    if (written)
+        assert(fwrite(buf, written, 1, f) == 1);
+    return cons_package_fclose(cons, f);
+}
+
+int main(int argc, char** argv)
+{
+    const char *root = getenv("TDB_TMP_DIR");
+    tdb_cons* c = tdb_cons_init();
+
+    assert(tdb_cons_set_opt(c,
+                            TDB_OPT_CONS_OUTPUT_FORMAT,
+                            opt_val(TDB_OPT_CONS_OUTPUT_FORMAT_PACKAGE)) == 0);
+    assert(tdb_cons_open(c, root, NULL, 0) == 0);
+    assert(cons_package_open(c) == 0);
+
+    assert(write_member(c, "exact", 8, 8) == 0);
+    assert(write_member(c, "too_large", 8, 16) == TDB_ERR_IO_PACKAGE);
+    assert(write_member(c, "too_small", 8, 4) == TDB_ERR_IO_PACKAGE);
+    assert(write_member(c, "unsized", TDB_CONS_UNKNOWN_SIZE, 16) == 0);
+
+    cons_package_free(c);
+    tdb_cons_close(c);
+    return 0;
+}
@@ -0,0 +1,56 @@
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <traildb.h>
+#include <tdb_io.h>
+
+/*
+Packages get the mode of other new files, 0666 minus the umask, so they
+can be read by other users like directory TrailDBs
+*/
+
+static mode_t package_mode(const char *root, mode_t mask)
+{
+    char path[TDB_MAX_PATH_SIZE];
+    static uint8_t uuid[16];
+    const char *fields[] = {"a"};
+    const char *values[] = {"x"};
+    uint64_t lengths[] = {1};
+    struct stat stats;
+
+    tdb_cons* c = tdb_cons_init();
+    assert(tdb_cons_set_opt(c,
+                            TDB_OPT_CONS_OUTPUT_FORMAT,
+                            opt_val(TDB_OPT_CONS_OUTPUT_FORMAT_PACKAGE)) == 0);
+    assert(tdb_cons_open(c, root, fields, 1) == 0);
+    assert(tdb_cons_add(c, uuid, 1, values, lengths) == 0);
+    umask(mask);
+    assert(tdb_cons_finalize(c) == 0);
+    tdb_cons_close(c);
+
+    assert(tdb_path(path, "%s.tdb", root) == 0);
+    assert(stat(path, &stats) == 0);
+    return stats.st_mode & 0777;
+}
+
+int main(int argc, char** argv)
+{
+    char root[TDB_MAX_PATH_SIZE];
+    const char *tmp = getenv("TDB_TMP_DIR");
+
+    assert(tdb_path(root, "%s.public", tmp) == 0);
+    assert(package_mode(root, 022) == 0644);
+
+    assert(tdb_path(root, "%s.private", tmp) == 0);
+    assert(package_mode(root, 077) == 0600);
+
+    assert(tdb_path(root, "%s.group", tmp) == 0);
+    assert(package_mode(root, 027) == 0640);
+    return 0;
+}
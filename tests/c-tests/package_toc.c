@@ -0,0 +1,118 @@
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include <traildb.h>
+#include <tdb_package.h>
+#include "tdb_test.h"
+
+#define NUM_FIELDS 300
+#define NUM_TRAILS 10
+
+static char names[NUM_FIELDS][16];
+
+static void test_package(const char *path)
+{
+    tdb_field field;
+    uint64_t i, len;
+    const char *value;
+
+    tdb* t = tdb_init();
+    assert(tdb_open(t, path) == 0);
+    assert(tdb_num_fields(t) == NUM_FIELDS + 1);
+    assert(tdb_num_trails(t) == NUM_TRAILS);
+
+    for (i = 0; i < NUM_FIELDS; i++){
+        assert(tdb_get_field(t, names[i], &field) == 0);
+        assert(field == i + 1);
+        value = tdb_get_item_value(t, tdb_make_item(field, 1), &len);
+        assert(len == strlen(names[i]) && !memcmp(value, names[i], len));
+    }
+    tdb_close(t);
+}
+
+/* rewrite the binary TOC in the text format of older packages */
+static void rewrite_text_toc(const char *path)
+{
+    uint64_t header[3];
+    uint64_t i;
+    uint64_t *slots;
+    struct pkg_toc_entry *files;
+    char *names;
+    FILE *f;
+
+    assert((f = fopen(path, "r+")) != NULL);
+    assert(fseek(f, TOC_FILE_OFFSET + TOC_MAGIC_SIZE, SEEK_SET) == 0);
+    assert(fread(header, sizeof(header), 1, f) == 1);
+
+    assert((slots = malloc(header[1] * 8)) != NULL);
+    assert((files = malloc(header[0] * sizeof(files[0]))) != NULL);
+    assert((names = malloc(header[2])) != NULL);
+    assert(fread(slots, 8, header[1], f) == header[1]);
+    assert(fread(files, sizeof(files[0]), header[0], f) == header[0]);
+    assert(fread(names, 1, header[2], f) == header[2]);
+
+    assert(fseek(f, TOC_FILE_OFFSET, SEEK_SET) == 0);
+    assert(fprintf(f, TDB_TAR_MAGIC) > 0);
+    for (i = 0; i < header[0]; i++)
+        assert(fprintf(f,
+                       "%.*s %"PRIu64" %"PRIu64"\n",
+                       (int)files[i].name_len,
+                       &names[files[i].name_offset],
+                       files[i].offset,
+                       files[i].size) > 0);
+    assert(fprintf(f, "\n") > 0);
+    assert(fclose(f) == 0);
+
+    free(slots);
+    free(files);
+    free(names);
+}
+
+int main(int argc, char** argv)
+{
+    char root[TDB_MAX_PATH_SIZE];
+    char path[TDB_MAX_PATH_SIZE];
+    const char *fields[NUM_FIELDS];
+    const char *values[NUM_FIELDS];
+    uint64_t lengths[NUM_FIELDS];
+    uint8_t uuid[16];
+    uint64_t i;
+
+    for (i = 0; i < NUM_FIELDS; i++){
+        sprintf(names[i], "field%"PRIu64, i);
+        fields[i] = values[i] = names[i];
+    }
+
+    tdb_path(root, "%s/package", getenv("TDB_TMP_DIR"));
+    tdb_cons* c = tdb_cons_init();
+    assert(tdb_cons_open(c, root, fields, NUM_FIELDS) == 0);
+    assert(tdb_cons_set_opt(c,
+                            TDB_OPT_CONS_OUTPUT_FORMAT,
+                            opt_val(TDB_OPT_CONS_OUTPUT_FORMAT_PACKAGE)) == 0);
+    /*
+    each trail sets a subset of fields: encoding events with hundreds of
+    non-empty values is very slow
+    */
+    memset(uuid, 0, 16);
+    for (i = 0; i < NUM_TRAILS; i++){
+        uint64_t j;
+        for (j = 0; j < NUM_FIELDS; j++)
+            lengths[j] = j % NUM_TRAILS == i ? strlen(names[j]): 0;
+        uuid[0] = (uint8_t)i;
+        assert(tdb_cons_add(c, uuid, i, values, lengths) == 0);
+    }
+    assert(tdb_cons_finalize(c) == 0);
+    tdb_cons_close(c);
+
+    tdb_path(path, "%s.tdb", root);
+    test_package(path);
+
+    rewrite_text_toc(path);
+    test_package(path);
+    return 0;
+}
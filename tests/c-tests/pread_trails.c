@@ -0,0 +1,150 @@
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include <traildb.h>
+#include "tdb_test.h"
+
+#define NUM_TRAILS 1000
+#define NUM_LARGE_TRAILS 3
+#define LARGE_TRAIL_LENGTH 50000
+#define NUM_CURSORS 4
+
+static tdb *open_tdb(const char *root, uint64_t cache_size)
+{
+    tdb* db = tdb_init();
+    tdb_opt_value value = {.value = cache_size};
+    assert(tdb_set_opt(db, TDB_OPT_PREAD_CACHE_SIZE, value) == 0);
+    assert(tdb_open(db, root) == 0);
+    assert(tdb_get_opt(db, TDB_OPT_PREAD_CACHE_SIZE, &value) == 0);
+    assert(value.value == cache_size);
+    return db;
+}
+
+static void compare_trail(tdb_cursor *c1, tdb_cursor *c2, uint64_t trail_id)
+{
+    const tdb_event *e1, *e2;
+
+    assert(tdb_get_trail(c1, trail_id) == 0);
+    assert(tdb_get_trail(c2, trail_id) == 0);
+    while ((e1 = tdb_cursor_next(c1))){
+        assert((e2 = tdb_cursor_next(c2)) != NULL);
+        assert(e1->timestamp == e2->timestamp);
+        assert(e1->num_items == e2->num_items);
+        assert(!memcmp(e1->items, e2->items, e1->num_items * sizeof(tdb_item)));
+    }
+    assert(tdb_cursor_next(c2) == NULL);
+}
+
+static uint64_t merge_trails(const tdb *db,
+                             uint64_t first,
+                             uint64_t num_threads)
+{
+    tdb_cursor *cursors[NUM_CURSORS];
+    const tdb_multi_event *mevent;
+    tdb_multi_cursor *mc;
+    uint64_t i, n = 0;
+
+    for (i = 0; i < NUM_CURSORS; i++){
+        assert((cursors[i] = tdb_cursor_new(db)) != NULL);
+        assert(tdb_get_trail(cursors[i], first + i) == 0);
+    }
+    if (num_threads)
+        mc = tdb_multi_cursor_new_parallel(cursors, NUM_CURSORS, num_threads);
+    else
+        mc = tdb_multi_cursor_new(cursors, NUM_CURSORS);
+    assert(mc);
+
+    while ((mevent = tdb_multi_cursor_next(mc)))
+        n += mevent->event->timestamp;
+
+    tdb_multi_cursor_free(mc);
+    for (i = 0; i < NUM_CURSORS; i++)
+        tdb_cursor_free(cursors[i]);
+    return n;
+}
+
+static void test_pread(const char *root, uint64_t cache_size)
+{
+    tdb *db = open_tdb(root, 0);
+    tdb *pdb = open_tdb(root, cache_size);
+    tdb_cursor *c1 = tdb_cursor_new(db);
+    tdb_cursor *c2 = tdb_cursor_new(pdb);
+    uint64_t trail_ids[NUM_TRAILS];
+    uint64_t i;
+
+    assert(tdb_num_trails(pdb) == tdb_num_trails(db));
+    assert(tdb_num_events(pdb) == tdb_num_events(db));
+
+    /* all trails in order, including large ones and ones crossing blocks */
+    for (i = 0; i < tdb_num_trails(db); i++)
+        compare_trail(c1, c2, i);
+
+    /* prefetched trails in a random order */
+    for (i = 0; i < NUM_TRAILS; i++)
+        trail_ids[i] = (i * 7919) % tdb_num_trails(db);
+    assert(tdb_prefetch_trails(pdb, trail_ids, NUM_TRAILS) == 0);
+    for (i = 0; i < NUM_TRAILS; i++)
+        compare_trail(c1, c2, trail_ids[i]);
+
+    tdb_willneed(pdb);
+    for (i = 0; i < NUM_TRAILS; i += 100){
+        assert(merge_trails(pdb, i, 0) == merge_trails(db, i, 0));
+        assert(merge_trails(pdb, i, 2) == merge_trails(db, i, 0));
+    }
+    tdb_dontneed(pdb);
+
+    /* trails are decoded from blocks to the trail cache */
+    tdb_opt_value value = {.value = 1LLU << 20};
+    assert(tdb_set_opt(pdb, TDB_OPT_TRAIL_CACHE_SIZE, value) == 0);
+    for (i = 0; i < NUM_TRAILS; i++)
+        compare_trail(c1, c2, trail_ids[i]);
+
+    assert(tdb_get_trail(c2, tdb_num_trails(db)) == TDB_ERR_INVALID_TRAIL_ID);
+
+    tdb_cursor_free(c1);
+    tdb_cursor_free(c2);
+    tdb_close(db);
+    tdb_close(pdb);
+}
+
+int main(int argc, char** argv)
+{
+    static uint8_t uuid[16];
+    const char *root = getenv("TDB_TMP_DIR");
+    const char *fields[] = {"a", "b"};
+    char buf1[32];
+    char buf2[32];
+    const char *values[] = {buf1, buf2};
+    uint64_t lengths[2];
+    uint64_t i, j, num_events;
+
+    tdb_cons* c = tdb_cons_init();
+    test_cons_settings(c);
+    assert(tdb_cons_open(c, root, fields, 2) == 0);
+
+    for (i = 0; i < NUM_TRAILS + NUM_LARGE_TRAILS; i++){
+        memcpy(uuid, &i, 8);
+        /* large trails of unique values don't fit in a block */
+        if (i < NUM_TRAILS)
+            num_events = (i * 13) % 200 + 1;
+        else
+            num_events = LARGE_TRAIL_LENGTH;
+        for (j = 0; j < num_events; j++){
+            lengths[0] = (uint64_t)sprintf(buf1, "%"PRIu64, (i * j) % 100);
+            lengths[1] = (uint64_t)sprintf(buf2, "%"PRIu64, i * 1000000 + j);
+            assert(tdb_cons_add(c, uuid, j * j, values, lengths) == 0);
+        }
+    }
+    assert(tdb_cons_finalize(c) == 0);
+    tdb_cons_close(c);
+
+    test_pread(root, 100LLU << 20);
+    /* a cache too small for a single block */
+    test_pread(root, 1);
+    return 0;
+}
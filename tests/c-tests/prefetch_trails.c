@@ -0,0 +1,130 @@
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include <traildb.h>
+#include "tdb_test.h"
+
+#define NUM_TRAILS 10000
+#define NUM_EVENTS 20
+#define NUM_CURSORS 8
+
+static void check_trail(tdb_cursor *cursor, uint64_t trail_id)
+{
+    const tdb_event *event;
+    uint64_t n = 0;
+
+    assert(tdb_get_trail(cursor, trail_id) == 0);
+    while ((event = tdb_cursor_next(cursor))){
+        assert(event->timestamp == trail_id + n * NUM_TRAILS);
+        ++n;
+    }
+    assert(n == NUM_EVENTS);
+}
+
+/* merge trails far apart from each other, they are prefetched on reset */
+static void check_multi_cursor(const tdb *db, uint64_t num_threads)
+{
+    tdb_cursor *cursors[NUM_CURSORS];
+    const tdb_multi_event *mevent;
+    tdb_multi_cursor *mc;
+    uint64_t i, first, prev, n;
+
+    for (i = 0; i < NUM_CURSORS; i++)
+        assert((cursors[i] = tdb_cursor_new(db)) != NULL);
+    if (num_threads)
+        mc = tdb_multi_cursor_new_parallel(cursors, NUM_CURSORS, num_threads);
+    else
+        mc = tdb_multi_cursor_new(cursors, NUM_CURSORS);
+    assert(mc);
+
+    for (first = 0; first < NUM_TRAILS / NUM_CURSORS; first += 97){
+        for (i = 0; i < NUM_CURSORS; i++)
+            assert(tdb_get_trail(cursors[i],
+                                 first + i * (NUM_TRAILS / NUM_CURSORS)) == 0);
+        tdb_multi_cursor_reset(mc);
+
+        n = prev = 0;
+        while ((mevent = tdb_multi_cursor_next(mc))){
+            assert(mevent->event->timestamp >= prev);
+            prev = mevent->event->timestamp;
+            ++n;
+        }
+        assert(n == NUM_CURSORS * NUM_EVENTS);
+    }
+
+    tdb_multi_cursor_free(mc);
+    for (i = 0; i < NUM_CURSORS; i++)
+        tdb_cursor_free(cursors[i]);
+}
+
+static void test_tdb(tdb *db)
+{
+    uint64_t trail_ids[100];
+    uint64_t i;
+    tdb_cursor *cursor = tdb_cursor_new(db);
+
+    assert(tdb_prefetch_trails(db, NULL, 0) == 0);
+
+    /* scattered trails, unknown ones are ignored */
+    for (i = 0; i < 100; i++)
+        trail_ids[i] = i % 10 ? (i * 7919) % NUM_TRAILS: TDB_UNKNOWN_TRAIL_ID;
+    trail_ids[99] = NUM_TRAILS;
+    assert(tdb_prefetch_trails(db, trail_ids, 100) == 0);
+    for (i = 0; i < 99; i++)
+        if (trail_ids[i] != TDB_UNKNOWN_TRAIL_ID)
+            check_trail(cursor, trail_ids[i]);
+
+    /* adjacent trails */
+    for (i = 0; i < 100; i++)
+        trail_ids[i] = 5000 + i;
+    assert(tdb_prefetch_trails(db, trail_ids, 100) == 0);
+    for (i = 0; i < 100; i++)
+        check_trail(cursor, trail_ids[i]);
+
+    check_multi_cursor(db, 0);
+    check_multi_cursor(db, 2);
+    tdb_cursor_free(cursor);
+}
+
+int main(int argc, char** argv)
+{
+    static uint8_t uuid[16];
+    const char *root = getenv("TDB_TMP_DIR");
+    const char *fields[] = {"a"};
+    char buf[32];
+    const char *values[] = {buf};
+    uint64_t lengths[1];
+    uint64_t i, j;
+
+    tdb_cons* c = tdb_cons_init();
+    test_cons_settings(c);
+    assert(tdb_cons_open(c, root, fields, 1) == 0);
+
+    /* interleave events, so that trails are not written in order */
+    for (j = 0; j < NUM_EVENTS; j++)
+        for (i = 0; i < NUM_TRAILS; i++){
+            memcpy(uuid, &i, 8);
+            lengths[0] = (uint64_t)sprintf(buf, "%"PRIu64, (i * j) % 1000);
+            assert(tdb_cons_add(c, uuid, i + j * NUM_TRAILS, values, lengths) == 0);
+        }
+    assert(tdb_cons_finalize(c) == 0);
+    tdb_cons_close(c);
+
+    tdb* t = tdb_init();
+    assert(tdb_open(t, root) == 0);
+    test_tdb(t);
+    tdb_close(t);
+
+    /* ranges point to the package mapping */
+    t = tdb_init();
+    assert(tdb_set_opt(t, TDB_OPT_MMAP_WHOLE_PACKAGE, TDB_TRUE) == 0);
+    assert(tdb_open(t, root) == 0);
+    test_tdb(t);
+    tdb_close(t);
+    return 0;
+}
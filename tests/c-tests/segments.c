@@ -0,0 +1,252 @@
+
+#include <dirent.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include <traildb.h>
+#include <tdb_io.h>
+#include "tdb_test.h"
+
+#define NUM_SEGMENTS 3
+#define NUM_TRAILS 200
+#define NUM_EVENTS 3
+
+/*
+A trail is spread over overlapping segments: cursors merge its events
+in time order, before and after the segments are compacted. Handles of
+the same directory don't lose each other's segments
+*/
+
+static void make_uuid(uint8_t uuid[16], uint64_t i)
+{
+    memset(uuid, 0, 16);
+    memcpy(uuid, &i, 8);
+}
+
+/* segment k has UUIDs k * 100 ... k * 100 + NUM_TRAILS - 1 */
+static void create_segment(const char *root, uint64_t k)
+{
+    uint8_t uuid[16];
+    const char *fields[] = {"segment", "id"};
+    char buf1[32];
+    char buf2[32];
+    const char *values[] = {buf1, buf2};
+    uint64_t lengths[2];
+    uint64_t i, j;
+
+    tdb_cons* c = tdb_cons_init();
+    test_cons_settings(c);
+    assert(tdb_cons_open(c, root, fields, 2) == 0);
+    for (i = k * 100; i < k * 100 + NUM_TRAILS; i++){
+        make_uuid(uuid, i);
+        lengths[0] = (uint64_t)sprintf(buf1, "s%"PRIu64, k);
+        lengths[1] = (uint64_t)sprintf(buf2, "%"PRIu64, i);
+        for (j = 0; j < NUM_EVENTS; j++)
+            assert(tdb_cons_add(c, uuid, i * 10 + k + j * 3, values, lengths) == 0);
+    }
+    assert(tdb_cons_finalize(c) == 0);
+    tdb_cons_close(c);
+}
+
+static uint64_t num_segments_of(uint64_t i)
+{
+    uint64_t k, n = 0;
+    for (k = 0; k < NUM_SEGMENTS; k++)
+        n += i >= k * 100 && i < k * 100 + NUM_TRAILS;
+    return n;
+}
+
+/* the events of the current trail of UUID i */
+static void check_trail(tdb_segments_cursor *c, uint64_t i)
+{
+    const tdb_multi_event *e;
+    uint64_t n = 0;
+    uint64_t prev = 0;
+
+    while ((e = tdb_segments_cursor_next(c))){
+        char buf[32];
+        uint64_t len;
+        const char *value;
+        uint64_t k = (e->event->timestamp - i * 10) % 3;
+
+        assert(e->event->timestamp >= prev);
+        prev = e->event->timestamp;
+
+        value = tdb_get_item_value(e->db, e->event->items[0], &len);
+        assert(len == (uint64_t)sprintf(buf, "s%"PRIu64, k));
+        assert(!memcmp(value, buf, len));
+        value = tdb_get_item_value(e->db, e->event->items[1], &len);
+        assert(len == (uint64_t)sprintf(buf, "%"PRIu64, i));
+        assert(!memcmp(value, buf, len));
+        ++n;
+    }
+    assert(n == num_segments_of(i) * NUM_EVENTS);
+}
+
+static void check_segments(tdb_segments_cursor *c)
+{
+    const uint8_t *uuid;
+    uint8_t expected[16];
+    uint64_t i, n = 0;
+
+    for (i = 0; i < (NUM_SEGMENTS - 1) * 100 + NUM_TRAILS; i++){
+        make_uuid(expected, i);
+        assert(tdb_segments_get_trail(c, expected) == 0);
+        check_trail(c, i);
+    }
+    make_uuid(expected, i);
+    assert(tdb_segments_get_trail(c, expected) == TDB_ERR_UNKNOWN_UUID);
+    assert(tdb_segments_cursor_next(c) == NULL);
+
+    /* trails are visited once, in the order of UUIDs */
+    while (!tdb_segments_next_trail(c, &uuid) && uuid){
+        make_uuid(expected, n);
+        assert(!memcmp(uuid, expected, 16));
+        check_trail(c, n++);
+    }
+    assert(n == i);
+}
+
+/* the number of trails and events in the segments of sg */
+static void count_trails(tdb_segments *sg,
+                         uint64_t *num_trails,
+                         uint64_t *num_events)
+{
+    const uint8_t *uuid;
+    tdb_segments_cursor *c = tdb_segments_cursor_new(sg);
+
+    assert(c);
+    *num_trails = *num_events = 0;
+    while (!tdb_segments_next_trail(c, &uuid) && uuid){
+        ++*num_trails;
+        while (tdb_segments_cursor_next(c))
+            ++*num_events;
+    }
+    tdb_segments_cursor_free(c);
+}
+
+static uint64_t count_segment_files(const char *root)
+{
+    struct dirent *entry;
+    uint64_t n = 0;
+    DIR *dir = opendir(root);
+
+    assert(dir);
+    while ((entry = readdir(dir)))
+        n += !strncmp(entry->d_name, "segment.", 8);
+    closedir(dir);
+    return n;
+}
+
+int main(int argc, char** argv)
+{
+    char root[TDB_MAX_PATH_SIZE];
+    char path[TDB_MAX_PATH_SIZE];
+    const char *tmp = getenv("TDB_TMP_DIR");
+    const char *other_fields[] = {"segment"};
+    tdb_segments_cursor *c, *old;
+    tdb_segments *sg2;
+    const uint8_t *uuid;
+    uint64_t k, num_trails, num_events;
+    tdb *db;
+
+    assert(tdb_path(root, "%s.segments", tmp) == 0);
+    tdb_segments *sg = tdb_segments_init();
+    assert(tdb_segments_open(sg, root) == 0);
+    assert(tdb_segments_num_segments(sg) == 0);
+
+    c = tdb_segments_cursor_new(sg);
+    assert(tdb_segments_next_trail(c, &uuid) == 0);
+    assert(uuid == NULL);
+    tdb_segments_cursor_free(c);
+
+    for (k = 0; k < NUM_SEGMENTS; k++){
+        assert(tdb_path(path, "%s.new", tmp) == 0);
+        create_segment(path, k);
+        assert(tdb_segments_add(sg, path) == 0);
+    }
+    assert(tdb_segments_num_segments(sg) == NUM_SEGMENTS);
+
+    /* segments must have the same fields */
+    assert(tdb_path(path, "%s.other", tmp) == 0);
+    tdb_cons* cons = tdb_cons_init();
+    test_cons_settings(cons);
+    assert(tdb_cons_open(cons, path, other_fields, 1) == 0);
+    assert(tdb_cons_finalize(cons) == 0);
+    tdb_cons_close(cons);
+    assert(tdb_segments_add(sg, path) == TDB_ERR_APPEND_FIELDS_MISMATCH);
+    db = tdb_init();
+    assert(tdb_open(db, path) == 0);
+    tdb_close(db);
+
+    old = tdb_segments_cursor_new(sg);
+    check_segments(old);
+
+    /* only segments smaller than max_events are merged */
+    assert(tdb_segments_compact(sg, NUM_TRAILS * NUM_EVENTS) == 0);
+    assert(tdb_segments_num_segments(sg) == NUM_SEGMENTS);
+
+    assert(tdb_segments_compact(sg, UINT64_MAX) == 0);
+    assert(tdb_segments_num_segments(sg) == 1);
+    assert(count_segment_files(root) == 1);
+
+    /* the old cursor keeps the merged segments */
+    check_segments(old);
+    tdb_segments_cursor_free(old);
+
+    c = tdb_segments_cursor_new(sg);
+    check_segments(c);
+    tdb_segments_cursor_free(c);
+    tdb_segments_close(sg);
+
+    /* the manifest lists the merged segment */
+    sg = tdb_segments_init();
+    assert(tdb_segments_open(sg, root) == 0);
+    assert(tdb_segments_num_segments(sg) == 1);
+    assert(tdb_segments_open(sg, root) == TDB_ERR_HANDLE_ALREADY_OPENED);
+    c = tdb_segments_cursor_new(sg);
+    check_segments(c);
+    tdb_segments_cursor_free(c);
+
+    /* a handle that hasn't seen the segment of another one keeps it */
+    sg2 = tdb_segments_init();
+    assert(tdb_segments_open(sg2, root) == 0);
+    old = tdb_segments_cursor_new(sg);
+    for (k = 0; k < 2; k++){
+        assert(tdb_path(path, "%s.new", tmp) == 0);
+        create_segment(path, NUM_SEGMENTS + k);
+        assert(tdb_segments_add(k ? sg2: sg, path) == 0);
+    }
+    assert(tdb_segments_num_segments(sg) == 2);
+    assert(tdb_segments_num_segments(sg2) == 3);
+    assert(tdb_segments_reload(sg) == 0);
+    assert(tdb_segments_num_segments(sg) == 3);
+    count_trails(sg, &num_trails, &num_events);
+    assert(num_trails == (NUM_SEGMENTS + 1) * 100 + NUM_TRAILS);
+    assert(num_events == (NUM_SEGMENTS + 2) * NUM_TRAILS * NUM_EVENTS);
+
+    /* segments merged by another handle are gone after a reload */
+    assert(tdb_segments_compact(sg2, UINT64_MAX) == 0);
+    assert(tdb_segments_num_segments(sg2) == 1);
+    assert(count_segment_files(root) == 1);
+    assert(tdb_segments_reload(sg) == 0);
+    assert(tdb_segments_num_segments(sg) == 1);
+    count_trails(sg, &num_trails, &num_events);
+    assert(num_events == (NUM_SEGMENTS + 2) * NUM_TRAILS * NUM_EVENTS);
+
+    /* but cursors keep them */
+    check_segments(old);
+    tdb_segments_cursor_free(old);
+    tdb_segments_close(sg2);
+    tdb_segments_close(sg);
+
+    sg = tdb_segments_init();
+    assert(tdb_segments_open(sg, root) == 0);
+    assert(tdb_segments_num_segments(sg) == 1);
+    tdb_segments_close(sg);
+    return 0;
+}
@@ -0,0 +1,210 @@
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include <traildb.h>
+#include <tdb_io.h>
+#include <xxhash/xxhash.h>
+#include "tdb_test.h"
+
+#define NUM_TRAILS 1000
+#define NUM_SHARDS 4
+
+/*
+tdb_split() writes every trail to exactly one shard, as it is, and the
+shards can be merged back with tdb_cons_append()
+*/
+
+static tdb *create_tdb(const char *root)
+{
+    static uint8_t uuid[16];
+    const char *fields[] = {"page", "id"};
+    char buf1[32];
+    char buf2[32];
+    const char *values[] = {buf1, buf2};
+    uint64_t lengths[2];
+    uint64_t i, j;
+    tdb *db = tdb_init();
+
+    tdb_cons* c = tdb_cons_init();
+    test_cons_settings(c);
+    assert(tdb_cons_open(c, root, fields, 2) == 0);
+
+    for (i = 0; i < NUM_TRAILS; i++){
+        uint64_t key = i * 0x9e3779b97f4a7c15LLU;
+        memcpy(uuid, &key, 8);
+        memcpy(&uuid[8], &key, 8);
+        for (j = 0; j < (i * 13) % 50 + 1; j++){
+            lengths[0] = (uint64_t)sprintf(buf1, "page%"PRIu64, j % 7);
+            /* ids are unique to a trail */
+            lengths[1] = (uint64_t)sprintf(buf2, "%"PRIu64, i * 100 + j % 5);
+            assert(tdb_cons_add(c, uuid, 1000 + i + j * 60, values, lengths) == 0);
+        }
+    }
+    assert(tdb_cons_finalize(c) == 0);
+    tdb_cons_close(c);
+
+    assert(tdb_open(db, root) == 0);
+    return db;
+}
+
+static void compare_trail(const tdb *db1,
+                          tdb_cursor *c1,
+                          uint64_t trail_id1,
+                          const tdb *db2,
+                          tdb_cursor *c2,
+                          uint64_t trail_id2,
+                          int same_items)
+{
+    const tdb_event *e1, *e2;
+    uint64_t i;
+
+    assert(tdb_get_trail(c1, trail_id1) == 0);
+    assert(tdb_get_trail(c2, trail_id2) == 0);
+    while ((e1 = tdb_cursor_next(c1))){
+        assert((e2 = tdb_cursor_next(c2)) != NULL);
+        assert(e1->timestamp == e2->timestamp);
+        assert(e1->num_items == e2->num_items);
+        for (i = 0; i < e1->num_items; i++){
+            uint64_t len1, len2;
+            const char *val1 = tdb_get_item_value(db1, e1->items[i], &len1);
+            const char *val2 = tdb_get_item_value(db2, e2->items[i], &len2);
+            if (same_items)
+                assert(e1->items[i] == e2->items[i]);
+            assert(len1 == len2 && !memcmp(val1, val2, len1));
+        }
+    }
+    assert(tdb_cursor_next(c2) == NULL);
+}
+
+static void test_split(const tdb *src,
+                       const char *root,
+                       uint64_t flags,
+                       uint64_t num_threads)
+{
+    char paths[NUM_SHARDS][TDB_MAX_PATH_SIZE];
+    char path[TDB_MAX_PATH_SIZE];
+    const char *roots[NUM_SHARDS];
+    const char *fields[] = {"page", "id"};
+    tdb *shards[NUM_SHARDS];
+    tdb_cursor *cursors[NUM_SHARDS];
+    uint64_t i, trail_id, num_trails = 0;
+    tdb_cursor *cursor = tdb_cursor_new(src);
+
+    for (i = 0; i < NUM_SHARDS; i++){
+        assert(tdb_path(paths[i], "%s.%"PRIu64, root, i) == 0);
+        roots[i] = paths[i];
+    }
+    assert(tdb_split(src, roots, NUM_SHARDS, flags, num_threads) == 0);
+
+    for (i = 0; i < NUM_SHARDS; i++){
+        shards[i] = tdb_init();
+        assert(tdb_open(shards[i], roots[i]) == 0);
+        assert(tdb_num_trails(shards[i]) > 0);
+        if (!(flags & TDB_SPLIT_UUID_HASH))
+            assert(tdb_num_trails(shards[i]) == NUM_TRAILS / NUM_SHARDS);
+        num_trails += tdb_num_trails(shards[i]);
+        cursors[i] = tdb_cursor_new(shards[i]);
+    }
+    assert(num_trails == NUM_TRAILS);
+
+    for (i = 0; i < NUM_TRAILS; i++){
+        const uint8_t *uuid = tdb_get_uuid(src, i);
+        uint64_t shard;
+
+        if (flags & TDB_SPLIT_UUID_HASH)
+            shard = XXH64(uuid, 16, 0) % NUM_SHARDS;
+        else
+            shard = i / (NUM_TRAILS / NUM_SHARDS);
+
+        assert(tdb_get_trail_id(shards[shard], uuid, &trail_id) == 0);
+        compare_trail(src,
+                      cursor,
+                      i,
+                      shards[shard],
+                      cursors[shard],
+                      trail_id,
+                      1);
+    }
+
+    /* merge the shards back */
+    assert(tdb_path(path, "%s.merged", root) == 0);
+    tdb_cons *c = tdb_cons_init();
+    test_cons_settings(c);
+    assert(tdb_cons_open(c, path, fields, 2) == 0);
+    for (i = 0; i < NUM_SHARDS; i++)
+        assert(tdb_cons_append(c, shards[i]) == 0);
+    assert(tdb_cons_finalize(c) == 0);
+    tdb_cons_close(c);
+
+    tdb *merged = tdb_init();
+    tdb_cursor *merged_cursor;
+    assert(tdb_open(merged, path) == 0);
+    assert(tdb_num_trails(merged) == NUM_TRAILS);
+    merged_cursor = tdb_cursor_new(merged);
+    for (i = 0; i < NUM_TRAILS; i++){
+        assert(tdb_get_trail_id(merged, tdb_get_uuid(src, i), &trail_id) == 0);
+        compare_trail(src, cursor, i, merged, merged_cursor, trail_id, 0);
+    }
+    tdb_cursor_free(merged_cursor);
+    tdb_close(merged);
+
+    for (i = 0; i < NUM_SHARDS; i++){
+        uint64_t len;
+        tdb_item item = tdb_make_item(2, tdb_lexicon_size(src, 2) - 1);
+
+        assert(tdb_lexicon_size(shards[i], 2) == tdb_lexicon_size(src, 2));
+        if (flags & TDB_SPLIT_PRUNE_LEXICONS){
+            /* trails of other shards use other ids */
+            uint64_t num_empty = 0;
+            for (trail_id = 1; trail_id < tdb_lexicon_size(src, 2); trail_id++){
+                tdb_get_value(shards[i], 2, trail_id, &len);
+                num_empty += len == 0;
+            }
+            assert(num_empty >= tdb_lexicon_size(src, 2) / 2);
+
+            /* repeated empty values can't seed a codebook */
+            c = tdb_cons_init();
+            test_cons_settings(c);
+            assert(tdb_cons_open(c, root, fields, 2) == 0);
+            assert(tdb_cons_set_opt(c,
+                                    TDB_OPT_CONS_CODEBOOK,
+                                    (tdb_opt_value){.ptr = shards[i]}) ==
+                   TDB_ERR_INVALID_OPTION_VALUE);
+            tdb_cons_close(c);
+        }else{
+            tdb_get_item_value(shards[i], item, &len);
+            assert(len > 0);
+        }
+        tdb_cursor_free(cursors[i]);
+        tdb_close(shards[i]);
+    }
+    tdb_cursor_free(cursor);
+}
+
+int main(int argc, char** argv)
+{
+    char path[TDB_MAX_PATH_SIZE];
+    const char *root = getenv("TDB_TMP_DIR");
+
+    assert(tdb_path(path, "%s.src", root) == 0);
+    tdb *src = create_tdb(path);
+
+    assert(tdb_split(src, NULL, 0, 0, 1) == TDB_ERR_INVALID_OPTION_VALUE);
+
+    assert(tdb_path(path, "%s.range", root) == 0);
+    test_split(src, path, 0, 1);
+
+    assert(tdb_path(path, "%s.hash", root) == 0);
+    test_split(src, path, TDB_SPLIT_UUID_HASH, 3);
+
+    assert(tdb_path(path, "%s.pruned", root) == 0);
+    test_split(src, path, TDB_SPLIT_UUID_HASH | TDB_SPLIT_PRUNE_LEXICONS, 8);
+
+    tdb_close(src);
+    return 0;
+}
@@ -0,0 +1,167 @@
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include <traildb.h>
+#include <tdb_io.h>
+#include "tdb_test.h"
+
+#define NUM_TDBS 10
+#define MAX_OPEN 3
+#define NUM_THREADS 4
+
+static char roots[NUM_TDBS][TDB_MAX_PATH_SIZE];
+
+/* TrailDB i has i + 1 trails with one event each */
+static void create_tdb(const char *root, uint64_t n)
+{
+    const char *fields[] = {"tdb", "trail"};
+    char bufs[2][32];
+    const char *values[] = {bufs[0], bufs[1]};
+    uint64_t lengths[2];
+    uint8_t uuid[16];
+    uint64_t i;
+
+    tdb_cons* c = tdb_cons_init();
+    test_cons_settings(c);
+    assert(tdb_cons_open(c, root, fields, 2) == 0);
+    memset(uuid, 0, 16);
+    for (i = 0; i < n + 1; i++){
+        memcpy(uuid, &i, 8);
+        lengths[0] = (uint64_t)sprintf(bufs[0], "%"PRIu64, n);
+        lengths[1] = (uint64_t)sprintf(bufs[1], "%"PRIu64, i);
+        assert(tdb_cons_add(c, uuid, 100 + i, values, lengths) == 0);
+    }
+    assert(tdb_cons_finalize(c) == 0);
+    tdb_cons_close(c);
+}
+
+static void check_tdb(const tdb *db, uint64_t n)
+{
+    char buf[32];
+    uint64_t len;
+    const char *value = tdb_get_value(db, 1, 1, &len);
+
+    assert(tdb_num_trails(db) == n + 1);
+    sprintf(buf, "%"PRIu64, n);
+    assert(value && len == strlen(buf) && !memcmp(value, buf, len));
+}
+
+static void *test_thread(void *arg)
+{
+    tdb_catalog *catalog = (tdb_catalog*)arg;
+    const tdb *db;
+    uint64_t i;
+
+    for (i = 0; i < NUM_TDBS * 20; i++){
+        uint64_t n = (i * 7) % NUM_TDBS;
+        assert(tdb_catalog_get(catalog, roots[n], &db) == 0);
+        check_tdb(db, n);
+        tdb_catalog_release(catalog, db);
+    }
+    return NULL;
+}
+
+int main(int argc, char** argv)
+{
+    const char *tmp = getenv("TDB_TMP_DIR");
+    const tdb *held[NUM_TDBS];
+    const tdb *db, *db1;
+    pthread_t threads[NUM_THREADS];
+    tdb_catalog_info info;
+    char path[TDB_MAX_PATH_SIZE];
+    uint64_t i;
+
+    for (i = 0; i < NUM_TDBS; i++){
+        tdb_path(roots[i], "%s/catalog%"PRIu64, tmp, i);
+        create_tdb(roots[i], i);
+    }
+
+    tdb_catalog *catalog = tdb_catalog_new(MAX_OPEN);
+    assert(catalog);
+    assert(tdb_catalog_num_open(catalog) == 0);
+
+    /* the same handle is shared by all references */
+    assert(tdb_catalog_get(catalog, roots[0], &db) == 0);
+    assert(tdb_catalog_get(catalog, roots[0], &db1) == 0);
+    assert(db == db1);
+    check_tdb(db, 0);
+    assert(tdb_catalog_num_open(catalog) == 1);
+    tdb_catalog_release(catalog, db);
+    tdb_catalog_release(catalog, db1);
+    assert(tdb_catalog_num_open(catalog) == 1);
+
+    /* idle handles are closed when the catalog is full */
+    for (i = 0; i < NUM_TDBS; i++){
+        assert(tdb_catalog_get(catalog, roots[i], &db) == 0);
+        check_tdb(db, i);
+        tdb_catalog_release(catalog, db);
+        assert(tdb_catalog_num_open(catalog) <= MAX_OPEN);
+    }
+    assert(tdb_catalog_num_open(catalog) == MAX_OPEN);
+
+    /* referenced handles are never closed */
+    for (i = 0; i < NUM_TDBS; i++){
+        assert(tdb_catalog_get(catalog, roots[i], &held[i]) == 0);
+        check_tdb(held[i], i);
+    }
+    assert(tdb_catalog_num_open(catalog) == NUM_TDBS);
+    for (i = 0; i < NUM_TDBS; i++)
+        check_tdb(held[i], i);
+    for (i = 0; i < NUM_TDBS; i++)
+        tdb_catalog_release(catalog, held[i]);
+    assert(tdb_catalog_num_open(catalog) == MAX_OPEN);
+
+    /* the most recently released handles stay open */
+    assert(tdb_catalog_get(catalog, roots[NUM_TDBS - 1], &db) == 0);
+    assert(db == held[NUM_TDBS - 1]);
+    tdb_catalog_release(catalog, db);
+
+    /* metadata is available after the handle has been closed */
+    for (i = 0; i < NUM_TDBS; i++){
+        assert(tdb_catalog_get_info(catalog, roots[i], &info) == 0);
+        assert(info.num_trails == i + 1);
+        assert(info.num_events == i + 1);
+        assert(info.num_fields == 3);
+        assert(info.min_timestamp == 100);
+        assert(info.max_timestamp == 100 + i);
+        assert(!strcmp(info.field_names[0], "time"));
+        assert(!strcmp(info.field_names[1], "tdb"));
+        assert(!strcmp(info.field_names[2], "trail"));
+        assert(info.lexicon_sizes[0] == 0);
+        assert(info.lexicon_sizes[1] == 2);
+        assert(info.lexicon_sizes[2] == i + 2);
+    }
+    assert(tdb_catalog_num_open(catalog) == MAX_OPEN);
+
+    /* metadata of a TrailDB that has not been opened yet */
+    tdb_catalog_free(catalog);
+    catalog = tdb_catalog_new(MAX_OPEN);
+    assert(tdb_catalog_get_info(catalog, roots[5], &info) == 0);
+    assert(info.num_trails == 6);
+    assert(tdb_catalog_num_open(catalog) == 1);
+
+    /* handles are shared by threads */
+    for (i = 0; i < NUM_THREADS; i++)
+        assert(pthread_create(&threads[i], NULL, test_thread, catalog) == 0);
+    for (i = 0; i < NUM_THREADS; i++)
+        assert(pthread_join(threads[i], NULL) == 0);
+    assert(tdb_catalog_num_open(catalog) == MAX_OPEN);
+
+    /* errors are returned but not cached */
+    tdb_path(path, "%s/catalog-missing", tmp);
+    assert(tdb_catalog_get(catalog, path, &db) != 0);
+    assert(tdb_catalog_get_info(catalog, path, &info) != 0);
+    create_tdb(path, 4);
+    assert(tdb_catalog_get(catalog, path, &db) == 0);
+    check_tdb(db, 4);
+    tdb_catalog_release(catalog, db);
+
+    tdb_catalog_free(catalog);
+    return 0;
+}
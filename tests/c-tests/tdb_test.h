@@ -17,6 +17,18 @@ static inline void test_cons_settings(tdb_cons *cons)
                                 TDB_OPT_CONS_NO_BIGRAMS,
                                 opt_val(0)) == 0);
     }
+    if (getenv("TDB_CONS_COMPRESSION")) {
+        assert(tdb_cons_set_opt(cons,
+                                TDB_OPT_CONS_COMPRESSION,
+                                opt_val(TDB_OPT_CONS_COMPRESSION_ZSTD)) == 0);
+    }
+    if (getenv("TDB_CONS_MEMORY_LIMIT")) {
+        assert(tdb_cons_set_opt(cons,
+                                TDB_OPT_CONS_MEMORY_LIMIT,
+                                opt_val(strtoull(getenv("TDB_CONS_MEMORY_LIMIT"),
+                                                 NULL,
+                                                 10))) == 0);
+    }
 #ifdef __HAVE_ARCHIVE_H__
     if (getenv("TDB_CONS_OUTPUT_FORMAT")){
         assert(tdb_cons_set_opt(cons,
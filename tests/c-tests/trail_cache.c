@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <traildb.h>
+#include "tdb_test.h"
+
+#define NUM_TRAILS 100
+
+static uint64_t trail_length(uint64_t trail_id)
+{
+    return trail_id * 10 + 1;
+}
+
+static void compare_trails(tdb_cursor *cursor, tdb_cursor *ref_cursor)
+{
+    const tdb_event *event, *ref_event;
+    uint64_t n = 0;
+
+    while ((ref_event = tdb_cursor_next(ref_cursor))){
+        assert((event = tdb_cursor_next(cursor)) != NULL);
+        assert(event->timestamp == ref_event->timestamp);
+        assert(event->num_items == ref_event->num_items);
+        assert(!memcmp(event->items,
+                       ref_event->items,
+                       event->num_items * sizeof(tdb_item)));
+        ++n;
+    }
+    assert(tdb_cursor_next(cursor) == NULL);
+    assert(n > 0);
+}
+
+int main(int argc, char** argv)
+{
+    static uint8_t uuid[16];
+    const char *root = getenv("TDB_TMP_DIR");
+    const char *fields[] = {"a", "b"};
+    char val[16];
+    const char *values[] = {val, val};
+    uint64_t lengths[2];
+    tdb_opt_value value;
+    uint64_t i, j;
+
+    tdb_cons* c = tdb_cons_init();
+    test_cons_settings(c);
+    assert(tdb_cons_open(c, root, fields, 2) == 0);
+    for (i = 0; i < NUM_TRAILS; i++){
+        memcpy(uuid, &i, 8);
+        for (j = 0; j < trail_length(i); j++){
+            lengths[0] = (uint64_t)sprintf(val, "%"PRIu64, j % 7);
+            lengths[1] = j % 3;
+            assert(tdb_cons_add(c, uuid, i + j, values, lengths) == 0);
+        }
+    }
+    assert(tdb_cons_finalize(c) == 0);
+    tdb_cons_close(c);
+
+    tdb* ref = tdb_init();
+    assert(tdb_open(ref, root) == 0);
+    tdb* t = tdb_init();
+    assert(tdb_open(t, root) == 0);
+
+    /* the cache is disabled by default */
+    assert(tdb_get_opt(t, TDB_OPT_TRAIL_CACHE_SIZE, &value) == 0);
+    assert(value.value == 0);
+    assert(tdb_get_opt(t, TDB_OPT_TRAIL_CACHE_HITS, &value) == 0);
+    assert(value.value == 0);
+
+    /* hit/miss counters are read-only */
+    assert(tdb_set_opt(t, TDB_OPT_TRAIL_CACHE_HITS, opt_val(1)) ==
+           TDB_ERR_UNKNOWN_OPTION);
+
+    /* a cache that fits all the trails */
+    assert(tdb_set_opt(t, TDB_OPT_TRAIL_CACHE_SIZE, opt_val(1 << 24)) == 0);
+    assert(tdb_get_opt(t, TDB_OPT_TRAIL_CACHE_SIZE, &value) == 0);
+    assert(value.value == 1 << 24);
+
+    /* use a small buffer so that trails are decoded in many batches */
+    assert(tdb_set_opt(t, TDB_OPT_CURSOR_EVENT_BUFFER_SIZE, opt_val(7)) == 0);
+
+    tdb_cursor *cursor = tdb_cursor_new(t);
+    tdb_cursor *ref_cursor = tdb_cursor_new(ref);
+
+    for (j = 0; j < 2; j++)
+        for (i = 0; i < NUM_TRAILS; i++){
+            assert(tdb_get_trail(cursor, i) == 0);
+            assert(tdb_get_trail(ref_cursor, i) == 0);
+            compare_trails(cursor, ref_cursor);
+        }
+
+    assert(tdb_get_opt(t, TDB_OPT_TRAIL_CACHE_MISSES, &value) == 0);
+    assert(value.value == NUM_TRAILS);
+    assert(tdb_get_opt(t, TDB_OPT_TRAIL_CACHE_HITS, &value) == 0);
+    assert(value.value == NUM_TRAILS);
+
+    /* trail length works with cached trails */
+    for (i = 0; i < NUM_TRAILS; i++){
+        assert(tdb_get_trail(cursor, i) == 0);
+        assert(tdb_get_trail_length(cursor) == trail_length(i));
+    }
+
+    /*
+    shrink the cache so that only a few trails fit. An evicted trail
+    must stay valid as long as a cursor is referencing it
+    */
+    assert(tdb_set_opt(t, TDB_OPT_TRAIL_CACHE_SIZE, opt_val(20000)) == 0);
+    tdb_cursor *cursor2 = tdb_cursor_new(t);
+    assert(tdb_get_trail(cursor, 10) == 0);
+    assert(tdb_get_trail(ref_cursor, 10) == 0);
+    for (i = 0; i < NUM_TRAILS; i++){
+        assert(tdb_get_trail(cursor2, i) == 0);
+        assert(tdb_get_trail_length(cursor2) == trail_length(i));
+    }
+    compare_trails(cursor, ref_cursor);
+
+    /* trails larger than the cache are decoded as usual */
+    for (i = 0; i < NUM_TRAILS; i++){
+        assert(tdb_get_trail(cursor, i) == 0);
+        assert(tdb_get_trail(ref_cursor, i) == 0);
+        compare_trails(cursor, ref_cursor);
+    }
+
+    /* disable the cache */
+    assert(tdb_set_opt(t, TDB_OPT_TRAIL_CACHE_SIZE, opt_val(0)) == 0);
+    assert(tdb_get_opt(t, TDB_OPT_TRAIL_CACHE_HITS, &value) == 0);
+    j = value.value;
+    for (i = 0; i < NUM_TRAILS; i++){
+        assert(tdb_get_trail(cursor, i) == 0);
+        assert(tdb_get_trail(ref_cursor, i) == 0);
+        compare_trails(cursor, ref_cursor);
+    }
+    assert(tdb_get_opt(t, TDB_OPT_TRAIL_CACHE_HITS, &value) == 0);
+    assert(value.value == j);
+
+    tdb_cursor_free(cursor);
+    tdb_cursor_free(cursor2);
+    tdb_cursor_free(ref_cursor);
+    tdb_close(t);
+    tdb_close(ref);
+    return 0;
+}
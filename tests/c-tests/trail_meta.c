@@ -0,0 +1,208 @@
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include <traildb.h>
+#include <tdb_io.h>
+#include <tdb_internal.h>
+#include "tdb_test.h"
+
+#define NUM_TRAILS 500
+#define MIN_TIMESTAMP 1000000
+#define RANGE_START (MIN_TIMESTAMP + 100 * 1000)
+#define RANGE_END (MIN_TIMESTAMP + 300 * 1000 + 3)
+
+/*
+Trail metadata matches the decoded trails in all formats, and filtered
+cursors that skip trails outside time ranges return the same events
+*/
+
+static uint64_t trail_length(uint64_t i)
+{
+    return i % 7 + 1;
+}
+
+static uint64_t event_timestamp(uint64_t i, uint64_t j)
+{
+    return MIN_TIMESTAMP + i * 1000 + j * (i % 5 + 1);
+}
+
+static void make_uuid(uint8_t uuid[16], uint64_t i)
+{
+    memset(uuid, 0, 16);
+    memcpy(uuid, &i, 8);
+}
+
+static void create_tdb(const char *root, uint64_t trail_meta)
+{
+    uint8_t uuid[16];
+    const char *fields[] = {"a"};
+    const char *values[] = {"x", "y"};
+    uint64_t lengths[] = {1};
+    uint64_t i, j;
+
+    tdb_cons* c = tdb_cons_init();
+    test_cons_settings(c);
+    assert(tdb_cons_set_opt(c, TDB_OPT_CONS_TRAIL_META, opt_val(3)) ==
+           TDB_ERR_INVALID_OPTION_VALUE);
+    assert(tdb_cons_set_opt(c,
+                            TDB_OPT_CONS_TRAIL_META,
+                            opt_val(trail_meta)) == 0);
+    assert(tdb_cons_open(c, root, fields, 1) == 0);
+    for (i = 0; i < NUM_TRAILS; i++){
+        make_uuid(uuid, i);
+        /* add events in reverse, they are sorted by finalize */
+        for (j = trail_length(i); j > 0; j--)
+            assert(tdb_cons_add(c,
+                                uuid,
+                                event_timestamp(i, j - 1),
+                                &values[j & 1],
+                                lengths) == 0);
+    }
+    assert(tdb_cons_finalize(c) == 0);
+    tdb_cons_close(c);
+}
+
+static void check_meta(const tdb *db, uint64_t trail_id, uint64_t i)
+{
+    tdb_trail_meta meta;
+
+    assert(tdb_get_trail_meta(db, trail_id, &meta) == 0);
+    assert(meta.num_events == trail_length(i));
+    assert(meta.min_timestamp == event_timestamp(i, 0));
+    assert(meta.max_timestamp == event_timestamp(i, trail_length(i) - 1));
+}
+
+/* events of trail i that match the filter of check_filter() */
+static uint64_t num_matching(uint64_t i)
+{
+    uint64_t j, n = 0;
+    for (j = 0; j < trail_length(i); j++){
+        const uint64_t timestamp = event_timestamp(i, j);
+        if (timestamp >= RANGE_START && timestamp < RANGE_END && (j & 1))
+            ++n;
+    }
+    return n;
+}
+
+static void check_filter(const tdb *db)
+{
+    const tdb_field field = 1;
+    struct tdb_event_filter *f = tdb_event_filter_new();
+    tdb_cursor *cursor = tdb_cursor_new(db);
+    uint64_t i, n;
+
+    /* time range AND (a=x OR time range before all events) */
+    assert(tdb_event_filter_add_time_range(f, 0, 1) == 0);
+    assert(tdb_event_filter_add_time_range(f, RANGE_START, RANGE_END) == 0);
+    assert(tdb_event_filter_new_clause(f) == 0);
+    assert(tdb_event_filter_add_term(f,
+                                     tdb_get_item(db, field, "x", 1),
+                                     0) == 0);
+    assert(tdb_event_filter_add_time_range(f, 0, 1) == 0);
+    assert(tdb_cursor_set_event_filter(cursor, f) == 0);
+
+    for (i = 0; i < NUM_TRAILS; i++){
+        assert(tdb_get_trail(cursor, i) == 0);
+        for (n = 0; tdb_cursor_next(cursor); n++);
+        assert(n == num_matching(i));
+        assert(tdb_get_trail(cursor, i) == 0);
+        assert(tdb_get_trail_length(cursor) == num_matching(i));
+    }
+
+    tdb_cursor_free(cursor);
+    tdb_event_filter_free(f);
+}
+
+static void check_tdb(const char *root, uint64_t trail_meta)
+{
+    tdb *db = tdb_init();
+    tdb_cursor *cursor;
+    tdb_trail_meta meta;
+    uint8_t uuid[16];
+    uint64_t i;
+
+    assert(tdb_open(db, root) == 0);
+    assert(!db->trail_meta.data ==
+           (trail_meta == TDB_OPT_CONS_TRAIL_META_NONE));
+    cursor = tdb_cursor_new(db);
+
+    for (i = 0; i < NUM_TRAILS; i++){
+        check_meta(db, i, i);
+
+        assert(tdb_get_trail(cursor, i) == 0);
+        assert(tdb_get_trail_length(cursor) == trail_length(i));
+        assert(tdb_cursor_next(cursor) == NULL);
+
+        /* the length of the remaining events */
+        assert(tdb_get_trail(cursor, i) == 0);
+        assert(tdb_cursor_next(cursor));
+        assert(tdb_get_trail_length(cursor) == trail_length(i) - 1);
+    }
+    assert(tdb_get_trail_meta(db, NUM_TRAILS, &meta) ==
+           TDB_ERR_INVALID_TRAIL_ID);
+
+    check_filter(db);
+
+    /* deleted trails have no events */
+    make_uuid(uuid, 0);
+    assert(tdb_delete_trails(db, uuid, 1) == 0);
+    assert(tdb_get_trail_meta(db, 0, &meta) == 0);
+    assert(meta.num_events == 0);
+    assert(tdb_get_trail(cursor, 0) == 0);
+    assert(tdb_get_trail_length(cursor) == 0);
+
+    tdb_cursor_free(cursor);
+    tdb_close(db);
+}
+
+int main(int argc, char** argv)
+{
+    char path[TDB_MAX_PATH_SIZE];
+    const char *root = getenv("TDB_TMP_DIR");
+    const uint64_t formats[] = {TDB_OPT_CONS_TRAIL_META_NONE,
+                                TDB_OPT_CONS_TRAIL_META_PLAIN,
+                                TDB_OPT_CONS_TRAIL_META_PACKED};
+    uint64_t trail_ids[NUM_TRAILS / 2];
+    uint64_t i, trail_id;
+    tdb_opt_value value;
+    uint8_t uuid[16];
+    tdb *db;
+
+    tdb_cons *c = tdb_cons_init();
+    assert(tdb_cons_get_opt(c, TDB_OPT_CONS_TRAIL_META, &value) == 0);
+    assert(value.value == TDB_OPT_CONS_TRAIL_META_PACKED);
+    tdb_cons_close(c);
+
+    for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++){
+        assert(tdb_path(path, "%s.%"PRIu64, root, formats[i]) == 0);
+        create_tdb(path, formats[i]);
+        check_tdb(path, formats[i]);
+    }
+
+    /* extracted trails keep their metadata */
+    db = tdb_init();
+    assert(tdb_path(path, "%s.%"PRIu64, root, formats[2]) == 0);
+    assert(tdb_open(db, path) == 0);
+    for (i = 0; i < NUM_TRAILS / 2; i++)
+        trail_ids[i] = i * 2 + 1;
+    assert(tdb_path(path, "%s.extracted", root) == 0);
+    assert(tdb_extract_trails(db, trail_ids, NUM_TRAILS / 2, path) == 0);
+    tdb_close(db);
+
+    db = tdb_init();
+    assert(tdb_open(db, path) == 0);
+    assert(db->trail_meta.data);
+    assert(tdb_num_trails(db) == NUM_TRAILS / 2);
+    for (i = 0; i < NUM_TRAILS / 2; i++){
+        make_uuid(uuid, trail_ids[i]);
+        assert(tdb_get_trail_id(db, uuid, &trail_id) == 0);
+        check_meta(db, trail_id, trail_ids[i]);
+    }
+    tdb_close(db);
+    return 0;
+}
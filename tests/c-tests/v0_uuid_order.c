@@ -0,0 +1,131 @@
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <traildb.h>
+#include <tdb_io.h>
+#include "tdb_test.h"
+
+#define NUM_TRAILS 5000
+#define NUM_THREADS 4
+
+static uint8_t uuids[NUM_TRAILS * 16];
+
+/* the first trail with a duplicate UUID is returned, like in a linear scan */
+static uint64_t expected_trail_id(uint64_t i)
+{
+    return i == 7 ? 3: i;
+}
+
+static void *test_lookups(void *arg)
+{
+    const tdb *db = (const tdb*)arg;
+    uint8_t unknown[16];
+    uint64_t i, trail_id;
+
+    for (i = 0; i < NUM_TRAILS; i++){
+        assert(tdb_get_trail_id(db, &uuids[i * 16], &trail_id) == 0);
+        assert(trail_id == expected_trail_id(i));
+    }
+
+    memset(unknown, 0xaa, 16);
+    assert(tdb_get_trail_id(db, unknown, &trail_id) == TDB_ERR_UNKNOWN_UUID);
+    return NULL;
+}
+
+static tdb *open_v0(const char *root)
+{
+    tdb* t = tdb_init();
+    assert(tdb_open(t, root) == 0);
+    assert(tdb_version(t) == TDB_VERSION_V0);
+    assert(tdb_num_trails(t) == NUM_TRAILS);
+    return t;
+}
+
+int main(int argc, char **argv)
+{
+    char path[TDB_MAX_PATH_SIZE];
+    char order_path[TDB_MAX_PATH_SIZE];
+    const char *root = getenv("TDB_TMP_DIR");
+    pthread_t threads[NUM_THREADS];
+    tdb_opt_value value;
+    FILE *f;
+    uint64_t i;
+
+    tdb_cons* c = tdb_cons_init();
+    test_cons_settings(c);
+    assert(tdb_cons_open(c, root, NULL, 0) == 0);
+    for (i = 0; i < NUM_TRAILS; i++){
+        uint64_t x = i * 2654435761LLU;
+        memcpy(&uuids[i * 16], &x, 8);
+        memcpy(&uuids[i * 16 + 8], &i, 8);
+        assert(tdb_cons_add(c, &uuids[i * 16], i, NULL, NULL) == 0);
+    }
+    assert(tdb_cons_finalize(c) == 0);
+    tdb_cons_close(c);
+
+    /*
+    turn the TrailDB into a V0 TrailDB with unordered UUIDs: V0 has
+    no version file and UUIDs are stored in a file called cookies.
+    This works only for directories.
+    */
+    tdb_path(path, "%s/version", root);
+    if (unlink(path))
+        return 0;
+    tdb_path(path, "%s/uuids", root);
+    unlink(path);
+
+    for (i = 0; i < NUM_TRAILS / 2; i++){
+        uint8_t tmp[16];
+        memcpy(tmp, &uuids[i * 16], 16);
+        memcpy(&uuids[i * 16], &uuids[(NUM_TRAILS - i - 1) * 16], 16);
+        memcpy(&uuids[(NUM_TRAILS - i - 1) * 16], tmp, 16);
+    }
+    memcpy(&uuids[7 * 16], &uuids[3 * 16], 16);
+
+    tdb_path(path, "%s/cookies", root);
+    assert((f = fopen(path, "w")) != NULL);
+    assert(fwrite(uuids, sizeof(uuids), 1, f) == 1);
+    assert(fclose(f) == 0);
+
+    tdb_path(order_path, "%s/uuids.order", root);
+
+    /* the order is not persisted by default */
+    tdb *t = open_v0(root);
+    assert(tdb_get_opt(t, TDB_OPT_PERSIST_UUID_ORDER, &value) == 0);
+    assert(value.value == 0);
+    test_lookups(t);
+    assert(access(order_path, F_OK));
+    tdb_close(t);
+
+    /* concurrent lookups build the order only once */
+    t = open_v0(root);
+    assert(tdb_set_opt(t, TDB_OPT_PERSIST_UUID_ORDER, TDB_TRUE) == 0);
+    for (i = 0; i < NUM_THREADS; i++)
+        assert(pthread_create(&threads[i], NULL, test_lookups, t) == 0);
+    for (i = 0; i < NUM_THREADS; i++)
+        assert(pthread_join(threads[i], NULL) == 0);
+    assert(access(order_path, F_OK) == 0);
+    tdb_close(t);
+
+    /* the persisted order is used by new handles */
+    t = open_v0(root);
+    test_lookups(t);
+    tdb_close(t);
+
+    /* a corrupted order is ignored */
+    assert((f = fopen(order_path, "r+")) != NULL);
+    assert(fseek(f, 8 + 100 * 8, SEEK_SET) == 0);
+    assert(fwrite(&i, 8, 1, f) == 1);
+    assert(fclose(f) == 0);
+    t = open_v0(root);
+    test_lookups(t);
+    tdb_close(t);
+
+    return 0;
+}
@@ -61,6 +61,9 @@ int main(int argc, char** argv)
     /* this should fail */
     const uint64_t TSTAMPS5[] = {TDB_MAX_TIMEDELTA + 1};
 
+    /* this should fail, not wrap around to 10 */
+    const uint64_t TSTAMPS6[] = {10, (1LLU << 48) + 10};
+
     const tdb_event *event;
 
     uint64_t i, num_events = sizeof(TSTAMPS1) / sizeof(TSTAMPS1[0]);
@@ -96,6 +99,7 @@ int main(int argc, char** argv)
 
     make_tdb(getenv("TDB_TMP_DIR"), TSTAMPS4, sizeof(TSTAMPS4) / sizeof(TSTAMPS4[0]), 1);
     make_tdb(getenv("TDB_TMP_DIR"), TSTAMPS5, sizeof(TSTAMPS5) / sizeof(TSTAMPS5[0]), 1);
+    make_tdb(getenv("TDB_TMP_DIR"), TSTAMPS6, sizeof(TSTAMPS6) / sizeof(TSTAMPS6[0]), 1);
 
     return 0;
 }
@@ -331,5 +331,37 @@ class TestMerge(TdbCliTest):
         self.assertEquals(stats.values(), [2] * 2)
         self.assertEquals({e['uuid'] for e in ev}, set(uuids))
 
+class TestSplit(TdbCliTest):
+    def events(self):
+        for i in range(100):
+            yield OrderedDict([('uuid', self.hexuuid(i)),
+                               ('time', str(i + 100)),
+                               ('number', str(i))])
+
+    def split(self, args=[]):
+        cmd = [TDB, 'split', '-i', TEST_DB, '-o', TEST_DB + '_shard',
+               '--shards', '4'] + args
+        self.tdb_cmd(cmd)
+        return [list(self.dump(suffix='_shard.%d' % i)) for i in range(4)]
+
+    def assertSplit(self, shards):
+        self.assertEquals(sorted(e['uuid'] for s in shards for e in s),
+                          sorted(e['uuid'] for e in self.dump()))
+        for shard in shards:
+            self.assertTrue(shard)
+            for ev in shard:
+                self.assertEquals(int(ev['time']) - 100, int(ev['number']))
+
+    def test_split_by_range(self):
+        shards = self.split()
+        self.assertSplit(shards)
+        self.assertEquals(map(len, shards), [25] * 4)
+
+    def test_split_by_hash(self):
+        self.assertSplit(self.split(['--split-by', 'hash']))
+
+    def test_prune_lexicons(self):
+        self.assertSplit(self.split(['--prune-lexicons']))
+
 if __name__ == '__main__':
     unittest.main()
@@ -435,6 +435,311 @@ static int cmd_info(const char* db_path)
        return err;
 }
 
+/**
+ * merges trails in groups of num_cursors with a multi-cursor
+ */
+static int do_merge(const tdb* db, uint64_t num_cursors, uint64_t num_threads)
+{
+	const uint64_t num_trails = tdb_num_trails(db);
+	const uint64_t batch_size = 10000;
+	tdb_cursor** const cursors = calloc(num_cursors, sizeof(tdb_cursor*));
+	tdb_multi_event* const events = malloc(batch_size * sizeof(tdb_multi_event));
+	tdb_multi_cursor* mc = NULL;
+	uint64_t events_merged = 0;
+	uint64_t timestamp = 0;
+	tdb_error err = 0;
+	assert(cursors); assert(events);
+
+	for(uint64_t i = 0; i < num_cursors; ++i) {
+		cursors[i] = tdb_cursor_new(db);
+		assert(cursors[i]);
+	}
+
+	for(uint64_t first = 0; first < num_trails; first += num_cursors) {
+		uint64_t n;
+		if(first + num_cursors > num_trails) {
+			/* the last group is smaller */
+			tdb_multi_cursor_free(mc);
+			mc = NULL;
+		}
+		if(!mc) {
+			const uint64_t group = first + num_cursors > num_trails ?
+					       num_trails - first : num_cursors;
+			if(num_threads)
+				mc = tdb_multi_cursor_new_parallel(cursors, group, num_threads);
+			else
+				mc = tdb_multi_cursor_new(cursors, group);
+			assert(mc);
+		}
+
+		for(uint64_t i = 0; i < num_cursors && first + i < num_trails; ++i) {
+			err = tdb_get_trail(cursors[i], first + i);
+			if(err) {
+				REPORT_ERROR("Failed to get trail (trail_id=%" PRIu64 "). error=%i\n",
+					     first + i, err);
+				goto out;
+			}
+		}
+		tdb_multi_cursor_reset(mc);
+
+		timestamp = 0;
+		while((n = tdb_multi_cursor_next_batch(mc, events, batch_size))) {
+			for(uint64_t i = 0; i < n; ++i) {
+				assert(events[i].event->timestamp >= timestamp);
+				timestamp = events[i].event->timestamp;
+			}
+			events_merged += n;
+		}
+	}
+
+	printf("# events merged: %" PRIu64 "\n", events_merged);
+
+out:
+	tdb_multi_cursor_free(mc);
+	for(uint64_t i = 0; i < num_cursors; ++i)
+		tdb_cursor_free(cursors[i]);
+	free(events);
+	free(cursors);
+	return err;
+}
+
+static int cmd_merge(const char* path, const char* num_cursors_str,
+		     const char* num_threads_str)
+{
+	const uint64_t num_cursors = strtoull(num_cursors_str, NULL, 10);
+	const uint64_t num_threads = num_threads_str ? strtoull(num_threads_str, NULL, 10) : 0;
+	if(!num_cursors) {
+		REPORT_ERROR("Invalid number of cursors: %s\n", num_cursors_str);
+		return 1;
+	}
+
+	tdb* db = tdb_init(); assert(db);
+	tdb_error err = tdb_open(db, path);
+	if(err) {
+		REPORT_ERROR("Failed to open TDB. error=%i\n", err);
+		return 1;
+	}
+
+	if(tdb_num_trails(db))
+		TIMED("merge", err, do_merge(db, num_cursors, num_threads));
+
+	tdb_close(db);
+	return err ? 1 : 0;
+}
+
+/**
+ * opens and closes a TDB repeatedly, e.g. to measure the cost
+ * of opening TDBs with many fields
+ */
+static int do_open(const char* path, uint64_t num_iter, int read_lexicons, int whole_package)
+{
+	tdb_error err = 0;
+	for(uint64_t i = 0; i < num_iter && !err; ++i) {
+		tdb* db = tdb_init(); assert(db);
+		if(whole_package)
+			tdb_set_opt(db, TDB_OPT_MMAP_WHOLE_PACKAGE, TDB_TRUE);
+		err = tdb_open(db, path);
+		if(!err && read_lexicons) {
+			/* lexicons are mapped on first use */
+			uint64_t len;
+			for(tdb_field field = 1; field < tdb_num_fields(db); ++field)
+				tdb_get_value(db, field, 1, &len);
+		}
+		tdb_close(db);
+	}
+	return err;
+}
+
+static int cmd_open(const char* path, const char* num_iter_str)
+{
+	const uint64_t num_iter = num_iter_str ? strtoull(num_iter_str, NULL, 10) : 100;
+	tdb_error err;
+
+	TIMED("open", err, do_open(path, num_iter, 0, 0));
+	if(err) {
+		REPORT_ERROR("Failed to open TDB. error=%i\n", err);
+		return 1;
+	}
+	TIMED("open+lexicons", err, do_open(path, num_iter, 1, 0));
+	if(err) {
+		REPORT_ERROR("Failed to open TDB. error=%i\n", err);
+		return 1;
+	}
+	/* a no-op for TDBs in directories */
+	TIMED("open whole package", err, do_open(path, num_iter, 0, 1));
+	if(err) {
+		REPORT_ERROR("Failed to open TDB. error=%i\n", err);
+		return 1;
+	}
+	TIMED("open+lexicons whole package", err, do_open(path, num_iter, 1, 1));
+	if(err) {
+		REPORT_ERROR("Failed to open TDB. error=%i\n", err);
+		return 1;
+	}
+	printf("# opened %" PRIu64 " times\n", num_iter);
+	return 0;
+}
+
+/**
+ * decodes a random sample of trails in batches, prefetching
+ * each batch with tdb_prefetch_trails() first
+ */
+static int do_sample(const tdb* db, uint64_t num_samples)
+{
+	const uint64_t num_trails = tdb_num_trails(db);
+	const uint64_t batch_size = 1000;
+	uint64_t* const trail_ids = malloc(batch_size * sizeof(uint64_t));
+	tdb_cursor* const cursor = tdb_cursor_new(db);
+	uint64_t events_decoded = 0;
+	uint64_t state = 1;
+	tdb_error err = 0;
+	assert(trail_ids); assert(cursor);
+
+	for(uint64_t first = 0; first < num_samples; first += batch_size) {
+		const uint64_t n = first + batch_size > num_samples ?
+				   num_samples - first : batch_size;
+		for(uint64_t i = 0; i < n; ++i) {
+			/* the same sample for every run */
+			state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+			trail_ids[i] = (state >> 33) % num_trails;
+		}
+		tdb_prefetch_trails(db, trail_ids, n);
+
+		for(uint64_t i = 0; i < n; ++i) {
+			err = tdb_get_trail(cursor, trail_ids[i]);
+			if(err) {
+				REPORT_ERROR("Failed to get trail (trail_id=%" PRIu64 "). error=%i\n",
+					     trail_ids[i], err);
+				goto out;
+			}
+			events_decoded += tdb_get_trail_length(cursor);
+		}
+	}
+
+	printf("# events decoded: %" PRIu64 "\n", events_decoded);
+
+out:
+	tdb_cursor_free(cursor);
+	free(trail_ids);
+	return err;
+}
+
+static int cmd_sample(const char* path, const char* num_samples_str,
+		      const char* cache_size_str)
+{
+	const uint64_t num_samples = strtoull(num_samples_str, NULL, 10);
+	const tdb_opt_value cache_size = {
+		.value = cache_size_str ? strtoull(cache_size_str, NULL, 10) : 64LLU << 20
+	};
+	tdb_error err;
+
+	tdb* db = tdb_init(); assert(db);
+	err = tdb_open(db, path);
+	if(err) {
+		REPORT_ERROR("Failed to open TDB. error=%i\n", err);
+		return 1;
+	}
+	if(tdb_num_trails(db))
+		TIMED("sample mmap", err, do_sample(db, num_samples));
+	tdb_close(db);
+	if(err)
+		return 1;
+
+	db = tdb_init(); assert(db);
+	tdb_set_opt(db, TDB_OPT_PREAD_CACHE_SIZE, cache_size);
+	err = tdb_open(db, path);
+	if(err) {
+		REPORT_ERROR("Failed to open TDB. error=%i\n", err);
+		return 1;
+	}
+	if(tdb_num_trails(db))
+		TIMED("sample pread", err, do_sample(db, num_samples));
+	tdb_close(db);
+	return err ? 1 : 0;
+}
+
+/**
+ * adds events of synthetic trails with tdb_cons_add(), interleaving
+ * trails like a live stream of events would
+ */
+static int do_ingest(tdb_cons* cons, uint64_t num_events, uint64_t num_fields)
+{
+	const uint64_t num_trails = num_events / 16 + 1;
+	char (*bufs)[32] = malloc(num_fields * 32);
+	const char** values = malloc(num_fields * sizeof(char*));
+	uint64_t* lengths = malloc(num_fields * sizeof(uint64_t));
+	uint64_t state = 1;
+	uint8_t uuid[16] = {0};
+	tdb_error err = 0;
+	assert(bufs); assert(values); assert(lengths);
+
+	for(uint64_t j = 0; j < num_fields; ++j)
+		values[j] = bufs[j];
+
+	for(uint64_t i = 0; i < num_events; ++i) {
+		const uint64_t trail = i % num_trails;
+		memcpy(uuid, &trail, sizeof(trail));
+		for(uint64_t j = 0; j < num_fields; ++j) {
+			state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+			/* field j has about 10^(j + 1) distinct values */
+			uint64_t card = 10;
+			for(uint64_t k = 0; k < j && k < 6; ++k)
+				card *= 10;
+			lengths[j] = (uint64_t)sprintf(bufs[j], "%" PRIu64, (state >> 33) % card);
+		}
+		err = tdb_cons_add(cons, uuid, i / num_trails, values, lengths);
+		if(err) {
+			REPORT_ERROR("Failed to add event %" PRIu64 ". error=%i\n", i, err);
+			break;
+		}
+	}
+
+	free(bufs);
+	free(values);
+	free(lengths);
+	return err;
+}
+
+static int cmd_ingest(const char* path, const char* num_events_str,
+		      const char* num_fields_str, const char* memory_limit_str)
+{
+	const uint64_t num_events = strtoull(num_events_str, NULL, 10);
+	const uint64_t num_fields = num_fields_str ? strtoull(num_fields_str, NULL, 10) : 3;
+	const uint64_t memory_limit = memory_limit_str ? strtoull(memory_limit_str, NULL, 10) : 0;
+	const char** field_ids = malloc(num_fields * sizeof(char*));
+	char (*names)[16] = malloc(num_fields * 16);
+	tdb_error err;
+	assert(field_ids); assert(names);
+
+	for(uint64_t j = 0; j < num_fields; ++j) {
+		sprintf(names[j], "f%" PRIu64, j);
+		field_ids[j] = names[j];
+	}
+
+	tdb_cons* cons = tdb_cons_init(); assert(cons);
+	err = tdb_cons_open(cons, path, field_ids, num_fields);
+	if(err) {
+		REPORT_ERROR("Failed to create TDB cons. error=%i\n", err);
+		goto out;
+	}
+	err = tdb_cons_set_opt(cons, TDB_OPT_CONS_MEMORY_LIMIT, opt_val(memory_limit));
+	assert(err == 0);
+
+	TIMED("tdb_cons_add()", err, do_ingest(cons, num_events, num_fields));
+	if(err)
+		goto out;
+
+	TIMED("tdb_cons_finalize()", err, tdb_cons_finalize(cons));
+	if(err)
+		REPORT_ERROR("Failed to finalize output DB. error=%i\n", err);
+
+out:
+	tdb_cons_close(cons);
+	free(field_ids);
+	free(names);
+	return err ? 1 : 0;
+}
+
 static void print_help(void)
 {
 	printf(
@@ -459,6 +764,24 @@ static void print_help(void)
 "  :: displays information on a TDB\n"
 "  dump <path>\n"
 "  :: dumps contents of a traildb in a most primitive way.\n"	       
+"  merge <path> <number of cursors> [<number of threads>]\n"
+"  :: merges trails in groups of /number of cursors/\n"
+"     using a multi-cursor. With /number of threads/,\n"
+"     trails are decoded in parallel on worker threads\n"
+"  open <path> [<number of iterations>]\n"
+"  :: opens and closes a TDB repeatedly (default 100 times),\n"
+"     with and without reading a value of every field, and\n"
+"     with and without TDB_OPT_MMAP_WHOLE_PACKAGE\n"
+"  sample <path> <number of trails> [<pread cache size>]\n"
+"  :: decodes a random sample of trails, reading them\n"
+"     with mmap and with TDB_OPT_PREAD_CACHE_SIZE\n"
+"     (default 64MB)\n"
+"  ingest <output path> <number of events> [<number of fields>\n"
+"         [<memory limit>]]\n"
+"  :: creates a TDB of synthetic events (3 fields by default)\n"
+"     with tdb_cons_add(), timing ingestion and finalization.\n"
+"     With /memory limit/, events are spilled to disk, see\n"
+"     TDB_OPT_CONS_MEMORY_LIMIT\n"
 		);
 }
 
@@ -491,6 +814,19 @@ int main(int argc, char** argv)
 	else if(IS_CMD("dump", 1)) {
 		return cmd_dump(argv[2]);
 	}
+	else if(IS_CMD("merge", 2)) {
+		return cmd_merge(argv[2], argv[3], argc > 4 ? argv[4] : NULL);
+	}
+	else if(IS_CMD("open", 1)) {
+		return cmd_open(argv[2], argc > 3 ? argv[3] : NULL);
+	}
+	else if(IS_CMD("sample", 2)) {
+		return cmd_sample(argv[2], argv[3], argc > 4 ? argv[4] : NULL);
+	}
+	else if(IS_CMD("ingest", 2)) {
+		return cmd_ingest(argv[2], argv[3], argc > 4 ? argv[4] : NULL,
+				  argc > 5 ? argv[5] : NULL);
+	}
 	else {
 		print_help();
 		return 1;